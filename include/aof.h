@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "storage.h"
+
+enum class AppendFsync { ALWAYS, EVERYSEC, NO };
+
+std::optional<AppendFsync> parse_append_fsync(std::string_view name);
+
+// append-only file persistence.
+//
+// storage appends each mutation to its shard's log while it holds the shard
+// (see storage.h), so nothing on the request path touches the file. a writer
+// thread drains every shard's log and group-commits the lot with one write,
+// and one fsync if the policy wants it. under ALWAYS a worker holds back
+// replies to writes until the writer reports a sync that covers them,
+// waking it through an eventfd, so many clients share each fsync instead of
+// each paying for its own.
+//
+// once the file has doubled since the last rewrite and passed
+// AUTO_REWRITE_MIN_SIZE, or BGREWRITEAOF asks, a rewriter thread dumps the
+// keyspace shard by shard into a new file while writes go on. entries made
+// to a shard after it's dumped are kept aside and appended to the new file
+// before it replaces the old one
+class Aof {
+  Storage &storage;
+  std::string path;
+  AppendFsync policy;
+  int fd = -1;
+  size_t size = 0;
+  // the size right after the last rewrite, what growth is measured against
+  size_t base_size = 0;
+  bool unsynced = false;
+  std::chrono::steady_clock::time_point last_sync;
+
+  // drained entries, reused across rounds so their buffers stay allocated
+  std::string main;
+  std::string tail;
+
+  std::thread writer;
+  std::thread rewriter;
+  bool rewriting = false;
+  // set by the rewriter when it's done, after rewrite_failed
+  std::atomic<bool> dumped = false;
+  bool rewrite_failed = false;
+  int rewrite_fd = -1;
+
+  std::mutex wake_lock;
+  std::condition_variable wake;
+  bool sync_requested = false;
+  bool running = false;
+
+  // bumped by the writer before each drain, so an entry appended before a
+  // worker reads ticket() is covered once synced() reaches that ticket
+  std::atomic<uint64_t> generation = 1;
+  std::atomic<uint64_t> synced = 0;
+  std::vector<int> listeners;
+
+  void write_loop();
+  // one drain, write and maybe fsync. false once stopped
+  bool write_round();
+  void start_rewrite();
+  void finish_rewrite();
+
+ public:
+  Aof(Storage &storage, std::string path, AppendFsync policy);
+  Aof(Aof const &other) = delete;
+  ~Aof();
+
+  // replays the file into storage, returning how many bytes were loaded.
+  // an incomplete command at the end, left by a crash mid-write, is cut off
+  size_t load();
+
+  // eventfds to signal after each sync under ALWAYS. only before start
+  void add_listener(int eventfd) { listeners.push_back(eventfd); }
+
+  // turns on storage's log and starts the writer
+  void start();
+
+  AppendFsync get_policy() const { return policy; }
+
+  uint64_t ticket() const { return generation; }
+  uint64_t synced_ticket() const { return synced; }
+
+  // wakes the writer for a commit now instead of at its next round
+  void request_sync();
+};
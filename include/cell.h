@@ -0,0 +1,235 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include "reply.h"
+#include "slab.h"
+
+// expiries are absolute unix times in milliseconds, so EXAT/PXAT map onto
+// them directly
+const int64_t NO_EXPIRY = 0;
+
+int64_t now_ms();
+
+// bytes held by large shared values, including ones only replies still
+// reference
+size_t shared_value_bytes();
+
+// a 24-bit seconds clock for access times, cached by the cron so touching a
+// key never reads the system clock
+const uint32_t LRU_CLOCK_MAX = (1 << 24) - 1;
+
+uint32_t lru_clock();
+void update_lru_clock();
+
+// scratch space for rendering an integer-encoded value as a string
+using IntBuffer = std::array<char, 20>;
+
+// what a value holds. collections start out in a compact LISTPACK and grow
+// into a structure of their own past a size, see collection.h
+enum class Type : uint8_t { STRING, HASH, LIST, SET, ZSET };
+
+// a stored key: up to 23 bytes live inline, longer keys in one block from
+// the shard's slab. the last byte holds the inline length, or HEAP
+class Key {
+  static constexpr uint8_t INLINE_MAX = 23;
+  static constexpr uint8_t HEAP = 0xff;
+
+  union {
+    char small[INLINE_MAX + 1];
+    struct {
+      char *ptr;
+      uint32_t len;
+    } heap;
+  };
+
+  uint8_t &tag() { return (uint8_t &)small[INLINE_MAX]; }
+  uint8_t tag() const { return small[INLINE_MAX]; }
+
+ public:
+  Key(std::string_view key, Slab &arena);
+  Key(Key &&other) noexcept;
+  Key &operator=(Key &&other) noexcept;
+  Key(Key const &other) = delete;
+  ~Key();
+
+  std::string_view view() const {
+    return tag() == HEAP ? std::string_view(heap.ptr, heap.len)
+                         : std::string_view(small, tag());
+  }
+
+  // slab bytes owned beyond sizeof(Key)
+  size_t allocated() const { return tag() == HEAP ? heap.len : 0; }
+};
+
+static_assert(sizeof(Key) == 24);
+
+// a stored value in 32 bytes. strings of up to 24 bytes are embedded,
+// canonical integers are kept as int64, mid-sized strings own a buffer from
+// the shard's slab and large ones are shared with the replies that read
+// them. collections own a slab block, or a pointer to what they grew into.
+// an expiry is rare enough to live out of line: setting one moves the
+// payload into a small slab box next to it
+class DataCell {
+ public:
+  enum Encoding : uint8_t {
+    EMBSTR,
+    INT,
+    RAW,
+    SHARED,
+    LISTPACK,
+    HASHTABLE,
+    DEQUE,
+    TREE
+  };
+
+  // a slab block holding a RAW string or a LISTPACK
+  struct Buffer {
+    char *ptr;
+    uint32_t len;
+    uint32_t capacity;
+  };
+
+ private:
+  static constexpr uint8_t EMBSTR_MAX = 24;
+  static constexpr uint8_t EXPIRES = 1;
+  static constexpr uint8_t SNAPSHOT_EPOCH = 2;
+
+  // new keys start with some frequency so they aren't evicted right away
+  static constexpr uint8_t LFU_INIT = 5;
+
+  union Payload {
+    char embstr[EMBSTR_MAX];
+    int64_t integer;
+    Buffer raw;
+    SharedValue shared;
+    void *big;
+
+    Payload() {}
+    ~Payload() {}
+  };
+
+  struct Boxed {
+    int64_t expiry;
+    Payload payload;
+  };
+
+  union {
+    Payload inline_payload;
+    Boxed *boxed;
+  };
+  // packed so the version fits
+  Encoding encoding : 3;
+  uint8_t flags : 5 = 0;
+  Type type : 3 = Type::STRING;
+  // embstr length
+  uint8_t len : 5 = 0;
+  // the low bits of the shard's write count when the cell last changed,
+  // for WATCH, see Storage::changed
+  uint16_t version = 0;
+  // lru_clock() at the last touch in the top 24 bits, a logarithmic access
+  // counter like redis's LFU in the low 8
+  uint32_t access;
+
+  Payload &payload() {
+    return flags & EXPIRES ? boxed->payload : inline_payload;
+  }
+  Payload const &payload() const {
+    return flags & EXPIRES ? boxed->payload : inline_payload;
+  }
+
+  void release();
+  void encode(std::string_view value, Slab &arena);
+  // makes the value a string of the given length in a buffer it may write,
+  // keeping its leading bytes, and returns the buffer. a new buffer is
+  // twice the old length, so repeated appends are amortized
+  char *resize(size_t length, Slab &arena);
+  // moves the payload out of `from` into `to`, leaving `from` uninitialized
+  void move_payload(Payload &to, Payload &from);
+
+ public:
+  DataCell(std::string_view value, int64_t expiry, Slab &arena);
+  // an empty collection
+  DataCell(Type type, Slab &arena);
+  DataCell(DataCell &&other) noexcept;
+  DataCell &operator=(DataCell &&other) noexcept;
+  DataCell(DataCell const &other) = delete;
+  ~DataCell();
+
+  Encoding get_encoding() const { return encoding; }
+  Type get_type() const { return type; }
+
+  // a collection's listpack, or the structure it grew into, for
+  // collection.cpp to work on
+  Buffer &buffer() { return payload().raw; }
+  Buffer const &buffer() const { return payload().raw; }
+  void *big() const { return payload().big; }
+  // frees the listpack and takes over what it grew into
+  void grow(void *big, Encoding encoding);
+
+  // hands a shared value or a big grown collection to the lazy free thread
+  // and leaves an empty string behind, see lazy_free.h
+  void free_lazily();
+
+  // replaces the value with a string, keeping the expiry and reusing a
+  // slab buffer when the new value fits
+  void assign(std::string_view value, Slab &arena);
+
+  enum class Sum { OK, NOT_INTEGER, OVERFLOW };
+
+  // in-place updates for INCRBY, APPEND and SETRANGE. add leaves the value
+  // alone unless it's OK. the others return the new length, and setting a
+  // range past the end pads with zero bytes
+  Sum add(int64_t delta, Slab &arena);
+  size_t append(std::string_view suffix, Slab &arena);
+  size_t set_range(size_t offset, std::string_view bytes, Slab &arena);
+
+  std::optional<int64_t> integer() const {
+    return encoding == INT ? std::make_optional(payload().integer)
+                           : std::nullopt;
+  }
+
+  // a string value, rendered into scratch if it's an integer
+  std::string_view view(IntBuffer &scratch) const;
+
+  // encodes the value as a bulk string, sharing it if it's large
+  void reply(Reply &reply) const;
+
+  int64_t expiry() const { return flags & EXPIRES ? boxed->expiry : NO_EXPIRY; }
+
+  void set_expiry(int64_t expiry, Slab &arena);
+
+  // only reads the clock for keys that have an expiry at all
+  bool expired() const { return flags & EXPIRES and now_ms() >= boxed->expiry; }
+
+  // one bit storage flips per snapshot to tell which cells the running
+  // snapshot has already accounted for
+  bool snapshot_epoch() const { return flags & SNAPSHOT_EPOCH; }
+  void set_snapshot_epoch(bool epoch) {
+    flags = epoch ? flags | SNAPSHOT_EPOCH : flags & ~SNAPSHOT_EPOCH;
+  }
+
+  uint16_t get_version() const { return version; }
+  void set_version(uint16_t version) { this->version = version; }
+
+  // heap and slab bytes owned beyond sizeof(DataCell)
+  size_t allocated() const;
+
+  // records an access for the eviction policies. reads may touch a cell
+  // concurrently under a shared lock, so the access word is updated with
+  // relaxed atomics and racing touches may drop an increment
+  void touch();
+
+  // seconds since the last touch
+  uint32_t idle() const;
+
+  // the access counter, decayed by one per minute since the last touch
+  uint8_t frequency() const;
+};
+
+static_assert(sizeof(DataCell) == 32);
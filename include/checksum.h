@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <cstdint>
+
+// crc32c (castagnoli), with the sse4.2 instruction when the cpu has it.
+// pass the previous result as crc to checksum data in pieces
+uint32_t crc32c(void const *data, size_t len, uint32_t crc = 0);
+
+// crc16-ccitt (xmodem), which redis cluster picks hash slots with
+uint16_t crc16(void const *data, size_t len);
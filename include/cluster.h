@@ -0,0 +1,177 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <shared_mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "shared.h"
+
+// cluster mode, like redis cluster without replicas or failover.
+//
+// the keyspace is split into 16384 hash slots by the crc16 of each key, or
+// of its hash tag: what's between the first { and the } after it, unless
+// that's empty, so related keys can share a slot. every slot is served by
+// one node. a node answers commands for a slot it doesn't serve with MOVED
+// and the address of the node that does, and commands naming keys of more
+// than one slot with CROSSSLOT.
+//
+// nodes gossip over their client ports: every GOSSIP_INTERVAL a node sends
+// every node it knows its view, each node it knows of with the slots it
+// claims and the config epoch it claims them at, and merges the view it
+// gets back. of two claims on a slot the one with the higher epoch wins, so
+// a node taking a slot over bumps its epoch past every other and its claim
+// spreads. CLUSTER MEET introduces one node to another, and the rest learn
+// of it from their views.
+//
+// a slot moves like in redis: the target is marked IMPORTING and the source
+// MIGRATING, then whoever is resharding moves the source's keys over in
+// batches of CLUSTER GETKEYSINSLOT with MIGRATE, as redis-cli does. the
+// source keeps serving the keys it still has and sends clients to the
+// target with ASK for the rest, and the target only serves the slot to
+// clients that say ASKING first. CLUSTER SETSLOT NODE ends it, on the target
+// first so its epoch goes up before the others hear of the move
+
+const size_t CLUSTER_SLOTS = 16384;
+const unsigned CLUSTER_SLOT_BITS = 14;
+
+uint16_t key_slot(std::string_view key);
+
+class Cluster {
+ public:
+  // where a slot's commands run
+  enum class Route {
+    LOCAL,
+    // here if the keys are still here, and with ASK at address if not,
+    // since the slot is moving there
+    MIGRATING,
+    // MOVED to address
+    MOVED,
+    // no node serves the slot
+    DOWN,
+  };
+
+  struct Where {
+    Route route;
+    std::string address;
+  };
+
+  enum class SlotState { IMPORTING, MIGRATING, STABLE, NODE };
+
+  // a run of slots with one owner
+  struct Range {
+    uint16_t first;
+    uint16_t last;
+    std::string id;
+    std::string host;
+    uint16_t port;
+  };
+
+ private:
+  static constexpr uint16_t NO_NODE = UINT16_MAX;
+  static constexpr uint16_t MYSELF = 0;
+
+  struct Node {
+    std::string id;
+    std::string host;
+    uint16_t port;
+    uint64_t epoch = 0;
+    // whether the last gossip with it was answered
+    bool linked = false;
+  };
+
+  // made up at startup and never changed, so it's read without the lock
+  std::string const node_id;
+
+  // guards everything below but reads of owners
+  mutable std::shared_mutex lock;
+  // this node first. a node is never removed, so owners can point at it by
+  // index
+  std::vector<Node> nodes;
+  std::array<std::atomic<uint16_t>, CLUSTER_SLOTS> owners;
+  std::array<uint16_t, CLUSTER_SLOTS> migrating;
+  std::array<uint16_t, CLUSTER_SLOTS> importing;
+  // how many slots are migrating or importing, so routing can skip looking
+  // while none are
+  std::atomic<size_t> moving = 0;
+  uint64_t current_epoch = 0;
+  // addresses met but not heard back from yet
+  std::vector<std::pair<std::string, uint16_t>> meeting;
+
+  std::atomic<bool> running = false;
+  std::thread bus;
+
+  void run();
+  // the gossip format: a line per node, "id host port epoch slots", where
+  // slots are comma-separated ranges like 0-5460, or - for none. this node
+  // comes first
+  std::string view() const;
+  void merge(std::string_view view);
+  uint16_t find(std::string_view id) const;
+  std::string address(uint16_t node) const;
+  void set_owner(uint16_t slot, uint16_t node);
+  void set_moving(std::array<uint16_t, CLUSTER_SLOTS> &moves, uint16_t slot,
+                  uint16_t node);
+
+ public:
+  // host and port are where other nodes and clients reach this one
+  Cluster(std::string host, uint16_t port);
+  Cluster(Cluster const &other) = delete;
+  ~Cluster();
+
+  void start();
+
+  std::string const &my_id() const { return node_id; }
+
+  // asking says the client sent ASKING, which lets it into a slot being
+  // imported
+  Where route(uint16_t slot, bool asking) const;
+  bool serves(uint16_t slot) const {
+    return owners[slot].load(std::memory_order_relaxed) == MYSELF;
+  }
+
+  // the CLUSTER subcommands, which throw with the error to reply with
+
+  // claims unassigned slots
+  void add_slots(std::span<uint16_t const> slots);
+  void set_slot(uint16_t slot, SlotState state, std::string_view id);
+  void meet(std::string host, uint16_t port);
+  // merges the view of the node gossiping and returns this one's
+  std::string gossip(std::string_view view);
+  // in slot order
+  std::vector<Range> ranges() const;
+  // CLUSTER INFO and CLUSTER NODES
+  std::string info() const;
+  std::string describe() const;
+};
+
+// set once at startup, and null unless cluster mode is on
+void set_cluster_node(Cluster *cluster);
+Cluster *cluster_node();
+
+// a blocking connection to another node, for gossip and MIGRATE, which
+// throws once it fails or an answer takes longer than timeout
+class NodeConnection {
+  int sock;
+  InputBuffer in;
+  size_t unread = 0;
+
+ public:
+  NodeConnection(std::string const &host, uint16_t port,
+                 std::chrono::milliseconds timeout);
+  NodeConnection(NodeConnection const &other) = delete;
+  ~NodeConnection();
+
+  void send(std::string_view commands);
+  // the next reply, as it arrived. valid until the next call
+  std::string_view reply();
+};
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <set>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include "cell.h"
+#include "reply.h"
+#include "slab.h"
+
+// hashes, lists, sets and sorted sets.
+//
+// every collection starts as a LISTPACK: its elements back to back in one
+// slab block after a 2-byte element count, each a varint length and its
+// bytes, scanned rather than indexed. a tiny collection costs a single
+// allocation that way. once it holds more than LISTPACK_MAX_ENTRIES, or an
+// element longer than LISTPACK_MAX_VALUE arrives, it grows for good into a
+// hash table (hashes and sets), a deque (lists) or a tree in score order
+// beside a hash table of scores (sorted sets), like redis's
+// *-max-listpack-* settings.
+//
+// a hash's listpack holds field, value pairs, and a sorted set's holds
+// member, score pairs in score order, with the score's 8 bytes as an element
+const size_t LISTPACK_MAX_ENTRIES = 128;
+const size_t LISTPACK_MAX_VALUE = 64;
+
+const std::string_view WRONGTYPE_ERROR =
+    "WRONGTYPE Operation against a key holding the wrong kind of value";
+
+namespace listpack {
+
+// where the first element starts, after the count
+const size_t BEGIN = 2;
+
+void init(DataCell::Buffer &lp, Slab &arena);
+size_t count(DataCell::Buffer const &lp);
+// the element at pos, moving pos past it
+std::string_view next(DataCell::Buffer const &lp, size_t &pos);
+void insert(DataCell::Buffer &lp, size_t pos,
+            std::initializer_list<std::string_view> elements, Slab &arena);
+void erase(DataCell::Buffer &lp, size_t pos, size_t elements, Slab &arena);
+
+}  // namespace listpack
+
+// what a grown collection's nodes cost on top of their strings, roughly, for
+// the memory accounting
+const size_t NODE_OVERHEAD = 48;
+
+struct HashTable {
+  std::unordered_map<std::string, std::string> fields;
+  size_t bytes = sizeof(HashTable);
+};
+
+struct SetTable {
+  std::unordered_set<std::string> members;
+  size_t bytes = sizeof(SetTable);
+};
+
+struct ListDeque {
+  std::deque<std::string> items;
+  size_t bytes = sizeof(ListDeque);
+};
+
+struct ScoreTree {
+  std::unordered_map<std::string, double> scores;
+  // views of the keys in scores, whose nodes never move
+  std::set<std::pair<double, std::string_view>> order;
+  size_t bytes = sizeof(ScoreTree);
+};
+
+// elements in the collection, pairs counting once
+size_t collection_size(DataCell const &cell);
+// heap bytes a grown collection owns
+size_t collection_bytes(Type type, void *big);
+void free_collection(Type type, void *big);
+std::string_view type_name(Type type);
+std::string_view encoding_name(DataCell const &cell);
+
+using ScoreBuffer = std::array<char, 32>;
+
+// the shortest form that parses back to the same double
+std::string_view format_score(double score, ScoreBuffer &scratch);
+// accepts what strtod does plus inf, +inf and -inf, but not nan
+std::optional<double> parse_score(std::string_view arg);
+
+namespace hashes {
+
+// true if the field is new
+bool set(DataCell &cell, std::string_view field, std::string_view value,
+         Slab &arena);
+std::optional<std::string_view> get(DataCell const &cell,
+                                    std::string_view field);
+bool remove(DataCell &cell, std::string_view field, Slab &arena);
+
+template <typename Fn>
+void for_each(DataCell const &cell, Fn &&fn) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    for (size_t pos = listpack::BEGIN; pos < lp.len;) {
+      auto field = listpack::next(lp, pos);
+      fn(field, listpack::next(lp, pos));
+    }
+  } else {
+    for (auto &[field, value] : ((HashTable *)cell.big())->fields) {
+      fn(field, value);
+    }
+  }
+}
+
+}  // namespace hashes
+
+namespace lists {
+
+void push(DataCell &cell, std::string_view item, bool front, Slab &arena);
+// replies with the item and removes it. the list must not be empty
+void pop(DataCell &cell, bool front, Reply &reply, Slab &arena);
+
+// items from start to stop inclusive, which must be in range
+template <typename Fn>
+void range(DataCell const &cell, size_t start, size_t stop, Fn &&fn) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    size_t pos = listpack::BEGIN;
+    for (size_t i = 0; i <= stop; i++) {
+      auto item = listpack::next(lp, pos);
+      if (i >= start) {
+        fn(item);
+      }
+    }
+  } else {
+    auto &items = ((ListDeque *)cell.big())->items;
+    for (size_t i = start; i <= stop; i++) {
+      fn(items[i]);
+    }
+  }
+}
+
+}  // namespace lists
+
+namespace sets {
+
+// true if the member is new
+bool add(DataCell &cell, std::string_view member, Slab &arena);
+bool remove(DataCell &cell, std::string_view member, Slab &arena);
+bool contains(DataCell const &cell, std::string_view member);
+
+template <typename Fn>
+void for_each(DataCell const &cell, Fn &&fn) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    for (size_t pos = listpack::BEGIN; pos < lp.len;) {
+      fn(listpack::next(lp, pos));
+    }
+  } else {
+    for (auto &member : ((SetTable *)cell.big())->members) {
+      fn(member);
+    }
+  }
+}
+
+}  // namespace sets
+
+namespace zsets {
+
+// adds the member or moves it to a new score. true if it's new
+bool add(DataCell &cell, std::string_view member, double score, Slab &arena);
+bool remove(DataCell &cell, std::string_view member, Slab &arena);
+std::optional<double> score(DataCell const &cell, std::string_view member);
+
+struct Bound {
+  double score;
+  bool exclusive = false;
+
+  bool above(double other) const {
+    return exclusive ? other > score : other >= score;
+  }
+  bool below(double other) const {
+    return exclusive ? other < score : other <= score;
+  }
+};
+
+// members scored between min and max in order, until fn returns false
+template <typename Fn>
+void range_by_score(DataCell const &cell, Bound min, Bound max, Fn &&fn) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    for (size_t pos = listpack::BEGIN; pos < lp.len;) {
+      auto member = listpack::next(lp, pos);
+      double score;
+      memcpy(&score, listpack::next(lp, pos).data(), sizeof(score));
+      if (!max.below(score)) {
+        return;
+      }
+      if (min.above(score) and !fn(member, score)) {
+        return;
+      }
+    }
+  } else {
+    auto &order = ((ScoreTree *)cell.big())->order;
+    for (auto iter = order.lower_bound({min.score, {}});
+         iter != order.end() and max.below(iter->first); ++iter) {
+      if (min.above(iter->first) and !fn(iter->second, iter->first)) {
+        return;
+      }
+    }
+  }
+}
+
+}  // namespace zsets
+
+// every element as its type's add command takes them: field, value pairs,
+// items, members, and score, member pairs
+template <typename Fn>
+void for_each_element(DataCell const &cell, Fn &&fn) {
+  switch (cell.get_type()) {
+    case Type::HASH:
+      hashes::for_each(cell, [&](auto field, auto value) {
+        fn(field);
+        fn(value);
+      });
+      break;
+    case Type::LIST:
+      if (size_t size = collection_size(cell)) {
+        lists::range(cell, 0, size - 1, fn);
+      }
+      break;
+    case Type::SET:
+      sets::for_each(cell, fn);
+      break;
+    case Type::ZSET:
+      zsets::range_by_score(cell, {-HUGE_VAL}, {HUGE_VAL},
+                            [&](auto member, double score) {
+                              ScoreBuffer scratch;
+                              fn(format_score(score, scratch));
+                              fn(member);
+                              return true;
+                            });
+      break;
+    case Type::STRING:
+      break;
+  }
+}
+
+// how many for_each_element gives
+size_t element_count(DataCell const &cell);
+
+// adds elements in for_each_element's form. false if a score is malformed
+bool restore(DataCell &cell, std::span<std::string_view const> elements,
+             Slab &arena);
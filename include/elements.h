@@ -1,7 +1,8 @@
 #pragma once
 
 #include <optional>
-#include <ostream>
+#include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
@@ -23,34 +24,10 @@
 
 STRING_NEWTYPE(SimpleString);
 
-static std::ostream &operator<<(std::ostream &os,
-                                SimpleString const &simple_string) {
-  return os << '+' << simple_string.view() << "\r\n";
-}
-
 STRING_NEWTYPE(SimpleError);
 
-static std::ostream &operator<<(std::ostream &os,
-                                SimpleError const &simple_error) {
-  return os << '-' << simple_error.view() << "\r\n";
-}
-
 STRING_NEWTYPE(BulkString);
 
-static std::ostream &operator<<(std::ostream &os,
-                                BulkString const &bulk_string) {
-  return os << '$' << bulk_string.view().length() << "\r\n"
-            << bulk_string.view() << "\r\n";
-}
-
-static std::ostream &operator<<(
-    std::ostream &os, std::optional<BulkString> const &maybe_bulk_string) {
-  if (maybe_bulk_string) {
-    return os << *maybe_bulk_string;
-  }
-  return os << "$-1\r\n";
-}
-
 template <>
 struct std::hash<BulkString> {
   size_t operator()(BulkString const &bulk_string) const noexcept {
@@ -0,0 +1,493 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// swiss-table style hash index over a dense, segmented array of entries.
+//
+// the index is an array of one-byte control words (empty, deleted, or the top
+// bit plus the low 7 bits of a full slot's hash) probed 16 at a time with
+// SIMD, next to an array of 32-bit entry numbers. empty is zero, so a fresh
+// index comes straight from calloc's zeroed pages instead of a memset that
+// would stall the resize. entries keep their full hash, so growing the
+// index never rehashes a key, and they never move when the index grows,
+// which lets the index be rebuilt a few groups at a time on each write
+// instead of all at once. a removed entry is replaced by the last one, so the
+// entries stay packed.
+//
+// callers hash keys themselves and pass the hash in, so one hash can pick
+// both a storage shard and a slot. entry pointers are stable until the next
+// insert or erase.
+template <typename Key, typename Value, typename Equal>
+class FlatMap {
+ public:
+  struct Entry {
+    uint64_t hash;
+    Key key;
+    Value value;
+  };
+
+ private:
+  static constexpr size_t GROUP = 16;
+  static constexpr int8_t EMPTY = 0;
+  static constexpr int8_t DELETED = 1;
+  static constexpr uint32_t NO_ENTRY = UINT32_MAX;
+  // how many old groups each write moves into the new index while resizing
+  static constexpr size_t MIGRATE_GROUPS = 4;
+
+  static constexpr size_t SEGMENT_SHIFT = 12;
+  static constexpr size_t SEGMENT = 1ul << SEGMENT_SHIFT;
+
+  struct Mask {
+    uint32_t bits;
+
+    explicit operator bool() const { return bits != 0; }
+    size_t lowest() const { return std::countr_zero(bits); }
+    void clear_lowest() { bits &= bits - 1; }
+  };
+
+  static Mask match(int8_t const *ctrl, int8_t byte) {
+#ifdef __SSE2__
+    auto group = _mm_loadu_si128((__m128i const *)ctrl);
+    return {(uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(group, _mm_set1_epi8(byte)))};
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < GROUP; i++) {
+      bits |= uint32_t(ctrl[i] == byte) << i;
+    }
+    return {bits};
+#endif
+  }
+
+  // full slots are the only ones with the top bit set
+  static Mask match_free(int8_t const *ctrl) {
+#ifdef __SSE2__
+    auto group = _mm_loadu_si128((__m128i const *)ctrl);
+    return {~(uint32_t)_mm_movemask_epi8(group) & 0xffff};
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < GROUP; i++) {
+      bits |= uint32_t(ctrl[i] >= 0) << i;
+    }
+    return {bits};
+#endif
+  }
+
+  static int8_t h2(uint64_t hash) { return (hash & 0x7f) | 0x80; }
+  static size_t h1(uint64_t hash) { return hash >> 7; }
+
+  struct Free {
+    void operator()(void *ptr) const { free(ptr); }
+  };
+
+  struct Index {
+    std::unique_ptr<int8_t[], Free> ctrl;
+    std::unique_ptr<uint32_t[]> slots;
+    size_t groups = 0;
+    // full plus deleted slots, since both lengthen probes
+    size_t used = 0;
+
+    Index() = default;
+    Index(size_t groups)
+        : ctrl((int8_t *)calloc(groups, GROUP)),
+          slots(new uint32_t[groups * GROUP]),
+          groups(groups) {
+      if (!ctrl) {
+        throw std::bad_alloc();
+      }
+    }
+
+    size_t capacity() const { return groups * GROUP; }
+    // 7/8 max load, like abseil
+    size_t max_used() const { return capacity() - capacity() / 8; }
+
+    // visits each group on the probe sequence for hash until f returns true
+    template <typename F>
+    bool probe(uint64_t hash, F &&f) const {
+      return probe_from(h1(hash) & (groups - 1), f);
+    }
+
+    // the same from the group hashes start at, for scan
+    template <typename F>
+    bool probe_from(size_t group, F &&f) const {
+      size_t mask = groups - 1;
+
+      for (size_t step = 1; step <= groups; step++) {
+        if (f(group * GROUP)) {
+          return true;
+        }
+        group = (group + step) & mask;
+      }
+      return false;
+    }
+
+    // the slot holding entry, or capacity() if this index doesn't have it
+    size_t slot_of(uint64_t hash, uint32_t entry) const {
+      size_t found = capacity();
+
+      probe(hash, [&](size_t base) {
+        for (auto m = match(&ctrl[base], h2(hash)); m; m.clear_lowest()) {
+          if (slots[base + m.lowest()] == entry) {
+            found = base + m.lowest();
+            return true;
+          }
+        }
+        return (bool)match(&ctrl[base], EMPTY);
+      });
+      return found;
+    }
+
+    void insert(uint64_t hash, uint32_t entry) {
+      probe(hash, [&](size_t base) {
+        auto m = match_free(&ctrl[base]);
+        if (m) {
+          size_t slot = base + m.lowest();
+          if (ctrl[slot] == EMPTY) {
+            used++;
+          }
+          ctrl[slot] = h2(hash);
+          slots[slot] = entry;
+          return true;
+        }
+        return false;
+      });
+    }
+
+    void erase(size_t slot) {
+      // a probe that reaches a group with an empty slot stops there, so if
+      // this group already has one nobody needs a tombstone to keep going
+      size_t base = slot & ~(GROUP - 1);
+      if (match(&ctrl[base], EMPTY)) {
+        ctrl[slot] = EMPTY;
+        used--;
+      } else {
+        ctrl[slot] = DELETED;
+      }
+    }
+  };
+
+  Index index;
+  // the index being drained into `index` during a resize, if any. its
+  // groups below migrated are all tombstones
+  Index old;
+  size_t migrated = 0;
+
+  struct alignas(Entry) Segment {
+    std::byte bytes[SEGMENT * sizeof(Entry)];
+  };
+
+  std::vector<std::unique_ptr<Segment>> segments;
+  size_t count = 0;
+
+  Entry &entry(size_t i) const {
+    return reinterpret_cast<Entry *>(
+        segments[i >> SEGMENT_SHIFT]->bytes)[i & (SEGMENT - 1)];
+  }
+
+  template <typename Pred>
+  Entry *find_in(Index const &idx, uint64_t hash, Pred &&pred) const {
+    Entry *found = nullptr;
+
+    if (idx.groups) {
+      idx.probe(hash, [&](size_t base) {
+        for (auto m = match(&idx.ctrl[base], h2(hash)); m; m.clear_lowest()) {
+          auto &candidate = entry(idx.slots[base + m.lowest()]);
+          if (candidate.hash == hash and pred(candidate)) {
+            found = &candidate;
+            return true;
+          }
+        }
+        return (bool)match(&idx.ctrl[base], EMPTY);
+      });
+    }
+    return found;
+  }
+
+  // points whichever index holds entry i at entry j instead
+  void relink(size_t i, size_t j) {
+    uint64_t hash = entry(i).hash;
+    size_t slot = index.slot_of(hash, i);
+
+    if (slot < index.capacity()) {
+      index.slots[slot] = j;
+    } else if (old.groups) {
+      old.slots[old.slot_of(hash, i)] = j;
+    }
+  }
+
+  // drops the slot in idx pointing at removed, returning its entry number
+  uint32_t unlink(Index &idx, Entry const &removed) {
+    uint32_t i = NO_ENTRY;
+
+    if (idx.groups) {
+      idx.probe(removed.hash, [&](size_t base) {
+        for (auto m = match(&idx.ctrl[base], h2(removed.hash)); m;
+             m.clear_lowest()) {
+          size_t slot = base + m.lowest();
+          if (&entry(idx.slots[slot]) == &removed) {
+            i = idx.slots[slot];
+            idx.erase(slot);
+            return true;
+          }
+        }
+        return (bool)match(&idx.ctrl[base], EMPTY);
+      });
+    }
+    return i;
+  }
+
+  // calls f with the entries of idx whose hashes start probing at group,
+  // skipping the groups below skip, which a resize has already moved out.
+  // entries sit on their probe sequence no further than the first group
+  // with an empty slot, since a full group never gets one back
+  template <typename F>
+  void scan_group(Index const &idx, size_t group, size_t skip, F &f) const {
+    size_t mask = idx.groups - 1;
+
+    idx.probe_from(group, [&](size_t base) {
+      if (base / GROUP >= skip) {
+        for (size_t slot = base; slot < base + GROUP; slot++) {
+          if (idx.ctrl[slot] < 0) {
+            auto &candidate = entry(idx.slots[slot]);
+            if ((h1(candidate.hash) & mask) == group) {
+              f(candidate);
+            }
+          }
+        }
+      }
+      return (bool)match(&idx.ctrl[base], EMPTY);
+    });
+  }
+
+  static size_t reverse_bits(size_t v) {
+    v = ((v >> 1) & 0x5555555555555555) | ((v & 0x5555555555555555) << 1);
+    v = ((v >> 2) & 0x3333333333333333) | ((v & 0x3333333333333333) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0f) | ((v & 0x0f0f0f0f0f0f0f0f) << 4);
+    return __builtin_bswap64(v);
+  }
+
+  void grow() {
+    // a resize still in progress is finished before the next one starts
+    while (old.groups) {
+      rehash_step(old.groups);
+    }
+
+    size_t groups = std::max(index.groups, 1ul);
+    // double when the live entries alone would keep the table over half
+    // full, otherwise the same size just sweeps out the tombstones
+    while (count + 1 > groups * GROUP / 2) {
+      groups *= 2;
+    }
+
+    old = std::move(index);
+    index = Index(groups);
+    migrated = 0;
+  }
+
+ public:
+  FlatMap() = default;
+  FlatMap(FlatMap const &other) = delete;
+
+  ~FlatMap() { clear(); }
+
+  size_t size() const { return count; }
+  // an incremental resize is under way
+  bool resizing() const { return old.groups; }
+
+  // bytes held by the indexes and entry segments
+  size_t allocated() const {
+    size_t slots = index.capacity() + old.capacity();
+    return slots * (sizeof(int8_t) + sizeof(uint32_t)) +
+           segments.size() * sizeof(Segment) +
+           segments.capacity() * sizeof(segments[0]);
+  }
+
+  template <typename K>
+  Entry *find(K const &key, uint64_t hash) const {
+    return find_if(hash, [&](Entry &candidate) {
+      return Equal{}(key, candidate.key);
+    });
+  }
+
+  // pulls the first group a lookup of hash probes into cache, so a batch of
+  // lookups can overlap their misses
+  void prefetch(uint64_t hash) const {
+    if (index.groups) {
+      size_t base = (h1(hash) & (index.groups - 1)) * GROUP;
+      __builtin_prefetch(&index.ctrl[base]);
+      __builtin_prefetch(&index.slots[base]);
+    }
+  }
+
+  // the first entry with this hash that pred accepts
+  template <typename Pred>
+  Entry *find_if(uint64_t hash, Pred &&pred) const {
+    if (auto found = find_in(index, hash, pred)) {
+      return found;
+    }
+    return old.groups ? find_in(old, hash, pred) : nullptr;
+  }
+
+  template <typename F>
+  void for_each(F &&f) const {
+    for (size_t i = 0; i < count; i++) {
+      f(entry(i));
+    }
+  }
+
+  // visits the entries whose hashes start at one group of the index and
+  // returns the cursor of the next, starting from 0 and back at 0 once
+  // done. the cursor counts up with its bits reversed, like redis's SCAN, so
+  // the groups behind it cover the same hashes after the index doubles and
+  // an entry present throughout a scan is visited at least once. while a
+  // resize runs both indexes are scanned, the larger one at every group the
+  // smaller one's splits into
+  template <typename F>
+  size_t scan(size_t cursor, F &&f) const {
+    if (!index.groups) {
+      return 0;
+    }
+
+    size_t mask = index.groups - 1;
+    if (!old.groups) {
+      scan_group(index, cursor & mask, 0, f);
+    } else {
+      bool old_smaller = old.groups < index.groups;
+      auto &small = old_smaller ? old : index;
+      auto &large = old_smaller ? index : old;
+      size_t small_mask = small.groups - 1, large_mask = large.groups - 1;
+
+      scan_group(small, cursor & small_mask, old_smaller ? migrated : 0, f);
+      size_t v = cursor;
+      do {
+        scan_group(large, v & large_mask, old_smaller ? 0 : migrated, f);
+        // the next group with the same low bits
+        v = (((v | small_mask) + 1) & ~small_mask) | (v & small_mask);
+      } while (v & (small_mask ^ large_mask));
+      mask = small_mask;
+    }
+
+    // add one to the high bits, which are reversed
+    cursor |= ~mask;
+    return reverse_bits(reverse_bits(cursor) + 1);
+  }
+
+  // sizes an empty map for n entries up front, so a bulk load neither
+  // resizes the index nor grows the segment list
+  void reserve(size_t n) {
+    if (count or old.groups) {
+      return;
+    }
+    size_t groups = 1;
+    while (n + 1 > groups * GROUP / 2) {
+      groups *= 2;
+    }
+    if (groups > index.groups) {
+      index = Index(groups);
+    }
+    segments.reserve((n >> SEGMENT_SHIFT) + 1);
+  }
+
+  // entries are packed, so picking a uniformly random one is an index below
+  // size()
+  Entry &at(size_t i) const { return entry(i); }
+
+  // the key must not be present yet
+  Entry &insert(uint64_t hash, Key &&key, Value &&value) {
+    rehash_step(MIGRATE_GROUPS);
+    if (index.used + 1 > index.max_used()) {
+      grow();
+    }
+
+    if ((count >> SEGMENT_SHIFT) == segments.size()) {
+      segments.push_back(std::unique_ptr<Segment>(new Segment));
+    }
+    auto &added = *new (&entry(count))
+        Entry{.hash = hash, .key = std::move(key), .value = std::move(value)};
+    index.insert(hash, count++);
+
+    return added;
+  }
+
+  void erase(Entry &removed) {
+    rehash_step(MIGRATE_GROUPS);
+
+    uint32_t i = unlink(index, removed);
+    if (i == NO_ENTRY) {
+      i = unlink(old, removed);
+    }
+
+    size_t last = count - 1;
+    if (i != last) {
+      relink(last, i);
+      entry(i) = std::move(entry(last));
+    }
+    entry(last).~Entry();
+    count--;
+
+    // keep one spare segment around so a size hovering on a boundary
+    // doesn't allocate and free it over and over, and every segment while
+    // a resize runs, so nothing the old index points at is freed
+    if (!old.groups and segments.size() > (count >> SEGMENT_SHIFT) + 2) {
+      segments.pop_back();
+    }
+  }
+
+  // moves up to `groups` groups of the old index into the new one
+  void rehash_step(size_t groups) {
+    if (!old.groups) {
+      return;
+    }
+
+    for (size_t end = std::min(migrated + groups, old.groups); migrated < end;
+         migrated++) {
+      size_t base = migrated * GROUP;
+
+      // each entry is in exactly one index, so erase and relink never
+      // leave a copy behind. the tombstone keeps later groups' probes
+      // going
+      for (size_t slot = base; slot < base + GROUP; slot++) {
+        if (old.ctrl[slot] < 0) {
+          index.insert(entry(old.slots[slot]).hash, old.slots[slot]);
+          old.ctrl[slot] = DELETED;
+        }
+      }
+    }
+
+    if (migrated == old.groups) {
+      old = Index();
+      migrated = 0;
+    }
+  }
+
+  void swap(FlatMap &other) {
+    std::swap(index, other.index);
+    std::swap(old, other.old);
+    std::swap(migrated, other.migrated);
+    std::swap(segments, other.segments);
+    std::swap(count, other.count);
+  }
+
+  void clear() {
+    for (size_t i = 0; i < count; i++) {
+      entry(i).~Entry();
+    }
+    count = 0;
+    segments.clear();
+    index = Index();
+    old = Index();
+    migrated = 0;
+  }
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <vector>
+
+// a latency histogram laid out like HdrHistogram's: values fall into
+// power-of-two buckets, each split into 1 << sub_bits linear steps, so every
+// recorded value keeps the same relative precision however large it is, in
+// a fixed array with no allocation per sample.
+//
+// one thread may record into a histogram while others merge it, which only
+// costs the recorder relaxed stores
+class Histogram {
+  // anything longer is counted as this, a little over a minute in ns
+  static constexpr uint64_t MAX_VALUE = (1ul << 36) - 1;
+
+  unsigned sub_bits;
+  uint64_t sub_buckets;
+  uint64_t half;
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t lowest = UINT64_MAX;
+  uint64_t highest = 0;
+  // for the mean, which doesn't suffer the buckets' rounding
+  double sum = 0;
+
+  size_t index(uint64_t value) const;
+  // the largest value that shares a slot with the one at index
+  uint64_t highest_at(size_t index) const;
+
+ public:
+  // 11 sub_bits keep values to 3 significant digits, and 7 to 2 in a
+  // sixteenth of the space
+  explicit Histogram(unsigned sub_bits = 11);
+
+  void record(uint64_t value);
+  // other must have the same sub_bits
+  void merge(Histogram const &other);
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return total ? lowest : 0; }
+  uint64_t max() const { return highest; }
+  double mean() const { return total ? sum / total : 0; }
+  // the value at or under which percentile percent of the samples fall
+  uint64_t percentile(double percentile) const;
+};
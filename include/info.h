@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "storage.h"
+
+// resident set size of this process, or 0 if it can't be read
+size_t resident_bytes();
+
+// what the server section reports, set once at startup like the
+// replication role
+void set_server_info(uint16_t port, size_t threads,
+                     std::string_view multiplexing_api);
+
+// renders the INFO reply for a section name, matched case-insensitively.
+// no section and "default" render every section but commandstats and
+// latencystats, which "all" and "everything" add, and unknown ones render
+// nothing, like redis
+std::string info(Storage &storage, std::string_view section);
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <functional>
+
+// a background thread that frees what DEL and UNLINK drop, so the command
+// replies without waiting for free() to walk a big collection or for a
+// large buffer to go back to the kernel
+
+// collections with fewer elements are freed right away, since queueing them
+// costs about as much, like redis's LAZYFREE_THRESHOLD
+const size_t LAZY_FREE_MIN = 64;
+
+// runs job on the lazy free thread, which starts on first use
+void lazy_free(std::function<void()> job);
+
+// jobs queued and not finished yet, for INFO
+size_t lazy_free_pending();
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <string>
+
+#include "histogram.h"
+#include "shared.h"
+
+// a pipelined load generator, which is what the client runs by default.
+//
+// each thread drives its share of the connections from its own epoll loop,
+// keeping pipeline requests in flight on every one: a reply is answered with
+// the next request, so the depth stays constant. every request is timed from
+// when it's queued to when its reply has been parsed
+
+// how SET value sizes are drawn between the smallest and the largest
+enum class ValueDist { UNIFORM, LOG };
+
+struct LoadConfig {
+  std::string host = "127.0.0.1";
+  uint16_t port = PORT;
+  size_t connections = 50;
+  // at most one per connection. 0 picks one per core
+  size_t threads = 0;
+  size_t pipeline = 1;
+  size_t keyspace = 100000;
+  size_t value_min = 32;
+  size_t value_max = 32;
+  ValueDist value_dist = ValueDist::UNIFORM;
+  // SETs to GETs, like memtier's --ratio
+  unsigned sets = 1;
+  unsigned gets = 10;
+  double seconds = 10;
+  // when set, runs until this many replies instead of for seconds
+  uint64_t requests = 0;
+  // where the JSON report goes, - for stdout. none when empty
+  std::string json_path;
+
+  LoadConfig(int argc, char **argv);
+};
+
+struct LoadReport {
+  size_t threads = 0;
+  uint64_t requests = 0;
+  uint64_t errors = 0;
+  uint64_t misses = 0;
+  double seconds = 0;
+  // in nanoseconds
+  Histogram all;
+  Histogram sets;
+  Histogram gets;
+};
+
+LoadReport run_load(LoadConfig const &config);
+
+void print_report(LoadConfig const &config, LoadReport const &report);
+std::string report_json(LoadConfig const &config, LoadReport const &report);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+// the server's log, with redis's levels.
+//
+// a line under the level is never formatted, so a disabled write_log costs a
+// relaxed load and a compare. the rest are formatted by the caller and handed
+// to a background thread that writes them, so no worker waits on the
+// terminal or the disk. when that thread falls too far behind, lines are
+// dropped and counted rather than queued without bound
+
+enum class LogLevel : uint8_t { DEBUG, VERBOSE, NOTICE, WARNING };
+
+std::optional<LogLevel> parse_log_level(std::string_view name);
+
+// an empty path logs to stdout
+void configure_log(LogLevel level, std::string const &path);
+
+inline std::atomic<LogLevel> log_threshold = LogLevel::NOTICE;
+
+inline bool log_enabled(LogLevel level) {
+  return level >= log_threshold.load(std::memory_order_relaxed);
+}
+
+// waits for every queued line to be written, for a process about to exit
+void flush_log();
+
+// queues a formatted message, however the level stands
+void log_line(LogLevel level, std::string message);
+
+// streams args into one line
+template <typename... Args>
+void write_log(LogLevel level, Args const &...args) {
+  if (log_enabled(level)) {
+    std::ostringstream message;
+    (message << ... << args);
+    log_line(level, std::move(message).str());
+  }
+}
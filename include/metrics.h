@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "histogram.h"
+
+// server counters.
+//
+// every thread that serves connections or runs commands counts into a
+// ThreadStats of its own, which only it writes, so counting takes no locks
+// and shares no cache lines. INFO merges every thread's on demand, so its
+// totals aren't a single snapshot
+
+// a count only its own thread changes, which any thread may read. a relaxed
+// load and store rather than an atomic add, since there's one writer
+class Counter {
+  std::atomic<uint64_t> value = 0;
+
+ public:
+  void add(uint64_t n = 1) {
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+  }
+  void sub(uint64_t n = 1) { add(-n); }
+  uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// room for every entry in the command table
+const size_t MAX_COMMANDS = 128;
+// per-command latencies keep 2 significant digits, in 16KB each
+const unsigned COMMAND_LATENCY_BITS = 7;
+
+struct CommandStats {
+  Counter calls;
+  // ran and replied with an error
+  Counter failed;
+  // refused before running, for arity or context
+  Counter rejected;
+  Counter nanos;
+  // made on the first call, since most commands never run
+  std::atomic<Histogram *> latency = nullptr;
+
+  CommandStats() = default;
+  CommandStats(CommandStats const &other) = delete;
+  ~CommandStats() { delete latency.load(); }
+};
+
+struct ThreadStats {
+  Counter connections_received;
+  Counter connected_clients;
+  Counter net_input_bytes;
+  Counter net_output_bytes;
+  // every error reply, so a caller can also tell whether a command failed
+  Counter error_replies;
+  // by index in the command table
+  std::array<CommandStats, MAX_COMMANDS> commands;
+};
+
+// the calling thread's, registered on first use and kept for the life of
+// the process, so its counts outlive it
+ThreadStats &thread_stats();
+
+// records a command that ran on the calling thread
+void record_command(size_t index, uint64_t nanos, bool failed);
+
+// every thread's stats summed
+struct Totals {
+  uint64_t connections_received = 0;
+  uint64_t connected_clients = 0;
+  uint64_t net_input_bytes = 0;
+  uint64_t net_output_bytes = 0;
+  uint64_t error_replies = 0;
+
+  struct Command {
+    uint64_t calls = 0;
+    uint64_t failed = 0;
+    uint64_t rejected = 0;
+    uint64_t nanos = 0;
+    // null until the command has run
+    std::unique_ptr<Histogram> latency;
+  };
+  std::array<Command, MAX_COMMANDS> commands;
+};
+
+std::unique_ptr<Totals> metric_totals();
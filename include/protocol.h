@@ -1,10 +1,71 @@
 #pragma once
 
+#include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
+#include "pubsub.h"
+#include "reply.h"
 #include "shared.h"
 #include "storage.h"
 
-void server_transact(Storage &storage, buffer const &in, std::string &out);
+class Element;
 
-std::string client_parse(buffer const &in);
\ No newline at end of file
+// a client's MULTI, WATCH, SUBSCRIBE and tracking state, kept by its connection
+// between reads
+struct Session {
+  bool multi = false;
+  // a command failed to queue, so EXEC discards the transaction
+  bool aborted = false;
+  // the commands queued since MULTI, as they arrived
+  std::string queued;
+  std::vector<std::pair<std::string, Storage::Watch>> watched;
+
+  // the connection as publishers reach it, set by its worker
+  Subscriber subscriber;
+  std::unordered_set<std::string> channels;
+  std::unordered_set<std::string> patterns;
+
+  // "ip:port", set by its worker, for SLOWLOG
+  std::string client;
+
+  // 2, or 3 after HELLO 3
+  int protocol = 2;
+  // CLIENT TRACKING is on in the default mode, so the keys the client reads
+  // are remembered
+  bool tracking = false;
+
+  // sent ASKING, which lets the next command, or transaction, into a slot
+  // this node is importing
+  bool asking = false;
+
+  // back to no transaction and no watched keys
+  void reset();
+  bool subscribed() const { return !channels.empty() or !patterns.empty(); }
+  // drops every subscription, for a connection that's going away
+  void unsubscribe_all();
+};
+
+// answers every complete command at the front of in, appending the replies to
+// out, and returns how many bytes were consumed. a partial trailing command is
+// left for the next call; nullopt means the stream is malformed. read_only
+// refuses commands that write, for clients of a replica. without a session,
+// as when replaying a log, transactions are refused
+std::optional<size_t> server_transact(Storage &storage, std::string_view in,
+                                      OutputBuffer &out,
+                                      bool read_only = false,
+                                      Session *session = nullptr);
+
+// the command table, by the index stats are kept under
+size_t command_count();
+std::string_view command_name(size_t index);
+
+// reads the reply at the front of in, of any RESP2 or RESP3 type, returning
+// how many bytes it spans, 0 while it's partial, or nullopt if the stream is
+// malformed. it's decoded into reply when one is given, and otherwise only
+// framed, which allocates nothing
+std::optional<size_t> client_parse(std::string_view in,
+                                   Element *reply = nullptr);
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stddef.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "reply.h"
+
+// publish/subscribe across workers.
+//
+// a channel's or a pattern's subscribers are kept as an Audience grouped by
+// the worker that owns them, which is replaced rather than changed when one
+// joins or leaves. PUBLISH takes a reference to it under a brief shared
+// lock, encodes the message once into a shared buffer, and pushes one
+// delivery per worker onto that worker's Mailbox without locking. the worker
+// then queues the same buffer on every target connection's output and
+// enforces the pubsub output limits there, so a stalled subscriber is
+// dropped rather than holding up the publisher or anyone else
+
+class Mailbox;
+
+// a connection as publishers reach it. ids tell a connection apart from a
+// later one that reused its socket
+struct Subscriber {
+  Mailbox *mailbox = nullptr;
+  int sock = -1;
+  uint64_t id = 0;
+};
+
+struct Audience {
+  struct Target {
+    int sock;
+    uint64_t id;
+  };
+  struct Group {
+    Mailbox *mailbox;
+    std::vector<Target> targets;
+  };
+
+  std::vector<Group> groups;
+  size_t count = 0;
+};
+
+// one message for one worker's share of an audience
+struct Delivery {
+  SharedValue message;
+  std::shared_ptr<Audience const> audience;
+  size_t group;
+  Delivery *next = nullptr;
+};
+
+// deliveries for one worker's connections, pushed from any thread onto a
+// lock-free list. the first push onto an empty list signals fd, which the
+// worker polls
+class Mailbox {
+  std::atomic<Delivery *> head = nullptr;
+  int event;
+
+ public:
+  Mailbox();
+  Mailbox(Mailbox const &other) = delete;
+  ~Mailbox();
+
+  int fd() const { return event; }
+
+  void push(Delivery *delivery);
+
+  // calls fn with every delivery pushed so far, oldest first
+  template <typename Fn>
+  void drain(Fn &&fn);
+};
+
+// read the signal before taking the list, so a push racing with the drain
+// either lands in it or signals again
+template <typename Fn>
+void Mailbox::drain(Fn &&fn) {
+  uint64_t count;
+  [[maybe_unused]] auto len = read(event, &count, sizeof(count));
+
+  Delivery *reversed = nullptr;
+  for (auto delivery = head.exchange(nullptr, std::memory_order_acquire);
+       delivery;) {
+    auto next = delivery->next;
+    delivery->next = reversed;
+    reversed = delivery;
+    delivery = next;
+  }
+  while (reversed) {
+    std::unique_ptr<Delivery> delivery(reversed);
+    reversed = reversed->next;
+    fn(*delivery);
+  }
+}
+
+// false if the subscription already existed, or didn't for unsubscribe
+bool subscribe(std::string_view channel, bool pattern,
+               Subscriber const &subscriber);
+bool unsubscribe(std::string_view channel, bool pattern,
+                 Subscriber const &subscriber);
+
+// how many channels, or patterns, have subscribers, for INFO
+size_t subscribed_count(bool pattern);
+
+// sends message to the channel's subscribers and to those of every pattern
+// it matches, returning how many that is
+size_t publish(std::string_view channel, std::string_view message);
+
+// redis's glob syntax: *, ?, [abc], [^abc], [a-z] and \ escapes
+bool glob_match(std::string_view pattern, std::string_view string);
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "storage.h"
+
+// like redis's repl-backlog-size default
+const size_t DEFAULT_BACKLOG_SIZE = 1024 * 1024;
+
+// the primary's side of replication.
+//
+// a replica connects like any client and sends PSYNC with the replication id
+// and offset it has, or "? -1" the first time. the worker answering it hands
+// the socket over here. if the offset is still in the backlog the stream
+// resumes from it (+CONTINUE). otherwise a syncer thread snapshots the
+// keyspace into memory and sends it (+FULLRESYNC id offset, then the
+// snapshot as a bulk string), followed by the stream from the snapshot's
+// instant.
+//
+// the stream is storage's replication log (see storage.h), which a feeder
+// thread drains into the backlog ring and every replica's queue. offsets
+// count the stream's bytes since this process started, under an id made up
+// at startup, so a replica can't resume across a restart
+class Primary {
+  struct Link {
+    int sock;
+    // the FULLRESYNC or CONTINUE line, and the snapshot's bulk string header
+    std::string preamble;
+    char *snapshot = nullptr;
+    size_t snapshot_len = 0;
+    size_t snapshot_sent = 0;
+    // the stream from the replica's offset on
+    std::string out;
+    size_t out_sent = 0;
+    // false while its snapshot is being taken
+    bool ready = false;
+
+    Link(int sock) : sock(sock) {}
+    Link(Link const &other) = delete;
+    ~Link();
+  };
+
+  Storage &storage;
+  std::string replid;
+
+  // guards everything below
+  std::mutex lock;
+  std::condition_variable wake;
+  bool running = false;
+  // the last backlog.size() bytes of the stream, wrapped around
+  std::string backlog;
+  uint64_t offset = 0;
+  // reused by every drain
+  std::string drained;
+  std::vector<std::unique_ptr<Link>> links;
+  // sockets waiting for a full sync
+  std::deque<int> waiting;
+
+  std::thread feeder;
+  std::thread syncer;
+
+  // moves storage's pending stream into the backlog and every queue
+  void propagate();
+  void feed_loop();
+  void sync_loop();
+  void full_sync(int sock);
+  // writes what the socket takes. false once the replica is gone
+  bool serve(Link &link);
+
+ public:
+  Primary(Storage &storage, size_t backlog_size);
+  Primary(Primary const &other) = delete;
+  ~Primary();
+
+  void start();
+
+  // takes over the socket of a connection that sent PSYNC
+  void attach(int sock, std::string_view replid, int64_t offset);
+
+  struct Stats {
+    std::string replid;
+    uint64_t offset;
+    size_t replicas;
+    size_t backlog_size;
+  };
+
+  Stats stats();
+};
+
+// the replica's side: a thread that keeps a connection to the primary,
+// syncs over it and applies the stream that follows, reconnecting with the
+// id and offset it got to after a disconnect. clients only get to read
+class Replica {
+  Storage &storage;
+  std::string host;
+  uint16_t port;
+
+  std::atomic<bool> running = false;
+  std::atomic<bool> linked = false;
+  std::atomic<int> sock = -1;
+  // only touched by the thread, and by stats under replid_lock
+  std::mutex replid_lock;
+  std::string replid = "?";
+  // the next stream byte wanted, -1 before the first sync
+  std::atomic<int64_t> offset = -1;
+  std::thread thread;
+
+  void run();
+  // one connection's sync and stream. throws once it's lost
+  void sync();
+
+ public:
+  Replica(Storage &storage, std::string host, uint16_t port);
+  Replica(Replica const &other) = delete;
+  ~Replica();
+
+  void start();
+
+  struct Stats {
+    std::string host;
+    uint16_t port;
+    bool linked;
+    std::string replid;
+    int64_t offset;
+  };
+
+  Stats stats();
+};
+
+// PSYNC's arguments, left by the command for the worker running it, which
+// takes them once the batch of commands is answered
+struct PsyncRequest {
+  std::string replid;
+  int64_t offset;
+};
+
+void request_psync(std::string_view replid, int64_t offset);
+std::optional<PsyncRequest> take_psync_request();
+
+// whichever side this server runs, for INFO. set once at startup
+void set_replication_role(Primary *primary, Replica *replica);
+Primary *replication_primary();
+Replica *replication_replica();
+
+// a blocking connection to host:port with Nagle's algorithm off, which
+// throws if none of the host's addresses answer
+int connect_to(std::string const &host, uint16_t port);
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// values at least this big are shared with the replies that read them and
+// written straight from storage, smaller ones are cheaper to copy
+const size_t SHARED_VALUE_MIN = 16 * 1024;
+
+using SharedValue = std::shared_ptr<const std::string>;
+
+// per-connection output queue. encoded replies are appended to inline chunks
+// and large values are queued by reference, then everything pending leaves in
+// a single scatter/gather write
+class OutputBuffer {
+  struct Chunk {
+    std::string bytes;
+    SharedValue value;
+
+    std::string_view view() const { return value ? *value : bytes; }
+  };
+
+  std::vector<Chunk> chunks{1};
+  size_t head = 0;
+  size_t offset = 0;
+  size_t pending = 0;
+
+ public:
+  void append(std::string_view bytes) {
+    if (chunks.back().value) {
+      chunks.emplace_back();
+    }
+    chunks.back().bytes.append(bytes);
+    pending += bytes.length();
+  }
+
+  void append(char c) { append(std::string_view(&c, 1)); }
+
+  void append(SharedValue value) {
+    pending += value->length();
+    chunks.push_back({.bytes = {}, .value = std::move(value)});
+  }
+
+  void clear() {
+    chunks.resize(1);
+    chunks[0].bytes.clear();
+    chunks[0].value.reset();
+    head = offset = pending = 0;
+  }
+
+  size_t size() const { return pending; }
+
+  bool empty() const { return pending == 0; }
+
+  // returns how many bytes the socket took, or -1 with errno set
+  ssize_t write_to(int sock);
+
+  // the pending bytes as up to iov.size() buffers, returning how many, and
+  // dropping the first written bytes once they've gone out. for a write
+  // the caller makes itself, during which nothing may be appended
+  size_t gather(std::span<iovec> iov) const;
+  void consume(size_t written);
+};
+
+// encodes RESP replies directly into an OutputBuffer
+class Reply {
+  OutputBuffer &out;
+
+  void number_line(char prefix, int64_t number);
+
+ public:
+  Reply(OutputBuffer &out) : out(out) {}
+
+  void simple_string(std::string_view string);
+  void error(std::string_view message);
+  void integer(int64_t integer);
+  void bulk_string(std::string_view string);
+  void bulk_string(SharedValue const &value);
+  void null_bulk_string();
+  void array(size_t len);
+  void null_array();
+  // RESP3, for clients that said HELLO 3: len keys, each followed by its
+  // value
+  void map(size_t len);
+};
@@ -1,11 +1,77 @@
 #pragma once
 
 #include <stddef.h>
+#include <string.h>
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
+#include <memory>
+#include <string_view>
+#include <utility>
 
 const uint16_t PORT = 6379;
-const size_t BUF_LEN = 2048;
 
-using buffer = std::array<char, BUF_LEN>;
\ No newline at end of file
+const size_t READ_CHUNK = 16 * 1024;
+
+// growable per-connection input buffer: bytes are appended at the tail by
+// reads and consumed from the head by the parser, so a partial frame simply
+// stays put until the rest of it arrives
+class InputBuffer {
+  std::unique_ptr<char[]> data;
+  size_t start = 0;
+  size_t end = 0;
+  size_t capacity = 0;
+
+ public:
+  std::string_view view() const { return {data.get() + start, end - start}; }
+
+  bool empty() const { return start == end; }
+
+  // returns a writable tail of at least min_free bytes
+  std::pair<char *, size_t> prepare(size_t min_free = READ_CHUNK) {
+    if (capacity - end < min_free) {
+      size_t used = end - start;
+
+      if (capacity - used >= min_free and start > 0) {
+        memmove(data.get(), data.get() + start, used);
+      } else {
+        size_t new_capacity = std::max(capacity * 2, used + min_free);
+        auto new_data = std::make_unique<char[]>(new_capacity);
+        if (used) {
+          memcpy(new_data.get(), data.get() + start, used);
+        }
+        data = std::move(new_data);
+        capacity = new_capacity;
+      }
+      start = 0;
+      end = used;
+    }
+
+    return {data.get() + end, capacity - end};
+  }
+
+  void commit(size_t len) { end += len; }
+
+  // frees the buffer while it's empty, for a connection that reads into
+  // shared buffers and only keeps what a partial command left over
+  void release() {
+    if (start == end) {
+      data.reset();
+      start = end = capacity = 0;
+    }
+  }
+
+  void consume(size_t len) {
+    start += len;
+
+    if (start == end) {
+      start = end = 0;
+      // don't let one huge request pin its buffer for the connection lifetime
+      if (capacity > 4 * READ_CHUNK) {
+        data.reset();
+        capacity = 0;
+      }
+    }
+  }
+};
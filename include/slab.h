@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <array>
+#include <cstdint>
+
+// size-class slab allocator for stored keys and values.
+//
+// sizes up to MAX_CLASS are rounded up to one of 36 classes, four per power
+// of two past 128 bytes, and carved out of 64KB pages aligned to their size,
+// so freeing a pointer finds its page header, and through it the owning
+// slab, by masking. pages come from a pool of large mappings shared by all
+// slabs. each page keeps its own free list and a page whose objects are all
+// free goes back to the system, except for one spare any class can reuse.
+// bigger blocks come from malloc behind a small header naming their owner.
+//
+// a slab isn't thread safe: every storage shard owns one and only touches it
+// under the shard's lock, so workers never contend on an allocator lock
+class Slab {
+ public:
+  static constexpr size_t PAGE = 64 * 1024;
+  static constexpr size_t MAX_CLASS = 16 * 1024;
+  static constexpr size_t CLASSES = 36;
+
+  struct Stats {
+    // bytes callers asked for
+    size_t used = 0;
+    // bytes handed out once rounded up to a size class
+    size_t allocated = 0;
+    // bytes taken from the system for pages and large blocks
+    size_t reserved = 0;
+    size_t pages = 0;
+
+    Stats &operator+=(Stats const &other) {
+      used += other.used;
+      allocated += other.allocated;
+      reserved += other.reserved;
+      pages += other.pages;
+      return *this;
+    }
+  };
+
+ private:
+  struct Page;
+
+  struct Class {
+    // pages with at least one free object
+    Page *partial = nullptr;
+  };
+
+  std::array<Class, CLASSES> classes;
+  void *spare = nullptr;
+  Stats stats;
+
+  Page *new_page(size_t size_class);
+  void unlink(Page *page);
+  void release_small(Page *page, void *ptr, size_t size);
+
+ public:
+  Slab() = default;
+  Slab(Slab const &other) = delete;
+  ~Slab();
+
+  void *allocate(size_t size);
+
+  // size must be what was passed to allocate
+  static void release(void *ptr, size_t size);
+
+  Stats get_stats() const { return stats; }
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// SLOWLOG: the latest commands that ran longer than a threshold, in a
+// bounded ring behind a lock that only slow commands take
+
+struct SlowlogEntry {
+  uint64_t id;
+  // unix seconds
+  int64_t time;
+  uint64_t micros;
+  // truncated like redis's: 32 arguments of 128 bytes at most
+  std::vector<std::string> args;
+  // "ip:port", empty for commands replayed from the log
+  std::string client;
+};
+
+// like redis's slowlog-log-slower-than, in microseconds, where a negative
+// threshold logs nothing and 0 everything, and slowlog-max-len
+void set_slowlog_config(int64_t slower_than, size_t max_len);
+
+// whether a command that ran for nanos belongs in the log, cheap enough to
+// ask after every command
+bool slowlog_wants(uint64_t nanos);
+void slowlog_push(uint64_t nanos, std::span<std::string_view const> args,
+                  std::string_view client);
+
+// the newest count entries, newest first
+std::vector<SlowlogEntry> slowlog_get(size_t count);
+size_t slowlog_len();
+void slowlog_reset();
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "cell.h"
+
+class Storage;
+
+// binary point-in-time snapshots of the whole keyspace.
+//
+// a snapshot starts by marking every shard at once. from then on a writer
+// about to change or delete an entry the snapshot hasn't reached yet first
+// copies it into its shard's snapshot buffer, while the snapshot walks each
+// shard a chunk at a time under the shard's lock, so writes never wait for
+// more than a chunk and the result is the keyspace as of the start, without
+// fork(). see Storage::begin_snapshot.
+//
+// the file is a header (magic, version, creation time in unix ms), then
+// blocks of records each prefixed with their length and crc32c, then a
+// trailer holding the key count so a load can size every table up front. a
+// record is a flags byte (HAS_EXPIRY, and the value's type from TYPE_SHIFT
+// up), an 8-byte little-endian expiry if there is one, then the key as a
+// varint length and bytes. a string value follows the same way, and a
+// collection as a varint element count and its elements, in
+// for_each_element's form
+namespace snapshot {
+
+const uint8_t HAS_EXPIRY = 1;
+const uint8_t TYPE_SHIFT = 4;
+
+void append_record(std::string &out, std::string_view key,
+                   DataCell const &value);
+
+// DUMP's payload: the type byte, the value as in a record, and a crc32c of
+// both, so RESTORE can refuse one mangled on the way
+void append_payload(std::string &out, DataCell const &value);
+// the payload's type and its elements in for_each_element's form, a
+// string's value being its only one. nullopt if it's malformed. elements
+// point into payload
+std::optional<Type> parse_payload(std::string_view payload,
+                                  std::vector<std::string_view> &elements);
+
+}  // namespace snapshot
+
+// writes a snapshot of storage to fd, returning how many keys it holds.
+// at_start runs at the snapshot's instant, see Storage::begin_snapshot
+size_t write_snapshot(Storage &storage, int fd,
+                      std::function<void()> const &at_start = nullptr);
+
+// where SAVE and BGSAVE write, set once at startup
+void set_snapshot_path(std::string path);
+std::string const &snapshot_path();
+
+// writes a snapshot to a temporary file next to snapshot_path() and renames
+// it over it, so a crash never leaves half a snapshot behind
+size_t save_snapshot(Storage &storage);
+
+// runs save_snapshot on its own thread. false if a save is already running
+bool background_save(Storage &storage);
+bool save_in_progress();
+
+// bulk loads the snapshot at path into an empty storage, returning how many
+// keys it held, or 0 if there's no file. throws if it's corrupt
+size_t load_snapshot(Storage &storage, std::string const &path);
+// the same from a snapshot already in memory
+size_t load_snapshot(Storage &storage, std::string_view data);
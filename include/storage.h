@@ -1,24 +1,556 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <shared_mutex>
-#include <unordered_map>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
-#include "elements.h"
+#include "cell.h"
+#include "cluster.h"
+#include "collection.h"
+#include "flat_map.h"
+#include "reply.h"
+#include "slab.h"
 
-struct DataCell {
-  BulkString value;
-  std::optional<std::chrono::time_point<std::chrono::steady_clock>> expiry;
+// passed as a SET expiry to leave an existing key's TTL alone
+const int64_t KEEP_TTL = -1;
+
+inline uint64_t hash_key(std::string_view key) {
+  return std::hash<std::string_view>{}(key);
+}
+
+// lets the map be probed with a string_view, so lookups never copy the key
+struct KeyEqual {
+  bool operator()(std::string_view lhs, Key const& rhs) const noexcept {
+    return lhs == rhs.view();
+  }
+};
+
+const size_t DEFAULT_SHARDS = 64;
+
+enum class EvictionPolicy {
+  NOEVICTION,
+  ALLKEYS_LRU,
+  ALLKEYS_LFU,
+  VOLATILE_TTL
+};
+
+std::optional<EvictionPolicy> parse_eviction_policy(std::string_view name);
+std::string_view eviction_policy_name(EvictionPolicy policy);
+
+struct MaxMemory {
+  // 0 for no limit
+  size_t bytes = 0;
+  EvictionPolicy policy = EvictionPolicy::NOEVICTION;
+  // keys compared per eviction by the lru and lfu policies
+  size_t samples = 5;
+};
+
+// a shard's lock. EXEC holds the shards its transaction touches for the
+// whole batch, and while it does, the storage calls its commands make lock
+// them again as no-ops on that thread
+class ShardLock {
+  std::shared_mutex mutex;
+  std::atomic<std::thread::id> holder;
+
+  bool held() const {
+    return holder.load(std::memory_order_relaxed) ==
+           std::this_thread::get_id();
+  }
+
+ public:
+  void lock() {
+    if (!held()) {
+      mutex.lock();
+    }
+  }
+  void unlock() {
+    if (!held()) {
+      mutex.unlock();
+    }
+  }
+  void lock_shared() {
+    if (!held()) {
+      mutex.lock_shared();
+    }
+  }
+  void unlock_shared() {
+    if (!held()) {
+      mutex.unlock_shared();
+    }
+  }
+
+  // false if this thread holds it already, as a RESTORE run by EXEC does,
+  // which leaves releasing it to the outer hold
+  bool hold() {
+    if (held()) {
+      return false;
+    }
+    mutex.lock();
+    holder.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    return true;
+  }
+  void release() {
+    holder.store({}, std::memory_order_relaxed);
+    mutex.unlock();
+  }
 };
 
+// the keyspace is split into a power-of-two number of shards by the top bits
+// of the key hash, each with its own lock, so writers to different shards
+// never contend.
+//
+// expired keys are dropped lazily when touched and actively by
+// expire_cycle, which pops each shard's min-heap of (expiry, key hash). heap
+// entries aren't removed when a TTL changes: a popped entry only deletes a
+// key whose expiry still matches it.
+//
+// with a memory limit each shard gets an equal slice of it, and a SET into
+// a shard over its slice first evicts a few keys picked by the policy, so
+// the cost is spread over the writes instead of paid in one pass. the limit
+// covers entries and what their keys and values own, not the hash indexes.
+//
+// once logging is on, every mutation is also appended to its shard's log as
+// the RESP command that redoes it, while the shard is still locked, so the
+// log orders writes to a key exactly as they were applied. collection
+// writes are logged as the command that made them. expiries are
+// logged as absolute times, so replaying a log later means the same thing.
+// the replication stream gets the same entries in a log of its own, so the
+// append-only file and replicas drain at their own pace
 class Storage {
-  std::unordered_map<BulkString, DataCell> data;
-  std::shared_mutex data_lock;
+  using Expiry = std::pair<int64_t, uint64_t>;
+  using Map = FlatMap<Key, DataCell, KeyEqual>;
+
+  struct alignas(64) Shard {
+    // declared before data so it outlives the cells allocated from it. on
+    // the heap, since pages point back at their slab, so FLUSHALL ASYNC can
+    // hand a whole slab to the lazy free thread by the pointer
+    std::unique_ptr<Slab> arena = std::make_unique<Slab>();
+    Map data;
+    std::vector<Expiry> expiries;
+    ShardLock data_lock;
+    // cells changed, for WATCH
+    uint64_t writes = 0;
+    // bytes counted against the memory limit
+    size_t stored = 0;
+    size_t evicted = 0;
+    uint64_t random = 0x9e3779b97f4a7c15;
+
+    // the append-only log's pending entries. appended to under data_lock
+    // too, but drained under log_lock alone, so the writer never holds up
+    // readers
+    std::mutex log_lock;
+    std::string log;
+    // while a rewrite runs, where the entries made after this shard was
+    // dumped start in log
+    bool rewriting = false;
+    size_t rewrite_from = 0;
+    // the replication stream's pending entries, kept like log
+    std::string repl;
+
+    // see begin_snapshot
+    bool snapshot_epoch = false;
+    bool snapshotting = false;
+    size_t snapshot_cursor = 0;
+    std::string snapshot_saved;
+    size_t snapshot_saved_keys = 0;
+  };
+
+  std::unique_ptr<Shard[]> shards;
+  size_t shard_bits;
+  // in cluster mode a key's hash starts with its slot, see hash_of
+  bool slotted;
+  // keys per slot, each counted under the lock of the shard holding the
+  // slot
+  std::unique_ptr<uint32_t[]> slot_keys;
+  // where in its shard's entries each slot's last GETKEYSINSLOT stopped, so
+  // the next batch of a migration picks up there instead of rescanning the
+  // slots before it. only a hint, so racing readers don't lock for it
+  std::unique_ptr<std::atomic<uint32_t>[]> slot_cursors;
+  MaxMemory max_memory;
+  size_t shard_limit;
+  // only touched by whoever runs expire_cycle
+  size_t next_expiry_shard = 0;
+  // only flipped before the workers start
+  bool logging = false;
+  // only flipped with every shard locked
+  bool replicating = false;
+  // set by a flush while a rewrite runs, which leaves the dumped shards
+  // stale. under every log lock
+  bool rewrite_flushed = false;
+  std::atomic<bool> rewrite_requested = false;
+  // held from begin_snapshot to end_snapshot, one snapshot at a time
+  std::mutex snapshot_lock;
+
+  size_t shard_index(uint64_t hash) const {
+    // the maps probe with the low bits, so pick shards by the high ones
+    return shard_bits ? hash >> (64 - shard_bits) : 0;
+  }
+  Shard& shard_for(uint64_t hash) { return shards[shard_index(hash)]; }
+
+  static constexpr unsigned SLOT_SHIFT = 64 - CLUSTER_SLOT_BITS;
+  // the key's hash, with its slot in the top bits in cluster mode so a
+  // slot's keys all land in one shard and can be counted and found without
+  // a full scan. the maps probe with the low bits, which stay the key's own
+  uint64_t hash_of(std::string_view key) const {
+    auto hash = hash_key(key);
+    return slotted ? uint64_t(key_slot(key)) << SLOT_SHIFT |
+                         hash >> CLUSTER_SLOT_BITS
+                   : hash;
+  }
+  // zeroes the counts of shard i's slots, once it's been emptied
+  void clear_slots(size_t i);
+  // counts a key inserted with hash
+  void count_in_slot(uint64_t hash) {
+    if (slotted) {
+      slot_keys[hash >> SLOT_SHIFT]++;
+    }
+  }
+
+  // locks each shard holding one of keys[0], keys[stride], ... once, in
+  // shard order so batches never deadlock with each other or with
+  // begin_snapshot, and calls fn with the keys' hashes
+  template <typename Fn>
+  void lock_batch(std::span<std::string_view const> keys, size_t stride,
+                  bool exclusive, Fn&& fn);
+  void set_locked(Shard& shard, uint64_t hash, std::string_view key,
+                  std::string_view value, int64_t expiry);
+
+  static size_t footprint(Map::Entry const& entry);
+  // lazy hands big values to the lazy free thread
+  void remove(Shard& shard, Map::Entry& entry, bool lazy = false);
+  // the same without counting it as a change, for an entry just created
+  // that nothing was written to
+  void discard(Shard& shard, Map::Entry& entry, bool lazy = false);
+  Map::Entry* eviction_candidate(Shard& shard);
+  // false if the shard is over its limit and nothing could be evicted
+  bool make_room(Shard& shard);
+
+  // copies an entry the running snapshot still needs into the shard's
+  // snapshot buffer before it's changed or removed
+  void save_for_snapshot(Shard& shard, Map::Entry& entry);
+  // stamps a changed entry with a new version for WATCH and tells the
+  // clients tracking it
+  void mark_changed(Shard& shard, Map::Entry& entry);
+  // both, for a change that's certain
+  void preserve(Shard& shard, Map::Entry& entry) {
+    save_for_snapshot(shard, entry);
+    mark_changed(shard, entry);
+  }
+
+  bool propagating() const { return logging or replicating; }
+  // every shard's log_lock, in shard order
+  std::vector<std::unique_lock<std::mutex>> lock_logs();
+  void log(Shard& shard, std::initializer_list<std::string_view> args);
+  void log(Shard& shard, std::span<std::string_view const> args);
+  void log_restore(Shard& shard, Map::Entry const& entry);
+  // the commands that recreate entry: SET, or its collection's add command
+  // in batches and then PEXPIREAT if it has an expiry
+  static void append_restore(std::string& out, Map::Entry const& entry);
+
+  void track_expiry(Shard& shard, uint64_t hash, int64_t expiry);
+  bool expire_shard(Shard& shard, int64_t now);
 
  public:
-  bool set(BulkString&& key, BulkString&& value,
-           std::optional<BulkString> const& px);
+  // slotted is cluster mode, which keeps up the slot index
+  Storage(size_t shard_count = DEFAULT_SHARDS, MaxMemory max_memory = {},
+          bool slotted = false);
+
+  enum class Access { OK, MISSING, WRONGTYPE, OOM, NOT_INTEGER, OVERFLOW };
+
+  // key and value are only copied if they end up stored. false if the
+  // memory limit is reached and the policy can't evict anything
+  bool set(std::string_view key, std::string_view value,
+           int64_t expiry = NO_EXPIRY);
+
+  // encodes the value, or a null bulk string, straight into the reply
+  void get(std::string_view key, Reply& reply);
+
+  // the multi-key commands take each shard's lock once for the whole batch
+  // and hold them all at once, so they see and make a single instant
+
+  // replies with an array of the values, nil for keys that are missing or
+  // not strings
+  void mget(std::span<std::string_view const> keys, Reply& reply);
+
+  // sets key, value pairs, or with only_new none of them if any key exists,
+  // returning false then. nullopt if the memory limit is reached and the
+  // policy can't evict anything
+  std::optional<bool> mset(std::span<std::string_view const> pairs,
+                           bool only_new = false);
+
+  // deletes the keys, freeing big values lazily, and counts those that
+  // existed
+  size_t del(std::span<std::string_view const> keys);
+
+  // counts the keys that exist, as often as they're named
+  size_t exists(std::span<std::string_view const> keys);
+
+  // the string commands below change the value in place under the shard's
+  // lock and log command as the change
+
+  // INCRBY and friends: adds delta to the integer at key, 0 if it's
+  // missing, and leaves the sum in value. NOT_INTEGER if the value isn't an
+  // integer, OVERFLOW if the sum would overflow
+  Access incr(std::string_view key, int64_t delta,
+              std::span<std::string_view const> command, int64_t& value);
+
+  // APPEND, leaving the new length in length
+  Access append(std::string_view key, std::string_view suffix,
+                std::span<std::string_view const> command, size_t& length);
+
+  // SETRANGE, zero-padding up to offset, and leaving the new length in
+  // length. an empty range changes nothing and creates no key
+  Access set_range(std::string_view key, size_t offset, std::string_view bytes,
+                   std::span<std::string_view const> command, size_t& length);
+
+  // GETSET: replies with the old value, or nil, and sets the new one
+  // without an expiry
+  Access getset(std::string_view key, std::string_view value, Reply& reply);
+
+  // WATCH: where a key stood, to tell later whether it's changed since
+  struct Watch {
+    uint64_t writes;
+    uint16_t version;
+    bool exists;
+  };
+  Watch watch(std::string_view key);
+  // true if the key may have changed since watch: always once its shard saw
+  // 64k writes meanwhile, and otherwise when its version differs, which
+  // only misses a change stamping the same 16 bits. a key that came and
+  // went again counts as unchanged
+  bool changed(std::string_view key, Watch const& watch);
+
+  // EXEC: runs fn holding every shard with one of keys exclusively, or
+  // every shard if all is set, so what it runs sees and makes a single
+  // instant. the storage calls fn makes on this thread don't lock again
+  void atomically(std::span<std::string_view const> keys, bool all,
+                  std::function<void()> const& fn);
+
+  // SCAN: calls fn(key, type) with the live keys of the map groups from
+  // cursor on until it has seen about count keys, and returns the cursor to
+  // go on from, 0 once every shard is done. the low bits pick the shard and
+  // the rest are the shard map's cursor, see FlatMap::scan, so a key
+  // present for the whole scan is seen at least once however the maps
+  // resize. a shard is locked for a bounded number of groups at a time
+  uint64_t scan(uint64_t cursor, size_t count,
+                std::function<void(std::string_view, Type)> const& fn);
+
+  // DBSIZE: the keys in every shard, including expired ones not deleted yet
+  size_t size();
+
+  // FLUSHALL: deletes every key and logs command. async swaps every shard's
+  // map and slab for empty ones and leaves freeing the old ones to the lazy
+  // free thread, so the lock is held for as long as the swap takes
+  void flush(bool async, std::span<std::string_view const> command);
+
+  // milliseconds left to live, -1 if the key never expires, -2 if missing
+  int64_t ttl(std::string_view key);
+
+  // gives the key an absolute expiry, deleting it if that's already past.
+  // false if the key doesn't exist
+  bool expire(std::string_view key, int64_t expiry);
+
+  // false unless the key existed and had an expiry to remove
+  bool persist(std::string_view key);
+
+  // calls fn with the key's collection of the given type under a shared
+  // lock, unless it's missing or of another type
+  template <typename Fn>
+  Access read(std::string_view key, Type type, Fn&& fn);
+
+  // calls fn(cell, arena) with the key's collection of the given type under
+  // the shard's lock, creating an empty one first if create is set, and
+  // deletes the key if fn leaves it empty. fn returns whether it changed
+  // anything, and if it did command is logged as the change
+  template <typename Fn>
+  Access write(std::string_view key, Type type, bool create,
+               std::span<std::string_view const> command, Fn&& fn);
+
+  // the key's type and encoding, for TYPE and OBJECT ENCODING
+  std::optional<std::pair<Type, std::string_view>> describe(
+      std::string_view key);
+
+  // deletes expired keys shard by shard until the budget runs out, and
+  // moves incremental resizes along while it holds each lock. true if it
+  // stopped with expired keys left over
+  bool expire_cycle(std::chrono::microseconds budget);
+
+  struct MemoryStats {
+    size_t keys = 0;
+    // keys and values carved from the shard slabs
+    Slab::Stats slab;
+    // hash indexes and entry arrays
+    size_t tables = 0;
+    // values large enough to be shared with replies, which live on the heap
+    size_t shared = 0;
+    // bytes counted against the memory limit
+    size_t stored = 0;
+    size_t evicted = 0;
+    MaxMemory max_memory;
+  };
+
+  // sums every shard, locking one at a time, so the totals aren't a single
+  // snapshot under concurrent writes
+  MemoryStats memory_stats();
+
+  // the append-only log's side. the writer drains every shard's pending
+  // entries into main, and those made after a shard's dump into tail while
+  // a rewrite runs. both drains take every shard's log at once, so a
+  // FLUSHALL sits between the same entries in the drained stream as it did
+  // in the shards
+  void enable_log() { logging = true; }
+  void drain_log(std::string& main, std::string& tail);
+
+  size_t shard_count() const { return 1ul << shard_bits; }
+
+  // appends SET commands recreating the shard's live keys to out, and from
+  // then on copies the shard's new entries to the rewrite tail
+  void dump_shard(size_t i, std::string& out);
+  // false if a flush made the dumped shards stale, so the rewrite has to be
+  // dropped and a new one is requested
+  bool end_rewrite();
+
+  // the replication stream's side. start_replication may only be called
+  // from begin_snapshot's at_start, so the first full sync's snapshot and
+  // the stream after it line up
+  void start_replication() { replicating = true; }
+  void drain_replication(std::string& out);
+
+  // asks the log writer for a rewrite. false if there's no log
+  bool request_rewrite();
+  bool take_rewrite_request() { return rewrite_requested.exchange(false); }
+
+  // snapshots: begin_snapshot marks every shard at once and flips its epoch,
+  // so every cell becomes one the snapshot hasn't accounted for.
+  // snapshot_chunk then walks a shard from its last entry down, a chunk per
+  // lock hold, recording cells it hasn't accounted for and marking them.
+  // writers preserve unaccounted cells before touching them and new cells
+  // start accounted for. erasing moves the last entry into the hole, so
+  // walking down means only entries already handled are ever moved below
+  // the cursor
+  // at_start runs while every shard is still locked, at the snapshot's
+  // instant
+  void begin_snapshot(std::function<void()> const& at_start = nullptr);
+  // appends records to out and counts them in keys. false once shard i is
+  // done
+  bool snapshot_chunk(size_t i, std::string& out, size_t& keys);
+  // finishes every shard's snapshot, even one given up halfway
+  void end_snapshot();
+
+  // bulk loading into an empty storage: size every shard for keys, then
+  // insert keys known not to exist yet. RESTORE loads a key it's just
+  // deleted the same way
+  void reserve(size_t keys);
+  void load(std::string_view key, std::string_view value, int64_t expiry);
+  // a collection, from its elements in for_each_element's form. false if
+  // they're malformed
+  bool load(std::string_view key, Type type,
+            std::span<std::string_view const> elements, int64_t expiry);
+
+  // deletes every key. not logged, so whoever calls it rewrites the log
+  void clear();
+
+  // cluster mode's slot index. CLUSTER COUNTKEYSINSLOT, including expired
+  // keys not deleted yet
+  size_t count_keys_in_slot(uint16_t slot);
+  // CLUSTER GETKEYSINSLOT: up to count live keys of slot, found by walking
+  // only the shard holding it from where the last call for the slot
+  // stopped, round to there again at most
+  void keys_in_slot(uint16_t slot, size_t count,
+                    std::vector<std::string>& keys);
+
+  // DUMP: appends the key's snapshot::append_payload to out. false if it's
+  // missing
+  bool dump(std::string_view key, std::string& out);
+
+  // log entries the calling thread has appended so far, so a worker can
+  // tell whether a batch of commands wrote anything
+  static size_t logged_by_thread();
+
+ private:
+  // write for strings: calls fn(cell, arena) with the string at key, which
+  // holds initial if the key was missing. a key created that way is dropped
+  // again unless fn returns that it changed it
+  template <typename Fn>
+  Access write_string(std::string_view key, std::string_view initial,
+                      std::span<std::string_view const> command, Fn&& fn);
+};
+
+template <typename Fn>
+Storage::Access Storage::read(std::string_view key, Type type, Fn&& fn) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::shared_lock guard(shard.data_lock);
+
+  // an expired key is left for a writer or the cron to delete
+  auto entry = shard.data.find(key, hash);
+  if (!entry or entry->value.expired()) {
+    return Access::MISSING;
+  }
+  if (entry->value.get_type() != type) {
+    return Access::WRONGTYPE;
+  }
+  entry->value.touch();
+  fn(entry->value);
+  return Access::OK;
+}
+
+template <typename Fn>
+Storage::Access Storage::write(std::string_view key, Type type, bool create,
+                               std::span<std::string_view const> command,
+                               Fn&& fn) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::unique_lock guard(shard.data_lock);
+
+  if (create and shard_limit and !make_room(shard)) {
+    return Access::OOM;
+  }
+
+  auto entry = shard.data.find(key, hash);
+  if (entry and entry->value.expired()) {
+    remove(shard, *entry);
+    entry = nullptr;
+  }
+  if (entry and entry->value.get_type() != type) {
+    return Access::WRONGTYPE;
+  }
+  if (!entry) {
+    if (!create) {
+      return Access::MISSING;
+    }
+    entry = &shard.data.insert(hash, Key(key, *shard.arena),
+                               DataCell(type, *shard.arena));
+    entry->value.set_snapshot_epoch(shard.snapshot_epoch);
+    count_in_slot(hash);
+    shard.stored += footprint(*entry);
+  }
+
+  save_for_snapshot(shard, *entry);
+  size_t before = footprint(*entry);
+  bool changed = fn(entry->value, *shard.arena);
+  entry->value.touch();
+  shard.stored += footprint(*entry) - before;
 
-  std::optional<BulkString> get(BulkString const& key);
-};
\ No newline at end of file
+  if (changed and propagating()) {
+    log(shard, command);
+  }
+  if (!collection_size(entry->value)) {
+    // a created collection that stayed empty was never logged, and one
+    // emptied by fn is deleted by the replayed command too
+    changed ? remove(shard, *entry) : discard(shard, *entry);
+  } else if (changed) {
+    mark_changed(shard, *entry);
+  }
+  return Access::OK;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pubsub.h"
+
+// server-assisted client-side caching, like redis's CLIENT TRACKING.
+//
+// in the default mode the keys a tracking client reads are remembered in a
+// table of key to client ids, sharded like storage, and the first change to
+// one sends every client that read it an invalidation and forgets them, so
+// a client has to read the key again to hear of the next change. the table
+// holds at most max_keys keys; going over forgets some, telling their
+// readers as if they'd changed. in broadcast mode nothing is remembered and
+// a client hears of every change to a key under one of its prefixes.
+//
+// invalidations travel like published messages, through the mailbox of the
+// worker owning the client, or the client it redirects them to: a RESP3
+// push for a client that said HELLO 3, and otherwise a message on the
+// __redis__:invalidate channel, which a RESP2 client only gets through a
+// redirect to a connection subscribed to it. a redirect to a RESP2
+// connection that isn't subscribed sends nothing, like redis
+
+// the channel RESP2 clients get invalidations on
+const std::string_view INVALIDATION_CHANNEL = "__redis__:invalidate";
+
+struct TrackingOptions {
+  // the client that gets the invalidations, 0 for this one
+  uint64_t redirect = 0;
+  bool bcast = false;
+  // broadcast mode: what the keys start with, where none means every key
+  std::vector<std::string> prefixes;
+  // not about keys the client changed itself
+  bool noloop = false;
+};
+
+// every connection, so clients can be found by id
+void add_client(Subscriber const &client);
+void remove_client(uint64_t id);
+// 2 or 3, which decides how invalidations are sent to it
+void set_client_protocol(uint64_t id, int protocol);
+// whether it's subscribed to INVALIDATION_CHANNEL, without which a RESP2
+// client can't be sent invalidations
+void set_client_invalidation_subscriber(uint64_t id, bool subscribed);
+
+// throws with the error to reply with
+void enable_tracking(uint64_t id, TrackingOptions options);
+void disable_tracking(uint64_t id);
+// nullopt unless the client is tracking
+std::optional<TrackingOptions> tracking_options(uint64_t id);
+
+// remembers that a default mode client read keys. done before reading them,
+// so a change racing with the read is sent after its reply
+void track_reads(uint64_t id, std::span<std::string_view const> keys);
+
+// the client whose commands the calling thread runs, for NOLOOP, or 0
+void set_tracking_caller(uint64_t id);
+
+// clients tracking in either mode, so storage's hooks cost one load while
+// there are none
+inline std::atomic<size_t> tracking_clients = 0;
+
+// queues key's invalidation, taking its readers from the table
+void invalidate_tracked(std::string_view key);
+
+// called by storage whenever key is changed, created or removed, under the
+// key's shard lock, so the clients to tell are only looked up once
+// flush_invalidations runs
+inline void invalidate_key(std::string_view key) {
+  if (tracking_clients.load(std::memory_order_relaxed)) {
+    invalidate_tracked(key);
+  }
+}
+
+// sends what the calling thread's changes queued. whoever drives storage
+// calls it once the shards are let go: after each command and each expire
+// cycle
+void flush_invalidations();
+
+// every key is gone: tells every tracking client to drop its whole cache
+void invalidate_all();
+
+void set_tracking_table_max_keys(size_t keys);
+
+// for INFO
+struct TrackingStats {
+  size_t keys = 0;
+  // client ids across every key
+  size_t items = 0;
+  size_t prefixes = 0;
+};
+TrackingStats tracking_stats();
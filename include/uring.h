@@ -0,0 +1,89 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+
+// a minimal io_uring over the raw system calls, so the server needs no
+// liburing to build.
+//
+// submissions queue up in the shared ring and only reach the kernel with the
+// next wait, so everything one pass of the event loop asks for costs a single
+// io_uring_enter. reads draw from a ring of provided buffers instead of
+// buffers of their own, so an idle connection holds no read buffer at all.
+//
+// a ring may only be used by the thread that created it
+class Ring {
+  int fd = -1;
+
+  void *sq_ring = nullptr;
+  size_t sq_ring_len = 0;
+  void *cq_ring = nullptr;
+  size_t cq_ring_len = 0;
+  io_uring_sqe *sqes = nullptr;
+  size_t sqes_len = 0;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  // submissions queued since the last enter
+  unsigned unsubmitted = 0;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  io_uring_cqe *cqes;
+
+  // the provided buffers, one block carved into equal slices
+  io_uring_buf_ring *buffers = nullptr;
+  size_t buffers_len = 0;
+  char *buffer_data = nullptr;
+  unsigned buffer_count = 0;
+  unsigned buffer_size = 0;
+  uint16_t buffer_tail = 0;
+
+  void enter(unsigned wait);
+  void provide(uint16_t bid);
+  void release();
+
+ public:
+  // the buffer group recv draws from
+  static constexpr uint16_t BUFFER_GROUP = 0;
+
+  // throws if the kernel has no io_uring, or not one new enough for
+  // multishot receives from provided buffers. buffer_count must be a power
+  // of two
+  Ring(unsigned entries, unsigned buffer_count, unsigned buffer_size);
+  Ring(Ring const &other) = delete;
+  ~Ring();
+
+  // a cleared submission to fill in, submitting what's queued first if the
+  // ring is full
+  io_uring_sqe &prepare();
+
+  // submits what's queued and waits for at least one completion
+  void submit_and_wait();
+
+  // calls fn with every completion that's arrived, then frees their slots
+  template <typename Fn>
+  void completions(Fn &&fn);
+
+  // a provided buffer a completion carries, and handing it back once read
+  std::string_view buffer(io_uring_cqe const &cqe) const;
+  void recycle(io_uring_cqe const &cqe);
+};
+
+template <typename Fn>
+void Ring::completions(Fn &&fn) {
+  unsigned head = *cq_head;
+  unsigned tail = std::atomic_ref(*cq_tail).load(std::memory_order_acquire);
+
+  for (; head != tail; head++) {
+    fn(cqes[head & cq_mask]);
+  }
+  std::atomic_ref(*cq_head).store(head, std::memory_order_release);
+}
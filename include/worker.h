@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "aof.h"
+#include "protocol.h"
+#include "pubsub.h"
+#include "replication.h"
+#include "reply.h"
+#include "shared.h"
+#include "storage.h"
+#include "uring.h"
+
+// how a worker waits on its sockets: epoll and a read and a write per
+// ready connection, or io_uring, which takes every receive and send of a
+// pass through the event loop in one system call
+enum class IoBackend { EPOLL, URING };
+
+std::optional<IoBackend> parse_io_backend(std::string_view name);
+
+struct Connection {
+  int sock;
+  // unique within the process, unlike the socket, and what CLIENT ID
+  // answers
+  uint64_t id;
+  InputBuffer in;
+  OutputBuffer out;
+  bool want_write = false;
+  bool closing = false;
+  // with fsync always, the aof ticket the pending replies wait for
+  uint64_t durable_at = 0;
+  Session session;
+  // when a subscriber's pending output went over the soft limit
+  std::optional<std::chrono::steady_clock::time_point> over_soft_limit;
+  // PSYNC arrived, and the connection goes to the primary once the replies
+  // before it are out
+  std::optional<PsyncRequest> handing_over;
+
+  // io_uring only: the replies a send has in flight, while new ones queue
+  // up in out, and what the send points the kernel at
+  OutputBuffer sending;
+  std::vector<iovec> iov;
+  msghdr msg{};
+  // operations the kernel still holds, which keep the socket open
+  unsigned inflight = 0;
+  bool receiving = false;
+  // reads held off while the client's replies pile up
+  bool paused = false;
+  // closed or handed over, and gone once inflight drops to 0
+  bool detached = false;
+
+  Connection(int sock, uint64_t id) : sock(sock), id(id) {}
+
+  size_t pending_out() const { return out.size() + sending.size(); }
+};
+
+// owns a listening socket bound with SO_REUSEPORT, an epoll instance or an
+// io_uring, and every connection the kernel hands to that socket, so workers
+// never share a client
+class Worker {
+  int sock;
+  int epoll;
+  int id;
+  IoBackend backend;
+  // set up by the worker's own thread, since only that thread may submit
+  std::unique_ptr<Ring> ring;
+  // detached connections whose last operation has finished
+  std::vector<int> retired;
+  Storage &storage;
+  Aof *aof;
+  Primary *primary;
+  // signalled by the aof writer after each sync, when fsync is always
+  int synced_event = -1;
+  std::unordered_map<int, Connection> conns;
+  // published messages for this worker's subscribers
+  Mailbox mailbox;
+  // connections holding replies until the aof catches up
+  std::vector<int> unsynced;
+  std::thread thread;
+
+  void epoll_loop();
+  void uring_loop();
+
+  void accept_all();
+  Connection &add_conn(int client_sock);
+  void handle_synced();
+  void handle_deliveries();
+  void handle_readable(Connection &conn);
+  // runs the complete commands at the front of input and drops them from
+  // it. false if the connection was handed over
+  bool serve(Connection &conn, std::string_view &input);
+  // under fsync always, holds the replies to a batch that wrote anything
+  // back until the aof has synced it
+  void hold_for_sync(Connection &conn, size_t logged);
+  bool flush(Connection &conn);
+  // passes a replica's connection to the primary
+  void hand_over(Connection &conn, PsyncRequest const &psync);
+  // epoll only: the hand over, once the replies before PSYNC are out
+  void finish_hand_over(Connection &conn);
+  void close_conn(Connection &conn);
+
+  // the io_uring side
+  void complete(io_uring_cqe const &cqe);
+  void received(Connection &conn, std::string_view data);
+  void sent(Connection &conn, int result);
+  void arm_poll(int fd, uint8_t op);
+  void arm_recv(Connection &conn);
+  void submit_send(Connection &conn);
+  void cancel(Connection &conn, uint64_t target, uint32_t flags);
+  void retire(Connection &conn);
+
+ public:
+  // aof is null unless the append only file is on. primary is null on a
+  // replica, whose clients may only read. a worker asked for io_uring falls
+  // back to epoll if the kernel can't provide it
+  Worker(int id, uint16_t port, Storage &storage, Aof *aof, Primary *primary,
+         IoBackend backend = IoBackend::EPOLL);
+  Worker(Worker const &other) = delete;
+  ~Worker();
+
+  void start();
+  void join();
+  void event_loop();
+};
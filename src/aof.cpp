@@ -0,0 +1,317 @@
+#include "aof.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "log.h"
+#include "protocol.h"
+
+// how long the writer sleeps between rounds when nobody asks for a sync,
+// which bounds how stale the file gets under EVERYSEC and NO
+const auto WRITE_INTERVAL = std::chrono::milliseconds(10);
+const auto EVERYSEC_INTERVAL = std::chrono::seconds(1);
+// rewrite once the file has doubled since the last one and is at least this
+// big, like redis's auto-aof-rewrite defaults
+const size_t AUTO_REWRITE_MIN_SIZE = 64 * 1024 * 1024;
+// the slice of the mapped file replayed per call, bounding the replies
+// buffered for nobody
+const size_t LOAD_SLICE = 1024 * 1024;
+
+std::optional<AppendFsync> parse_append_fsync(std::string_view name) {
+  if (name == "always") {
+    return AppendFsync::ALWAYS;
+  } else if (name == "everysec") {
+    return AppendFsync::EVERYSEC;
+  } else if (name == "no") {
+    return AppendFsync::NO;
+  }
+  return std::nullopt;
+}
+
+static void write_all(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t written = write(fd, data.data(), data.length());
+    if (0 > written) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("failed to write append only file");
+    }
+    data.remove_prefix(written);
+  }
+}
+
+static void sync_file(int fd) {
+  if (fdatasync(fd)) {
+    throw std::runtime_error("failed to fsync append only file");
+  }
+}
+
+Aof::Aof(Storage &storage, std::string path, AppendFsync policy)
+    : storage(storage), path(std::move(path)), policy(policy) {}
+
+Aof::~Aof() {
+  if (writer.joinable()) {
+    {
+      std::lock_guard guard(wake_lock);
+      running = false;
+    }
+    wake.notify_one();
+    writer.join();
+  }
+  if (rewriter.joinable()) {
+    rewriter.join();
+  }
+  if (0 <= rewrite_fd) {
+    close(rewrite_fd);
+  }
+  if (0 <= fd) {
+    close(fd);
+  }
+}
+
+size_t Aof::load() {
+  int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (0 > file) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    throw std::runtime_error("failed to open append only file");
+  }
+
+  struct stat info;
+  if (fstat(file, &info)) {
+    close(file);
+    throw std::runtime_error("failed to stat append only file");
+  }
+  size_t length = info.st_size;
+  if (!length) {
+    close(file);
+    return 0;
+  }
+
+  // replay straight out of the page cache through the same parser and
+  // commands clients use, just without a socket or a lock held by anyone
+  // else in between
+  auto data = (char *)mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("failed to map append only file");
+  }
+  madvise(data, length, MADV_SEQUENTIAL);
+
+  std::string_view contents(data, length);
+  OutputBuffer replies;
+  size_t loaded = 0, window = LOAD_SLICE;
+
+  while (loaded < length) {
+    // the parser stops at the last whole command in the slice, and a
+    // command bigger than the slice gets a wider one
+    auto slice = contents.substr(loaded, window);
+    auto consumed = server_transact(storage, slice, replies);
+    replies.clear();
+
+    if (!consumed) {
+      munmap(data, length);
+      throw std::runtime_error("append only file is corrupt past byte " +
+                               std::to_string(loaded));
+    }
+    if (*consumed) {
+      loaded += *consumed;
+      window = LOAD_SLICE;
+    } else if (slice.length() < length - loaded) {
+      window *= 2;
+    } else {
+      break;
+    }
+  }
+  munmap(data, length);
+
+  if (loaded < length) {
+    write_log(LogLevel::WARNING, "append only file ends with ",
+              length - loaded, " bytes of an incomplete command, truncating");
+    if (truncate(path.c_str(), loaded)) {
+      throw std::runtime_error("failed to truncate append only file");
+    }
+  }
+  return loaded;
+}
+
+void Aof::start() {
+  if (0 > (fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                     0644))) {
+    throw std::runtime_error("failed to open append only file");
+  }
+  size = base_size = lseek(fd, 0, SEEK_END);
+  last_sync = std::chrono::steady_clock::now();
+
+  storage.enable_log();
+  running = true;
+  writer = std::thread([this] {
+    try {
+      write_loop();
+    } catch (std::runtime_error const &e) {
+      // acknowledged writes can't be made durable anymore, so stop taking
+      // them instead of pretending
+      write_log(LogLevel::WARNING, "append only file error: ", e.what());
+      flush_log();
+      exit(1);
+    }
+  });
+}
+
+void Aof::request_sync() {
+  {
+    std::lock_guard guard(wake_lock);
+    sync_requested = true;
+  }
+  wake.notify_one();
+}
+
+void Aof::write_loop() {
+  while (write_round()) {
+  }
+}
+
+bool Aof::write_round() {
+  bool requested, stopping;
+  {
+    std::unique_lock guard(wake_lock);
+    wake.wait_for(guard, WRITE_INTERVAL,
+                  [&] { return sync_requested or !running; });
+    requested = sync_requested;
+    sync_requested = false;
+    stopping = !running;
+  }
+
+  uint64_t round = generation.fetch_add(1);
+  storage.drain_log(main, tail);
+
+  if (!main.empty()) {
+    write_all(fd, main);
+    size += main.length();
+    main.clear();
+    unsynced = true;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  if (unsynced and (policy == AppendFsync::ALWAYS or stopping or
+                    (policy == AppendFsync::EVERYSEC and
+                     now - last_sync >= EVERYSEC_INTERVAL))) {
+    sync_file(fd);
+    unsynced = false;
+    last_sync = now;
+  }
+
+  // under ALWAYS everything drained is synced by now, so tell the workers
+  // holding replies back
+  synced = round;
+  if (requested) {
+    for (int listener : listeners) {
+      uint64_t one = 1;
+      write(listener, &one, sizeof(one));
+    }
+  }
+
+  if (rewriting and dumped) {
+    finish_rewrite();
+  } else if (!rewriting and !stopping and
+             (storage.take_rewrite_request() or
+              (size >= AUTO_REWRITE_MIN_SIZE and size >= 2 * base_size))) {
+    start_rewrite();
+  }
+
+  return !stopping;
+}
+
+void Aof::start_rewrite() {
+  auto temp = path + ".rewrite";
+  if (0 > (rewrite_fd = open(temp.c_str(),
+                             O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))) {
+    write_log(LogLevel::WARNING, "failed to start append only file rewrite");
+    return;
+  }
+
+  rewriting = true;
+  rewrite_failed = false;
+  dumped = false;
+  rewriter = std::thread([this] {
+    std::string out;
+
+    try {
+      for (size_t i = 0; i < storage.shard_count(); i++) {
+        storage.dump_shard(i, out);
+        write_all(rewrite_fd, out);
+        out.clear();
+      }
+    } catch (std::runtime_error const &) {
+      rewrite_failed = true;
+    }
+    dumped = true;
+  });
+}
+
+void Aof::finish_rewrite() {
+  rewriter.join();
+  rewriting = false;
+
+  // pick up whatever reached the shards since this round's drain, so the
+  // tail is complete up to the switch
+  storage.drain_log(main, tail);
+  write_all(fd, main);
+  size += main.length();
+  unsynced |= !main.empty();
+  main.clear();
+  // a flush during the rewrite left the dump stale, and the storage asks
+  // for another rewrite then
+  bool current = storage.end_rewrite();
+
+  auto temp = path + ".rewrite";
+  try {
+    if (rewrite_failed) {
+      throw std::runtime_error("failed to dump the keyspace");
+    }
+    if (current) {
+      write_all(rewrite_fd, tail);
+      sync_file(rewrite_fd);
+    }
+  } catch (std::runtime_error const &e) {
+    write_log(LogLevel::WARNING, "append only file rewrite error: ", e.what());
+    current = false;
+  }
+
+  if (!current) {
+    // the old file is still whole, so keep appending to it
+    close(rewrite_fd);
+    rewrite_fd = -1;
+    unlink(temp.c_str());
+    tail.clear();
+    return;
+  }
+
+  if (rename(temp.c_str(), path.c_str())) {
+    throw std::runtime_error("failed to replace append only file");
+  }
+  // make the rename itself durable
+  std::string dir = path;
+  int dir_fd = open(dirname(dir.data()), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (0 <= dir_fd) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  close(fd);
+  fd = rewrite_fd;
+  rewrite_fd = -1;
+  size = base_size = lseek(fd, 0, SEEK_END);
+  unsynced = false;
+
+  tail.clear();
+  tail.shrink_to_fit();
+}
@@ -0,0 +1,439 @@
+#include "cell.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+
+#include "collection.h"
+#include "lazy_free.h"
+
+int64_t now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+static std::atomic<uint32_t> cached_lru_clock =
+    (now_ms() / 1000) & LRU_CLOCK_MAX;
+
+uint32_t lru_clock() {
+  return cached_lru_clock.load(std::memory_order_relaxed);
+}
+
+void update_lru_clock() {
+  cached_lru_clock.store((now_ms() / 1000) & LRU_CLOCK_MAX,
+                         std::memory_order_relaxed);
+}
+
+static std::atomic<size_t> shared_bytes = 0;
+
+size_t shared_value_bytes() { return shared_bytes; }
+
+// counts a shared value down once the last reply holding it lets go
+struct SharedDelete {
+  void operator()(std::string const *value) const {
+    shared_bytes -= value->capacity();
+    delete value;
+  }
+};
+
+Key::Key(std::string_view key, Slab &arena) {
+  if (key.length() <= INLINE_MAX) {
+    memcpy(small, key.data(), key.length());
+    tag() = key.length();
+  } else {
+    heap.ptr = (char *)arena.allocate(key.length());
+    heap.len = key.length();
+    memcpy(heap.ptr, key.data(), key.length());
+    tag() = HEAP;
+  }
+}
+
+Key::Key(Key &&other) noexcept {
+  memcpy((void *)this, (void *)&other, sizeof(Key));
+  other.tag() = 0;
+}
+
+Key &Key::operator=(Key &&other) noexcept {
+  if (this != &other) {
+    this->~Key();
+    memcpy((void *)this, (void *)&other, sizeof(Key));
+    other.tag() = 0;
+  }
+  return *this;
+}
+
+Key::~Key() {
+  if (tag() == HEAP) {
+    Slab::release(heap.ptr, heap.len);
+  }
+}
+
+// only strings that print back identically become integers, so GET returns
+// exactly what was SET
+static std::optional<int64_t> canonical_integer(std::string_view value) {
+  int64_t integer;
+  IntBuffer printed;
+
+  if (value.empty() or value.length() > printed.size()) {
+    return std::nullopt;
+  }
+  auto res = std::from_chars(value.begin(), value.end(), integer);
+  if (res.ec != std::errc() or res.ptr != value.end()) {
+    return std::nullopt;
+  }
+  auto end = std::to_chars(printed.begin(), printed.end(), integer).ptr;
+  if (value != std::string_view(printed.begin(), end)) {
+    return std::nullopt;
+  }
+  return integer;
+}
+
+void DataCell::encode(std::string_view value, Slab &arena) {
+  auto &to = payload();
+
+  if (auto integer = canonical_integer(value)) {
+    to.integer = *integer;
+    encoding = INT;
+  } else if (value.length() <= EMBSTR_MAX) {
+    memcpy(to.embstr, value.data(), value.length());
+    len = value.length();
+    encoding = EMBSTR;
+  } else if (value.length() >= SHARED_VALUE_MIN) {
+    // not const itself, so append can grow it once nobody else holds it
+    auto shared = new std::string(value);
+    shared_bytes += shared->capacity();
+    new (&to.shared) SharedValue(shared, SharedDelete());
+    encoding = SHARED;
+  } else {
+    to.raw.ptr = (char *)arena.allocate(value.length());
+    to.raw.len = to.raw.capacity = value.length();
+    memcpy(to.raw.ptr, value.data(), value.length());
+    encoding = RAW;
+  }
+}
+
+void DataCell::release() {
+  auto &from = payload();
+
+  if (encoding == RAW or encoding == LISTPACK) {
+    Slab::release(from.raw.ptr, from.raw.capacity);
+  } else if (encoding == SHARED) {
+    from.shared.~SharedValue();
+  } else if (encoding != EMBSTR and encoding != INT) {
+    free_collection(type, from.big);
+  }
+  encoding = EMBSTR;
+  type = Type::STRING;
+  len = 0;
+}
+
+void DataCell::move_payload(Payload &to, Payload &from) {
+  if (encoding == SHARED) {
+    new (&to.shared) SharedValue(std::move(from.shared));
+    from.shared.~SharedValue();
+  } else {
+    memcpy((void *)&to, (void *)&from, sizeof(Payload));
+  }
+}
+
+DataCell::DataCell(std::string_view value, int64_t expiry, Slab &arena)
+    : access(lru_clock() << 8 | LFU_INIT) {
+  encode(value, arena);
+  set_expiry(expiry, arena);
+}
+
+DataCell::DataCell(Type type, Slab &arena)
+    : encoding(LISTPACK), type(type), access(lru_clock() << 8 | LFU_INIT) {
+  listpack::init(inline_payload.raw, arena);
+}
+
+DataCell::DataCell(DataCell &&other) noexcept
+    : encoding(other.encoding),
+      flags(other.flags),
+      type(other.type),
+      len(other.len),
+      version(other.version),
+      access(other.access) {
+  if (flags & EXPIRES) {
+    boxed = other.boxed;
+  } else {
+    move_payload(inline_payload, other.inline_payload);
+  }
+  other.flags = 0;
+  other.encoding = EMBSTR;
+  other.type = Type::STRING;
+  other.len = 0;
+}
+
+DataCell &DataCell::operator=(DataCell &&other) noexcept {
+  if (this != &other) {
+    this->~DataCell();
+    new (this) DataCell(std::move(other));
+  }
+  return *this;
+}
+
+DataCell::~DataCell() {
+  release();
+  if (flags & EXPIRES) {
+    boxed->~Boxed();
+    Slab::release(boxed, sizeof(Boxed));
+  }
+}
+
+void DataCell::assign(std::string_view value, Slab &arena) {
+  auto &to = payload();
+
+  // reuse the buffer unless that would leave most of it unused
+  if (encoding == RAW and value.length() <= to.raw.capacity and
+      value.length() >= to.raw.capacity / 2 and value.length() > EMBSTR_MAX and
+      !canonical_integer(value)) {
+    memcpy(to.raw.ptr, value.data(), value.length());
+    to.raw.len = value.length();
+    return;
+  }
+
+  release();
+  encode(value, arena);
+}
+
+void DataCell::free_lazily() {
+  auto &from = payload();
+
+  if (encoding == SHARED) {
+    lazy_free([value = std::move(from.shared)]() mutable { value.reset(); });
+    from.shared.~SharedValue();
+  } else if ((encoding == HASHTABLE or encoding == DEQUE or
+              encoding == TREE) and
+             collection_size(*this) >= LAZY_FREE_MIN) {
+    lazy_free([type = type, big = from.big] { free_collection(type, big); });
+  } else {
+    return;
+  }
+  encoding = EMBSTR;
+  type = Type::STRING;
+  len = 0;
+}
+
+void DataCell::grow(void *big, Encoding encoding) {
+  auto &to = payload();
+
+  Slab::release(to.raw.ptr, to.raw.capacity);
+  to.big = big;
+  this->encoding = encoding;
+}
+
+char *DataCell::resize(size_t length, Slab &arena) {
+  auto &to = payload();
+  IntBuffer scratch;
+  auto current = view(scratch);
+
+  if (encoding == EMBSTR and length <= EMBSTR_MAX) {
+    len = length;
+    return to.embstr;
+  } else if (encoding == RAW and length <= to.raw.capacity) {
+    to.raw.len = length;
+    return to.raw.ptr;
+  } else if (encoding == SHARED and to.shared.use_count() == 1) {
+    // writers hold the shard exclusively, so no reply can be taking a
+    // reference meanwhile
+    auto &string = const_cast<std::string &>(*to.shared);
+    size_t capacity = string.capacity();
+    string.resize(length);
+    shared_bytes += string.capacity() - capacity;
+    return string.data();
+  } else if (encoding == INT and length <= EMBSTR_MAX) {
+    memcpy(to.embstr, current.data(), current.length());
+    encoding = EMBSTR;
+    len = length;
+    return to.embstr;
+  }
+
+  size_t kept = std::min(current.length(), length);
+  size_t capacity = std::max(length, 2 * current.length());
+
+  if (length >= SHARED_VALUE_MIN) {
+    auto string = new std::string();
+    string->reserve(capacity);
+    string->append(current.substr(0, kept));
+    string->resize(length);
+    shared_bytes += string->capacity();
+    release();
+    new (&to.shared) SharedValue(string, SharedDelete());
+    encoding = SHARED;
+    return string->data();
+  }
+
+  auto ptr = (char *)arena.allocate(capacity);
+  memcpy(ptr, current.data(), kept);
+  release();
+  to.raw.ptr = ptr;
+  to.raw.len = length;
+  to.raw.capacity = capacity;
+  encoding = RAW;
+  return ptr;
+}
+
+DataCell::Sum DataCell::add(int64_t delta, Slab &arena) {
+  auto current = integer();
+  if (!current and (encoding == EMBSTR or encoding == RAW)) {
+    IntBuffer scratch;
+    current = canonical_integer(view(scratch));
+  }
+
+  int64_t sum;
+  if (!current) {
+    return Sum::NOT_INTEGER;
+  }
+  if (__builtin_add_overflow(*current, delta, &sum)) {
+    return Sum::OVERFLOW;
+  }
+  if (encoding != INT) {
+    release();
+    encoding = INT;
+  }
+  payload().integer = sum;
+  return Sum::OK;
+}
+
+size_t DataCell::append(std::string_view suffix, Slab &arena) {
+  IntBuffer scratch;
+  size_t old = view(scratch).length();
+
+  // suffix is a view into the request, never into this value
+  char *bytes = resize(old + suffix.length(), arena);
+  memcpy(bytes + old, suffix.data(), suffix.length());
+  return old + suffix.length();
+}
+
+size_t DataCell::set_range(size_t offset, std::string_view bytes,
+                           Slab &arena) {
+  IntBuffer scratch;
+  size_t old = view(scratch).length();
+  size_t length = std::max(old, offset + bytes.length());
+
+  char *data = resize(length, arena);
+  if (offset > old) {
+    memset(data + old, 0, offset - old);
+  }
+  memcpy(data + offset, bytes.data(), bytes.length());
+  return length;
+}
+
+std::string_view DataCell::view(IntBuffer &scratch) const {
+  auto &from = payload();
+
+  switch (encoding) {
+    case EMBSTR:
+      return std::string_view(from.embstr, len);
+    case INT: {
+      auto res = std::to_chars(scratch.begin(), scratch.end(), from.integer);
+      return std::string_view(scratch.begin(), res.ptr);
+    }
+    case RAW:
+      return std::string_view(from.raw.ptr, from.raw.len);
+    case SHARED:
+      return *from.shared;
+    default:
+      break;
+  }
+  return {};
+}
+
+void DataCell::reply(Reply &reply) const {
+  if (encoding == SHARED) {
+    reply.bulk_string(payload().shared);
+  } else {
+    IntBuffer scratch;
+    reply.bulk_string(view(scratch));
+  }
+}
+
+void DataCell::set_expiry(int64_t expiry, Slab &arena) {
+  if (expiry != NO_EXPIRY and !(flags & EXPIRES)) {
+    auto box = new (arena.allocate(sizeof(Boxed))) Boxed{.expiry = expiry};
+    move_payload(box->payload, inline_payload);
+    boxed = box;
+    flags |= EXPIRES;
+  } else if (expiry != NO_EXPIRY) {
+    boxed->expiry = expiry;
+  } else if (flags & EXPIRES) {
+    auto box = boxed;
+    move_payload(inline_payload, box->payload);
+    box->~Boxed();
+    Slab::release(box, sizeof(Boxed));
+    flags &= ~EXPIRES;
+  }
+}
+
+size_t DataCell::allocated() const {
+  size_t bytes = flags & EXPIRES ? sizeof(Boxed) : 0;
+
+  if (encoding == RAW or encoding == LISTPACK) {
+    bytes += payload().raw.capacity;
+  } else if (encoding == SHARED) {
+    bytes += payload().shared->capacity();
+  } else if (encoding != EMBSTR and encoding != INT) {
+    bytes += collection_bytes(type, payload().big);
+  }
+  return bytes;
+}
+
+// how many counter steps an access is worth gets smaller as the counter
+// grows, so 8 bits cover about a million accesses, as with redis's default
+// lfu-log-factor of 10
+const uint32_t LFU_LOG_FACTOR = 10;
+const uint32_t LFU_DECAY_SECONDS = 60;
+
+static uint8_t decayed(uint32_t access, uint32_t now) {
+  uint32_t idle = (now - (access >> 8)) & LRU_CLOCK_MAX;
+  uint32_t periods = idle / LFU_DECAY_SECONDS;
+  uint8_t counter = access & 0xff;
+  return counter > periods ? counter - periods : 0;
+}
+
+void DataCell::touch() {
+  thread_local uint64_t state = 0x9e3779b97f4a7c15;
+  std::atomic_ref word(access);
+  uint32_t old = word.load(std::memory_order_relaxed);
+  uint32_t now = lru_clock();
+  uint32_t counter = decayed(old, now);
+
+  if (counter < 255) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    uint32_t base = counter > LFU_INIT ? counter - LFU_INIT : 0;
+    // increments with probability 1 / (base * factor + 1)
+    if ((state >> 32) * (base * LFU_LOG_FACTOR + 1) < (1ull << 32)) {
+      counter++;
+    }
+  }
+
+  // skipping unchanged stores keeps hot keys' cache lines shared between
+  // the cores reading them
+  uint32_t updated = now << 8 | counter;
+  if (updated != old) {
+    word.store(updated, std::memory_order_relaxed);
+  }
+}
+
+uint32_t DataCell::idle() const {
+  uint32_t word = std::atomic_ref(const_cast<uint32_t &>(access))
+                      .load(std::memory_order_relaxed);
+  return (lru_clock() - (word >> 8)) & LRU_CLOCK_MAX;
+}
+
+uint8_t DataCell::frequency() const {
+  uint32_t word = std::atomic_ref(const_cast<uint32_t &>(access))
+                      .load(std::memory_order_relaxed);
+  return decayed(word, lru_clock());
+}
@@ -0,0 +1,85 @@
+#include "checksum.h"
+
+#include <string.h>
+
+#include <array>
+
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+// reflected castagnoli polynomial
+const uint32_t POLY = 0x82f63b78;
+
+static constexpr std::array<uint32_t, 256> TABLE = [] {
+  std::array<uint32_t, 256> table;
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+    }
+    table[i] = crc;
+  }
+  return table;
+}();
+
+static uint32_t crc32c_table(uint8_t const *bytes, size_t len, uint32_t crc) {
+  for (size_t i = 0; i < len; i++) {
+    crc = TABLE[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(
+    uint8_t const *bytes, size_t len, uint32_t crc) {
+  uint64_t wide = crc;
+  for (; len >= 8; bytes += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    wide = _mm_crc32_u64(wide, word);
+  }
+  crc = wide;
+  for (; len; bytes++, len--) {
+    crc = _mm_crc32_u8(crc, *bytes);
+  }
+  return crc;
+}
+#endif
+
+uint32_t crc32c(void const *data, size_t len, uint32_t crc) {
+  auto bytes = (uint8_t const *)data;
+  crc = ~crc;
+
+#ifdef __x86_64__
+  static const bool hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware) {
+    return ~crc32c_sse42(bytes, len, crc);
+  }
+#endif
+  return ~crc32c_table(bytes, len, crc);
+}
+
+// ccitt polynomial, msb first
+const uint16_t POLY16 = 0x1021;
+
+static constexpr std::array<uint16_t, 256> TABLE16 = [] {
+  std::array<uint16_t, 256> table;
+  for (uint32_t i = 0; i < 256; i++) {
+    uint16_t crc = i << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ POLY16 : crc << 1;
+    }
+    table[i] = crc;
+  }
+  return table;
+}();
+
+uint16_t crc16(void const *data, size_t len) {
+  auto bytes = (uint8_t const *)data;
+  uint16_t crc = 0;
+  for (size_t i = 0; i < len; i++) {
+    crc = (crc << 8) ^ TABLE16[((crc >> 8) ^ bytes[i]) & 0xff];
+  }
+  return crc;
+}
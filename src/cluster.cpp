@@ -0,0 +1,535 @@
+#include "cluster.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+
+#include "checksum.h"
+#include "log.h"
+#include "protocol.h"
+#include "replication.h"
+
+const auto GOSSIP_INTERVAL = std::chrono::milliseconds(100);
+// how long the bus waits on a node before giving up on it for the round
+const auto GOSSIP_TIMEOUT = std::chrono::seconds(1);
+const size_t NODE_ID_LEN = 40;
+
+uint16_t key_slot(std::string_view key) {
+  auto open = key.find('{');
+  if (open != std::string_view::npos) {
+    auto close = key.find('}', open + 1);
+    if (close != std::string_view::npos and close > open + 1) {
+      key = key.substr(open + 1, close - open - 1);
+    }
+  }
+  return crc16(key.data(), key.length()) & (CLUSTER_SLOTS - 1);
+}
+
+static std::string make_node_id() {
+  std::random_device random;
+  std::string id;
+
+  while (id.length() < NODE_ID_LEN) {
+    id += "0123456789abcdef"[random() % 16];
+  }
+  return id;
+}
+
+static std::runtime_error bad_gossip() {
+  return std::runtime_error("bad gossip");
+}
+
+template <typename T>
+static T parse_number(std::string_view text) {
+  T value;
+  auto [end, error] =
+      std::from_chars(text.data(), text.data() + text.length(), value);
+  if (error != std::errc() or end != text.data() + text.length()) {
+    throw bad_gossip();
+  }
+  return value;
+}
+
+// the next space or newline separated field of text, moving text past it
+static std::string_view next_field(std::string_view &text, char separator) {
+  auto end = text.find(separator);
+  auto field = text.substr(0, end);
+  text.remove_prefix(end == std::string_view::npos ? text.length() : end + 1);
+  return field;
+}
+
+Cluster::Cluster(std::string host, uint16_t port) : node_id(make_node_id()) {
+  nodes.push_back({node_id, std::move(host), port});
+  for (auto &owner : owners) {
+    owner.store(NO_NODE, std::memory_order_relaxed);
+  }
+  migrating.fill(NO_NODE);
+  importing.fill(NO_NODE);
+}
+
+Cluster::~Cluster() {
+  if (bus.joinable()) {
+    running = false;
+    bus.join();
+  }
+}
+
+void Cluster::start() {
+  running = true;
+  bus = std::thread(&Cluster::run, this);
+}
+
+void Cluster::run() {
+  // kept open between rounds, by node index
+  std::vector<std::unique_ptr<NodeConnection>> links;
+
+  while (running) {
+    std::string gossip;
+    std::vector<std::pair<std::string, uint16_t>> peers;
+    size_t known;
+    {
+      std::shared_lock guard(lock);
+      gossip = view();
+      for (auto &node : nodes) {
+        peers.emplace_back(node.host, node.port);
+      }
+      known = peers.size();
+      peers.insert(peers.end(), meeting.begin(), meeting.end());
+    }
+    links.resize(known);
+
+    std::string command = "*3\r\n$7\r\nCLUSTER\r\n$6\r\nGOSSIP\r\n$" +
+                          std::to_string(gossip.length()) + "\r\n" + gossip +
+                          "\r\n";
+    for (size_t i = 1; i < peers.size() and running; i++) {
+      auto &[host, port] = peers[i];
+      std::unique_ptr<NodeConnection> met;
+      auto &link = i < known ? links[i] : met;
+
+      bool answered = false;
+      try {
+        if (!link) {
+          link = std::make_unique<NodeConnection>(host, port, GOSSIP_TIMEOUT);
+        }
+        link->send(command);
+        auto reply = link->reply();
+        // a bulk string holding the node's view
+        auto header = reply.find("\r\n");
+        if (!reply.starts_with('$') or header == std::string_view::npos) {
+          throw std::runtime_error("refused gossip: " + std::string(reply));
+        }
+        merge(reply.substr(header + 2, reply.length() - header - 4));
+        answered = true;
+      } catch (std::runtime_error const &e) {
+        write_log(LogLevel::VERBOSE, "cluster bus to ", host, ":", port, ": ",
+                  e.what());
+        link.reset();
+      }
+
+      std::unique_lock guard(lock);
+      if (i < known) {
+        nodes[i].linked = answered;
+      } else if (answered) {
+        // the node is known by its id now
+        std::erase(meeting, peers[i]);
+      }
+    }
+
+    auto until = std::chrono::steady_clock::now() + GOSSIP_INTERVAL;
+    while (running and std::chrono::steady_clock::now() < until) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+}
+
+// every node's slots as ranges, by node index
+static std::vector<std::string> slot_lists(
+    std::array<std::atomic<uint16_t>, CLUSTER_SLOTS> const &owners,
+    size_t node_count) {
+  std::vector<std::string> lists(node_count);
+  for (size_t slot = 0; slot < CLUSTER_SLOTS;) {
+    auto owner = owners[slot].load(std::memory_order_relaxed);
+    size_t last = slot;
+    while (last + 1 < CLUSTER_SLOTS and
+           owners[last + 1].load(std::memory_order_relaxed) == owner) {
+      last++;
+    }
+    if (owner < node_count) {
+      auto &list = lists[owner];
+      if (!list.empty()) {
+        list += ',';
+      }
+      list += std::to_string(slot);
+      if (last != slot) {
+        list += '-' + std::to_string(last);
+      }
+    }
+    slot = last + 1;
+  }
+  return lists;
+}
+
+std::string Cluster::view() const {
+  auto lists = slot_lists(owners, nodes.size());
+  std::string out;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    auto &node = nodes[i];
+    out += node.id + ' ' + node.host + ' ' + std::to_string(node.port) + ' ' +
+           std::to_string(node.epoch) + ' ' +
+           (lists[i].empty() ? "-" : lists[i]) + '\n';
+  }
+  return out;
+}
+
+void Cluster::merge(std::string_view view) {
+  std::unique_lock guard(lock);
+
+  while (!view.empty()) {
+    auto line = next_field(view, '\n');
+    auto id = next_field(line, ' ');
+    auto host = next_field(line, ' ');
+    auto port = parse_number<uint16_t>(next_field(line, ' '));
+    auto epoch = parse_number<uint64_t>(next_field(line, ' '));
+    auto slots = line;
+    if (id.length() != NODE_ID_LEN or host.empty() or slots.empty()) {
+      throw bad_gossip();
+    }
+    current_epoch = std::max(current_epoch, epoch);
+
+    // only this node knows what it serves
+    auto node = find(id);
+    if (node == MYSELF) {
+      continue;
+    }
+    if (node == NO_NODE) {
+      node = nodes.size();
+      if (node == NO_NODE) {
+        throw bad_gossip();
+      }
+      nodes.push_back({std::string(id), std::string(host), port});
+      write_log(LogLevel::NOTICE, "cluster node ", id, " at ", host, ":",
+                port, " joined");
+    }
+    auto &known = nodes[node];
+    known.host = host;
+    known.port = port;
+    // a record older than what's known already is stale
+    if (epoch < known.epoch) {
+      continue;
+    }
+    known.epoch = epoch;
+
+    if (slots == "-") {
+      continue;
+    }
+    while (!slots.empty()) {
+      auto range = next_field(slots, ',');
+      auto dash = range.find('-');
+      auto first = parse_number<uint16_t>(range.substr(0, dash));
+      auto last = dash == std::string_view::npos
+                      ? first
+                      : parse_number<uint16_t>(range.substr(dash + 1));
+      if (first > last or last >= CLUSTER_SLOTS) {
+        throw bad_gossip();
+      }
+
+      for (size_t slot = first; slot <= last; slot++) {
+        auto owner = owners[slot].load(std::memory_order_relaxed);
+        // the higher epoch wins, and the lower id breaks ties
+        if (owner == node or
+            (owner != NO_NODE and
+             (nodes[owner].epoch > epoch or
+              (nodes[owner].epoch == epoch and nodes[owner].id < id)))) {
+          continue;
+        }
+        if (owner == MYSELF) {
+          write_log(LogLevel::NOTICE, "cluster slot ", slot, " moved to ",
+                    id);
+        }
+        set_owner(slot, node);
+      }
+    }
+  }
+}
+
+uint16_t Cluster::find(std::string_view id) const {
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (nodes[i].id == id) {
+      return i;
+    }
+  }
+  return NO_NODE;
+}
+
+std::string Cluster::address(uint16_t node) const {
+  return nodes[node].host + ':' + std::to_string(nodes[node].port);
+}
+
+void Cluster::set_owner(uint16_t slot, uint16_t node) {
+  owners[slot].store(node, std::memory_order_relaxed);
+  if (node == MYSELF) {
+    set_moving(importing, slot, NO_NODE);
+  } else {
+    set_moving(migrating, slot, NO_NODE);
+  }
+}
+
+void Cluster::set_moving(std::array<uint16_t, CLUSTER_SLOTS> &moves,
+                         uint16_t slot, uint16_t node) {
+  bool before = migrating[slot] != NO_NODE or importing[slot] != NO_NODE;
+  moves[slot] = node;
+  bool after = migrating[slot] != NO_NODE or importing[slot] != NO_NODE;
+  if (before != after) {
+    moving += after ? 1 : -1;
+  }
+}
+
+Cluster::Where Cluster::route(uint16_t slot, bool asking) const {
+  if (serves(slot) and !moving.load(std::memory_order_relaxed)) {
+    return {Route::LOCAL, {}};
+  }
+
+  std::shared_lock guard(lock);
+  auto owner = owners[slot].load(std::memory_order_relaxed);
+  if (owner == MYSELF) {
+    if (migrating[slot] != NO_NODE) {
+      return {Route::MIGRATING, address(migrating[slot])};
+    }
+    return {Route::LOCAL, {}};
+  }
+  if (asking and importing[slot] != NO_NODE) {
+    return {Route::LOCAL, {}};
+  }
+  if (owner == NO_NODE) {
+    return {Route::DOWN, {}};
+  }
+  return {Route::MOVED, address(owner)};
+}
+
+void Cluster::add_slots(std::span<uint16_t const> slots) {
+  std::unique_lock guard(lock);
+  for (auto slot : slots) {
+    if (owners[slot].load(std::memory_order_relaxed) != NO_NODE) {
+      throw std::runtime_error("Slot " + std::to_string(slot) +
+                               " is already busy");
+    }
+  }
+  for (auto slot : slots) {
+    set_owner(slot, MYSELF);
+  }
+  // a node serving slots needs an epoch for its claims to be weighed by
+  if (!nodes[MYSELF].epoch) {
+    nodes[MYSELF].epoch = ++current_epoch;
+  }
+}
+
+void Cluster::set_slot(uint16_t slot, SlotState state, std::string_view id) {
+  std::unique_lock guard(lock);
+  auto owner = owners[slot].load(std::memory_order_relaxed);
+  if (state == SlotState::STABLE) {
+    set_moving(migrating, slot, NO_NODE);
+    set_moving(importing, slot, NO_NODE);
+    return;
+  }
+
+  auto node = find(id);
+  if (node == NO_NODE) {
+    throw std::runtime_error("I don't know about node " + std::string(id));
+  }
+  switch (state) {
+    case SlotState::IMPORTING:
+      if (owner == MYSELF) {
+        throw std::runtime_error("I'm already the owner of hash slot " +
+                                 std::to_string(slot));
+      }
+      set_moving(importing, slot, node);
+      break;
+    case SlotState::MIGRATING:
+      if (owner != MYSELF) {
+        throw std::runtime_error("I'm not the owner of hash slot " +
+                                 std::to_string(slot));
+      }
+      set_moving(migrating, slot, node);
+      break;
+    case SlotState::NODE:
+      // taking a slot over needs an epoch above every other claim on it
+      if (node == MYSELF and owner != MYSELF) {
+        nodes[MYSELF].epoch = ++current_epoch;
+      }
+      set_owner(slot, node);
+      break;
+    case SlotState::STABLE:
+      break;
+  }
+}
+
+void Cluster::meet(std::string host, uint16_t port) {
+  std::unique_lock guard(lock);
+  for (auto &node : nodes) {
+    if (node.host == host and node.port == port) {
+      return;
+    }
+  }
+  std::pair address(std::move(host), port);
+  if (std::find(meeting.begin(), meeting.end(), address) == meeting.end()) {
+    meeting.push_back(std::move(address));
+  }
+}
+
+std::string Cluster::gossip(std::string_view view) {
+  merge(view);
+  std::shared_lock guard(lock);
+  return this->view();
+}
+
+std::vector<Cluster::Range> Cluster::ranges() const {
+  std::shared_lock guard(lock);
+  std::vector<Range> ranges;
+  for (size_t slot = 0; slot < CLUSTER_SLOTS; slot++) {
+    auto owner = owners[slot].load(std::memory_order_relaxed);
+    if (owner == NO_NODE) {
+      continue;
+    }
+    if (!ranges.empty() and ranges.back().last + 1 == slot and
+        ranges.back().id == nodes[owner].id) {
+      ranges.back().last = slot;
+      continue;
+    }
+    auto &node = nodes[owner];
+    ranges.push_back(
+        {uint16_t(slot), uint16_t(slot), node.id, node.host, node.port});
+  }
+  return ranges;
+}
+
+std::string Cluster::info() const {
+  std::shared_lock guard(lock);
+  size_t assigned = 0;
+  std::vector<bool> serving(nodes.size());
+  for (auto &owner : owners) {
+    auto node = owner.load(std::memory_order_relaxed);
+    if (node != NO_NODE) {
+      assigned++;
+      serving[node] = true;
+    }
+  }
+
+  std::string out;
+  auto field = [&](std::string_view name, auto value) {
+    out += name;
+    out += ':';
+    if constexpr (std::is_convertible_v<decltype(value), std::string_view>) {
+      out += value;
+    } else {
+      out += std::to_string(value);
+    }
+    out += "\r\n";
+  };
+  field("cluster_enabled", 1);
+  field("cluster_state", assigned == CLUSTER_SLOTS ? "ok" : "fail");
+  field("cluster_slots_assigned", assigned);
+  field("cluster_slots_ok", assigned);
+  field("cluster_slots_pfail", 0);
+  field("cluster_slots_fail", 0);
+  field("cluster_known_nodes", nodes.size());
+  field("cluster_size", std::count(serving.begin(), serving.end(), true));
+  field("cluster_current_epoch", current_epoch);
+  field("cluster_my_epoch", nodes[MYSELF].epoch);
+  return out;
+}
+
+std::string Cluster::describe() const {
+  std::shared_lock guard(lock);
+  auto lists = slot_lists(owners, nodes.size());
+
+  std::string out;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    auto &node = nodes[i];
+    out += node.id + ' ' + address(i) + '@' + std::to_string(node.port) +
+           (i == MYSELF ? " myself,master" : " master") + " - 0 0 " +
+           std::to_string(node.epoch) +
+           (i == MYSELF or node.linked ? " connected" : " disconnected");
+    for (auto list = std::string_view(lists[i]); !list.empty();) {
+      out += ' ';
+      out += next_field(list, ',');
+    }
+    if (i == MYSELF) {
+      for (size_t slot = 0; slot < CLUSTER_SLOTS; slot++) {
+        if (migrating[slot] != NO_NODE) {
+          out += " [" + std::to_string(slot) + "->-" +
+                 nodes[migrating[slot]].id + ']';
+        }
+        if (importing[slot] != NO_NODE) {
+          out += " [" + std::to_string(slot) + "-<-" +
+                 nodes[importing[slot]].id + ']';
+        }
+      }
+    }
+    out += '\n';
+  }
+  return out;
+}
+
+static Cluster *cluster = nullptr;
+
+void set_cluster_node(Cluster *node) { cluster = node; }
+
+Cluster *cluster_node() { return cluster; }
+
+NodeConnection::NodeConnection(std::string const &host, uint16_t port,
+                               std::chrono::milliseconds timeout)
+    : sock(connect_to(host, port)) {
+  timeval limit{.tv_sec = timeout.count() / 1000,
+                .tv_usec = timeout.count() % 1000 * 1000};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+}
+
+NodeConnection::~NodeConnection() { close(sock); }
+
+void NodeConnection::send(std::string_view commands) {
+  while (!commands.empty()) {
+    ssize_t sent =
+        ::send(sock, commands.data(), commands.length(), MSG_NOSIGNAL);
+    if (0 > sent) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("failed to send to the node");
+    }
+    commands.remove_prefix(sent);
+  }
+}
+
+std::string_view NodeConnection::reply() {
+  in.consume(std::exchange(unread, 0));
+  while (true) {
+    auto len = client_parse(in.view());
+    if (!len) {
+      throw std::runtime_error("malformed reply from the node");
+    }
+    if (*len) {
+      unread = *len;
+      return in.view().substr(0, *len);
+    }
+
+    auto [tail, free] = in.prepare();
+    ssize_t read = recv(sock, tail, free, 0);
+    if (0 > read and errno == EINTR) {
+      continue;
+    }
+    if (0 >= read) {
+      throw std::runtime_error("lost the node");
+    }
+    in.commit(read);
+  }
+}
@@ -0,0 +1,606 @@
+#include "collection.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+
+namespace listpack {
+
+static uint16_t get_count(DataCell::Buffer const &lp) {
+  uint16_t count;
+  memcpy(&count, lp.ptr, sizeof(count));
+  return count;
+}
+
+static void set_count(DataCell::Buffer &lp, uint16_t count) {
+  memcpy(lp.ptr, &count, sizeof(count));
+}
+
+static size_t varint_len(size_t value) {
+  size_t len = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    len++;
+  }
+  return len;
+}
+
+static void resize(DataCell::Buffer &lp, size_t capacity, Slab &arena) {
+  auto ptr = (char *)arena.allocate(capacity);
+  memcpy(ptr, lp.ptr, lp.len);
+  Slab::release(lp.ptr, lp.capacity);
+  lp.ptr = ptr;
+  lp.capacity = capacity;
+}
+
+void init(DataCell::Buffer &lp, Slab &arena) {
+  // room for a couple of small elements before the first resize
+  lp.capacity = 32;
+  lp.ptr = (char *)arena.allocate(lp.capacity);
+  lp.len = BEGIN;
+  set_count(lp, 0);
+}
+
+size_t count(DataCell::Buffer const &lp) { return get_count(lp); }
+
+std::string_view next(DataCell::Buffer const &lp, size_t &pos) {
+  size_t len = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t byte = lp.ptr[pos++];
+    len |= size_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  std::string_view element(lp.ptr + pos, len);
+  pos += len;
+  return element;
+}
+
+void insert(DataCell::Buffer &lp, size_t pos,
+            std::initializer_list<std::string_view> elements, Slab &arena) {
+  size_t added = 0;
+  for (auto element : elements) {
+    added += varint_len(element.length()) + element.length();
+  }
+  if (lp.len + added > lp.capacity) {
+    // grow by half again so appends are amortized
+    size_t capacity = lp.capacity + lp.capacity / 2;
+    resize(lp, std::max(lp.len + added, capacity), arena);
+  }
+
+  memmove(lp.ptr + pos + added, lp.ptr + pos, lp.len - pos);
+  for (auto element : elements) {
+    size_t len = element.length();
+    while (len >= 0x80) {
+      lp.ptr[pos++] = char(len | 0x80);
+      len >>= 7;
+    }
+    lp.ptr[pos++] = char(len);
+    memcpy(lp.ptr + pos, element.data(), element.length());
+    pos += element.length();
+  }
+  lp.len += added;
+  set_count(lp, get_count(lp) + elements.size());
+}
+
+void erase(DataCell::Buffer &lp, size_t pos, size_t elements, Slab &arena) {
+  size_t end = pos;
+  for (size_t i = 0; i < elements; i++) {
+    next(lp, end);
+  }
+
+  memmove(lp.ptr + pos, lp.ptr + end, lp.len - end);
+  lp.len -= end - pos;
+  set_count(lp, get_count(lp) - elements);
+
+  // give back most of a block that emptied out
+  if (lp.capacity > 64 and lp.len < lp.capacity / 4) {
+    resize(lp, std::max<size_t>(lp.len * 2, 32), arena);
+  }
+}
+
+// the position of the element equal to target, stepping over stride - 1
+// elements after each one compared, or lp.len
+static size_t find(DataCell::Buffer const &lp, std::string_view target,
+                   size_t stride) {
+  for (size_t pos = BEGIN; pos < lp.len;) {
+    size_t at = pos;
+    bool found = next(lp, pos) == target;
+    if (found) {
+      return at;
+    }
+    for (size_t i = 1; i < stride; i++) {
+      next(lp, pos);
+    }
+  }
+  return lp.len;
+}
+
+}  // namespace listpack
+
+static size_t cost(std::string_view element) {
+  return NODE_OVERHEAD + element.length();
+}
+
+static bool fits(std::string_view element) {
+  return element.length() <= LISTPACK_MAX_VALUE;
+}
+
+size_t collection_size(DataCell const &cell) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    size_t count = listpack::count(cell.buffer());
+    return cell.get_type() == Type::HASH or cell.get_type() == Type::ZSET
+               ? count / 2
+               : count;
+  }
+
+  switch (cell.get_type()) {
+    case Type::HASH:
+      return ((HashTable *)cell.big())->fields.size();
+    case Type::LIST:
+      return ((ListDeque *)cell.big())->items.size();
+    case Type::SET:
+      return ((SetTable *)cell.big())->members.size();
+    case Type::ZSET:
+      return ((ScoreTree *)cell.big())->scores.size();
+    case Type::STRING:
+      break;
+  }
+  return 0;
+}
+
+size_t collection_bytes(Type type, void *big) {
+  switch (type) {
+    case Type::HASH:
+      return ((HashTable *)big)->bytes;
+    case Type::LIST:
+      return ((ListDeque *)big)->bytes;
+    case Type::SET:
+      return ((SetTable *)big)->bytes;
+    case Type::ZSET:
+      return ((ScoreTree *)big)->bytes;
+    case Type::STRING:
+      break;
+  }
+  return 0;
+}
+
+void free_collection(Type type, void *big) {
+  switch (type) {
+    case Type::HASH:
+      delete (HashTable *)big;
+      break;
+    case Type::LIST:
+      delete (ListDeque *)big;
+      break;
+    case Type::SET:
+      delete (SetTable *)big;
+      break;
+    case Type::ZSET:
+      delete (ScoreTree *)big;
+      break;
+    case Type::STRING:
+      break;
+  }
+}
+
+std::string_view type_name(Type type) {
+  switch (type) {
+    case Type::STRING:
+      return "string";
+    case Type::HASH:
+      return "hash";
+    case Type::LIST:
+      return "list";
+    case Type::SET:
+      return "set";
+    case Type::ZSET:
+      return "zset";
+  }
+  return "";
+}
+
+std::string_view encoding_name(DataCell const &cell) {
+  switch (cell.get_encoding()) {
+    case DataCell::EMBSTR:
+      return "embstr";
+    case DataCell::INT:
+      return "int";
+    case DataCell::RAW:
+      return "raw";
+    case DataCell::SHARED:
+      return "shared";
+    case DataCell::LISTPACK:
+      return "listpack";
+    case DataCell::HASHTABLE:
+      return "hashtable";
+    case DataCell::DEQUE:
+      return "deque";
+    case DataCell::TREE:
+      return "tree";
+  }
+  return "";
+}
+
+std::string_view format_score(double score, ScoreBuffer &scratch) {
+  if (std::isinf(score)) {
+    return score > 0 ? "inf" : "-inf";
+  }
+  auto end = std::to_chars(scratch.begin(), scratch.end(), score).ptr;
+  return std::string_view(scratch.begin(), end);
+}
+
+std::optional<double> parse_score(std::string_view arg) {
+  if (arg == "inf" or arg == "+inf") {
+    return HUGE_VAL;
+  } else if (arg == "-inf") {
+    return -HUGE_VAL;
+  }
+
+  // strtod needs a terminator and arguments are views into the input
+  char digits[64];
+  if (arg.empty() or arg.length() >= sizeof(digits)) {
+    return std::nullopt;
+  }
+  memcpy(digits, arg.data(), arg.length());
+  digits[arg.length()] = '\0';
+
+  char *end;
+  double score = strtod(digits, &end);
+  if (end != digits + arg.length() or std::isnan(score)) {
+    return std::nullopt;
+  }
+  return score;
+}
+
+namespace hashes {
+
+static void grow(DataCell &cell) {
+  auto table = new HashTable();
+  for_each(cell, [&](auto field, auto value) {
+    table->fields.emplace(field, value);
+    table->bytes += cost(field) + value.length();
+  });
+  cell.grow(table, DataCell::HASHTABLE);
+}
+
+bool set(DataCell &cell, std::string_view field, std::string_view value,
+         Slab &arena) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    size_t pos = listpack::find(lp, field, 2);
+
+    if (pos < lp.len and fits(value)) {
+      size_t at = pos;
+      listpack::next(lp, at);
+      listpack::erase(lp, at, 1, arena);
+      listpack::insert(lp, at, {value}, arena);
+      return false;
+    }
+    if (pos == lp.len and fits(field) and fits(value) and
+        listpack::count(lp) / 2 < LISTPACK_MAX_ENTRIES) {
+      listpack::insert(lp, lp.len, {field, value}, arena);
+      return true;
+    }
+    grow(cell);
+  }
+
+  auto &table = *(HashTable *)cell.big();
+  auto [iter, added] = table.fields.try_emplace(std::string(field));
+  if (added) {
+    table.bytes += cost(field);
+  }
+  table.bytes += value.length() - iter->second.length();
+  iter->second.assign(value);
+  return added;
+}
+
+std::optional<std::string_view> get(DataCell const &cell,
+                                    std::string_view field) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    size_t pos = listpack::find(lp, field, 2);
+    if (pos == lp.len) {
+      return std::nullopt;
+    }
+    listpack::next(lp, pos);
+    return listpack::next(lp, pos);
+  }
+
+  auto &fields = ((HashTable *)cell.big())->fields;
+  auto iter = fields.find(std::string(field));
+  if (iter == fields.end()) {
+    return std::nullopt;
+  }
+  return iter->second;
+}
+
+bool remove(DataCell &cell, std::string_view field, Slab &arena) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    size_t pos = listpack::find(lp, field, 2);
+    if (pos == lp.len) {
+      return false;
+    }
+    listpack::erase(lp, pos, 2, arena);
+    return true;
+  }
+
+  auto &table = *(HashTable *)cell.big();
+  auto iter = table.fields.find(std::string(field));
+  if (iter == table.fields.end()) {
+    return false;
+  }
+  table.bytes -= cost(field) + iter->second.length();
+  table.fields.erase(iter);
+  return true;
+}
+
+}  // namespace hashes
+
+namespace lists {
+
+static void grow(DataCell &cell) {
+  auto list = new ListDeque();
+  if (size_t size = collection_size(cell)) {
+    range(cell, 0, size - 1, [&](auto item) {
+      list->items.emplace_back(item);
+      list->bytes += cost(item);
+    });
+  }
+  cell.grow(list, DataCell::DEQUE);
+}
+
+void push(DataCell &cell, std::string_view item, bool front, Slab &arena) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    if (fits(item) and listpack::count(lp) < LISTPACK_MAX_ENTRIES) {
+      listpack::insert(lp, front ? listpack::BEGIN : lp.len, {item}, arena);
+      return;
+    }
+    grow(cell);
+  }
+
+  auto &list = *(ListDeque *)cell.big();
+  if (front) {
+    list.items.emplace_front(item);
+  } else {
+    list.items.emplace_back(item);
+  }
+  list.bytes += cost(item);
+}
+
+void pop(DataCell &cell, bool front, Reply &reply, Slab &arena) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    size_t pos = listpack::BEGIN;
+    for (size_t i = front ? 1 : listpack::count(lp); i > 1; i--) {
+      listpack::next(lp, pos);
+    }
+    size_t at = pos;
+    reply.bulk_string(listpack::next(lp, at));
+    listpack::erase(lp, pos, 1, arena);
+    return;
+  }
+
+  auto &list = *(ListDeque *)cell.big();
+  auto &item = front ? list.items.front() : list.items.back();
+  reply.bulk_string(item);
+  list.bytes -= cost(item);
+  if (front) {
+    list.items.pop_front();
+  } else {
+    list.items.pop_back();
+  }
+}
+
+}  // namespace lists
+
+namespace sets {
+
+static void grow(DataCell &cell) {
+  auto table = new SetTable();
+  for_each(cell, [&](auto member) {
+    table->members.emplace(member);
+    table->bytes += cost(member);
+  });
+  cell.grow(table, DataCell::HASHTABLE);
+}
+
+bool add(DataCell &cell, std::string_view member, Slab &arena) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    if (listpack::find(lp, member, 1) < lp.len) {
+      return false;
+    }
+    if (fits(member) and listpack::count(lp) < LISTPACK_MAX_ENTRIES) {
+      listpack::insert(lp, lp.len, {member}, arena);
+      return true;
+    }
+    grow(cell);
+  }
+
+  auto &table = *(SetTable *)cell.big();
+  bool added = table.members.emplace(member).second;
+  if (added) {
+    table.bytes += cost(member);
+  }
+  return added;
+}
+
+bool remove(DataCell &cell, std::string_view member, Slab &arena) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    size_t pos = listpack::find(lp, member, 1);
+    if (pos == lp.len) {
+      return false;
+    }
+    listpack::erase(lp, pos, 1, arena);
+    return true;
+  }
+
+  auto &table = *(SetTable *)cell.big();
+  if (!table.members.erase(std::string(member))) {
+    return false;
+  }
+  table.bytes -= cost(member);
+  return true;
+}
+
+bool contains(DataCell const &cell, std::string_view member) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    return listpack::find(lp, member, 1) < lp.len;
+  }
+  return ((SetTable *)cell.big())->members.contains(std::string(member));
+}
+
+}  // namespace sets
+
+namespace zsets {
+
+static std::string_view score_bytes(double const &score) {
+  return std::string_view((char const *)&score, sizeof(score));
+}
+
+static void grow(DataCell &cell) {
+  auto tree = new ScoreTree();
+  range_by_score(cell, {-HUGE_VAL}, {HUGE_VAL}, [&](auto member, double score) {
+    auto iter = tree->scores.emplace(member, score).first;
+    tree->order.emplace(score, iter->first);
+    tree->bytes += 2 * cost(member);
+    return true;
+  });
+  cell.grow(tree, DataCell::TREE);
+}
+
+bool add(DataCell &cell, std::string_view member, double score, Slab &arena) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    size_t pos = listpack::find(lp, member, 2);
+    bool added = pos == lp.len;
+
+    if (added and (!fits(member) or
+                   listpack::count(lp) / 2 >= LISTPACK_MAX_ENTRIES)) {
+      grow(cell);
+    } else {
+      if (!added) {
+        listpack::erase(lp, pos, 2, arena);
+      }
+      // members stay in (score, member) order
+      for (pos = listpack::BEGIN; pos < lp.len;) {
+        size_t at = pos;
+        auto other = listpack::next(lp, pos);
+        double other_score;
+        memcpy(&other_score, listpack::next(lp, pos).data(),
+               sizeof(other_score));
+        if (other_score > score or (other_score == score and other > member)) {
+          pos = at;
+          break;
+        }
+      }
+      listpack::insert(lp, pos, {member, score_bytes(score)}, arena);
+      return added;
+    }
+  }
+
+  auto &tree = *(ScoreTree *)cell.big();
+  auto [iter, added] = tree.scores.try_emplace(std::string(member), score);
+  if (added) {
+    tree.bytes += 2 * cost(member);
+  } else {
+    tree.order.erase({iter->second, iter->first});
+    iter->second = score;
+  }
+  tree.order.emplace(score, iter->first);
+  return added;
+}
+
+bool remove(DataCell &cell, std::string_view member, Slab &arena) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    size_t pos = listpack::find(lp, member, 2);
+    if (pos == lp.len) {
+      return false;
+    }
+    listpack::erase(lp, pos, 2, arena);
+    return true;
+  }
+
+  auto &tree = *(ScoreTree *)cell.big();
+  auto iter = tree.scores.find(std::string(member));
+  if (iter == tree.scores.end()) {
+    return false;
+  }
+  tree.order.erase({iter->second, iter->first});
+  tree.scores.erase(iter);
+  tree.bytes -= 2 * cost(member);
+  return true;
+}
+
+std::optional<double> score(DataCell const &cell, std::string_view member) {
+  if (cell.get_encoding() == DataCell::LISTPACK) {
+    auto &lp = cell.buffer();
+    size_t pos = listpack::find(lp, member, 2);
+    if (pos == lp.len) {
+      return std::nullopt;
+    }
+    listpack::next(lp, pos);
+    double score;
+    memcpy(&score, listpack::next(lp, pos).data(), sizeof(score));
+    return score;
+  }
+
+  auto &scores = ((ScoreTree *)cell.big())->scores;
+  auto iter = scores.find(std::string(member));
+  if (iter == scores.end()) {
+    return std::nullopt;
+  }
+  return iter->second;
+}
+
+}  // namespace zsets
+
+size_t element_count(DataCell const &cell) {
+  size_t size = collection_size(cell);
+  return cell.get_type() == Type::HASH or cell.get_type() == Type::ZSET
+             ? 2 * size
+             : size;
+}
+
+bool restore(DataCell &cell, std::span<std::string_view const> elements,
+             Slab &arena) {
+  switch (cell.get_type()) {
+    case Type::HASH:
+      for (size_t i = 0; i + 1 < elements.size(); i += 2) {
+        hashes::set(cell, elements[i], elements[i + 1], arena);
+      }
+      return elements.size() % 2 == 0;
+    case Type::LIST:
+      for (auto item : elements) {
+        lists::push(cell, item, false, arena);
+      }
+      return true;
+    case Type::SET:
+      for (auto member : elements) {
+        sets::add(cell, member, arena);
+      }
+      return true;
+    case Type::ZSET:
+      for (size_t i = 0; i + 1 < elements.size(); i += 2) {
+        auto score = parse_score(elements[i]);
+        if (!score) {
+          return false;
+        }
+        zsets::add(cell, elements[i + 1], *score, arena);
+      }
+      return elements.size() % 2 == 0;
+    case Type::STRING:
+      break;
+  }
+  return false;
+}
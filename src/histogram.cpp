@@ -0,0 +1,74 @@
+#include "histogram.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+
+// bucket b holds values under sub_buckets << b in steps of 1 << b. the first
+// bucket's lower half would repeat what the one before it covers, so each
+// bucket after the first only takes half the slots
+size_t Histogram::index(uint64_t value) const {
+  unsigned bucket = std::bit_width(value | (sub_buckets - 1)) - sub_bits;
+  return bucket * half + (value >> bucket);
+}
+
+uint64_t Histogram::highest_at(size_t index) const {
+  unsigned bucket = index < sub_buckets ? 0 : index / half - 1;
+  uint64_t sub = index - bucket * half;
+  return (sub << bucket) + (1ul << bucket) - 1;
+}
+
+Histogram::Histogram(unsigned sub_bits)
+    : sub_bits(sub_bits),
+      sub_buckets(1ul << sub_bits),
+      half(sub_buckets / 2),
+      counts(index(MAX_VALUE) + 1) {}
+
+// only the recording thread writes, so plain loads and relaxed stores are
+// enough for anyone merging concurrently to see whole values
+void Histogram::record(uint64_t value) {
+  auto store = [](auto &field, auto value) {
+    std::atomic_ref(field).store(value, std::memory_order_relaxed);
+  };
+
+  value = std::min(value, MAX_VALUE);
+  auto &count = counts[index(value)];
+  store(count, count + 1);
+  store(total, total + 1);
+  store(lowest, std::min(lowest, value));
+  store(highest, std::max(highest, value));
+  store(sum, sum + value);
+}
+
+void Histogram::merge(Histogram const &other) {
+  // atomic_ref wants a mutable reference, though nothing's written
+  auto &source = const_cast<Histogram &>(other);
+  auto load = [](auto &field) {
+    return std::atomic_ref(field).load(std::memory_order_relaxed);
+  };
+
+  for (size_t i = 0; i < counts.size(); i++) {
+    counts[i] += load(source.counts[i]);
+  }
+  total += load(source.total);
+  lowest = std::min(lowest, load(source.lowest));
+  highest = std::max(highest, load(source.highest));
+  sum += load(source.sum);
+}
+
+uint64_t Histogram::percentile(double percentile) const {
+  if (!total) {
+    return 0;
+  }
+  auto wanted = std::max<uint64_t>(
+      1, std::ceil(std::clamp(percentile, 0.0, 100.0) / 100 * total));
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < counts.size(); i++) {
+    if ((seen += counts[i]) >= wanted) {
+      return std::min(highest_at(i), highest);
+    }
+  }
+  return highest;
+}
@@ -0,0 +1,311 @@
+#include "info.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+
+#include "cluster.h"
+#include "lazy_free.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "pubsub.h"
+#include "replication.h"
+#include "tracking.h"
+
+size_t resident_bytes() {
+  size_t pages = 0, resident = 0;
+  if (FILE *statm = fopen("/proc/self/statm", "r")) {
+    if (2 != fscanf(statm, "%zu %zu", &pages, &resident)) {
+      resident = 0;
+    }
+    fclose(statm);
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+namespace {
+
+struct ServerInfo {
+  uint16_t port = 0;
+  size_t threads = 0;
+  std::string multiplexing_api;
+  std::chrono::steady_clock::time_point started =
+      std::chrono::steady_clock::now();
+};
+
+// never destroyed, since workers may still answer INFO while the process
+// exits
+ServerInfo &server_info() {
+  static auto &server_info = *new ServerInfo();
+  return server_info;
+}
+
+// appends "name:value\r\n" lines
+class Section {
+  std::string &out;
+
+ public:
+  Section(std::string &out, std::string_view title) : out(out) {
+    if (!out.empty()) {
+      out += "\r\n";
+    }
+    out += "# ";
+    out += title;
+    out += "\r\n";
+  }
+
+  void field(std::string_view name, std::string_view value) {
+    out += name;
+    out += ':';
+    out += value;
+    out += "\r\n";
+  }
+
+  void field(std::string_view name, size_t value) {
+    char digits[20];
+    auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    field(name, std::string_view(digits, end - digits));
+  }
+
+  void ratio(std::string_view name, size_t numerator, size_t denominator) {
+    char digits[32];
+    double value = denominator ? double(numerator) / denominator : 0;
+    auto end = std::to_chars(digits, digits + sizeof(digits), value,
+                             std::chars_format::fixed, 2)
+                   .ptr;
+    field(name, std::string_view(digits, end - digits));
+  }
+
+  void human(std::string_view name, size_t bytes) {
+    const char *units = "BKMGT";
+    double value = bytes;
+    while (value >= 1024 and units[1]) {
+      value /= 1024;
+      units++;
+    }
+
+    char digits[32];
+    auto end = std::to_chars(digits, digits + sizeof(digits) - 1, value,
+                             std::chars_format::fixed, 2)
+                   .ptr;
+    *end++ = *units;
+    field(name, std::string_view(digits, end - digits));
+  }
+};
+
+// a command's name as INFO spells it
+std::string lower_name(size_t index) {
+  std::string name(command_name(index));
+  std::transform(name.begin(), name.end(), name.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return name;
+}
+
+void server_section(std::string &out) {
+  auto &info = server_info();
+  auto uptime = std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::steady_clock::now() - info.started)
+                    .count();
+  Section section(out, "Server");
+
+  section.field("multiplexing_api", info.multiplexing_api);
+  section.field("process_id", size_t(getpid()));
+  section.field("tcp_port", info.port);
+  section.field("uptime_in_seconds", uptime);
+  section.field("uptime_in_days", uptime / (24 * 60 * 60));
+  section.field("worker_threads", info.threads);
+}
+
+void clients_section(Totals const &totals, std::string &out) {
+  Section section(out, "Clients");
+  section.field("connected_clients", totals.connected_clients);
+  section.field("tracking_clients",
+                tracking_clients.load(std::memory_order_relaxed));
+}
+
+void stats_section(Storage &storage, Totals const &totals, std::string &out) {
+  uint64_t commands = 0;
+  for (auto &command : totals.commands) {
+    commands += command.calls;
+  }
+  Section section(out, "Stats");
+
+  section.field("total_connections_received", totals.connections_received);
+  section.field("total_commands_processed", commands);
+  section.field("total_net_input_bytes", totals.net_input_bytes);
+  section.field("total_net_output_bytes", totals.net_output_bytes);
+  section.field("total_error_replies", totals.error_replies);
+  section.field("evicted_keys", storage.memory_stats().evicted);
+  section.field("pubsub_channels", subscribed_count(false));
+  section.field("pubsub_patterns", subscribed_count(true));
+  auto tracking = tracking_stats();
+  section.field("tracking_total_keys", tracking.keys);
+  section.field("tracking_total_items", tracking.items);
+  section.field("tracking_total_prefixes", tracking.prefixes);
+}
+
+void commandstats_section(Totals const &totals, std::string &out) {
+  Section section(out, "Commandstats");
+
+  char value[128];
+  for (size_t i = 0; i < command_count(); i++) {
+    auto &command = totals.commands[i];
+    if (!command.calls and !command.rejected) {
+      continue;
+    }
+    double usec = command.nanos / 1000.0;
+    snprintf(value, sizeof(value),
+             "calls=%lu,usec=%.0f,usec_per_call=%.2f,rejected_calls=%lu,"
+             "failed_calls=%lu",
+             command.calls, usec, command.calls ? usec / command.calls : 0,
+             command.rejected, command.failed);
+    section.field("cmdstat_" + lower_name(i), value);
+  }
+}
+
+void latencystats_section(Totals const &totals, std::string &out) {
+  Section section(out, "Latencystats");
+
+  char value[128];
+  for (size_t i = 0; i < command_count(); i++) {
+    auto &latency = totals.commands[i].latency;
+    if (!latency or !latency->count()) {
+      continue;
+    }
+    snprintf(value, sizeof(value), "p50=%.3f,p99=%.3f,p99.9=%.3f",
+             latency->percentile(50) / 1000.0,
+             latency->percentile(99) / 1000.0,
+             latency->percentile(99.9) / 1000.0);
+    section.field("latency_percentiles_usec_" + lower_name(i), value);
+  }
+}
+
+// only the one database, whose expiring keys aren't counted apart
+void keyspace_section(Storage &storage, std::string &out) {
+  Section section(out, "Keyspace");
+  if (size_t keys = storage.size()) {
+    section.field("db0", "keys=" + std::to_string(keys));
+  }
+}
+
+void memory_section(Storage &storage, std::string &out) {
+  auto stats = storage.memory_stats();
+  size_t used = stats.slab.reserved + stats.tables + stats.shared;
+  size_t rss = resident_bytes();
+  Section section(out, "Memory");
+
+  section.field("used_memory", used);
+  section.human("used_memory_human", used);
+  section.field("used_memory_rss", rss);
+  section.human("used_memory_rss_human", rss);
+  section.ratio("mem_fragmentation_ratio", rss, used);
+  section.field("slab_used_bytes", stats.slab.used);
+  section.field("slab_allocated_bytes", stats.slab.allocated);
+  section.field("slab_reserved_bytes", stats.slab.reserved);
+  section.field("slab_pages", stats.slab.pages);
+  // reserved over requested: size-class rounding plus free slots in pages
+  section.ratio("slab_fragmentation_ratio", stats.slab.reserved,
+                stats.slab.used);
+  section.field("table_bytes", stats.tables);
+  section.field("shared_value_bytes", stats.shared);
+  section.field("keys", stats.keys);
+  section.field("maxmemory", stats.max_memory.bytes);
+  section.human("maxmemory_human", stats.max_memory.bytes);
+  section.field("maxmemory_policy",
+                eviction_policy_name(stats.max_memory.policy));
+  // what the limit is checked against
+  section.field("maxmemory_used", stats.stored);
+  section.field("evicted_keys", stats.evicted);
+  section.field("lazyfree_pending_objects", lazy_free_pending());
+}
+
+void replication_section(std::string &out) {
+  Section section(out, "Replication");
+
+  if (auto primary = replication_primary()) {
+    auto stats = primary->stats();
+    section.field("role", "master");
+    section.field("connected_slaves", stats.replicas);
+    section.field("master_replid", stats.replid);
+    section.field("master_repl_offset", stats.offset);
+    section.field("repl_backlog_size", stats.backlog_size);
+  } else if (auto replica = replication_replica()) {
+    auto stats = replica->stats();
+    section.field("role", "slave");
+    section.field("master_host", stats.host);
+    section.field("master_port", stats.port);
+    section.field("master_link_status", stats.linked ? "up" : "down");
+    section.field("master_replid", stats.replid);
+    section.field("master_repl_offset", std::max<int64_t>(stats.offset, 0));
+  }
+}
+
+void cluster_section(std::string &out) {
+  Section section(out, "Cluster");
+  section.field("cluster_enabled", size_t(cluster_node() ? 1 : 0));
+}
+
+}  // namespace
+
+void set_server_info(uint16_t port, size_t threads,
+                     std::string_view multiplexing_api) {
+  auto &info = server_info();
+  info.port = port;
+  info.threads = threads;
+  info.multiplexing_api = multiplexing_api;
+  info.started = std::chrono::steady_clock::now();
+}
+
+std::string info(Storage &storage, std::string_view section) {
+  std::string name(section);
+  std::transform(name.begin(), name.end(), name.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  bool all = name == "all" or name == "everything";
+  bool common = all or name.empty() or name == "default";
+  auto wants = [&](std::string_view section, bool by_default = true) {
+    return (by_default ? common : all) or name == section;
+  };
+
+  // the counters are only merged when a section needs them
+  std::unique_ptr<Totals> totals;
+  auto merged = [&]() -> Totals const & {
+    if (!totals) {
+      totals = metric_totals();
+    }
+    return *totals;
+  };
+
+  std::string out;
+  if (wants("server")) {
+    server_section(out);
+  }
+  if (wants("clients")) {
+    clients_section(merged(), out);
+  }
+  if (wants("memory")) {
+    memory_section(storage, out);
+  }
+  if (wants("stats")) {
+    stats_section(storage, merged(), out);
+  }
+  if (wants("replication")) {
+    replication_section(out);
+  }
+  if (wants("cluster")) {
+    cluster_section(out);
+  }
+  if (wants("commandstats", false)) {
+    commandstats_section(merged(), out);
+  }
+  if (wants("latencystats", false)) {
+    latencystats_section(merged(), out);
+  }
+  if (wants("keyspace")) {
+    keyspace_section(storage, out);
+  }
+  return out;
+}
@@ -0,0 +1,55 @@
+#include "lazy_free.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+std::atomic<size_t> pending = 0;
+
+struct Queue {
+  std::mutex lock;
+  std::condition_variable wake;
+  std::deque<std::function<void()>> jobs;
+
+  void run() {
+    std::unique_lock guard(lock);
+    while (true) {
+      wake.wait(guard, [&] { return !jobs.empty(); });
+      auto job = std::move(jobs.front());
+      jobs.pop_front();
+      guard.unlock();
+
+      job();
+      // whatever the job captured is freed here too, off the lock
+      job = nullptr;
+      pending--;
+      guard.lock();
+    }
+  }
+};
+
+// never destroyed, since the thread may still be waiting on it at exit
+Queue &queue() {
+  static auto &queue = *new Queue();
+  static std::once_flag started;
+  std::call_once(started, [] { std::thread([] { queue.run(); }).detach(); });
+  return queue;
+}
+
+}  // namespace
+
+void lazy_free(std::function<void()> job) {
+  auto &jobs = queue();
+  pending++;
+  {
+    std::lock_guard guard(jobs.lock);
+    jobs.jobs.push_back(std::move(job));
+  }
+  jobs.wake.notify_one();
+}
+
+size_t lazy_free_pending() { return pending; }
@@ -0,0 +1,529 @@
+#include "load.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "protocol.h"
+#include "replication.h"
+
+const int MAX_EVENTS = 256;
+// how long a thread waits for replies before looking at the clock again
+const int POLL_MS = 10;
+// redis refuses bulk strings over 512MB, so there's no point sending them
+const size_t MAX_VALUE_SIZE = 512 * 1024 * 1024;
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// a whole non-negative number, where anything else is an error rather than
+// a zero
+static uint64_t parse_count(std::string_view option, std::string_view arg) {
+  uint64_t count;
+  auto res = std::from_chars(arg.begin(), arg.end(), count);
+  if (res.ec != std::errc() or res.ptr != arg.end()) {
+    throw std::runtime_error("invalid " + std::string(option) + ": " +
+                             std::string(arg));
+  }
+  return count;
+}
+
+// the two numbers of "<first><separator><second>", or of just "<first>" as
+// both when the separator is optional
+static std::pair<uint64_t, uint64_t> parse_pair(std::string_view option,
+                                                std::string_view arg,
+                                                char separator,
+                                                bool optional) {
+  auto at = arg.find(separator);
+  if (at == arg.npos and optional) {
+    auto count = parse_count(option, arg);
+    return {count, count};
+  }
+  if (at == arg.npos) {
+    throw std::runtime_error("invalid " + std::string(option) + ": " +
+                             std::string(arg));
+  }
+  return {parse_count(option, arg.substr(0, at)),
+          parse_count(option, arg.substr(at + 1))};
+}
+
+LoadConfig::LoadConfig(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg(argv[i]);
+
+    if (arg == "--host" and i + 1 < argc) {
+      host = argv[++i];
+    } else if (arg == "--port" and i + 1 < argc) {
+      port = parse_count(arg, argv[++i]);
+    } else if (arg == "--connections" and i + 1 < argc) {
+      connections = parse_count(arg, argv[++i]);
+    } else if (arg == "--threads" and i + 1 < argc) {
+      threads = parse_count(arg, argv[++i]);
+    } else if (arg == "--pipeline" and i + 1 < argc) {
+      pipeline = parse_count(arg, argv[++i]);
+    } else if (arg == "--keyspace" and i + 1 < argc) {
+      keyspace = parse_count(arg, argv[++i]);
+    } else if (arg == "--value-size" and i + 1 < argc) {
+      std::tie(value_min, value_max) = parse_pair(arg, argv[++i], '-', true);
+    } else if (arg == "--value-dist" and i + 1 < argc) {
+      std::string_view dist(argv[++i]);
+      if (dist == "uniform") {
+        value_dist = ValueDist::UNIFORM;
+      } else if (dist == "log") {
+        value_dist = ValueDist::LOG;
+      } else {
+        throw std::runtime_error("unknown value distribution: " +
+                                 std::string(dist));
+      }
+    } else if (arg == "--ratio" and i + 1 < argc) {
+      std::tie(sets, gets) = parse_pair(arg, argv[++i], ':', false);
+    } else if (arg == "--duration" and i + 1 < argc) {
+      seconds = strtod(argv[++i], nullptr);
+    } else if (arg == "--requests" and i + 1 < argc) {
+      requests = parse_count(arg, argv[++i]);
+    } else if (arg == "--json" and i + 1 < argc) {
+      json_path = argv[++i];
+    } else {
+      throw std::runtime_error("unknown argument: " + std::string(arg));
+    }
+  }
+
+  if (!connections or !pipeline or !keyspace) {
+    throw std::runtime_error(
+        "connections, pipeline and keyspace must be at least 1");
+  }
+  if (value_min > value_max or value_max > MAX_VALUE_SIZE) {
+    throw std::runtime_error("invalid value size range");
+  }
+  if (!sets and !gets) {
+    throw std::runtime_error("the ratio has to include some requests");
+  }
+  if (!requests and !(seconds > 0)) {
+    throw std::runtime_error("the duration has to be positive");
+  }
+}
+
+namespace {
+
+// a request on the wire, oldest first
+struct Request {
+  uint64_t sent;
+  bool get;
+};
+
+struct Conn {
+  int sock;
+  InputBuffer in;
+  std::string out;
+  // how much of out the socket has taken
+  size_t written = 0;
+  bool want_write = false;
+  std::deque<Request> inflight;
+};
+
+void append_number(std::string &out, uint64_t number) {
+  char digits[20];
+  auto res = std::to_chars(digits, digits + sizeof(digits), number);
+  out.append(digits, res.ptr);
+}
+
+// one thread's connections and the loop that keeps them busy
+class Driver {
+  LoadConfig const &config;
+  // value_max bytes, of which each SET sends a prefix
+  std::string_view values;
+  uint64_t state;
+  int epoll;
+  std::vector<Conn> conns;
+  // requests this thread may still send
+  uint64_t budget;
+  // replies it's still waiting for
+  uint64_t outstanding = 0;
+
+  uint64_t random() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+
+  size_t value_size();
+  void issue(Conn &conn, uint64_t now);
+  void send(size_t index);
+  // parses every reply that's arrived and answers each with a new request
+  void receive(size_t index, LoadReport &report);
+
+ public:
+  Driver(LoadConfig const &config, std::string_view values,
+         size_t connections, uint64_t budget, uint64_t seed);
+  Driver(Driver const &other) = delete;
+  ~Driver();
+
+  // until the deadline passes, or when counting requests, until the budget
+  // is spent and answered
+  void run(uint64_t deadline, LoadReport &report);
+};
+
+Driver::Driver(LoadConfig const &config, std::string_view values,
+               size_t connections, uint64_t budget, uint64_t seed)
+    : config(config),
+      values(values),
+      state(seed * 0x9e3779b97f4a7c15),
+      budget(budget) {
+  if (0 > (epoll = epoll_create1(EPOLL_CLOEXEC))) {
+    throw std::runtime_error("failed to create epoll instance");
+  }
+  conns.reserve(connections);
+
+  try {
+    for (size_t i = 0; i < connections; i++) {
+      int sock = connect_to(config.host, config.port);
+      conns.push_back({.sock = sock});
+
+      int flags = fcntl(sock, F_GETFL, 0);
+      if (0 > flags or 0 > fcntl(sock, F_SETFL, flags | O_NONBLOCK)) {
+        throw std::runtime_error("failed to make socket non-blocking");
+      }
+      epoll_event event{.events = EPOLLIN, .data = {.u64 = i}};
+      if (epoll_ctl(epoll, EPOLL_CTL_ADD, sock, &event)) {
+        throw std::runtime_error("failed to register socket");
+      }
+    }
+  } catch (...) {
+    for (auto &conn : conns) {
+      close(conn.sock);
+    }
+    close(epoll);
+    throw;
+  }
+}
+
+Driver::~Driver() {
+  for (auto &conn : conns) {
+    close(conn.sock);
+  }
+  close(epoll);
+}
+
+size_t Driver::value_size() {
+  if (config.value_min == config.value_max) {
+    return config.value_min;
+  }
+  if (config.value_dist == ValueDist::UNIFORM) {
+    return config.value_min +
+           random() % (config.value_max - config.value_min + 1);
+  }
+
+  // every order of magnitude in the range equally likely, so most values
+  // are small and a few are large
+  double low = std::log(config.value_min + 1.0);
+  double high = std::log(config.value_max + 1.0);
+  double at = double(random() >> 11) / double(1ul << 53);
+  size_t size = std::exp(low + at * (high - low)) - 1;
+  return std::clamp(size, config.value_min, config.value_max);
+}
+
+void Driver::issue(Conn &conn, uint64_t now) {
+  bool get = random() % (config.sets + config.gets) >= config.sets;
+  char key[24] = "key:";
+  auto res = std::to_chars(key + 4, key + sizeof(key),
+                           random() % config.keyspace);
+  size_t key_len = res.ptr - key;
+
+  conn.out += get ? "*2\r\n$3\r\nGET\r\n$" : "*3\r\n$3\r\nSET\r\n$";
+  append_number(conn.out, key_len);
+  conn.out += "\r\n";
+  conn.out.append(key, key_len);
+  conn.out += "\r\n";
+  if (!get) {
+    size_t size = value_size();
+    conn.out += "$";
+    append_number(conn.out, size);
+    conn.out += "\r\n";
+    conn.out += values.substr(0, size);
+    conn.out += "\r\n";
+  }
+
+  conn.inflight.push_back({now, get});
+  budget--;
+  outstanding++;
+}
+
+void Driver::send(size_t index) {
+  auto &conn = conns[index];
+
+  while (conn.written < conn.out.size()) {
+    ssize_t len = write(conn.sock, conn.out.data() + conn.written,
+                        conn.out.size() - conn.written);
+    if (0 > len) {
+      if (errno == EAGAIN or errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno != EINTR) {
+        throw std::runtime_error("failed to send to the server");
+      }
+      continue;
+    }
+    conn.written += len;
+  }
+  if (conn.written == conn.out.size()) {
+    conn.out.clear();
+    conn.written = 0;
+  }
+
+  // only wait for room while there's something to send, or every idle
+  // connection would wake the loop
+  bool want_write = !conn.out.empty();
+  if (want_write != conn.want_write) {
+    epoll_event event{.events = EPOLLIN | (want_write ? EPOLLOUT : 0u),
+                      .data = {.u64 = index}};
+    if (epoll_ctl(epoll, EPOLL_CTL_MOD, conn.sock, &event)) {
+      throw std::runtime_error("failed to update socket");
+    }
+    conn.want_write = want_write;
+  }
+}
+
+void Driver::receive(size_t index, LoadReport &report) {
+  auto &conn = conns[index];
+  size_t replies = 0;
+  uint64_t now = 0;
+
+  while (true) {
+    auto [tail, free] = conn.in.prepare();
+    ssize_t len = read(conn.sock, tail, free);
+    if (0 == len) {
+      throw std::runtime_error("the server closed the connection");
+    }
+    if (0 > len) {
+      if (errno == EAGAIN or errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno != EINTR) {
+        throw std::runtime_error("failed to read from the server");
+      }
+      continue;
+    }
+    conn.in.commit(len);
+    now = now_ns();
+
+    auto input = conn.in.view();
+    size_t pos = 0;
+    while (true) {
+      auto reply_len = client_parse(input.substr(pos));
+      if (!reply_len) {
+        throw std::runtime_error("malformed reply from the server");
+      }
+      if (!*reply_len) {
+        break;
+      }
+      if (conn.inflight.empty()) {
+        throw std::runtime_error("unexpected reply from the server");
+      }
+
+      auto request = conn.inflight.front();
+      conn.inflight.pop_front();
+      outstanding--;
+      replies++;
+
+      uint64_t latency = now - request.sent;
+      report.all.record(latency);
+      (request.get ? report.gets : report.sets).record(latency);
+      report.requests++;
+
+      char type = input[pos];
+      if (type == '-' or type == '!') {
+        report.errors++;
+      } else if (request.get and
+                 (type == '_' or input.substr(pos, 3) == "$-1")) {
+        report.misses++;
+      }
+      pos += *reply_len;
+    }
+    conn.in.consume(pos);
+  }
+
+  for (; replies and budget; replies--) {
+    issue(conn, now);
+  }
+  send(index);
+}
+
+void Driver::run(uint64_t deadline, LoadReport &report) {
+  uint64_t now = now_ns();
+  for (size_t i = 0; i < conns.size(); i++) {
+    for (size_t j = 0; j < config.pipeline and budget; j++) {
+      issue(conns[i], now);
+    }
+    send(i);
+  }
+
+  std::array<epoll_event, MAX_EVENTS> events;
+  while (config.requests ? budget or outstanding : now_ns() < deadline) {
+    int ready = epoll_wait(epoll, events.data(), events.size(), POLL_MS);
+    if (0 > ready) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("failed to wait for events");
+    }
+
+    for (int i = 0; i < ready; i++) {
+      size_t index = events[i].data.u64;
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        receive(index, report);
+      } else if (events[i].events & EPOLLOUT) {
+        send(index);
+      }
+    }
+  }
+}
+
+// the JSON for one histogram's summary, in microseconds
+std::string latency_json(Histogram const &histogram) {
+  char json[256];
+  snprintf(json, sizeof(json),
+           "{\"count\": %lu, \"mean\": %.2f, \"p50\": %.2f, \"p99\": %.2f, "
+           "\"p99.9\": %.2f, \"max\": %.2f}",
+           histogram.count(), histogram.mean() / 1000,
+           histogram.percentile(50) / 1000.0,
+           histogram.percentile(99) / 1000.0,
+           histogram.percentile(99.9) / 1000.0, histogram.max() / 1000.0);
+  return json;
+}
+
+}  // namespace
+
+LoadReport run_load(LoadConfig const &config) {
+  size_t threads =
+      config.threads ? config.threads : std::thread::hardware_concurrency();
+  threads = std::clamp<size_t>(threads, 1, config.connections);
+  std::string values(config.value_max, 'x');
+
+  // everything connects before the clock starts
+  std::vector<std::unique_ptr<Driver>> drivers;
+  for (size_t t = 0; t < threads; t++) {
+    size_t connections =
+        config.connections / threads + (t < config.connections % threads);
+    uint64_t budget = config.requests ? config.requests / threads +
+                                            (t < config.requests % threads)
+                                      : UINT64_MAX;
+    drivers.push_back(
+        std::make_unique<Driver>(config, values, connections, budget, t + 1));
+  }
+
+  std::vector<LoadReport> reports(threads);
+  std::vector<uint64_t> ends(threads);
+  std::vector<std::exception_ptr> errors(threads);
+  std::vector<std::thread> pool;
+
+  uint64_t start = now_ns();
+  uint64_t deadline = start + uint64_t(config.seconds * 1e9);
+  for (size_t t = 0; t < threads; t++) {
+    pool.emplace_back([&, t] {
+      try {
+        drivers[t]->run(deadline, reports[t]);
+      } catch (...) {
+        errors[t] = std::current_exception();
+      }
+      ends[t] = now_ns();
+    });
+  }
+  for (auto &thread : pool) {
+    thread.join();
+  }
+  for (auto &error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  LoadReport report;
+  report.threads = threads;
+  report.seconds = (*std::max_element(ends.begin(), ends.end()) - start) / 1e9;
+  for (auto &thread_report : reports) {
+    report.requests += thread_report.requests;
+    report.errors += thread_report.errors;
+    report.misses += thread_report.misses;
+    report.all.merge(thread_report.all);
+    report.sets.merge(thread_report.sets);
+    report.gets.merge(thread_report.gets);
+  }
+  return report;
+}
+
+// "32 byte" or "16-4096 byte uniform"
+static std::string describe_values(LoadConfig const &config) {
+  if (config.value_min == config.value_max) {
+    return std::to_string(config.value_min) + " byte";
+  }
+  return std::to_string(config.value_min) + "-" +
+         std::to_string(config.value_max) + " byte " +
+         (config.value_dist == ValueDist::UNIFORM ? "uniform" : "log");
+}
+
+void print_report(LoadConfig const &config, LoadReport const &report) {
+  printf("%zu connections on %zu threads, pipeline %zu, %zu keys, %s values, "
+         "SET:GET %u:%u\n",
+         config.connections, report.threads, config.pipeline, config.keyspace,
+         describe_values(config).c_str(), config.sets, config.gets);
+  printf("%lu requests in %.2fs: %.0f requests/sec, %lu errors, %lu GET "
+         "misses\n\n",
+         report.requests, report.seconds, report.requests / report.seconds,
+         report.errors, report.misses);
+
+  printf("%-8s %10s %10s %10s %10s %10s %10s\n", "usec", "count", "mean",
+         "p50", "p99", "p99.9", "max");
+  for (auto [name, histogram] :
+       {std::pair{"all", &report.all}, {"SET", &report.sets},
+        {"GET", &report.gets}}) {
+    printf("%-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+           histogram->count(), histogram->mean() / 1000,
+           histogram->percentile(50) / 1000.0,
+           histogram->percentile(99) / 1000.0,
+           histogram->percentile(99.9) / 1000.0, histogram->max() / 1000.0);
+  }
+}
+
+std::string report_json(LoadConfig const &config, LoadReport const &report) {
+  char head[1024];
+  snprintf(head, sizeof(head),
+           "{\n  \"config\": {\"host\": \"%s\", \"port\": %u, "
+           "\"connections\": %zu, \"threads\": %zu, \"pipeline\": %zu, "
+           "\"keyspace\": %zu, \"value_min\": %zu, \"value_max\": %zu, "
+           "\"value_dist\": \"%s\", \"sets\": %u, \"gets\": %u},\n"
+           "  \"requests\": %lu,\n  \"seconds\": %.3f,\n"
+           "  \"throughput\": %.1f,\n  \"errors\": %lu,\n"
+           "  \"get_misses\": %lu,\n",
+           config.host.c_str(), config.port, config.connections,
+           report.threads, config.pipeline, config.keyspace, config.value_min,
+           config.value_max,
+           config.value_dist == ValueDist::UNIFORM ? "uniform" : "log",
+           config.sets, config.gets, report.requests, report.seconds,
+           report.requests / report.seconds, report.errors, report.misses);
+
+  return std::string(head) + "  \"latency_us\": {\n    \"all\": " +
+         latency_json(report.all) + ",\n    \"set\": " +
+         latency_json(report.sets) + ",\n    \"get\": " +
+         latency_json(report.gets) + "\n  }\n}\n";
+}
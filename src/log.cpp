@@ -0,0 +1,133 @@
+#include "log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// past this many unwritten lines, new ones are dropped
+const size_t MAX_QUEUED = 10000;
+
+namespace {
+
+struct Logger {
+  std::mutex lock;
+  std::condition_variable ready;
+  // signalled whenever the writer has caught up
+  std::condition_variable drained;
+  std::vector<std::string> queued;
+  size_t dropped = 0;
+  bool writing = false;
+  FILE *out = stdout;
+
+  Logger() { std::thread([this] { run(); }).detach(); }
+
+  void run() {
+    std::vector<std::string> batch;
+    while (true) {
+      std::unique_lock guard(lock);
+      writing = false;
+      drained.notify_all();
+      ready.wait(guard, [&] { return !queued.empty() or dropped; });
+      writing = true;
+      std::swap(batch, queued);
+      size_t lost = std::exchange(dropped, 0);
+      FILE *file = out;
+      guard.unlock();
+
+      if (lost) {
+        fprintf(file, "%d # %zu log lines dropped\n", getpid(), lost);
+      }
+      for (auto &line : batch) {
+        fwrite(line.data(), 1, line.length(), file);
+      }
+      fflush(file);
+      batch.clear();
+    }
+  }
+};
+
+// never destroyed, since the writer thread runs until the process exits
+Logger &logger() {
+  static auto &logger = *new Logger();
+  return logger;
+}
+
+}  // namespace
+
+std::optional<LogLevel> parse_log_level(std::string_view name) {
+  if (name == "debug") {
+    return LogLevel::DEBUG;
+  } else if (name == "verbose") {
+    return LogLevel::VERBOSE;
+  } else if (name == "notice") {
+    return LogLevel::NOTICE;
+  } else if (name == "warning") {
+    return LogLevel::WARNING;
+  }
+  return std::nullopt;
+}
+
+void configure_log(LogLevel level, std::string const &path) {
+  FILE *file = stdout;
+  if (!path.empty() and !(file = fopen(path.c_str(), "a"))) {
+    throw std::runtime_error("can't open log file " + path + ": " +
+                             strerror(errno));
+  }
+
+  auto &logger = ::logger();
+  std::lock_guard guard(logger.lock);
+  if (logger.out != stdout) {
+    fclose(logger.out);
+  }
+  logger.out = file;
+  log_threshold = level;
+}
+
+void flush_log() {
+  auto &logger = ::logger();
+  std::unique_lock guard(logger.lock);
+  logger.drained.wait(guard, [&] {
+    return logger.queued.empty() and !logger.dropped and !logger.writing;
+  });
+}
+
+void log_line(LogLevel level, std::string message) {
+  // like redis's: "pid dd Mon yyyy hh:mm:ss.mmm <mark> message"
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  tm local;
+  localtime_r(&now.tv_sec, &local);
+
+  char prefix[64];
+  int length = snprintf(prefix, sizeof(prefix), "%d ", getpid());
+  length += strftime(prefix + length, sizeof(prefix) - length,
+                     "%d %b %Y %H:%M:%S", &local);
+  length += snprintf(prefix + length, sizeof(prefix) - length, ".%03ld %c ",
+                     now.tv_nsec / 1000000, ".-*#"[int(level)]);
+
+  std::string line;
+  line.reserve(length + message.length() + 1);
+  line.append(prefix, length);
+  line += message;
+  line += '\n';
+
+  auto &logger = ::logger();
+  {
+    std::lock_guard guard(logger.lock);
+    if (logger.queued.size() >= MAX_QUEUED) {
+      logger.dropped++;
+      return;
+    }
+    logger.queued.push_back(std::move(line));
+  }
+  logger.ready.notify_one();
+}
@@ -1,86 +1,269 @@
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
 #include <thread>
+#include <vector>
 
-#include "protocol.h"
+#include "aof.h"
+#include "cluster.h"
+#include "info.h"
+#include "log.h"
+#include "replication.h"
 #include "shared.h"
+#include "slowlog.h"
+#include "snapshot.h"
 #include "storage.h"
+#include "tracking.h"
+#include "worker.h"
 
-const size_t BACKLOG = 10;
+// a byte count with an optional k, kb, m, mb, g or gb suffix, where the
+// short ones are powers of 1000 like redis's config
+static size_t parse_bytes(std::string_view arg) {
+  char *end;
+  size_t bytes = strtoull(arg.data(), &end, 10);
+  std::string_view unit(end);
 
-class Server {
-  int sock;
-  sockaddr_in addr;
-  Storage storage;
-
- public:
-  Server()
-      : addr{
-            .sin_family = AF_INET,
-            .sin_port = htons(PORT),
-            .sin_addr = {.s_addr = INADDR_ANY},
-        } {
-    if (0 > (sock = socket(AF_INET, SOCK_STREAM, 0))) {
-      throw std::runtime_error("failed to create socket");
-    }
-    int opt = 1;
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt,
-                   sizeof(opt))) {
-      throw std::runtime_error("failed to set socket options");
-    }
-    if (bind(sock, (sockaddr *)&addr, sizeof(addr))) {
-      throw std::runtime_error("failed to bind socket");
-    }
-    if (listen(sock, BACKLOG)) {
-      throw std::runtime_error("failed to prepare socket");
+  for (auto [suffix, scale] : {std::pair{"k", 1000ul}, {"kb", 1ul << 10},
+                               {"m", 1000ul * 1000}, {"mb", 1ul << 20},
+                               {"g", 1000ul * 1000 * 1000}, {"gb", 1ul << 30},
+                               {"", 1ul}}) {
+    if (end != arg.data() and unit.length() == strlen(suffix) and
+        std::equal(unit.begin(), unit.end(), suffix, [](char a, char b) {
+          return std::tolower(a) == b;
+        })) {
+      return bytes * scale;
     }
   }
+  throw std::runtime_error("invalid memory size: " + std::string(arg));
+}
 
-  ~Server() { close(sock); }
+struct Config {
+  uint16_t port = PORT;
+  size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  MaxMemory max_memory;
+  bool append_only = false;
+  std::string append_filename = "appendonly.aof";
+  AppendFsync append_fsync = AppendFsync::EVERYSEC;
+  // the primary's host, empty unless this is a replica
+  std::string replica_of;
+  uint16_t replica_of_port = 0;
+  size_t backlog_size = DEFAULT_BACKLOG_SIZE;
+  IoBackend io_backend = IoBackend::EPOLL;
+  LogLevel log_level = LogLevel::NOTICE;
+  // stdout when empty
+  std::string log_file;
+  // in microseconds, like redis's
+  int64_t slowlog_slower_than = 10000;
+  size_t slowlog_max_len = 128;
+  bool cluster_enabled = false;
+  // where other nodes and redirected clients reach this one
+  std::string cluster_announce_ip = "127.0.0.1";
+  // 0 for no limit
+  size_t tracking_table_max_keys = 1000000;
 
-  void accept_loop() {
-    int client_sock;
+  Config(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+      std::string_view arg(argv[i]);
 
-    while (true) {
-      if (0 > (client_sock = accept(sock, nullptr, nullptr))) {
-        throw std::runtime_error("failed to accept connection");
+      if (arg == "--threads" and i + 1 < argc) {
+        threads = std::max(1l, strtol(argv[++i], nullptr, 10));
+      } else if (arg == "--port" and i + 1 < argc) {
+        port = strtoul(argv[++i], nullptr, 10);
+      } else if (arg == "--maxmemory" and i + 1 < argc) {
+        max_memory.bytes = parse_bytes(argv[++i]);
+      } else if (arg == "--maxmemory-policy" and i + 1 < argc) {
+        auto policy = parse_eviction_policy(argv[++i]);
+        if (!policy) {
+          throw std::runtime_error("unknown maxmemory policy: " +
+                                   std::string(argv[i]));
+        }
+        max_memory.policy = *policy;
+      } else if (arg == "--maxmemory-samples" and i + 1 < argc) {
+        max_memory.samples = std::max(1l, strtol(argv[++i], nullptr, 10));
+      } else if (arg == "--appendonly" and i + 1 < argc) {
+        append_only = std::string_view(argv[++i]) == "yes";
+      } else if (arg == "--appendfilename" and i + 1 < argc) {
+        append_filename = argv[++i];
+      } else if (arg == "--appendfsync" and i + 1 < argc) {
+        auto policy = parse_append_fsync(argv[++i]);
+        if (!policy) {
+          throw std::runtime_error("unknown appendfsync policy: " +
+                                   std::string(argv[i]));
+        }
+        append_fsync = *policy;
+      } else if (arg == "--replicaof" and i + 2 < argc) {
+        replica_of = argv[++i];
+        replica_of_port = strtoul(argv[++i], nullptr, 10);
+      } else if (arg == "--repl-backlog-size" and i + 1 < argc) {
+        backlog_size = std::max(1ul, parse_bytes(argv[++i]));
+      } else if (arg == "--io-backend" and i + 1 < argc) {
+        auto backend = parse_io_backend(argv[++i]);
+        if (!backend) {
+          throw std::runtime_error("unknown io backend: " +
+                                   std::string(argv[i]));
+        }
+        io_backend = *backend;
+      } else if (arg == "--dbfilename" and i + 1 < argc) {
+        set_snapshot_path(argv[++i]);
+      } else if (arg == "--loglevel" and i + 1 < argc) {
+        auto level = parse_log_level(argv[++i]);
+        if (!level) {
+          throw std::runtime_error("unknown log level: " +
+                                   std::string(argv[i]));
+        }
+        log_level = *level;
+      } else if (arg == "--logfile" and i + 1 < argc) {
+        log_file = argv[++i];
+      } else if (arg == "--slowlog-log-slower-than" and i + 1 < argc) {
+        slowlog_slower_than = strtoll(argv[++i], nullptr, 10);
+      } else if (arg == "--slowlog-max-len" and i + 1 < argc) {
+        slowlog_max_len = strtoull(argv[++i], nullptr, 10);
+      } else if (arg == "--cluster-enabled" and i + 1 < argc) {
+        cluster_enabled = std::string_view(argv[++i]) == "yes";
+      } else if (arg == "--cluster-announce-ip" and i + 1 < argc) {
+        cluster_announce_ip = argv[++i];
+      } else if (arg == "--tracking-table-max-keys" and i + 1 < argc) {
+        tracking_table_max_keys = strtoull(argv[++i], nullptr, 10);
+      } else {
+        throw std::runtime_error("unknown argument: " + std::string(arg));
       }
-      // using threads, could optimize with an event loop
-      std::thread(&Server::handle_conn, this, client_sock).detach();
     }
   }
+};
+
+// how often the cron thread wakes up, and how long each active expiry pass
+// may take, like redis's default hz 10 with a 25% cpu cap
+const auto CRON_PERIOD = std::chrono::milliseconds(100);
+const auto EXPIRE_BUDGET = std::chrono::milliseconds(25);
 
-  void handle_conn(int client_sock) {
-    buffer in{};
-    std::string out;
+class Server {
+  Storage storage;
+  std::unique_ptr<Aof> aof;
+  // exactly one of these
+  std::unique_ptr<Primary> primary;
+  std::unique_ptr<Replica> replica;
+  // null unless cluster mode is on
+  std::unique_ptr<Cluster> cluster;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::thread cron;
+  std::atomic<bool> running = true;
 
-    while (0 < read(client_sock, in.data(), in.size())) {
-      std::cout << "read:\n" << in.data() << std::endl;
-      out.clear();
-      server_transact(storage, in, out);
-      std::cout << "writing:\n" << out.data() << std::endl;
+  void cron_loop() {
+    while (running) {
+      auto start = std::chrono::steady_clock::now();
 
-      if (0 > send(client_sock, out.data(), out.size(), 0)) {
-        close(client_sock);
-        throw std::runtime_error("failed to send data to client");
+      update_lru_clock();
+
+      // keep going while the backlog of expired keys lasts, but still sleep
+      // off the rest of the period so expiry never takes over a core
+      while (storage.expire_cycle(EXPIRE_BUDGET) and
+             std::chrono::steady_clock::now() - start < EXPIRE_BUDGET) {
       }
+      flush_invalidations();
+      std::this_thread::sleep_until(start + CRON_PERIOD);
+    }
+  }
+
+ public:
+  // replicas leave eviction to their primary, whose deletes they replay,
+  // like redis's replica-ignore-maxmemory
+  Server(Config const &config)
+      : storage(DEFAULT_SHARDS,
+                config.replica_of.empty() ? config.max_memory : MaxMemory{},
+                config.cluster_enabled) {
+    if (config.append_only) {
+      auto start = std::chrono::steady_clock::now();
+      aof = std::make_unique<Aof>(storage, config.append_filename,
+                                  config.append_fsync);
+      auto loaded = aof->load();
+      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start);
+      write_log(LogLevel::NOTICE, "loaded ", loaded, " bytes from ",
+                config.append_filename, " in ", elapsed.count(), "ms");
+    } else {
+      // the aof is the more complete record, so the snapshot is only read
+      // without it, like redis
+      auto start = std::chrono::steady_clock::now();
+      auto loaded = load_snapshot(storage, snapshot_path());
+      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start);
+      write_log(LogLevel::NOTICE, "loaded ", loaded, " keys from ",
+                snapshot_path(), " in ", elapsed.count(), "ms");
+    }
+
+    if (config.replica_of.empty()) {
+      primary = std::make_unique<Primary>(storage, config.backlog_size);
+    } else {
+      replica = std::make_unique<Replica>(storage, config.replica_of,
+                                          config.replica_of_port);
+    }
+    set_replication_role(primary.get(), replica.get());
+    if (config.cluster_enabled) {
+      cluster =
+          std::make_unique<Cluster>(config.cluster_announce_ip, config.port);
+      set_cluster_node(cluster.get());
+      write_log(LogLevel::NOTICE, "cluster node id ", cluster->my_id());
+    }
+    set_server_info(config.port, config.threads,
+                    config.io_backend == IoBackend::URING ? "io_uring"
+                                                          : "epoll");
+
+    // every worker binds its own SO_REUSEPORT listener, so the kernel spreads
+    // new connections across them without a dispatcher thread
+    for (size_t i = 0; i < config.threads; i++) {
+      workers.push_back(std::make_unique<Worker>(i, config.port, storage,
+                                                 aof.get(), primary.get(),
+                                                 config.io_backend));
     }
+  }
 
-    close(client_sock);
+  void run() {
+    if (aof) {
+      aof->start();
+    }
+    if (primary) {
+      primary->start();
+    } else {
+      replica->start();
+    }
+    if (cluster) {
+      cluster->start();
+    }
+    for (auto &worker : workers) {
+      worker->start();
+    }
+    cron = std::thread(&Server::cron_loop, this);
+
+    for (auto &worker : workers) {
+      worker->join();
+    }
+    running = false;
+    cron.join();
   }
 };
 
-int main() {
+int main(int argc, char **argv) {
   try {
-    Server server;
-    std::cout << "listening..." << std::endl;
-    server.accept_loop();
+    Config config(argc, argv);
+    configure_log(config.log_level, config.log_file);
+    set_slowlog_config(config.slowlog_slower_than, config.slowlog_max_len);
+    set_tracking_table_max_keys(config.tracking_table_max_keys);
+    Server server(config);
+    write_log(LogLevel::NOTICE, "listening with ", config.threads,
+              " threads...");
+    server.run();
   } catch (std::runtime_error const &e) {
+    flush_log();
     std::cerr << "error: " << e.what() << std::endl;
   }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,77 @@
+#include "metrics.h"
+
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct Registry {
+  std::mutex lock;
+  std::vector<ThreadStats *> threads;
+};
+
+// never destroyed, since threads may still count while the process exits
+Registry &registry() {
+  static auto &registry = *new Registry();
+  return registry;
+}
+
+}  // namespace
+
+ThreadStats &thread_stats() {
+  thread_local ThreadStats *stats = [] {
+    auto stats = new ThreadStats();
+    auto &registry = ::registry();
+    std::lock_guard guard(registry.lock);
+    registry.threads.push_back(stats);
+    return stats;
+  }();
+  return *stats;
+}
+
+void record_command(size_t index, uint64_t nanos, bool failed) {
+  auto &command = thread_stats().commands[index];
+  command.calls.add();
+  command.nanos.add(nanos);
+  if (failed) {
+    command.failed.add();
+  }
+
+  auto latency = command.latency.load(std::memory_order_relaxed);
+  if (!latency) {
+    latency = new Histogram(COMMAND_LATENCY_BITS);
+    command.latency.store(latency, std::memory_order_release);
+  }
+  latency->record(nanos);
+}
+
+std::unique_ptr<Totals> metric_totals() {
+  auto totals = std::make_unique<Totals>();
+  auto &registry = ::registry();
+  std::lock_guard guard(registry.lock);
+
+  for (auto stats : registry.threads) {
+    totals->connections_received += stats->connections_received.get();
+    totals->connected_clients += stats->connected_clients.get();
+    totals->net_input_bytes += stats->net_input_bytes.get();
+    totals->net_output_bytes += stats->net_output_bytes.get();
+    totals->error_replies += stats->error_replies.get();
+
+    for (size_t i = 0; i < MAX_COMMANDS; i++) {
+      auto &command = stats->commands[i];
+      auto &total = totals->commands[i];
+      total.calls += command.calls.get();
+      total.failed += command.failed.get();
+      total.rejected += command.rejected.get();
+      total.nanos += command.nanos.get();
+
+      if (auto latency = command.latency.load(std::memory_order_acquire)) {
+        if (!total.latency) {
+          total.latency = std::make_unique<Histogram>(COMMAND_LATENCY_BITS);
+        }
+        total.latency->merge(*latency);
+      }
+    }
+  }
+  return totals;
+}
@@ -1,72 +1,307 @@
-#include <arpa/inet.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 
+#include "info.h"
+#include "flat_map.h"
+#include "load.h"
 #include "protocol.h"
-#include "shared.h"
-
-const char *ADDR = "127.0.0.1";
-
-class Client {
-  int sock;
-  struct sockaddr_in addr;
-
- public:
-  Client()
-      : addr{
-            .sin_family = AF_INET,
-            .sin_port = htons(PORT),
-        } {
-    if (0 > (sock = socket(AF_INET, SOCK_STREAM, 0))) {
-      throw std::runtime_error("failed to create socket");
+#include "storage.h"
+
+// counts every global allocation, so --bench-alloc can report how many the
+// server's parse and execute path makes per command
+static std::atomic<size_t> allocations = 0;
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+static std::string encode(std::vector<std::string_view> const &args) {
+  std::string command = "*" + std::to_string(args.size()) + "\r\n";
+
+  for (auto arg : args) {
+    command += "$" + std::to_string(arg.length()) + "\r\n";
+    command += arg;
+    command += "\r\n";
+  }
+  return command;
+}
+
+// drives server_transact directly, one command per call like an unpipelined
+// client, and reports allocations and time per command
+static void bench_alloc() {
+  const size_t COMMANDS = 100000;
+  const std::string value(32, 'v');
+
+  Storage storage;
+  OutputBuffer out;
+  std::vector<std::string> keys, sets, gets, misses;
+
+  for (size_t i = 0; i < COMMANDS; i++) {
+    keys.push_back("key:" + std::to_string(i));
+    sets.push_back(encode({"SET", keys.back(), value}));
+    gets.push_back(encode({"GET", keys.back()}));
+    misses.push_back(encode({"GET", "missing:" + std::to_string(i)}));
+  }
+  std::vector<std::string> pings(COMMANDS, encode({"PING"}));
+
+  auto run = [&](char const *name, std::vector<std::string> const &commands) {
+    size_t before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+
+    for (auto const &command : commands) {
+      out.clear();
+      server_transact(storage, command, out);
     }
-    if (0 >= inet_pton(AF_INET, ADDR, &addr.sin_addr)) {
-      close(sock);
-      throw std::runtime_error("failed to set ip address");
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    double allocs = double(allocations.load() - before) / commands.size();
+    double ns =
+        double(std::chrono::nanoseconds(elapsed).count()) / commands.size();
+    printf("%-20s %10.2f %10.0f\n", name, allocs, ns);
+  };
+
+  printf("%-20s %10s %10s\n", "command", "allocs/cmd", "ns/cmd");
+  run("SET new key", sets);
+  run("SET existing key", sets);
+  run("GET hit", gets);
+  run("GET miss", misses);
+  run("PING", pings);
+}
+
+// hammers one Storage from a growing number of threads with a 90/10 GET/SET
+// mix, once with a single shard (one global lock) and once sharded
+static void bench_storage(size_t max_threads) {
+  const size_t KEYS = 100000;
+  const size_t OPS_PER_THREAD = 2000000;
+  const std::string value(32, 'v');
+
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < KEYS; i++) {
+    keys.push_back("key:" + std::to_string(i));
+  }
+
+  printf("%-8s %-8s %12s\n", "shards", "threads", "ops/sec");
+
+  for (size_t shards : {1ul, DEFAULT_SHARDS}) {
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+      Storage storage(shards);
+      for (auto const &key : keys) {
+        storage.set(key, value);
+      }
+
+      std::vector<std::thread> pool;
+      auto start = std::chrono::steady_clock::now();
+
+      for (size_t t = 0; t < threads; t++) {
+        pool.emplace_back([&, seed = t + 1] {
+          OutputBuffer out;
+          Reply reply(out);
+          uint64_t state = seed * 0x9e3779b97f4a7c15;
+
+          for (size_t i = 0; i < OPS_PER_THREAD; i++) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+
+            auto const &key = keys[state % KEYS];
+            if (state % 10 == 0) {
+              storage.set(key, value);
+            } else {
+              storage.get(key, reply);
+            }
+            if (out.size() > 64 * 1024) {
+              out.clear();
+            }
+          }
+        });
+      }
+      for (auto &thread : pool) {
+        thread.join();
+      }
+
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start;
+      printf("%-8zu %-8zu %12.0f\n", shards, threads,
+             threads * OPS_PER_THREAD / elapsed.count());
     }
   }
+}
 
-  ~Client() { close(sock); }
+// grows a map to keys entries, and each time a resize starts erases
+// random entries until it's done, looking up keys present and absent after
+// every erase, and checks every answer. that's erasing entries the resize
+// has moved already and ones it hasn't, and freeing entry segments midway
+static void check_map_churn(size_t keys) {
+  FlatMap<uint64_t, uint64_t, std::equal_to<>> map;
+  // what's in the map, and what was erased from it
+  std::vector<uint64_t> live, gone;
+  size_t resizes = 0;
+  // splitmix64's finalizer, so both halves of the hash are well mixed
+  auto hash = [](uint64_t key) {
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111eb;
+    return key ^ (key >> 31);
+  };
+  uint64_t state = 0x9e3779b97f4a7c15;
+  auto random = [&] {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  };
+  auto check = [&](uint64_t key, bool expected) {
+    auto found = map.find(key, hash(key));
+    if (bool(found) != expected or (found and found->value != key)) {
+      throw std::runtime_error("map churn: wrong answer for key " +
+                               std::to_string(key));
+    }
+  };
 
-  void handle_conn() {
-    if (0 > connect(sock, (sockaddr *)&addr, sizeof(addr))) {
-      throw std::runtime_error("failed to connect");
+  for (uint64_t next = 0; next < keys; next++) {
+    bool resizing = map.resizing();
+    map.insert(hash(next), uint64_t(next), uint64_t(next));
+    live.push_back(next);
+    if (resizing or !map.resizing()) {
+      continue;
     }
 
-    buffer in{}, out{};
+    resizes++;
+    while (map.resizing() and live.size() > 1) {
+      size_t victim = random() % live.size();
+      uint64_t key = live[victim];
+      map.erase(*map.find(key, hash(key)));
+      live[victim] = live.back();
+      live.pop_back();
+      gone.push_back(key);
 
-    read_command(out);
-    std::cout << "writing: " << out.data() << std::endl;
-    if (0 > send(sock, out.data(), out.size(), 0)) {
-      throw std::runtime_error("failed to send data");
+      check(keys + random() % keys, false);
+      check(gone[random() % gone.size()], false);
+      check(live[random() % live.size()], true);
     }
+  }
+  for (auto key : live) {
+    check(key, true);
+  }
+  for (auto key : gone) {
+    check(key, false);
+  }
+  printf("map churn: %zu inserts, %zu erases during %zu resizes, every "
+         "lookup right\n",
+         keys, gone.size(), resizes);
+}
 
-    while (0 < read(sock, in.data(), in.size())) {
-      std::cout << "read:\n" << in.data() << std::endl;
-      auto response = client_parse(in);
-      std::cout << "response:\n" << response << std::endl;
+// fills a Storage with keys, reporting resident memory per key and the
+// latency distribution of the SETs that built it and of random GETs after
+static void bench_map(size_t keys, size_t value_size) {
+  const size_t GETS = 1000000;
+  const std::string value(value_size, 'v');
 
-      read_command(out);
-      std::cout << "writing:\n" << out.data() << std::endl;
+  std::vector<uint32_t> set_ns(keys), get_ns(GETS);
+  Storage storage;
+  OutputBuffer out;
+  Reply reply(out);
 
-      if (0 > send(sock, out.data(), out.size(), 0)) {
-        throw std::runtime_error("failed to send data");
-      }
-    }
+  auto percentiles = [](char const *name, std::vector<uint32_t> &samples) {
+    std::sort(samples.begin(), samples.end());
+    auto at = [&](double p) {
+      return samples[size_t(p * (samples.size() - 1))];
+    };
+    printf("%-4s p50 %6uns  p99 %6uns  p99.9 %6uns  max %8uns\n", name,
+           at(0.5), at(0.99), at(0.999), samples.back());
+  };
+
+  size_t before = resident_bytes();
+  std::string key;
+
+  for (size_t i = 0; i < keys; i++) {
+    key = "key:" + std::to_string(i);
+    auto start = std::chrono::steady_clock::now();
+    storage.set(key, value);
+    set_ns[i] = std::chrono::nanoseconds(std::chrono::steady_clock::now() -
+                                         start).count();
   }
 
-  void read_command(buffer &out) { strncpy(out.data(), "PING", out.size()); }
-};
+  size_t after = resident_bytes();
+  uint64_t state = 0x9e3779b97f4a7c15;
+
+  for (size_t i = 0; i < GETS; i++) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    key = "key:" + std::to_string(state % keys);
+    auto start = std::chrono::steady_clock::now();
+    storage.get(key, reply);
+    get_ns[i] = std::chrono::nanoseconds(std::chrono::steady_clock::now() -
+                                         start).count();
+    out.clear();
+  }
+
+  printf("%zu keys, %zu byte values, %.1f resident bytes per key\n", keys,
+         value_size, double(after - before) / keys);
+  percentiles("SET", set_ns);
+  percentiles("GET", get_ns);
+
+  check_map_churn(keys);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 and std::string_view(argv[1]) == "--bench-alloc") {
+    bench_alloc();
+    return 0;
+  }
+  if (argc > 1 and std::string_view(argv[1]) == "--bench-map") {
+    bench_map(argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000000,
+              argc > 3 ? strtoul(argv[3], nullptr, 10) : 32);
+    return 0;
+  }
+  if (argc > 1 and std::string_view(argv[1]) == "--bench-storage") {
+    size_t threads = argc > 2 ? strtoul(argv[2], nullptr, 10)
+                              : std::thread::hardware_concurrency();
+    bench_storage(std::max(1ul, threads));
+    return 0;
+  }
 
-int main() {
   try {
-    Client client;
-    client.handle_conn();
+    LoadConfig config(argc, argv);
+    auto report = run_load(config);
+
+    // JSON on stdout takes the place of the text, so it can be piped
+    if (config.json_path != "-") {
+      print_report(config, report);
+    }
+    if (!config.json_path.empty()) {
+      auto json = report_json(config, report);
+      if (config.json_path == "-") {
+        fputs(json.c_str(), stdout);
+      } else if (!(std::ofstream(config.json_path) << json)) {
+        throw std::runtime_error("failed to write " + config.json_path);
+      }
+    }
   } catch (std::runtime_error const &e) {
     std::cerr << "error: " << e.what() << std::endl;
+    return 1;
   }
 
   return 0;
@@ -1,438 +1,2930 @@
 #include "protocol.h"
 
 #include <algorithm>
-#include <iostream>
-#include <numeric>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <optional>
-#include <sstream>
+#include <span>
+#include <stdexcept>
 #include <string>
 #include <string_view>
-#include <tuple>
 #include <variant>
 #include <vector>
 
+#include "cluster.h"
+#include "collection.h"
 #include "elements.h"
+#include "info.h"
+#include "metrics.h"
+#include "pubsub.h"
+#include "replication.h"
+#include "slowlog.h"
+#include "snapshot.h"
 #include "storage.h"
+#include "tracking.h"
 
 namespace commands {
 
+using Args = std::span<std::string_view const>;
+
+// answers for a value that couldn't be reached or changed. false if it
+// could
+static bool refused(Storage::Access access, Reply &reply) {
+  if (access == Storage::Access::WRONGTYPE) {
+    reply.error(WRONGTYPE_ERROR);
+  } else if (access == Storage::Access::OOM) {
+    reply.error("OOM command not allowed when used memory > 'maxmemory'.");
+  } else if (access == Storage::Access::NOT_INTEGER) {
+    reply.error("ERR value is not an integer or out of range");
+  } else if (access == Storage::Access::OVERFLOW) {
+    reply.error("ERR increment or decrement would overflow");
+  } else {
+    return false;
+  }
+  return true;
+}
+
 struct Echo {
-  BulkString msg;
+  std::string_view msg;
 
-  Echo(BulkString &&msg) : msg(std::move(msg)) {}
+  Echo(std::string_view msg) : msg(msg) {}
 
-  void visit(Storage &storage, std::ostream &os) { os << msg; }
+  void visit(Storage &storage, Reply &reply) { reply.bulk_string(msg); }
 };
 
 struct Ping {
-  std::optional<BulkString> msg;
+  std::optional<std::string_view> msg;
 
   Ping() : msg(std::nullopt) {}
-  Ping(BulkString &&msg) : msg(std::move(msg)) {}
+  Ping(std::string_view msg) : msg(msg) {}
 
-  void visit(Storage &storage, std::ostream &os) {
+  void visit(Storage &storage, Reply &reply) {
     if (msg) {
-      os << *msg;
+      reply.bulk_string(*msg);
     } else {
-      os << SimpleString("PONG");
+      reply.simple_string("PONG");
     }
   }
 };
 
+struct Error {
+  std::string_view message;
+
+  Error(std::string_view message) : message(message) {}
+
+  void visit(Storage &storage, Reply &reply) { reply.error(message); }
+};
+
+// arguments are views into the connection's input buffer, only valid until
+// the command has been visited. storage copies whatever it keeps
 struct Set {
-  BulkString key;
-  BulkString value;
-  std::optional<BulkString> px;
+  std::string_view key;
+  std::string_view value;
+  int64_t expiry;
 
-  Set(BulkString &&key, BulkString &&value, std::optional<BulkString> &&px)
-      : key(std::move(key)), value(std::move(value)), px(std::move(px)) {}
+  Set(std::string_view key, std::string_view value, int64_t expiry)
+      : key(key), value(value), expiry(expiry) {}
 
-  void visit(Storage &storage, std::ostream &os) {
-    if (storage.set(std::move(key), std::move(value), px)) {
-      os << SimpleString("OK");
+  void visit(Storage &storage, Reply &reply) {
+    if (storage.set(key, value, expiry)) {
+      reply.simple_string("OK");
     } else {
-      os << std::optional<BulkString>();
+      reply.error("OOM command not allowed when used memory > 'maxmemory'.");
     }
   }
 };
 
 struct Get {
-  BulkString key;
+  std::string_view key;
 
-  Get(BulkString &&key) : key(std::move(key)) {}
+  Get(std::string_view key) : key(key) {}
 
-  void visit(Storage &storage, std::ostream &os) { os << storage.get(key); }
+  void visit(Storage &storage, Reply &reply) { storage.get(key, reply); }
 };
 
-using Command = std::variant<Ping, Echo, Set, Get>;
+// MGET key [key ...]
+struct MGet {
+  Args keys;
 
-struct Visitor {
-  std::ostream &os;
-  Storage &storage;
+  MGet(Args keys) : keys(keys) {}
 
-  Visitor(std::ostream &os, Storage &storage) : os(os), storage(storage) {}
+  void visit(Storage &storage, Reply &reply) { storage.mget(keys, reply); }
+};
+
+// MSET and MSETNX key value [key value ...]
+struct MSet {
+  Args pairs;
+  bool only_new;
 
-  template <typename Command>
-  void operator()(Command &command) {
-    command.visit(storage, os);
+  MSet(Args pairs, bool only_new) : pairs(pairs), only_new(only_new) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    auto set = storage.mset(pairs, only_new);
+    if (!set) {
+      reply.error("OOM command not allowed when used memory > 'maxmemory'.");
+    } else if (only_new) {
+      reply.integer(*set);
+    } else {
+      reply.simple_string("OK");
+    }
   }
 };
 
-}  // namespace commands
+// DEL and UNLINK key [key ...], which both free big values lazily
+struct Del {
+  Args keys;
 
-namespace parsers {
+  Del(Args keys) : keys(keys) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    reply.integer(storage.del(keys));
+  }
+};
 
-template <typename T>
-using Result = std::optional<std::pair<std::string_view, T>>;
+// EXISTS key [key ...]
+struct Exists {
+  Args keys;
 
-template <typename T>
-Result<T> result(std::string_view data, T &&t) {
-  return std::make_optional(std::make_pair(data, std::move(t)));
-}
+  Exists(Args keys) : keys(keys) {}
 
-auto tag(std::string_view tag) {
-  return [=](std::string_view data) -> Result<std::string_view> {
-    return data.starts_with(tag)
-               ? result(data.substr(tag.length()), data.substr(0, tag.length()))
-               : std::nullopt;
-  };
-}
+  void visit(Storage &storage, Reply &reply) {
+    reply.integer(storage.exists(keys));
+  }
+};
 
-Result<std::string_view> crlf(std::string_view data) {
-  return tag("\r\n")(data);
-}
+// the in-place string commands keep their whole argument list, which
+// storage logs as the change
 
-auto one_of(std::string_view one_of) {
-  return [=](std::string_view data) -> Result<char> {
-    if (!data.empty()) {
-      auto iter = std::find_if(one_of.begin(), one_of.end(),
-                               [=](char c) { return data.front() == c; });
+// INCR, DECR, INCRBY and DECRBY, with the delta already signed
+struct IncrBy {
+  Args args;
+  int64_t delta;
 
-      return iter != one_of.end() ? result(data.substr(1), *iter)
-                                  : std::nullopt;
+  IncrBy(Args args, int64_t delta) : args(args), delta(delta) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    int64_t value;
+    auto access = storage.incr(args[1], delta, args, value);
+    if (!refused(access, reply)) {
+      reply.integer(value);
     }
+  }
+};
 
-    return std::nullopt;
-  };
-}
+// APPEND key value
+struct Append {
+  Args args;
 
-template <typename... Parsers>
-auto alt(Parsers... parsers) {
-  return [=](std::string_view data) -> decltype(std::get<0>(
-                                        make_tuple(parsers...))("")) {
-    for (auto parser : {parsers...}) {
-      auto res = parser(data);
-      if (res) {
-        return res;
-      }
+  Append(Args args) : args(args) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    size_t length;
+    auto access = storage.append(args[1], args[2], args, length);
+    if (!refused(access, reply)) {
+      reply.integer(length);
     }
+  }
+};
 
-    return std::nullopt;
-  };
-}
+// SETRANGE key offset value
+struct SetRange {
+  Args args;
+  size_t offset;
 
-template <typename Parser1, typename Parser2>
-auto then(Parser1 parser1, Parser2 parser2) {
-  return [=](std::string_view data) -> decltype(parser2("")) {
-    auto res = parser1(data);
-    if (res) {
-      auto [data2, _] = *res;
+  SetRange(Args args, size_t offset) : args(args), offset(offset) {}
 
-      return parser2(data2);
+  void visit(Storage &storage, Reply &reply) {
+    size_t length;
+    auto access = storage.set_range(args[1], offset, args[3], args, length);
+    if (!refused(access, reply)) {
+      reply.integer(length);
     }
+  }
+};
 
-    return std::nullopt;
-  };
-}
+// GETSET key value
+struct GetSet {
+  std::string_view key;
+  std::string_view value;
 
-Result<size_t> number(std::string_view data) {
-  auto end = std::find_if_not(data.begin(), data.end(),
-                              [](char c) { return c >= '0' and c <= '9'; });
-  if (end != data.begin()) {
-    size_t size = std::accumulate(data.begin(), end, 0, [](size_t acc, char c) {
-      return acc * 10 + (c - '0');
-    });
+  GetSet(std::string_view key, std::string_view value)
+      : key(key), value(value) {}
 
-    return result(data.substr(end - data.begin()), std::move(size));
+  void visit(Storage &storage, Reply &reply) {
+    refused(storage.getset(key, value, reply), reply);
   }
+};
 
-  return std::nullopt;
-}
+// PUBLISH channel message
+struct Publish {
+  std::string_view channel;
+  std::string_view message;
 
-auto take_until(std::string_view until) {
-  return [=](std::string_view data) {
-    auto at = data.find(until);
+  Publish(std::string_view channel, std::string_view message)
+      : channel(channel), message(message) {}
 
-    return at != data.npos ? result(data.substr(at), data.substr(0, at))
-                           : std::nullopt;
-  };
-}
+  void visit(Storage &storage, Reply &reply) {
+    reply.integer(publish(channel, message));
+  }
+};
 
-Result<Element> simple_string(std::string_view data) {
-  auto res = tag("+")(data);
+// TTL and PTTL
+struct Ttl {
+  std::string_view key;
+  bool millis;
 
-  if (res) {
-    auto [data, _] = *res;
+  Ttl(std::string_view key, bool millis) : key(key), millis(millis) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    auto ttl = storage.ttl(key);
+    reply.integer(ttl < 0 or millis ? ttl : (ttl + 500) / 1000);
+  }
+};
 
-    if (res = take_until("\r\n")(data)) {
-      auto [data, string] = *res;
+// EXPIRE, PEXPIRE, EXPIREAT and PEXPIREAT, already made absolute
+struct Expire {
+  std::string_view key;
+  int64_t expiry;
 
-      if (res = crlf(data)) {
-        auto [data, __] = *res;
+  Expire(std::string_view key, int64_t expiry) : key(key), expiry(expiry) {}
 
-        return result(data, Element::simple_string(std::string(string)));
-      }
+  void visit(Storage &storage, Reply &reply) {
+    reply.integer(storage.expire(key, expiry));
+  }
+};
+
+struct Persist {
+  std::string_view key;
+
+  Persist(std::string_view key) : key(key) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    reply.integer(storage.persist(key));
+  }
+};
+
+// INFO [section]
+struct Info {
+  std::string_view section;
+
+  Info(std::string_view section) : section(section) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    reply.bulk_string(info(storage, section));
+  }
+};
+
+struct BgRewriteAof {
+  void visit(Storage &storage, Reply &reply) {
+    if (storage.request_rewrite()) {
+      reply.simple_string("Background append only file rewriting scheduled");
+    } else {
+      reply.error("ERR append only file is off");
     }
   }
+};
 
-  return std::nullopt;
-}
+struct Save {
+  void visit(Storage &storage, Reply &reply) {
+    try {
+      save_snapshot(storage);
+      reply.simple_string("OK");
+    } catch (std::runtime_error const &e) {
+      reply.error(std::string("ERR ") + e.what());
+    }
+  }
+};
+
+struct BgSave {
+  void visit(Storage &storage, Reply &reply) {
+    if (background_save(storage)) {
+      reply.simple_string("Background saving started");
+    } else {
+      reply.error("ERR Background save already in progress");
+    }
+  }
+};
 
-Result<Element> simple_error(std::string_view data) {
-  auto res = tag("-")(data);
+// PSYNC replid offset, sent by a replica. the worker hands the connection to
+// the primary once it's answered the rest of the batch
+struct Psync {
+  std::string_view replid;
+  int64_t offset;
 
-  if (res) {
-    auto [data, _] = *res;
+  Psync(std::string_view replid, int64_t offset)
+      : replid(replid), offset(offset) {}
 
-    if (res = take_until("\r\n")(data)) {
-      auto [data, string] = *res;
+  void visit(Storage &storage, Reply &reply) { request_psync(replid, offset); }
+};
+
+// collection commands keep their whole argument list, which storage logs as
+// the change when they make one
+
+// HSET key field value [field value ...]
+struct HSet {
+  Args args;
+
+  HSet(Args args) : args(args) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    size_t added = 0;
+    auto access = storage.write(args[1], Type::HASH, true, args,
+                                [&](DataCell &cell, Slab &arena) {
+                                  for (size_t i = 2; i < args.size(); i += 2) {
+                                    added += hashes::set(cell, args[i],
+                                                         args[i + 1], arena);
+                                  }
+                                  return true;
+                                });
+    if (!refused(access, reply)) {
+      reply.integer(added);
+    }
+  }
+};
+
+struct HGet {
+  std::string_view key;
+  std::string_view field;
 
-      if (res = crlf(data)) {
-        auto [data, _] = *res;
+  HGet(std::string_view key, std::string_view field) : key(key), field(field) {}
 
-        return result(data, Element::simple_error(std::string(string)));
+  void visit(Storage &storage, Reply &reply) {
+    auto access = storage.read(key, Type::HASH, [&](DataCell const &cell) {
+      if (auto value = hashes::get(cell, field)) {
+        reply.bulk_string(*value);
+      } else {
+        reply.null_bulk_string();
       }
+    });
+    if (access == Storage::Access::MISSING) {
+      reply.null_bulk_string();
+    }
+    refused(access, reply);
+  }
+};
+
+// HDEL key field [field ...]
+struct HDel {
+  Args args;
+
+  HDel(Args args) : args(args) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    size_t removed = 0;
+    auto access = storage.write(args[1], Type::HASH, false, args,
+                                [&](DataCell &cell, Slab &arena) {
+                                  for (size_t i = 2; i < args.size(); i++) {
+                                    removed +=
+                                        hashes::remove(cell, args[i], arena);
+                                  }
+                                  return removed > 0;
+                                });
+    if (!refused(access, reply)) {
+      reply.integer(removed);
     }
   }
+};
 
-  return std::nullopt;
-}
+struct HExists {
+  std::string_view key;
+  std::string_view field;
+
+  HExists(std::string_view key, std::string_view field)
+      : key(key), field(field) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    bool exists = false;
+    auto access = storage.read(key, Type::HASH, [&](DataCell const &cell) {
+      exists = hashes::get(cell, field).has_value();
+    });
+    if (!refused(access, reply)) {
+      reply.integer(exists);
+    }
+  }
+};
 
-Result<Element> integer(std::string_view data) {
-  auto res = tag(":")(data);
+struct HGetAll {
+  std::string_view key;
 
-  if (res) {
-    auto [data, _] = *res;
-    auto res = one_of("+-")(data);
+  HGetAll(std::string_view key) : key(key) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    auto access = storage.read(key, Type::HASH, [&](DataCell const &cell) {
+      reply.array(2 * collection_size(cell));
+      hashes::for_each(cell, [&](auto field, auto value) {
+        reply.bulk_string(field);
+        reply.bulk_string(value);
+      });
+    });
+    if (access == Storage::Access::MISSING) {
+      reply.array(0);
+    }
+    refused(access, reply);
+  }
+};
 
-    if (res) {
-      auto [data, sign] = *res;
-      auto res = number(data);
+// HLEN, LLEN, SCARD and ZCARD
+struct Size {
+  std::string_view key;
+  Type type;
 
-      if (res) {
-        auto [data, number] = *res;
+  Size(std::string_view key, Type type) : key(key), type(type) {}
 
-        auto res = crlf(data);
-        if (res) {
-          auto [data, _] = *res;
-          int64_t integer = sign == '+' ? number : -(int64_t)number;
+  void visit(Storage &storage, Reply &reply) {
+    size_t size = 0;
+    auto access = storage.read(key, type, [&](DataCell const &cell) {
+      size = collection_size(cell);
+    });
+    if (!refused(access, reply)) {
+      reply.integer(size);
+    }
+  }
+};
 
-          return result(data, Element::integer(integer));
-        }
+// LPUSH and RPUSH key item [item ...]
+struct Push {
+  Args args;
+  bool front;
+
+  Push(Args args, bool front) : args(args), front(front) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    size_t size = 0;
+    auto access = storage.write(args[1], Type::LIST, true, args,
+                                [&](DataCell &cell, Slab &arena) {
+                                  for (size_t i = 2; i < args.size(); i++) {
+                                    lists::push(cell, args[i], front, arena);
+                                  }
+                                  size = collection_size(cell);
+                                  return true;
+                                });
+    if (!refused(access, reply)) {
+      reply.integer(size);
+    }
+  }
+};
+
+// LPOP and RPOP key [count]
+struct Pop {
+  Args args;
+  bool front;
+  std::optional<size_t> count;
+
+  Pop(Args args, bool front, std::optional<size_t> count)
+      : args(args), front(front), count(count) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    auto access = storage.write(
+        args[1], Type::LIST, false, args, [&](DataCell &cell, Slab &arena) {
+          size_t n = std::min(count.value_or(1), collection_size(cell));
+          if (count) {
+            reply.array(n);
+          }
+          for (size_t i = 0; i < n; i++) {
+            lists::pop(cell, front, reply, arena);
+          }
+          return n > 0;
+        });
+    if (access == Storage::Access::MISSING) {
+      count ? reply.null_array() : reply.null_bulk_string();
+    }
+    refused(access, reply);
+  }
+};
+
+// LRANGE key start stop, counting negative indices from the end
+struct LRange {
+  std::string_view key;
+  int64_t start;
+  int64_t stop;
+
+  LRange(std::string_view key, int64_t start, int64_t stop)
+      : key(key), start(start), stop(stop) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    auto access = storage.read(key, Type::LIST, [&](DataCell const &cell) {
+      int64_t size = collection_size(cell);
+      int64_t from = std::max<int64_t>(start < 0 ? size + start : start, 0);
+      int64_t to = std::min(stop < 0 ? size + stop : stop, size - 1);
+      if (from > to) {
+        reply.array(0);
+        return;
       }
+      reply.array(to - from + 1);
+      lists::range(cell, from, to,
+                   [&](std::string_view item) { reply.bulk_string(item); });
+    });
+    if (access == Storage::Access::MISSING) {
+      reply.array(0);
     }
+    refused(access, reply);
   }
+};
 
-  return std::nullopt;
-}
+// SADD and SREM key member [member ...]
+struct SetMembers {
+  Args args;
+  bool add;
+
+  SetMembers(Args args, bool add) : args(args), add(add) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    size_t changed = 0;
+    auto access = storage.write(args[1], Type::SET, add, args,
+                                [&](DataCell &cell, Slab &arena) {
+                                  for (size_t i = 2; i < args.size(); i++) {
+                                    changed +=
+                                        add ? sets::add(cell, args[i], arena)
+                                            : sets::remove(cell, args[i],
+                                                           arena);
+                                  }
+                                  return changed > 0;
+                                });
+    if (!refused(access, reply)) {
+      reply.integer(changed);
+    }
+  }
+};
+
+struct SIsMember {
+  std::string_view key;
+  std::string_view member;
 
-Result<Element> bulk_string(std::string_view data) {
-  auto res = then(tag("$"), number)(data);
+  SIsMember(std::string_view key, std::string_view member)
+      : key(key), member(member) {}
 
-  if (res) {
-    auto [data, size] = *res;
-    auto res = then(tag("-1"), crlf)(data);
+  void visit(Storage &storage, Reply &reply) {
+    bool member_of = false;
+    auto access = storage.read(key, Type::SET, [&](DataCell const &cell) {
+      member_of = sets::contains(cell, member);
+    });
+    if (!refused(access, reply)) {
+      reply.integer(member_of);
+    }
+  }
+};
+
+struct SMembers {
+  std::string_view key;
+
+  SMembers(std::string_view key) : key(key) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    auto access = storage.read(key, Type::SET, [&](DataCell const &cell) {
+      reply.array(collection_size(cell));
+      sets::for_each(cell, [&](std::string_view member) {
+        reply.bulk_string(member);
+      });
+    });
+    if (access == Storage::Access::MISSING) {
+      reply.array(0);
+    }
+    refused(access, reply);
+  }
+};
 
-    if (res) {
-      auto [data, _] = *res;
+// ZADD key [NX|XX] [CH] score member [score member ...], with the scores
+// already checked
+struct ZAdd {
+  Args args;
+  size_t first;
+  bool nx;
+  bool xx;
+  bool ch;
+
+  ZAdd(Args args, size_t first, bool nx, bool xx, bool ch)
+      : args(args), first(first), nx(nx), xx(xx), ch(ch) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    size_t added = 0, updated = 0;
+    auto access = storage.write(
+        args[1], Type::ZSET, !xx, args, [&](DataCell &cell, Slab &arena) {
+          for (size_t i = first; i < args.size(); i += 2) {
+            auto score = *parse_score(args[i]);
+            auto old = zsets::score(cell, args[i + 1]);
+            if ((old and nx) or (!old and xx)) {
+              continue;
+            }
+            if (!old) {
+              added += zsets::add(cell, args[i + 1], score, arena);
+            } else if (*old != score) {
+              zsets::add(cell, args[i + 1], score, arena);
+              updated++;
+            }
+          }
+          return added + updated > 0;
+        });
+    if (!refused(access, reply)) {
+      reply.integer(ch ? added + updated : added);
+    }
+  }
+};
 
-      return result(data, Element::null_bulk_string());
+// ZREM key member [member ...]
+struct ZRem {
+  Args args;
+
+  ZRem(Args args) : args(args) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    size_t removed = 0;
+    auto access = storage.write(args[1], Type::ZSET, false, args,
+                                [&](DataCell &cell, Slab &arena) {
+                                  for (size_t i = 2; i < args.size(); i++) {
+                                    removed +=
+                                        zsets::remove(cell, args[i], arena);
+                                  }
+                                  return removed > 0;
+                                });
+    if (!refused(access, reply)) {
+      reply.integer(removed);
     }
+  }
+};
+
+struct ZScore {
+  std::string_view key;
+  std::string_view member;
 
-    if (res = crlf(data)) {
-      auto [data, _] = *res;
+  ZScore(std::string_view key, std::string_view member)
+      : key(key), member(member) {}
 
-      if (data.length() >= size) {
-        auto string = data.substr(0, size);
-        data = data.substr(size);
+  void visit(Storage &storage, Reply &reply) {
+    auto access = storage.read(key, Type::ZSET, [&](DataCell const &cell) {
+      if (auto score = zsets::score(cell, member)) {
+        ScoreBuffer scratch;
+        reply.bulk_string(format_score(*score, scratch));
+      } else {
+        reply.null_bulk_string();
+      }
+    });
+    if (access == Storage::Access::MISSING) {
+      reply.null_bulk_string();
+    }
+    refused(access, reply);
+  }
+};
 
-        if (res = crlf(data)) {
-          auto [data, __] = *res;
+// ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count]
+struct ZRangeByScore {
+  std::string_view key;
+  zsets::Bound min;
+  zsets::Bound max;
+  bool with_scores;
+  size_t offset;
+  // negative for no limit
+  int64_t count;
+
+  ZRangeByScore(std::string_view key, zsets::Bound min, zsets::Bound max,
+                bool with_scores, size_t offset, int64_t count)
+      : key(key),
+        min(min),
+        max(max),
+        with_scores(with_scores),
+        offset(offset),
+        count(count) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    // one per worker thread, since the reply's length has to come first
+    thread_local std::vector<std::pair<std::string_view, double>> found;
+
+    auto access = storage.read(key, Type::ZSET, [&](DataCell const &cell) {
+      found.clear();
+      size_t skipped = 0;
+      zsets::range_by_score(cell, min, max, [&](auto member, double score) {
+        if (skipped < offset) {
+          skipped++;
+          return true;
+        }
+        found.emplace_back(member, score);
+        return count < 0 or found.size() < size_t(count);
+      });
+      if (count == 0) {
+        found.clear();
+      }
 
-          return result(data, Element::bulk_string(std::string(string)));
+      reply.array(with_scores ? 2 * found.size() : found.size());
+      for (auto [member, score] : found) {
+        reply.bulk_string(member);
+        if (with_scores) {
+          ScoreBuffer scratch;
+          reply.bulk_string(format_score(score, scratch));
         }
       }
+    });
+    if (access == Storage::Access::MISSING) {
+      reply.array(0);
     }
+    refused(access, reply);
   }
+};
 
-  return std::nullopt;
-}
+struct TypeOf {
+  std::string_view key;
 
-Result<Element> element(std::string_view data);
+  TypeOf(std::string_view key) : key(key) {}
 
-Result<Element> array(std::string_view data) {
-  auto res = then(tag("*"), number)(data);
+  void visit(Storage &storage, Reply &reply) {
+    auto described = storage.describe(key);
+    reply.simple_string(described ? type_name(described->first) : "none");
+  }
+};
 
-  if (res) {
-    auto [data2, size] = *res;
+// OBJECT ENCODING key
+struct ObjectEncoding {
+  std::string_view key;
 
-    auto res = then(tag("-1"), crlf)(data);
-    if (res) {
-      auto [data, _] = *res;
+  ObjectEncoding(std::string_view key) : key(key) {}
 
-      return result(data, Element::null_bulk_string());
+  void visit(Storage &storage, Reply &reply) {
+    if (auto described = storage.describe(key)) {
+      reply.bulk_string(described->second);
+    } else {
+      reply.null_bulk_string();
     }
+  }
+};
 
-    if (res = crlf(data2)) {
-      auto [data, _] = *res;
+// SCAN cursor [MATCH pattern] [COUNT count] [TYPE type]
+struct Scan {
+  uint64_t cursor;
+  std::optional<std::string_view> pattern;
+  size_t count;
+  std::optional<Type> type;
+
+  Scan(uint64_t cursor, std::optional<std::string_view> pattern, size_t count,
+       std::optional<Type> type)
+      : cursor(cursor), pattern(pattern), count(count), type(type) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    // copied out, since the shard is unlocked before the reply is written
+    thread_local std::vector<std::string> found;
+
+    auto next = storage.scan(cursor, count, [&](auto key, auto key_type) {
+      if ((!type or key_type == *type) and
+          (!pattern or glob_match(*pattern, key))) {
+        found.emplace_back(key);
+      }
+    });
 
-      std::vector<Element> array;
-      array.reserve(size);
+    reply.array(2);
+    reply.bulk_string(std::to_string(next));
+    reply.array(found.size());
+    for (auto &key : found) {
+      reply.bulk_string(key);
+    }
+    found.clear();
+  }
+};
 
-      for (size_t i = 0; i < size; i++) {
-        auto res = element(data);
+// keys KEYS asks each scan call for
+const size_t KEYS_BATCH = 1024;
 
-        if (res) {
-          auto [new_data, element] = std::move(*res);
+// KEYS pattern, as a whole scan, so no shard is locked for longer than a
+// SCAN would lock it
+struct Keys {
+  std::string_view pattern;
 
-          array.push_back(std::move(element));
-          data = new_data;
+  Keys(std::string_view pattern) : pattern(pattern) {}
 
-        } else {
-          return std::nullopt;
+  void visit(Storage &storage, Reply &reply) {
+    std::vector<std::string> found;
+    uint64_t cursor = 0;
+    do {
+      cursor = storage.scan(cursor, KEYS_BATCH, [&](auto key, auto) {
+        if (glob_match(pattern, key)) {
+          found.emplace_back(key);
         }
-      }
+      });
+    } while (cursor);
+
+    // a map that resized during the scan may have shown a key twice
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
 
-      return result(data, Element::array(std::move(array)));
+    reply.array(found.size());
+    for (auto &key : found) {
+      reply.bulk_string(key);
     }
   }
+};
 
-  return std::nullopt;
-}
+struct DbSize {
+  void visit(Storage &storage, Reply &reply) {
+    reply.integer(storage.size());
+  }
+};
 
-Result<Element> null(std::string_view data) {
-  auto res = then(tag("_"), crlf)(data);
+// FLUSHALL and FLUSHDB [ASYNC | SYNC]
+struct FlushAll {
+  Args command;
+  bool async;
 
-  if (res) {
-    auto [data, _] = *res;
+  FlushAll(Args command, bool async) : command(command), async(async) {}
 
-    return result(data, Element::null());
+  void visit(Storage &storage, Reply &reply) {
+    storage.flush(async, command);
+    reply.simple_string("OK");
   }
+};
 
-  return std::nullopt;
-}
+// COMMAND, COMMAND COUNT and COMMAND INFO [name ...], answered from the
+// registry in parsers
+struct CommandInfo {
+  Args names;
+  // false to describe every command
+  bool named;
+  bool count;
 
-Result<Element> element(std::string_view data) {
-  return alt(simple_string, simple_error, integer, bulk_string, array,
-             null)(data);
-}
+  CommandInfo(Args names, bool named, bool count)
+      : names(names), named(named), count(count) {}
 
-Result<commands::Command> parse_command(std::string_view data) {
-  auto res = array(data);
+  void visit(Storage &storage, Reply &reply);
+};
 
-  if (res) {
-    auto [data, element] = std::move(*res);
+// SLOWLOG GET [count], SLOWLOG LEN and SLOWLOG RESET
+struct Slowlog {
+  enum Action { GET, LEN, RESET };
+  Action action;
+  size_t count;
 
-    try {
-      auto array = element.get_array();
+  Slowlog(Action action, size_t count = 0) : action(action), count(count) {}
 
-      if (!array.empty()) {
-        auto command_name = array[0].get_bulk_string();
+  void visit(Storage &storage, Reply &reply) {
+    if (action == LEN) {
+      reply.integer(slowlog_len());
+      return;
+    }
+    if (action == RESET) {
+      slowlog_reset();
+      reply.simple_string("OK");
+      return;
+    }
 
-        if (command_name) {
-          auto cmp = [](std::string_view lhs, std::string_view rhs) {
-            auto right = rhs.begin();
+    auto entries = slowlog_get(count);
+    reply.array(entries.size());
+    for (auto &entry : entries) {
+      reply.array(6);
+      reply.integer(entry.id);
+      reply.integer(entry.time);
+      reply.integer(entry.micros);
+      reply.array(entry.args.size());
+      for (auto &arg : entry.args) {
+        reply.bulk_string(arg);
+      }
+      reply.bulk_string(entry.client);
+      // the client name, which there's no CLIENT SETNAME to set
+      reply.bulk_string("");
+    }
+  }
+};
 
-            return lhs.length() == rhs.length() and
-                   std::all_of(lhs.begin(), lhs.end(), [&](char left) {
-                     return std::toupper(left) == *(right++);
-                   });
-          };
+// CLUSTER and its subcommands, see cluster.h. arg, number and slots hold
+// what the subcommand was given
+struct ClusterCommand {
+  enum Action {
+    INFO,
+    MYID,
+    MEET,
+    NODES,
+    SLOTS,
+    SHARDS,
+    ADDSLOTS,
+    SETSLOT,
+    KEYSLOT,
+    COUNTKEYSINSLOT,
+    GETKEYSINSLOT,
+    GOSSIP,
+  };
+  Action action;
+  std::string_view arg;
+  int64_t number;
+  std::vector<uint16_t> slots;
+  Cluster::SlotState state;
+
+  ClusterCommand(Action action, std::string_view arg = {}, int64_t number = 0,
+                 std::vector<uint16_t> slots = {},
+                 Cluster::SlotState state = Cluster::SlotState::STABLE)
+      : action(action),
+        arg(arg),
+        number(number),
+        slots(std::move(slots)),
+        state(state) {}
+
+  void visit(Storage &storage, Reply &reply);
+};
 
-          auto command_name_is = [&](std::string_view rhs) {
-            return cmp(command_name->view(), rhs);
-          };
+struct Dump {
+  std::string_view key;
 
-          if (command_name_is("PING")) {
-            if (array.size() >= 2) {
-              auto arg = array[1].get_bulk_string();
+  Dump(std::string_view key) : key(key) {}
 
-              return arg ? result(data, commands::Ping(std::move(*arg)))
-                         : result(data, commands::Ping());
-            } else {
-              return result(data, commands::Ping());
-            }
+  void visit(Storage &storage, Reply &reply) {
+    thread_local std::string payload;
+    payload.clear();
+    if (storage.dump(key, payload)) {
+      reply.bulk_string(payload);
+    } else {
+      reply.null_bulk_string();
+    }
+  }
+};
 
-          } else if (command_name_is("ECHO")) {
-            if (array.size() >= 2) {
-              auto arg = array[1].get_bulk_string();
+// RESTORE and RESTORE-ASKING key ttl payload [REPLACE] [ABSTTL], where expiry
+// is absolute already
+struct Restore {
+  std::string_view key;
+  int64_t expiry;
+  std::string_view payload;
+  bool replace;
+
+  Restore(std::string_view key, int64_t expiry, std::string_view payload,
+          bool replace)
+      : key(key), expiry(expiry), payload(payload), replace(replace) {}
+
+  void visit(Storage &storage, Reply &reply) {
+    thread_local std::vector<std::string_view> elements;
+    auto type = snapshot::parse_payload(payload, elements);
+    if (!type) {
+      reply.error("ERR DUMP payload version or checksum are wrong");
+      return;
+    }
 
-              if (arg) {
-                return result(data, commands::Echo(std::move(*arg)));
-              }
-            }
+    std::string_view keys[] = {key};
+    bool busy = false, malformed = false;
+    storage.atomically(keys, false, [&] {
+      if (!replace and storage.exists(keys)) {
+        busy = true;
+        return;
+      }
+      storage.del(keys);
+      // a key restored already expired is only deleted, like redis
+      if (expiry != NO_EXPIRY and expiry <= now_ms()) {
+        return;
+      }
+      if (*type == Type::STRING) {
+        storage.load(key, elements[0], expiry);
+      } else {
+        malformed = !storage.load(key, *type, elements, expiry);
+      }
+    });
 
-          } else if (command_name_is("SET")) {
-            if (array.size() >= 3) {
-              auto key = array[1].get_bulk_string();
-              auto value = array[2].get_bulk_string();
-
-              if (key and value) {
-                if (array.size() >= 4) {
-                  auto px_label = array[3].get_bulk_string();
-
-                  if (px_label and cmp(px_label->view(), "PX")) {
-                    if (array.size() >= 5) {
-                      auto px = array[4].get_bulk_string();
-
-                      if (px) {
-                        return result(data, commands::Set(std::move(*key),
-                                                          std::move(*value),
-                                                          std::move(*px)));
-                      }
-                    }
-                  }
-                } else {
-                  return result(
-                      data, commands::Set(std::move(*key), std::move(*value),
-                                          std::nullopt));
-                }
-              }
-            }
-          } else if (command_name_is("GET")) {
-            if (array.size() >= 2) {
-              auto key = array[1].get_bulk_string();
+    if (busy) {
+      reply.error("BUSYKEY Target key name already exists.");
+    } else if (malformed) {
+      reply.error("ERR Bad data format");
+    } else {
+      reply.simple_string("OK");
+    }
+  }
+};
 
-              if (key) {
-                return result(data, commands::Get(std::move(*key)));
-              }
-            }
-          }
-        }
-      }
-    } catch (std::bad_variant_access) {
+// MIGRATE host port key|"" db timeout [COPY] [REPLACE] [KEYS key ...]:
+// moves the keys to another node with RESTORE-ASKING. their shards are
+// only held to dump them and to delete them after, so they keep serving
+// while the target answers, and a key written in between is sent again
+struct Migrate {
+  std::string host;
+  uint16_t port;
+  std::chrono::milliseconds timeout;
+  bool copy;
+  bool replace;
+  Args keys;
+
+  Migrate(std::string_view host, uint16_t port,
+          std::chrono::milliseconds timeout, bool copy, bool replace,
+          Args keys)
+      : host(host),
+        port(port),
+        timeout(timeout),
+        copy(copy),
+        replace(replace),
+        keys(keys) {}
+
+  void visit(Storage &storage, Reply &reply);
+};
+
+using Command =
+    std::variant<Ping, Echo, Error, Set, Get, MGet, MSet, Del, Exists, IncrBy,
+                 Append, SetRange, GetSet, Publish, Ttl, Expire, Persist, Info,
+                 BgRewriteAof, Save, BgSave, Psync,
+                 HSet, HGet, HDel, HExists, HGetAll, Size, Push, Pop, LRange,
+                 SetMembers, SIsMember, SMembers, ZAdd, ZRem, ZScore,
+                 ZRangeByScore, TypeOf, ObjectEncoding, Scan, Keys, DbSize,
+                 FlushAll, CommandInfo, Slowlog, ClusterCommand, Dump,
+                 Restore, Migrate>;
+
+}  // namespace commands
+
+namespace parsers {
+
+// redis refuses bulk strings over 512MB and so do we
+const size_t MAX_BULK_LEN = 512 * 1024 * 1024;
+const size_t MAX_LINE_LEN = 64 * 1024;
+const int64_t MAX_ARGS = 1024 * 1024;
+
+const size_t INCOMPLETE = 0;
+const size_t MALFORMED = std::string_view::npos;
+
+// splits the command at the front of data into its arguments, as views that
+// point straight into data, so nothing is copied or allocated once args has
+// grown to fit. returns how many bytes the command spans, INCOMPLETE if more
+// bytes are needed or MALFORMED if it can never parse
+size_t parse_args(std::string_view data, std::vector<std::string_view> &args) {
+  args.clear();
+
+  // reads the "<prefix><number>\r\n" line at pos, returning the position
+  // after it
+  auto header = [&](size_t pos, char prefix, int64_t &number) -> size_t {
+    if (pos >= data.length()) {
+      return INCOMPLETE;
+    }
+    if (data[pos] != prefix) {
+      return MALFORMED;
+    }
+
+    auto line_end = data.find("\r\n", pos);
+    if (line_end == data.npos) {
+      return data.length() - pos > MAX_LINE_LEN ? MALFORMED : INCOMPLETE;
+    }
+
+    auto begin = data.data() + pos + 1, end = data.data() + line_end;
+    auto res = std::from_chars(begin, end, number);
+
+    return res.ec == std::errc() and res.ptr == end ? line_end + 2 : MALFORMED;
+  };
+
+  int64_t count;
+  size_t pos = header(0, '*', count);
+
+  if (pos == INCOMPLETE or pos == MALFORMED) {
+    return pos;
+  }
+  if (count > MAX_ARGS) {
+    return MALFORMED;
+  }
+
+  for (int64_t i = 0; i < count; i++) {
+    int64_t len;
+    pos = header(pos, '$', len);
+
+    if (pos == INCOMPLETE or pos == MALFORMED) {
+      return pos;
+    }
+    if (len < 0 or len > (int64_t)MAX_BULK_LEN) {
+      return MALFORMED;
     }
+    if (data.length() < pos + len + 2) {
+      return INCOMPLETE;
+    }
+    if (data.substr(pos + len, 2) != "\r\n") {
+      return MALFORMED;
+    }
+
+    args.push_back(data.substr(pos, len));
+    pos += len + 2;
   }
 
-  return std::nullopt;
+  return pos;
 }
 
-};  // namespace parsers
+const std::string_view NOT_INTEGER =
+    "ERR value is not an integer or out of range";
+const std::string_view SYNTAX_ERROR = "ERR syntax error";
 
-void server_transact(Storage &storage, buffer const &in, std::string &out) {
-  auto res = parsers::parse_command(in.begin());
-  std::ostringstream oss(std::move(out), std::ios_base::trunc);
+std::optional<int64_t> integer_arg(std::string_view arg) {
+  int64_t integer;
+  auto res = std::from_chars(arg.begin(), arg.end(), integer);
 
-  if (res) {
-    auto [_, command] = std::move(*res);
-    commands::Visitor visitor(oss, storage);
+  return res.ec == std::errc() and res.ptr == arg.end()
+             ? std::make_optional(integer)
+             : std::nullopt;
+}
 
-    std::visit(visitor, command);
-  } else {
-    oss << SimpleError("server error");
+// how deep replies may nest before the stream counts as malformed, which
+// bounds the recursion
+const size_t MAX_REPLY_DEPTH = 128;
+
+// reads the reply at pos, returning the position after it, INCOMPLETE or
+// MALFORMED. RESP3 types come out as their nearest Element: doubles and big
+// numbers as their text, booleans as 0 or 1, blob errors as errors,
+// verbatim strings without their format, and maps, sets and pushes as flat
+// arrays. attributes are skipped
+size_t parse_reply(std::string_view data, size_t pos, Element *reply,
+                   size_t depth = 0) {
+  if (pos >= data.length()) {
+    return INCOMPLETE;
+  }
+  auto line_end = data.find("\r\n", pos);
+  if (line_end == data.npos) {
+    return data.length() - pos > MAX_LINE_LEN ? MALFORMED : INCOMPLETE;
+  }
+
+  char type = data[pos];
+  auto line = data.substr(pos + 1, line_end - pos - 1);
+  pos = line_end + 2;
+
+  switch (type) {
+    case '+':
+    case ',':
+    case '(':
+      if (reply) {
+        *reply = Element::simple_string(std::string(line));
+      }
+      return pos;
+    case '-':
+      if (reply) {
+        *reply = Element::simple_error(std::string(line));
+      }
+      return pos;
+    case ':': {
+      auto integer = integer_arg(line);
+      if (!integer) {
+        return MALFORMED;
+      }
+      if (reply) {
+        *reply = Element::integer(*integer);
+      }
+      return pos;
+    }
+    case '#':
+      if (line != "t" and line != "f") {
+        return MALFORMED;
+      }
+      if (reply) {
+        *reply = Element::integer(line == "t");
+      }
+      return pos;
+    case '_':
+      if (!line.empty()) {
+        return MALFORMED;
+      }
+      if (reply) {
+        *reply = Element::null();
+      }
+      return pos;
+    case '$':
+    case '!':
+    case '=': {
+      auto len = integer_arg(line);
+      if (type == '$' and len == -1) {
+        if (reply) {
+          *reply = Element::null_bulk_string();
+        }
+        return pos;
+      }
+      if (!len or *len < 0 or *len > (int64_t)MAX_BULK_LEN or
+          (type == '=' and *len < 4)) {
+        return MALFORMED;
+      }
+      if (data.length() < pos + *len + 2) {
+        return INCOMPLETE;
+      }
+      if (data.substr(pos + *len, 2) != "\r\n") {
+        return MALFORMED;
+      }
+
+      auto string = data.substr(pos, *len);
+      if (reply and type == '$') {
+        *reply = Element::bulk_string(std::string(string));
+      } else if (reply and type == '!') {
+        *reply = Element::simple_error(std::string(string));
+      } else if (reply) {
+        *reply = Element::bulk_string(std::string(string.substr(4)));
+      }
+      return pos + *len + 2;
+    }
+    case '*':
+    case '~':
+    case '>':
+    case '%':
+    case '|': {
+      auto count = integer_arg(line);
+      if (type == '*' and count == -1) {
+        if (reply) {
+          *reply = Element::null();
+        }
+        return pos;
+      }
+      if (!count or *count < 0 or *count > MAX_ARGS or
+          depth == MAX_REPLY_DEPTH) {
+        return MALFORMED;
+      }
+      if (type == '%' or type == '|') {
+        *count *= 2;
+      }
+
+      std::vector<Element> elements;
+      auto element = Element::null();
+      for (int64_t i = 0; i < *count; i++) {
+        bool decode = reply and type != '|';
+        pos = parse_reply(data, pos, decode ? &element : nullptr, depth + 1);
+        if (pos == INCOMPLETE or pos == MALFORMED) {
+          return pos;
+        }
+        if (decode) {
+          elements.push_back(std::move(element));
+        }
+      }
+
+      if (type == '|') {
+        return parse_reply(data, pos, reply, depth);
+      }
+      if (reply) {
+        *reply = Element::array(std::move(elements));
+      }
+      return pos;
+    }
+    default:
+      return MALFORMED;
+  }
+}
+
+// turns a relative or absolute time in seconds or milliseconds into an
+// absolute unix time in milliseconds, or nullopt if that overflows
+std::optional<int64_t> absolute_expiry(int64_t time, bool millis,
+                                       bool absolute) {
+  int64_t expiry;
+
+  if (!millis and __builtin_mul_overflow(time, 1000, &expiry)) {
+    return std::nullopt;
+  }
+  expiry = millis ? time : expiry;
+  if (!absolute and __builtin_add_overflow(expiry, now_ms(), &expiry)) {
+    return std::nullopt;
+  }
+  return expiry;
+}
+
+// a ZRANGEBYSCORE bound: a score, exclusive if it starts with '('
+std::optional<zsets::Bound> score_bound(std::string_view arg) {
+  bool exclusive = arg.starts_with('(');
+  if (auto score = parse_score(exclusive ? arg.substr(1) : arg)) {
+    return zsets::Bound{*score, exclusive};
+  }
+  return std::nullopt;
+}
+
+// ascii only, unlike std::toupper, which consults the locale
+constexpr char upcase(char c) {
+  return c >= 'a' and c <= 'z' ? c - ('a' - 'A') : c;
+}
+
+constexpr char downcase(char c) {
+  return c >= 'A' and c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// compares an argument to an uppercase keyword, ignoring its case
+bool arg_is(std::string_view arg, std::string_view keyword) {
+  return arg.length() == keyword.length() and
+         std::equal(arg.begin(), arg.end(), keyword.begin(),
+                    [](char c, char k) { return upcase(c) == k; });
+}
+
+using commands::Args;
+using commands::Command;
+
+Command parse_set(std::string_view name, Args args) {
+  int64_t expiry = NO_EXPIRY;
+  bool has_expiry = false;
+
+  for (size_t i = 3; i < args.size(); i++) {
+    bool ex = arg_is(args[i], "EX"), px = arg_is(args[i], "PX"),
+         exat = arg_is(args[i], "EXAT"), pxat = arg_is(args[i], "PXAT");
+
+    if (arg_is(args[i], "KEEPTTL") and !has_expiry) {
+      expiry = KEEP_TTL;
+      has_expiry = true;
+
+    } else if ((ex or px or exat or pxat) and i + 1 < args.size() and
+               !has_expiry) {
+      auto time = integer_arg(args[++i]);
+      if (!time) {
+        return commands::Error(NOT_INTEGER);
+      }
+
+      auto absolute = absolute_expiry(*time, px or pxat, exat or pxat);
+      if (*time <= 0 or !absolute) {
+        return commands::Error("ERR invalid expire time in 'set' command");
+      }
+      expiry = *absolute;
+      has_expiry = true;
+
+    } else {
+      return commands::Error(SYNTAX_ERROR);
+    }
+  }
+
+  return commands::Set(args[1], args[2], expiry);
+}
+
+// MSET and MSETNX
+Command parse_mset(std::string_view name, Args args) {
+  if (args.size() % 2 == 0) {
+    return commands::Error(
+        name == "MSET" ? "ERR wrong number of arguments for 'mset' command"
+                       : "ERR wrong number of arguments for 'msetnx' command");
+  }
+  return commands::MSet(args.subspan(1), name == "MSETNX");
+}
+
+// INCR, DECR, INCRBY and DECRBY
+Command parse_incr(std::string_view name, Args args) {
+  int64_t delta = 1;
+  if (args.size() == 3) {
+    auto by = integer_arg(args[2]);
+    if (!by) {
+      return commands::Error(NOT_INTEGER);
+    }
+    delta = *by;
+  }
+  if (name.starts_with('D')) {
+    if (delta == INT64_MIN) {
+      return commands::Error("ERR decrement would overflow");
+    }
+    delta = -delta;
+  }
+  return commands::IncrBy(args, delta);
+}
+
+// like redis's proto-max-bulk-len
+const size_t STRING_MAX = 512 * 1024 * 1024;
+
+Command parse_setrange(std::string_view name, Args args) {
+  auto offset = integer_arg(args[2]);
+  if (!offset) {
+    return commands::Error(NOT_INTEGER);
+  }
+  if (*offset < 0) {
+    return commands::Error("ERR offset is out of range");
+  }
+  if ((uint64_t)*offset + args[3].length() > STRING_MAX) {
+    return commands::Error(
+        "ERR string exceeds maximum allowed size (proto-max-bulk-len)");
+  }
+  return commands::SetRange(args, *offset);
+}
+
+// the session commands are answered by server_transact, unless there's no
+// session to act on
+Command parse_session(std::string_view name, Args args) {
+  return commands::Error("ERR this command needs a client connection");
+}
+
+// EXPIRE, PEXPIRE, EXPIREAT and PEXPIREAT
+Command parse_expire(std::string_view name, Args args) {
+  auto time = integer_arg(args[2]);
+  if (!time) {
+    return commands::Error(NOT_INTEGER);
+  }
+
+  bool millis = name.starts_with('P');
+  bool absolute = name.ends_with("AT");
+  auto expiry = absolute_expiry(*time, millis, absolute);
+  if (!expiry) {
+    return commands::Error("ERR invalid expire time in 'expire' command");
+  }
+  return commands::Expire(args[1], *expiry);
+}
+
+Command parse_psync(std::string_view name, Args args) {
+  auto offset = integer_arg(args[2]);
+  if (!offset) {
+    return commands::Error(NOT_INTEGER);
+  }
+  return commands::Psync(args[1], *offset);
+}
+
+// HLEN, LLEN, SCARD and ZCARD
+Command parse_size(std::string_view name, Args args) {
+  auto type = name == "HLEN"    ? Type::HASH
+              : name == "LLEN"  ? Type::LIST
+              : name == "SCARD" ? Type::SET
+                                : Type::ZSET;
+  return commands::Size(args[1], type);
+}
+
+// LPOP and RPOP
+Command parse_pop(std::string_view name, Args args) {
+  if (args.size() > 3) {
+    return commands::Error(SYNTAX_ERROR);
+  }
+
+  std::optional<size_t> count;
+  if (args.size() == 3) {
+    auto n = integer_arg(args[2]);
+    if (!n or *n < 0) {
+      return commands::Error("ERR value is out of range, must be positive");
+    }
+    count = *n;
+  }
+  return commands::Pop(args, name == "LPOP", count);
+}
+
+Command parse_lrange(std::string_view name, Args args) {
+  auto start = integer_arg(args[2]), stop = integer_arg(args[3]);
+  if (!start or !stop) {
+    return commands::Error(NOT_INTEGER);
+  }
+  return commands::LRange(args[1], *start, *stop);
+}
+
+Command parse_zadd(std::string_view name, Args args) {
+  bool nx = false, xx = false, ch = false;
+  size_t i = 2;
+  for (; i < args.size(); i++) {
+    if (arg_is(args[i], "NX")) {
+      nx = true;
+    } else if (arg_is(args[i], "XX")) {
+      xx = true;
+    } else if (arg_is(args[i], "CH")) {
+      ch = true;
+    } else {
+      break;
+    }
+  }
+  if (nx and xx) {
+    return commands::Error(
+        "ERR XX and NX options at the same time are not compatible");
+  }
+  if (i == args.size() or (args.size() - i) % 2) {
+    return commands::Error(SYNTAX_ERROR);
+  }
+
+  for (size_t j = i; j < args.size(); j += 2) {
+    if (!parse_score(args[j])) {
+      return commands::Error("ERR value is not a valid float");
+    }
+  }
+  return commands::ZAdd(args, i, nx, xx, ch);
+}
+
+Command parse_zrangebyscore(std::string_view name, Args args) {
+  auto min = score_bound(args[2]), max = score_bound(args[3]);
+  if (!min or !max) {
+    return commands::Error("ERR min or max is not a float");
+  }
+
+  bool with_scores = false;
+  int64_t offset = 0, count = -1;
+  for (size_t i = 4; i < args.size(); i++) {
+    if (arg_is(args[i], "WITHSCORES")) {
+      with_scores = true;
+    } else if (arg_is(args[i], "LIMIT") and i + 2 < args.size()) {
+      auto from = integer_arg(args[i + 1]), n = integer_arg(args[i + 2]);
+      if (!from or !n) {
+        return commands::Error(NOT_INTEGER);
+      }
+      offset = *from;
+      count = *n;
+      i += 2;
+    } else {
+      return commands::Error(SYNTAX_ERROR);
+    }
+  }
+  // a negative offset matches nothing, as in redis
+  if (offset < 0) {
+    count = 0;
+    offset = 0;
+  }
+  return commands::ZRangeByScore(args[1], *min, *max, with_scores, offset,
+                                 count);
+}
+
+Command parse_scan(std::string_view name, Args args) {
+  uint64_t cursor;
+  auto res = std::from_chars(args[1].begin(), args[1].end(), cursor);
+  if (res.ec != std::errc() or res.ptr != args[1].end()) {
+    return commands::Error("ERR invalid cursor");
+  }
+
+  std::optional<std::string_view> pattern;
+  size_t count = 10;
+  std::optional<Type> type;
+  for (size_t i = 2; i < args.size(); i += 2) {
+    if (i + 1 == args.size()) {
+      return commands::Error(SYNTAX_ERROR);
+    }
+    if (arg_is(args[i], "MATCH")) {
+      // everything matches *, so skip the matching
+      pattern = args[i + 1] == "*" ? std::nullopt : std::optional(args[i + 1]);
+    } else if (arg_is(args[i], "COUNT")) {
+      auto n = integer_arg(args[i + 1]);
+      if (!n) {
+        return commands::Error(NOT_INTEGER);
+      }
+      if (*n < 1) {
+        return commands::Error(SYNTAX_ERROR);
+      }
+      count = *n;
+    } else if (arg_is(args[i], "TYPE")) {
+      type = std::nullopt;
+      for (auto candidate :
+           {Type::STRING, Type::HASH, Type::LIST, Type::SET, Type::ZSET}) {
+        auto candidate_name = type_name(candidate);
+        if (std::equal(args[i + 1].begin(), args[i + 1].end(),
+                       candidate_name.begin(), candidate_name.end(),
+                       [](char c, char t) { return upcase(c) == upcase(t); })) {
+          type = candidate;
+        }
+      }
+      if (!type) {
+        return commands::Error("ERR unknown type name");
+      }
+    } else {
+      return commands::Error(SYNTAX_ERROR);
+    }
+  }
+  return commands::Scan(cursor, pattern, count, type);
+}
+
+// FLUSHALL and FLUSHDB
+Command parse_flush(std::string_view name, Args args) {
+  if (args.size() == 1) {
+    return commands::FlushAll(args, false);
+  }
+  if (args.size() == 2 and arg_is(args[1], "ASYNC")) {
+    return commands::FlushAll(args, true);
+  }
+  if (args.size() == 2 and arg_is(args[1], "SYNC")) {
+    return commands::FlushAll(args, false);
+  }
+  return commands::Error(SYNTAX_ERROR);
+}
+
+Command parse_object(std::string_view name, Args args) {
+  if (args.size() == 3 and arg_is(args[1], "ENCODING")) {
+    return commands::ObjectEncoding(args[2]);
+  }
+  return commands::Error("ERR unknown subcommand or wrong number of arguments");
+}
+
+Command parse_command_info(std::string_view name, Args args) {
+  if (args.size() == 1) {
+    return commands::CommandInfo({}, false, false);
+  } else if (args.size() == 2 and arg_is(args[1], "COUNT")) {
+    return commands::CommandInfo({}, false, true);
+  } else if (arg_is(args[1], "INFO")) {
+    return commands::CommandInfo(args.subspan(2), true, false);
+  }
+  return commands::Error("ERR unknown subcommand or wrong number of arguments");
+}
+
+// SLOWLOG GET [count], where a count of -1 gets every entry, LEN and RESET
+Command parse_slowlog(std::string_view name, Args args) {
+  if (arg_is(args[1], "GET") and args.size() <= 3) {
+    int64_t count = 10;
+    if (args.size() == 3) {
+      auto parsed = integer_arg(args[2]);
+      if (!parsed) {
+        return commands::Error(NOT_INTEGER);
+      }
+      if (*parsed < -1) {
+        return commands::Error(
+            "ERR count should be greater than or equal to -1");
+      }
+      count = *parsed;
+    }
+    return commands::Slowlog(commands::Slowlog::GET,
+                             count < 0 ? SIZE_MAX : size_t(count));
+  } else if (args.size() == 2 and arg_is(args[1], "LEN")) {
+    return commands::Slowlog(commands::Slowlog::LEN);
+  } else if (args.size() == 2 and arg_is(args[1], "RESET")) {
+    return commands::Slowlog(commands::Slowlog::RESET);
+  }
+  return commands::Error("ERR unknown subcommand or wrong number of arguments");
+}
+
+const std::string_view BAD_SLOT = "ERR Invalid or out of range slot";
+
+std::optional<uint16_t> slot_arg(std::string_view arg) {
+  auto slot = integer_arg(arg);
+  if (!slot or *slot < 0 or *slot >= int64_t(CLUSTER_SLOTS)) {
+    return std::nullopt;
+  }
+  return *slot;
+}
+
+Command parse_cluster(std::string_view name, Args args) {
+  using commands::ClusterCommand;
+  auto sub = args[1];
+  size_t count = args.size();
+
+  if (count == 2 and arg_is(sub, "INFO")) {
+    return ClusterCommand(ClusterCommand::INFO);
+  } else if (count == 2 and arg_is(sub, "MYID")) {
+    return ClusterCommand(ClusterCommand::MYID);
+  } else if (count == 2 and arg_is(sub, "NODES")) {
+    return ClusterCommand(ClusterCommand::NODES);
+  } else if (count == 2 and arg_is(sub, "SLOTS")) {
+    return ClusterCommand(ClusterCommand::SLOTS);
+  } else if (count == 2 and arg_is(sub, "SHARDS")) {
+    return ClusterCommand(ClusterCommand::SHARDS);
+  } else if (count == 4 and arg_is(sub, "MEET")) {
+    auto port = integer_arg(args[3]);
+    if (!port or *port <= 0 or *port > UINT16_MAX) {
+      return commands::Error("ERR Invalid node address specified");
+    }
+    return ClusterCommand(ClusterCommand::MEET, args[2], *port);
+  } else if (count >= 3 and arg_is(sub, "ADDSLOTS")) {
+    std::vector<uint16_t> slots;
+    for (auto arg : args.subspan(2)) {
+      auto slot = slot_arg(arg);
+      if (!slot) {
+        return commands::Error(BAD_SLOT);
+      }
+      slots.push_back(*slot);
+    }
+    return ClusterCommand(ClusterCommand::ADDSLOTS, {}, 0, std::move(slots));
+  } else if (count >= 4 and count % 2 == 0 and
+             arg_is(sub, "ADDSLOTSRANGE")) {
+    std::vector<uint16_t> slots;
+    for (size_t i = 2; i < count; i += 2) {
+      auto first = slot_arg(args[i]), last = slot_arg(args[i + 1]);
+      if (!first or !last or *first > *last) {
+        return commands::Error(BAD_SLOT);
+      }
+      for (size_t slot = *first; slot <= *last; slot++) {
+        slots.push_back(slot);
+      }
+    }
+    return ClusterCommand(ClusterCommand::ADDSLOTS, {}, 0, std::move(slots));
+  } else if ((count == 4 or count == 5) and arg_is(sub, "SETSLOT")) {
+    auto slot = slot_arg(args[2]);
+    if (!slot) {
+      return commands::Error(BAD_SLOT);
+    }
+    std::optional<Cluster::SlotState> state;
+    if (count == 5 and arg_is(args[3], "IMPORTING")) {
+      state = Cluster::SlotState::IMPORTING;
+    } else if (count == 5 and arg_is(args[3], "MIGRATING")) {
+      state = Cluster::SlotState::MIGRATING;
+    } else if (count == 5 and arg_is(args[3], "NODE")) {
+      state = Cluster::SlotState::NODE;
+    } else if (count == 4 and arg_is(args[3], "STABLE")) {
+      state = Cluster::SlotState::STABLE;
+    } else {
+      return commands::Error(SYNTAX_ERROR);
+    }
+    return ClusterCommand(ClusterCommand::SETSLOT,
+                          count == 5 ? args[4] : std::string_view(), 0,
+                          {*slot}, *state);
+  } else if (count == 3 and arg_is(sub, "KEYSLOT")) {
+    return ClusterCommand(ClusterCommand::KEYSLOT, args[2]);
+  } else if (count == 3 and arg_is(sub, "COUNTKEYSINSLOT")) {
+    auto slot = slot_arg(args[2]);
+    if (!slot) {
+      return commands::Error(BAD_SLOT);
+    }
+    return ClusterCommand(ClusterCommand::COUNTKEYSINSLOT, {}, 0, {*slot});
+  } else if (count == 4 and arg_is(sub, "GETKEYSINSLOT")) {
+    auto slot = slot_arg(args[2]);
+    auto keys = integer_arg(args[3]);
+    if (!slot) {
+      return commands::Error(BAD_SLOT);
+    }
+    if (!keys or *keys < 0) {
+      return commands::Error("ERR Invalid number of keys");
+    }
+    return ClusterCommand(ClusterCommand::GETKEYSINSLOT, {}, *keys, {*slot});
+  } else if (count == 3 and arg_is(sub, "GOSSIP")) {
+    return ClusterCommand(ClusterCommand::GOSSIP, args[2]);
+  }
+  return commands::Error("ERR unknown subcommand or wrong number of arguments");
+}
+
+// RESTORE and RESTORE-ASKING
+Command parse_restore(std::string_view name, Args args) {
+  auto ttl = integer_arg(args[2]);
+  if (!ttl) {
+    return commands::Error(NOT_INTEGER);
+  }
+  if (*ttl < 0) {
+    return commands::Error("ERR Invalid TTL value, must be >= 0");
+  }
+
+  bool replace = false, absttl = false;
+  for (auto arg : args.subspan(4)) {
+    if (arg_is(arg, "REPLACE")) {
+      replace = true;
+    } else if (arg_is(arg, "ABSTTL")) {
+      absttl = true;
+    } else {
+      return commands::Error(SYNTAX_ERROR);
+    }
+  }
+
+  auto expiry = *ttl ? absolute_expiry(*ttl, true, absttl) : NO_EXPIRY;
+  if (!expiry) {
+    return commands::Error("ERR invalid expire time in 'restore' command");
+  }
+  return commands::Restore(args[1], *expiry, args[3], replace);
+}
+
+Command parse_migrate(std::string_view name, Args args) {
+  auto port = integer_arg(args[2]);
+  auto db = integer_arg(args[4]);
+  auto timeout = integer_arg(args[5]);
+  if (!port or !db or !timeout) {
+    return commands::Error(NOT_INTEGER);
+  }
+  if (*port <= 0 or *port > UINT16_MAX) {
+    return commands::Error("ERR Invalid port");
+  }
+  // there's only the one database
+  if (*db) {
+    return commands::Error("ERR DB index is out of range");
+  }
+
+  bool copy = false, replace = false;
+  Args keys = args.subspan(3, 1);
+  for (size_t i = 6; i < args.size(); i++) {
+    if (arg_is(args[i], "COPY")) {
+      copy = true;
+    } else if (arg_is(args[i], "REPLACE")) {
+      replace = true;
+    } else if (arg_is(args[i], "KEYS")) {
+      if (!args[3].empty()) {
+        return commands::Error(
+            "ERR When using MIGRATE KEYS option, the key argument must be "
+            "set to the empty string");
+      }
+      keys = args.subspan(i + 1);
+      break;
+    } else {
+      return commands::Error(SYNTAX_ERROR);
+    }
+  }
+  // like redis, a timeout that isn't one means a second
+  auto wait = std::chrono::milliseconds(*timeout > 0 ? *timeout : 1000);
+  return commands::Migrate(args[1], *port, wait, copy, replace, keys);
+}
+
+// the command registry, which dispatch, COMMAND and the read-only check all
+// go by. arity counts the name, like redis: n means exactly n arguments, -n
+// at least n. keys are at args[first_key], every key_step up to last_key,
+// which counts from the end when negative. parse only sees arguments that
+// fit the arity, and answers anything else wrong with an Error
+enum CommandFlags : uint8_t {
+  WRITE = 1,
+  READONLY = 2,
+  // constant time
+  FAST = 4,
+  // runs outside transactions
+  ADMIN = 8,
+  // MULTI, EXEC, DISCARD, WATCH, UNWATCH and the (P)(UN)SUBSCRIBE
+  // commands, which act on the client's session
+  SESSION = 16,
+  // allowed on a connection that's subscribed to something
+  SUBSCRIBED = 32,
+  // served in a slot this node is importing without ASKING first
+  ASKING = 64,
+};
+
+struct CommandSpec {
+  std::string_view name;
+  int arity;
+  uint8_t flags;
+  int first_key;
+  int last_key;
+  int key_step;
+  Command (*parse)(std::string_view name, Args args);
+};
+
+constexpr CommandSpec COMMANDS[] = {
+    {"PING", -1, FAST | SUBSCRIBED, 0, 0, 0,
+     [](std::string_view, Args args) -> Command {
+       return args.size() >= 2 ? commands::Ping(args[1]) : commands::Ping();
+     }},
+    {"ECHO", 2, FAST, 0, 0, 0,
+     [](std::string_view, Args args) -> Command {
+       return commands::Echo(args[1]);
+     }},
+    {"SET", -3, WRITE, 1, 1, 1, parse_set},
+    {"GET", 2, READONLY | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::Get(args[1]);
+     }},
+    {"MGET", -2, READONLY | FAST, 1, -1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::MGet(args.subspan(1));
+     }},
+    {"MSET", -3, WRITE, 1, -1, 2, parse_mset},
+    {"MSETNX", -3, WRITE, 1, -1, 2, parse_mset},
+    {"DEL", -2, WRITE, 1, -1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::Del(args.subspan(1));
+     }},
+    {"UNLINK", -2, WRITE | FAST, 1, -1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::Del(args.subspan(1));
+     }},
+    {"EXISTS", -2, READONLY | FAST, 1, -1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::Exists(args.subspan(1));
+     }},
+    {"INCR", 2, WRITE | FAST, 1, 1, 1, parse_incr},
+    {"DECR", 2, WRITE | FAST, 1, 1, 1, parse_incr},
+    {"INCRBY", 3, WRITE | FAST, 1, 1, 1, parse_incr},
+    {"DECRBY", 3, WRITE | FAST, 1, 1, 1, parse_incr},
+    {"APPEND", 3, WRITE | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::Append(args);
+     }},
+    {"SETRANGE", 4, WRITE, 1, 1, 1, parse_setrange},
+    {"GETSET", 3, WRITE | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::GetSet(args[1], args[2]);
+     }},
+    {"TTL", 2, READONLY | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::Ttl(args[1], false);
+     }},
+    {"PTTL", 2, READONLY | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::Ttl(args[1], true);
+     }},
+    {"EXPIRE", 3, WRITE | FAST, 1, 1, 1, parse_expire},
+    {"PEXPIRE", 3, WRITE | FAST, 1, 1, 1, parse_expire},
+    {"EXPIREAT", 3, WRITE | FAST, 1, 1, 1, parse_expire},
+    {"PEXPIREAT", 3, WRITE | FAST, 1, 1, 1, parse_expire},
+    {"PERSIST", 2, WRITE | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::Persist(args[1]);
+     }},
+    {"INFO", -1, 0, 0, 0, 0,
+     [](std::string_view, Args args) -> Command {
+       if (args.size() > 2) {
+         return commands::Error(SYNTAX_ERROR);
+       }
+       return commands::Info(args.size() == 2 ? args[1] : "");
+     }},
+    {"SLOWLOG", -2, ADMIN, 0, 0, 0, parse_slowlog},
+    {"BGREWRITEAOF", 1, ADMIN, 0, 0, 0,
+     [](std::string_view, Args args) -> Command {
+       return commands::BgRewriteAof();
+     }},
+    {"SAVE", 1, ADMIN, 0, 0, 0,
+     [](std::string_view, Args args) -> Command { return commands::Save(); }},
+    {"BGSAVE", 1, ADMIN, 0, 0, 0,
+     [](std::string_view, Args args) -> Command {
+       return commands::BgSave();
+     }},
+    {"PSYNC", 3, ADMIN, 0, 0, 0, parse_psync},
+    {"CLUSTER", -2, 0, 0, 0, 0, parse_cluster},
+    {"ASKING", 1, SESSION | FAST, 0, 0, 0, parse_session},
+    {"DUMP", 2, READONLY, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::Dump(args[1]);
+     }},
+    {"RESTORE", -4, WRITE, 1, 1, 1, parse_restore},
+    {"RESTORE-ASKING", -4, WRITE | ASKING, 1, 1, 1, parse_restore},
+    {"MIGRATE", -6, WRITE | ADMIN, 0, 0, 0, parse_migrate},
+    {"HSET", -4, WRITE | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       if (args.size() % 2) {
+         return commands::Error(
+             "ERR wrong number of arguments for 'hset' command");
+       }
+       return commands::HSet(args);
+     }},
+    {"HGET", 3, READONLY | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::HGet(args[1], args[2]);
+     }},
+    {"HDEL", -3, WRITE | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::HDel(args);
+     }},
+    {"HEXISTS", 3, READONLY | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::HExists(args[1], args[2]);
+     }},
+    {"HGETALL", 2, READONLY, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::HGetAll(args[1]);
+     }},
+    {"HLEN", 2, READONLY | FAST, 1, 1, 1, parse_size},
+    {"LLEN", 2, READONLY | FAST, 1, 1, 1, parse_size},
+    {"SCARD", 2, READONLY | FAST, 1, 1, 1, parse_size},
+    {"ZCARD", 2, READONLY | FAST, 1, 1, 1, parse_size},
+    {"LPUSH", -3, WRITE | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::Push(args, true);
+     }},
+    {"RPUSH", -3, WRITE | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::Push(args, false);
+     }},
+    {"LPOP", -2, WRITE | FAST, 1, 1, 1, parse_pop},
+    {"RPOP", -2, WRITE | FAST, 1, 1, 1, parse_pop},
+    {"LRANGE", 4, READONLY, 1, 1, 1, parse_lrange},
+    {"SADD", -3, WRITE | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::SetMembers(args, true);
+     }},
+    {"SREM", -3, WRITE | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::SetMembers(args, false);
+     }},
+    {"SISMEMBER", 3, READONLY | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::SIsMember(args[1], args[2]);
+     }},
+    {"SMEMBERS", 2, READONLY, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::SMembers(args[1]);
+     }},
+    {"ZADD", -4, WRITE | FAST, 1, 1, 1, parse_zadd},
+    {"ZREM", -3, WRITE | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::ZRem(args);
+     }},
+    {"ZSCORE", 3, READONLY | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::ZScore(args[1], args[2]);
+     }},
+    {"ZRANGEBYSCORE", -4, READONLY, 1, 1, 1, parse_zrangebyscore},
+    {"TYPE", 2, READONLY | FAST, 1, 1, 1,
+     [](std::string_view, Args args) -> Command {
+       return commands::TypeOf(args[1]);
+     }},
+    {"OBJECT", -2, READONLY, 2, 2, 1, parse_object},
+    {"SCAN", -2, READONLY, 0, 0, 0, parse_scan},
+    {"KEYS", 2, READONLY, 0, 0, 0,
+     [](std::string_view, Args args) -> Command {
+       return commands::Keys(args[1]);
+     }},
+    {"DBSIZE", 1, READONLY | FAST, 0, 0, 0,
+     [](std::string_view, Args args) -> Command { return commands::DbSize(); }},
+    {"FLUSHALL", -1, WRITE, 0, 0, 0, parse_flush},
+    {"FLUSHDB", -1, WRITE, 0, 0, 0, parse_flush},
+    {"COMMAND", -1, 0, 0, 0, 0, parse_command_info},
+    {"MULTI", 1, SESSION | FAST, 0, 0, 0, parse_session},
+    {"EXEC", 1, SESSION, 0, 0, 0, parse_session},
+    {"DISCARD", 1, SESSION | FAST, 0, 0, 0, parse_session},
+    {"WATCH", -2, SESSION | FAST, 1, -1, 1, parse_session},
+    {"UNWATCH", 1, SESSION | FAST, 0, 0, 0, parse_session},
+    {"SUBSCRIBE", -2, SESSION | SUBSCRIBED, 0, 0, 0, parse_session},
+    {"UNSUBSCRIBE", -1, SESSION | SUBSCRIBED, 0, 0, 0, parse_session},
+    {"PSUBSCRIBE", -2, SESSION | SUBSCRIBED, 0, 0, 0, parse_session},
+    {"PUNSUBSCRIBE", -1, SESSION | SUBSCRIBED, 0, 0, 0, parse_session},
+    {"HELLO", -1, SESSION | FAST, 0, 0, 0, parse_session},
+    {"CLIENT", -2, SESSION, 0, 0, 0, parse_session},
+    {"PUBLISH", 3, FAST, 0, 0, 0,
+     [](std::string_view, Args args) -> Command {
+       return commands::Publish(args[1], args[2]);
+     }},
+};
+
+// stats are kept per command, by index in the table
+static_assert(std::size(COMMANDS) <= MAX_COMMANDS);
+
+// the longest name, so lookups can upcase into a fixed buffer
+constexpr size_t MAX_NAME_LEN = 16;
+
+// FNV-1a, which only has to spread a few dozen names
+constexpr uint32_t name_hash(std::string_view name) {
+  uint32_t hash = 2166136261u;
+  for (char c : name) {
+    hash = (hash ^ uint8_t(c)) * 16777619u;
+  }
+  return hash;
+}
+
+// an open-addressed index over COMMANDS, built by the compiler and kept at
+// most a quarter full, so a lookup is one hash and about one probe
+constexpr size_t SLOTS = 512;
+
+constexpr auto SLOT_TABLE = [] {
+  static_assert(std::size(COMMANDS) < SLOTS / 4);
+  std::array<uint8_t, SLOTS> slots{};
+  for (size_t i = 0; i < std::size(COMMANDS); i++) {
+    size_t slot = name_hash(COMMANDS[i].name) & (SLOTS - 1);
+    while (slots[slot]) {
+      slot = (slot + 1) & (SLOTS - 1);
+    }
+    // 0 marks an empty slot
+    slots[slot] = i + 1;
+  }
+  return slots;
+}();
+
+static_assert([] {
+  for (auto &spec : COMMANDS) {
+    if (spec.name.length() > MAX_NAME_LEN) {
+      return false;
+    }
+  }
+  return true;
+}());
+
+CommandSpec const *find_command(std::string_view name) {
+  if (name.length() > MAX_NAME_LEN) {
+    return nullptr;
+  }
+
+  char upper[MAX_NAME_LEN];
+  std::transform(name.begin(), name.end(), upper, upcase);
+  std::string_view key(upper, name.length());
+
+  for (size_t slot = name_hash(key) & (SLOTS - 1); SLOT_TABLE[slot];
+       slot = (slot + 1) & (SLOTS - 1)) {
+    auto &spec = COMMANDS[SLOT_TABLE[slot] - 1];
+    if (spec.name == key) {
+      return &spec;
+    }
+  }
+  return nullptr;
+}
+
+bool arity_fits(CommandSpec const &spec, size_t args) {
+  return spec.arity >= 0 ? args == size_t(spec.arity)
+                         : args >= size_t(-spec.arity);
+}
+
+// the keys a command names, by its key spec
+void command_keys(CommandSpec const &spec, Args args,
+                  std::vector<std::string_view> &keys) {
+  if (!spec.first_key) {
+    return;
+  }
+  size_t last = spec.last_key < 0 ? args.size() + spec.last_key
+                                  : size_t(spec.last_key);
+  for (size_t i = spec.first_key; i <= last and i < args.size();
+       i += spec.key_step) {
+    keys.push_back(args[i]);
+  }
+}
+
+// COMMAND's description of one command: name, arity, flags and key spec
+void describe_command(CommandSpec const &spec, Reply &reply) {
+  static const std::pair<uint8_t, std::string_view> FLAG_NAMES[] = {
+      {WRITE, "write"},
+      {READONLY, "readonly"},
+      {FAST, "fast"},
+      {ADMIN, "admin"},
+      {SESSION, "session"},
+      {SUBSCRIBED, "pubsub"},
+      {ASKING, "asking"},
+  };
+
+  char lower[MAX_NAME_LEN];
+  std::transform(spec.name.begin(), spec.name.end(), lower, downcase);
+
+  reply.array(6);
+  reply.bulk_string(std::string_view(lower, spec.name.length()));
+  reply.integer(spec.arity);
+  reply.array(std::popcount(spec.flags));
+  for (auto [flag, flag_name] : FLAG_NAMES) {
+    if (spec.flags & flag) {
+      reply.simple_string(flag_name);
+    }
+  }
+  reply.integer(spec.first_key);
+  reply.integer(spec.last_key);
+  reply.integer(spec.key_step);
+}
+
+};  // namespace parsers
+
+size_t command_count() { return std::size(parsers::COMMANDS); }
+
+std::string_view command_name(size_t index) {
+  return parsers::COMMANDS[index].name;
+}
+
+void commands::CommandInfo::visit(Storage &storage, Reply &reply) {
+  if (count) {
+    reply.integer(std::size(parsers::COMMANDS));
+  } else if (!named) {
+    reply.array(std::size(parsers::COMMANDS));
+    for (auto &spec : parsers::COMMANDS) {
+      parsers::describe_command(spec, reply);
+    }
+  } else {
+    reply.array(names.size());
+    for (auto name : names) {
+      if (auto spec = parsers::find_command(name)) {
+        parsers::describe_command(*spec, reply);
+      } else {
+        reply.null_array();
+      }
+    }
+  }
+}
+
+void commands::ClusterCommand::visit(Storage &storage, Reply &reply) {
+  auto cluster = cluster_node();
+  if (!cluster) {
+    reply.error("ERR This instance has cluster support disabled");
+    return;
+  }
+
+  try {
+    switch (action) {
+      case INFO:
+        reply.bulk_string(cluster->info());
+        break;
+      case MYID:
+        reply.bulk_string(cluster->my_id());
+        break;
+      case MEET:
+        cluster->meet(std::string(arg), number);
+        reply.simple_string("OK");
+        break;
+      case NODES:
+        reply.bulk_string(cluster->describe());
+        break;
+      case SLOTS: {
+        auto ranges = cluster->ranges();
+        reply.array(ranges.size());
+        for (auto &range : ranges) {
+          reply.array(3);
+          reply.integer(range.first);
+          reply.integer(range.last);
+          reply.array(3);
+          reply.bulk_string(range.host);
+          reply.integer(range.port);
+          reply.bulk_string(range.id);
+        }
+        break;
+      }
+      case SHARDS: {
+        // a shard per node serving slots, in the order their slots start
+        auto ranges = cluster->ranges();
+        std::vector<std::vector<Cluster::Range const *>> shards;
+        for (auto &range : ranges) {
+          auto shard = std::find_if(shards.begin(), shards.end(),
+                                    [&](auto &shard) {
+                                      return shard[0]->id == range.id;
+                                    });
+          if (shard == shards.end()) {
+            shards.emplace_back();
+            shard = shards.end() - 1;
+          }
+          shard->push_back(&range);
+        }
+
+        reply.array(shards.size());
+        for (auto &shard : shards) {
+          auto &node = *shard[0];
+          reply.array(4);
+          reply.bulk_string("slots");
+          reply.array(shard.size() * 2);
+          for (auto range : shard) {
+            reply.integer(range->first);
+            reply.integer(range->last);
+          }
+          reply.bulk_string("nodes");
+          reply.array(1);
+          reply.array(14);
+          reply.bulk_string("id");
+          reply.bulk_string(node.id);
+          reply.bulk_string("port");
+          reply.integer(node.port);
+          reply.bulk_string("ip");
+          reply.bulk_string(node.host);
+          reply.bulk_string("endpoint");
+          reply.bulk_string(node.host);
+          reply.bulk_string("role");
+          reply.bulk_string("master");
+          reply.bulk_string("replication-offset");
+          reply.integer(0);
+          reply.bulk_string("health");
+          reply.bulk_string("online");
+        }
+        break;
+      }
+      case ADDSLOTS:
+        cluster->add_slots(slots);
+        reply.simple_string("OK");
+        break;
+      case SETSLOT:
+        // the keys have to be migrated first
+        if (state == Cluster::SlotState::NODE and arg != cluster->my_id() and
+            cluster->serves(slots[0]) and
+            storage.count_keys_in_slot(slots[0])) {
+          reply.error("ERR Can't assign hashslot " + std::to_string(slots[0]) +
+                      " to a different node while I still hold keys for "
+                      "this hash slot.");
+          break;
+        }
+        cluster->set_slot(slots[0], state, arg);
+        reply.simple_string("OK");
+        break;
+      case KEYSLOT:
+        reply.integer(key_slot(arg));
+        break;
+      case COUNTKEYSINSLOT:
+        reply.integer(storage.count_keys_in_slot(slots[0]));
+        break;
+      case GETKEYSINSLOT: {
+        std::vector<std::string> keys;
+        storage.keys_in_slot(slots[0], number, keys);
+        reply.array(keys.size());
+        for (auto &key : keys) {
+          reply.bulk_string(key);
+        }
+        break;
+      }
+      case GOSSIP:
+        reply.bulk_string(cluster->gossip(arg));
+        break;
+    }
+  } catch (std::runtime_error const &e) {
+    reply.error(std::string("ERR ") + e.what());
+  }
+}
+
+// appends args as a RESP array
+static void append_command(std::string &out,
+                           std::initializer_list<std::string_view> args) {
+  out += '*' + std::to_string(args.size()) + "\r\n";
+  for (auto arg : args) {
+    out += '$' + std::to_string(arg.length()) + "\r\n";
+    out += arg;
+    out += "\r\n";
+  }
+}
+
+// passes MIGRATE makes over keys written while the target took them, the
+// last holding their shards throughout so a busy key can't keep it from
+// moving
+const int MIGRATE_PASSES = 3;
+
+void commands::Migrate::visit(Storage &storage, Reply &reply) {
+  std::string sent, payload, error;
+  std::vector<std::string_view> pending(keys.begin(), keys.end());
+  std::vector<std::string_view> next;
+  // each key dumped in a pass, with where it stood then
+  std::vector<std::string_view> found;
+  std::vector<Storage::Watch> dumped;
+  std::vector<std::string_view> moved;
+  bool any = false;
+
+  for (int pass = 1; !pending.empty() and error.empty(); pass++) {
+    // a key sent again replaces the copy sent before
+    bool overwrite = replace or pass > 1;
+    sent.clear();
+    found.clear();
+    dumped.clear();
+    moved.clear();
+    next.clear();
+
+    auto dump = [&] {
+      for (auto key : pending) {
+        payload.clear();
+        if (!storage.dump(key, payload)) {
+          continue;
+        }
+        auto ttl = std::to_string(std::max<int64_t>(storage.ttl(key), 0));
+        if (overwrite) {
+          append_command(sent,
+                         {"RESTORE-ASKING", key, ttl, payload, "REPLACE"});
+        } else {
+          append_command(sent, {"RESTORE-ASKING", key, ttl, payload});
+        }
+        found.push_back(key);
+        dumped.push_back(storage.watch(key));
+      }
+    };
+
+    auto send = [&] {
+      try {
+        NodeConnection target(host, port, timeout);
+        target.send(sent);
+        for (auto key : found) {
+          auto answer = target.reply();
+          if (answer.starts_with('-')) {
+            if (error.empty()) {
+              error = answer.substr(1, answer.length() - 3);
+            }
+          } else {
+            moved.push_back(key);
+          }
+        }
+      } catch (std::runtime_error const &) {
+        error = "IOERR error or timeout reading to target instance";
+      }
+    };
+
+    // deletes what the target took unless it was written since its dump,
+    // which leaves it for the next pass
+    auto remove = [&] {
+      std::vector<std::string_view> unchanged;
+      for (size_t i = 0, j = 0; i < moved.size(); i++) {
+        while (found[j] != moved[i]) {
+          j++;
+        }
+        if (storage.changed(moved[i], dumped[j])) {
+          next.push_back(moved[i]);
+        } else {
+          unchanged.push_back(moved[i]);
+        }
+      }
+      storage.del(unchanged);
+    };
+
+    if (pass < MIGRATE_PASSES) {
+      storage.atomically(pending, false, dump);
+      if (!found.empty()) {
+        send();
+      }
+      if (!copy and !moved.empty()) {
+        storage.atomically(moved, false, remove);
+      }
+    } else {
+      storage.atomically(pending, false, [&] {
+        dump();
+        if (!found.empty()) {
+          send();
+        }
+        if (!copy) {
+          remove();
+        }
+      });
+    }
+    any = any or !found.empty();
+    pending.swap(next);
+  }
+
+  if (!any) {
+    reply.simple_string("NOKEY");
+  } else if (error.starts_with("IOERR")) {
+    reply.error(error);
+  } else if (!error.empty()) {
+    reply.error("ERR Target instance replied with error: " + error);
+  } else {
+    reply.simple_string("OK");
+  }
+}
+
+void Session::reset() {
+  multi = false;
+  aborted = false;
+  asking = false;
+  queued.clear();
+  watched.clear();
+}
+
+void Session::unsubscribe_all() {
+  for (auto &channel : channels) {
+    unsubscribe(channel, false, subscriber);
+  }
+  for (auto &pattern : patterns) {
+    unsubscribe(pattern, true, subscriber);
+  }
+  channels.clear();
+  patterns.clear();
+}
+
+// SUBSCRIBE, UNSUBSCRIBE, PSUBSCRIBE and PUNSUBSCRIBE, which reply for each
+// channel or pattern with the connection's subscription count after it.
+// unsubscribing from nothing in particular means from everything
+static void run_subscribe(std::string_view name, commands::Args names,
+                          Session &session, Reply &reply) {
+  bool pattern = name.starts_with('P');
+  bool adding = name.find("UN") == std::string_view::npos;
+  auto &subscribed = pattern ? session.patterns : session.channels;
+  char lower[16];
+  std::transform(name.begin(), name.end(), lower,
+                 [](char c) { return c - 'A' + 'a'; });
+  std::string_view kind(lower, name.length());
+  auto invalidations = [&] {
+    return session.channels.contains(std::string(INVALIDATION_CHANNEL));
+  };
+  bool listening = invalidations();
+
+  auto answer = [&](std::optional<std::string_view> channel) {
+    reply.array(3);
+    reply.bulk_string(kind);
+    if (channel) {
+      reply.bulk_string(*channel);
+    } else {
+      reply.null_bulk_string();
+    }
+    reply.integer(session.channels.size() + session.patterns.size());
+  };
+
+  if (adding) {
+    for (auto channel : names) {
+      if (subscribed.emplace(channel).second) {
+        subscribe(channel, pattern, session.subscriber);
+      }
+      answer(channel);
+    }
+  } else if (!names.empty()) {
+    for (auto channel : names) {
+      if (subscribed.erase(std::string(channel))) {
+        unsubscribe(channel, pattern, session.subscriber);
+      }
+      answer(channel);
+    }
+  } else if (subscribed.empty()) {
+    answer(std::nullopt);
+  } else {
+    while (!subscribed.empty()) {
+      auto node = subscribed.extract(subscribed.begin());
+      unsubscribe(node.value(), pattern, session.subscriber);
+      answer(node.value());
+    }
+  }
+
+  if (invalidations() != listening) {
+    set_client_invalidation_subscriber(session.subscriber.id, !listening);
+  }
+}
+
+// a map for a RESP3 client, and a flat array of its keys and values
+// otherwise, like redis
+static void map_reply(Session const &session, Reply &reply, size_t len) {
+  if (session.protocol == 3) {
+    reply.map(len);
+  } else {
+    reply.array(2 * len);
+  }
+}
+
+// HELLO [protover], which switches the connection's protocol and says what
+// it's talking to. besides this reply, only CLIENT TRACKING's invalidations
+// use RESP3's types. every other reply keeps its RESP2 encoding, which RESP3
+// clients read the same
+static void run_hello(commands::Args args, Session &session, Reply &reply) {
+  if (args.size() > 2) {
+    reply.error("ERR Syntax error in HELLO option '" + std::string(args[2]) +
+                "'");
+    return;
+  }
+  if (args.size() == 2) {
+    auto version = parsers::integer_arg(args[1]);
+    if (!version) {
+      reply.error("ERR Protocol version is not an integer or out of range");
+      return;
+    }
+    if (*version != 2 and *version != 3) {
+      reply.error("NOPROTO unsupported protocol version");
+      return;
+    }
+    session.protocol = *version;
+    set_client_protocol(session.subscriber.id, session.protocol);
+  }
+
+  map_reply(session, reply, 6);
+  reply.bulk_string("server");
+  reply.bulk_string("sider");
+  reply.bulk_string("proto");
+  reply.integer(session.protocol);
+  reply.bulk_string("id");
+  reply.integer(session.subscriber.id);
+  reply.bulk_string("mode");
+  reply.bulk_string(cluster_node() ? "cluster" : "standalone");
+  reply.bulk_string("role");
+  reply.bulk_string(replication_replica() ? "replica" : "master");
+  reply.bulk_string("modules");
+  reply.array(0);
+}
+
+// CLIENT TRACKING ON|OFF [REDIRECT id] [BCAST] [PREFIX prefix ...]
+// [NOLOOP]
+static void run_tracking(commands::Args args, Session &session,
+                         Reply &reply) {
+  auto id = session.subscriber.id;
+  bool on = parsers::arg_is(args[0], "ON");
+  if (!on and !parsers::arg_is(args[0], "OFF")) {
+    reply.error(parsers::SYNTAX_ERROR);
+    return;
+  }
+
+  TrackingOptions options;
+  for (size_t i = 1; i < args.size(); i++) {
+    if (parsers::arg_is(args[i], "REDIRECT") and i + 1 < args.size()) {
+      auto redirect = parsers::integer_arg(args[++i]);
+      if (!redirect or *redirect < 0) {
+        reply.error(parsers::NOT_INTEGER);
+        return;
+      }
+      options.redirect = *redirect;
+    } else if (parsers::arg_is(args[i], "BCAST")) {
+      options.bcast = true;
+    } else if (parsers::arg_is(args[i], "PREFIX") and i + 1 < args.size()) {
+      options.prefixes.emplace_back(args[++i]);
+    } else if (parsers::arg_is(args[i], "NOLOOP")) {
+      options.noloop = true;
+    } else {
+      reply.error(parsers::SYNTAX_ERROR);
+      return;
+    }
+  }
+
+  if (!on) {
+    disable_tracking(id);
+    session.tracking = false;
+    reply.simple_string("OK");
+    return;
+  }
+  bool bcast = options.bcast;
+  try {
+    enable_tracking(id, std::move(options));
+  } catch (std::runtime_error const &e) {
+    reply.error(e.what());
+    return;
+  }
+  // broadcast mode doesn't care what the client reads
+  session.tracking = !bcast;
+  reply.simple_string("OK");
+}
+
+// CLIENT ID, TRACKING, GETREDIR and TRACKINGINFO
+static void run_client(commands::Args args, Session &session, Reply &reply) {
+  auto sub = args[1];
+  size_t count = args.size();
+  auto id = session.subscriber.id;
+
+  if (count == 2 and parsers::arg_is(sub, "ID")) {
+    reply.integer(id);
+  } else if (count >= 3 and parsers::arg_is(sub, "TRACKING")) {
+    run_tracking(args.subspan(2), session, reply);
+  } else if (count == 2 and parsers::arg_is(sub, "GETREDIR")) {
+    // -1 while tracking is off
+    auto options = tracking_options(id);
+    reply.integer(options ? int64_t(options->redirect) : -1);
+  } else if (count == 2 and parsers::arg_is(sub, "TRACKINGINFO")) {
+    auto options = tracking_options(id);
+    map_reply(session, reply, 3);
+    reply.bulk_string("flags");
+    if (!options) {
+      reply.array(1);
+      reply.bulk_string("off");
+    } else {
+      reply.array(1 + options->bcast + options->noloop);
+      reply.bulk_string("on");
+      if (options->bcast) {
+        reply.bulk_string("bcast");
+      }
+      if (options->noloop) {
+        reply.bulk_string("noloop");
+      }
+    }
+    reply.bulk_string("redirect");
+    reply.integer(options ? int64_t(options->redirect) : -1);
+    reply.bulk_string("prefixes");
+    reply.array(options ? options->prefixes.size() : 0);
+    if (options) {
+      for (auto &prefix : options->prefixes) {
+        reply.bulk_string(prefix);
+      }
+    }
+  } else {
+    reply.error("ERR unknown subcommand or wrong number of arguments");
+  }
+}
+
+// replies with a command's error, which dooms the transaction being queued
+static void reject(std::string_view message, Session *session, Reply &reply) {
+  reply.error(message);
+  if (session and session->multi) {
+    session->aborted = true;
+  }
+}
+
+using Clock = std::chrono::steady_clock;
+
+// counts a command that ran into the calling thread's stats, failed if it
+// replied with an error since errors was read, and into the slow log if it
+// took long enough
+static void account(parsers::CommandSpec const &spec, commands::Args args,
+                    Clock::time_point started, uint64_t errors,
+                    Session *session) {
+  uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       Clock::now() - started)
+                       .count();
+  record_command(&spec - parsers::COMMANDS, nanos,
+                 thread_stats().error_replies.get() != errors);
+  if (slowlog_wants(nanos)) {
+    slowlog_push(nanos, args, session ? session->client : "");
+  }
+}
+
+const std::string_view TRYAGAIN =
+    "TRYAGAIN Multiple keys request during rehashing of slot";
+
+// cluster mode: refuses a command naming keys this node doesn't serve with
+// where they are served, and returns whether it did. on a slot migrating
+// away, ask is left holding the redirect for keys that have moved already
+static bool misrouted(Cluster &cluster, commands::Args keys, bool asking,
+                      Session &session, Reply &reply, std::string &ask) {
+  if (keys.empty()) {
+    return false;
+  }
+  auto slot = key_slot(keys[0]);
+  for (auto key : keys.subspan(1)) {
+    if (key_slot(key) != slot) {
+      reject("CROSSSLOT Keys in request don't hash to the same slot",
+             &session, reply);
+      return true;
+    }
+  }
+
+  auto where = cluster.route(slot, asking);
+  switch (where.route) {
+    case Cluster::Route::LOCAL:
+      break;
+    case Cluster::Route::MIGRATING:
+      ask = "ASK " + std::to_string(slot) + " " + where.address;
+      break;
+    case Cluster::Route::MOVED:
+      reject("MOVED " + std::to_string(slot) + " " + where.address, &session,
+             reply);
+      return true;
+    case Cluster::Route::DOWN:
+      reject("CLUSTERDOWN Hash slot not served", &session, reply);
+      return true;
+  }
+  return false;
+}
+
+// for a slot migrating away: the keys are served here while every one of
+// them still is, under their shards' locks so MIGRATE can't take one
+// meanwhile, and asked for at the target when none are
+static void run_if_here(Storage &storage, commands::Args keys,
+                        std::string_view ask, Reply &reply,
+                        std::function<void()> const &run) {
+  storage.atomically(keys, false, [&] {
+    size_t here = storage.exists(keys);
+    if (here == keys.size()) {
+      run();
+    } else if (!here) {
+      reply.error(ask);
+    } else {
+      reply.error(TRYAGAIN);
+    }
+  });
+}
+
+// runs the queued commands under a single hold of every shard they or the
+// watched keys live in, unless a watched key changed
+static void exec(Storage &storage, Session &session, Reply &reply) {
+  std::vector<std::string_view> args;
+  std::vector<std::string_view> keys;
+  // the keys of one command, for tracking
+  std::vector<std::string_view> read;
+  std::string_view queued = session.queued;
+  bool all = false;
+  size_t count = 0;
+
+  for (auto &[key, _] : session.watched) {
+    keys.push_back(key);
+  }
+  // every command was checked as it was queued
+  for (size_t pos = 0; pos < queued.length(); count++) {
+    pos += parsers::parse_args(queued.substr(pos), args);
+    auto spec = parsers::find_command(args[0]);
+    if (!(spec->flags & parsers::SESSION)) {
+      // a command without keys may touch any shard
+      all |= !spec->first_key;
+      parsers::command_keys(*spec, args, keys);
+    }
+  }
+
+  // the whole transaction has to stay in one slot
+  std::string ask;
+  auto cluster = cluster_node();
+  if (cluster and misrouted(*cluster, keys, session.asking, session, reply,
+                            ask)) {
+    return;
+  }
+
+  storage.atomically(keys, all, [&] {
+    for (auto &[key, watch] : session.watched) {
+      if (storage.changed(key, watch)) {
+        reply.null_array();
+        return;
+      }
+    }
+    if (!ask.empty()) {
+      size_t here = storage.exists(keys);
+      if (here != keys.size()) {
+        reply.error(here ? TRYAGAIN : std::string_view(ask));
+        return;
+      }
+    }
+
+    auto &stats = thread_stats();
+    reply.array(count);
+    for (size_t pos = 0; pos < queued.length();) {
+      pos += parsers::parse_args(queued.substr(pos), args);
+      auto spec = parsers::find_command(args[0]);
+      if (spec->flags & parsers::SESSION) {
+        // UNWATCH, which EXEC does anyway
+        reply.simple_string("OK");
+        continue;
+      }
+      if (session.tracking and spec->flags & parsers::READONLY) {
+        read.clear();
+        parsers::command_keys(*spec, args, read);
+        track_reads(session.subscriber.id, read);
+      }
+      auto started = Clock::now();
+      uint64_t errors = stats.error_replies.get();
+      auto command = spec->parse(spec->name, args);
+      std::visit([&](auto &command) { command.visit(storage, reply); },
+                 command);
+      account(*spec, args, started, errors, &session);
+    }
+  });
+}
+
+// the session commands. raw is the command as it arrived, for queueing
+static void run_session(std::string_view name, commands::Args args,
+                        std::string_view raw, Storage &storage,
+                        Session &session, Reply &reply) {
+  if (session.multi and (name.ends_with("SUBSCRIBE") or name == "HELLO" or
+                        name == "CLIENT")) {
+    reject("ERR Command not allowed inside a transaction", &session, reply);
+  } else if (name.ends_with("SUBSCRIBE")) {
+    run_subscribe(name, args.subspan(1), session, reply);
+  } else if (name == "HELLO") {
+    run_hello(args, session, reply);
+  } else if (name == "CLIENT") {
+    run_client(args, session, reply);
+  } else if (name == "MULTI") {
+    if (session.multi) {
+      reply.error("ERR MULTI calls can not be nested");
+    } else {
+      session.multi = true;
+      reply.simple_string("OK");
+    }
+  } else if (name == "EXEC" or name == "DISCARD") {
+    if (!session.multi) {
+      reply.error("ERR " + std::string(name) + " without MULTI");
+    } else if (name == "DISCARD") {
+      session.reset();
+      reply.simple_string("OK");
+    } else if (session.aborted) {
+      session.reset();
+      reply.error(
+          "EXECABORT Transaction discarded because of previous errors.");
+    } else {
+      exec(storage, session, reply);
+      session.reset();
+    }
+  } else if (name == "ASKING") {
+    session.asking = true;
+    reply.simple_string("OK");
+  } else if (name == "WATCH") {
+    if (session.multi) {
+      reply.error("ERR WATCH inside MULTI is not allowed");
+      return;
+    }
+    for (auto key : args.subspan(1)) {
+      session.watched.emplace_back(key, storage.watch(key));
+    }
+    reply.simple_string("OK");
+  } else if (session.multi) {
+    // UNWATCH is queued like any other command
+    session.queued.append(raw);
+    reply.simple_string("QUEUED");
+  } else {
+    session.watched.clear();
+    reply.simple_string("OK");
+  }
+}
+
+// answers a command that can't run in this context with why, and returns
+// whether it couldn't
+static bool refused(parsers::CommandSpec const &spec, commands::Args args,
+                    bool read_only, Session *session, Reply &reply) {
+  // in lowercase whatever the client sent, like redis
+  auto name = [&] {
+    std::string name(spec.name);
+    std::transform(name.begin(), name.end(), name.begin(), parsers::downcase);
+    return name;
+  };
+  if (!parsers::arity_fits(spec, args.size())) {
+    reject("ERR wrong number of arguments for '" + name() + "' command",
+           session, reply);
+  } else if (read_only and spec.flags & parsers::WRITE) {
+    reject("READONLY You can't write against a read only replica.", session,
+           reply);
+  } else if (session and session->subscribed() and
+             !(spec.flags & parsers::SUBSCRIBED)) {
+    reply.error("ERR Can't execute '" + name() +
+                "': only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING are allowed "
+                "in this context");
+  } else if (session and session->multi and spec.flags & parsers::ADMIN) {
+    reject("ERR Command not allowed inside a transaction", session, reply);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::optional<size_t> server_transact(Storage &storage, std::string_view in,
+                                      OutputBuffer &out, bool read_only,
+                                      Session *session) {
+  // one argument array per worker thread, reused for every command it parses
+  thread_local std::vector<std::string_view> args;
+  thread_local std::vector<std::string_view> keys;
+  auto cluster = cluster_node();
+
+  auto &stats = thread_stats();
+  Reply reply(out);
+  size_t consumed = 0;
+  // changes made here are the session's, which NOLOOP leaves out
+  set_tracking_caller(session ? session->subscriber.id : 0);
+
+  while (consumed < in.length()) {
+    auto len = parsers::parse_args(in.substr(consumed), args);
+
+    if (len == parsers::INCOMPLETE) {
+      break;
+    }
+    if (len == parsers::MALFORMED) {
+      reply.error("ERR protocol error");
+      return std::nullopt;
+    }
+    consumed += len;
+
+    if (args.empty()) {
+      continue;
+    }
+
+    auto spec = parsers::find_command(args[0]);
+    auto raw = in.substr(consumed - len, len);
+    if (!spec) {
+      reject("ERR unknown command '" + std::string(args[0]) + "'", session,
+             reply);
+      continue;
+    }
+
+    // ASKING lets in the command right after it, or a transaction through
+    // to its EXEC
+    bool asking = session and session->asking;
+    if (asking and !session->multi) {
+      session->asking = false;
+    }
+    if (refused(*spec, args, read_only, session, reply)) {
+      stats.commands[spec - parsers::COMMANDS].rejected.add();
+      continue;
+    }
+
+    std::string ask;
+    keys.clear();
+    bool tracked = session and session->tracking and
+                   spec->flags & parsers::READONLY;
+    if (session and (cluster or tracked)) {
+      parsers::command_keys(*spec, args, keys);
+    }
+    if (session and cluster) {
+      if (misrouted(*cluster, keys, asking or spec->flags & parsers::ASKING,
+                    *session, reply, ask)) {
+        stats.commands[spec - parsers::COMMANDS].rejected.add();
+        continue;
+      }
+    }
+
+    auto started = Clock::now();
+    uint64_t errors = stats.error_replies.get();
+    auto run = [&] {
+      auto command = spec->parse(spec->name, args);
+      std::visit([&](auto &command) { command.visit(storage, reply); },
+                 command);
+    };
+    if (session and session->subscribed() and spec->name == "PING") {
+      reply.array(2);
+      reply.bulk_string("pong");
+      reply.bulk_string(args.size() > 1 ? args[1] : "");
+    } else if (session and spec->flags & parsers::SESSION) {
+      run_session(spec->name, args, raw, storage, *session, reply);
+    } else if (session and session->multi) {
+      // counted when EXEC runs it
+      session->queued.append(raw);
+      reply.simple_string("QUEUED");
+      continue;
+    } else {
+      if (tracked) {
+        track_reads(session->subscriber.id, keys);
+      }
+      if (!ask.empty()) {
+        run_if_here(storage, keys, ask, reply, run);
+      } else {
+        run();
+      }
+    }
+    // once the command let go of its shards
+    flush_invalidations();
+    account(*spec, args, started, errors, session);
   }
 
-  out = oss.str();
+  return consumed;
 }
 
-std::string client_parse(buffer const &in) { return ""; }
\ No newline at end of file
+std::optional<size_t> client_parse(std::string_view in, Element *reply) {
+  size_t pos = parsers::parse_reply(in, 0, reply);
+  return pos == parsers::MALFORMED ? std::nullopt : std::make_optional(pos);
+}
\ No newline at end of file
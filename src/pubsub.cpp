@@ -0,0 +1,260 @@
+#include "pubsub.h"
+
+#include <sys/eventfd.h>
+
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+Mailbox::Mailbox() {
+  if (0 > (event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+    throw std::runtime_error("failed to create eventfd");
+  }
+}
+
+Mailbox::~Mailbox() {
+  for (auto delivery = head.load(); delivery;) {
+    std::unique_ptr<Delivery> dropped(delivery);
+    delivery = delivery->next;
+  }
+  close(event);
+}
+
+void Mailbox::push(Delivery *delivery) {
+  auto old = head.load(std::memory_order_relaxed);
+  do {
+    delivery->next = old;
+  } while (!head.compare_exchange_weak(old, delivery,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed));
+
+  if (!old) {
+    uint64_t one = 1;
+    [[maybe_unused]] auto len = write(event, &one, sizeof(one));
+  }
+}
+
+namespace {
+
+// lets the maps be probed with a string_view
+struct StringHash {
+  using is_transparent = void;
+
+  size_t operator()(std::string_view string) const {
+    return std::hash<std::string_view>{}(string);
+  }
+};
+
+using Audiences =
+    std::unordered_map<std::string, std::shared_ptr<Audience const>,
+                       StringHash, std::equal_to<>>;
+
+struct Registry {
+  std::shared_mutex lock;
+  Audiences channels;
+  Audiences patterns;
+};
+
+// never destroyed, since workers may still publish while the process exits
+Registry &registry() {
+  static auto &registry = *new Registry();
+  return registry;
+}
+
+bool contains(Audience const &audience, Subscriber const &subscriber) {
+  for (auto &group : audience.groups) {
+    if (group.mailbox == subscriber.mailbox) {
+      return std::any_of(
+          group.targets.begin(), group.targets.end(),
+          [&](auto &target) { return target.id == subscriber.id; });
+    }
+  }
+  return false;
+}
+
+// a copy of audience with the subscriber added or taken out, or null if
+// that leaves nobody
+std::shared_ptr<Audience const> changed(Audience const *audience,
+                                        Subscriber const &subscriber,
+                                        bool add) {
+  auto copy = audience ? std::make_shared<Audience>(*audience)
+                       : std::make_shared<Audience>();
+  auto group = std::find_if(
+      copy->groups.begin(), copy->groups.end(),
+      [&](auto &group) { return group.mailbox == subscriber.mailbox; });
+
+  if (add) {
+    if (group == copy->groups.end()) {
+      group = copy->groups.insert(group, {subscriber.mailbox, {}});
+    }
+    group->targets.push_back({subscriber.sock, subscriber.id});
+    copy->count++;
+  } else {
+    std::erase_if(group->targets,
+                  [&](auto &target) { return target.id == subscriber.id; });
+    if (group->targets.empty()) {
+      copy->groups.erase(group);
+    }
+    copy->count--;
+  }
+  return copy->count ? copy : nullptr;
+}
+
+// a RESP array of bulk strings
+SharedValue encode(std::initializer_list<std::string_view> parts) {
+  auto encoded = std::make_shared<std::string>();
+  *encoded += "*" + std::to_string(parts.size()) + "\r\n";
+  for (auto part : parts) {
+    *encoded += "$" + std::to_string(part.length()) + "\r\n";
+    *encoded += part;
+    *encoded += "\r\n";
+  }
+  return encoded;
+}
+
+// one element of pattern against c, moving pos past it
+bool match_one(std::string_view pattern, size_t &pos, char c) {
+  if (pattern[pos] == '?') {
+    pos++;
+    return true;
+  }
+  if (pattern[pos] != '[') {
+    if (pattern[pos] == '\\' and pos + 1 < pattern.length()) {
+      pos++;
+    }
+    return pattern[pos++] == c;
+  }
+
+  size_t i = pos + 1;
+  bool negate = i < pattern.length() and pattern[i] == '^';
+  i += negate;
+  bool found = false;
+  while (i < pattern.length() and pattern[i] != ']') {
+    if (pattern[i] == '\\' and i + 1 < pattern.length()) {
+      found |= pattern[i + 1] == c;
+      i += 2;
+    } else if (i + 2 < pattern.length() and pattern[i + 1] == '-' and
+               pattern[i + 2] != ']') {
+      auto [low, high] = std::minmax(pattern[i], pattern[i + 2]);
+      found |= low <= c and c <= high;
+      i += 3;
+    } else {
+      found |= pattern[i] == c;
+      i++;
+    }
+  }
+  // an unterminated class runs to the end of the pattern, like redis
+  pos = std::min(i + 1, pattern.length());
+  return found != negate;
+}
+
+}  // namespace
+
+bool subscribe(std::string_view channel, bool pattern,
+               Subscriber const &subscriber) {
+  auto &registry = ::registry();
+  auto &audiences = pattern ? registry.patterns : registry.channels;
+  std::unique_lock guard(registry.lock);
+
+  auto iter = audiences.find(channel);
+  if (iter == audiences.end()) {
+    iter = audiences.emplace(channel, nullptr).first;
+  } else if (contains(*iter->second, subscriber)) {
+    return false;
+  }
+  iter->second = changed(iter->second.get(), subscriber, true);
+  return true;
+}
+
+bool unsubscribe(std::string_view channel, bool pattern,
+                 Subscriber const &subscriber) {
+  auto &registry = ::registry();
+  auto &audiences = pattern ? registry.patterns : registry.channels;
+  std::unique_lock guard(registry.lock);
+
+  auto iter = audiences.find(channel);
+  if (iter == audiences.end() or !contains(*iter->second, subscriber)) {
+    return false;
+  }
+  if (!(iter->second = changed(iter->second.get(), subscriber, false))) {
+    audiences.erase(iter);
+  }
+  return true;
+}
+
+size_t subscribed_count(bool pattern) {
+  auto &registry = ::registry();
+  std::shared_lock guard(registry.lock);
+  return (pattern ? registry.patterns : registry.channels).size();
+}
+
+size_t publish(std::string_view channel, std::string_view message) {
+  auto &registry = ::registry();
+  // what to send to whom, reused by every publish on this thread
+  thread_local std::vector<
+      std::pair<SharedValue, std::shared_ptr<Audience const>>>
+      sends;
+
+  {
+    std::shared_lock guard(registry.lock);
+
+    if (auto iter = registry.channels.find(channel);
+        iter != registry.channels.end()) {
+      sends.emplace_back(encode({"message", channel, message}), iter->second);
+    }
+    for (auto &[pattern, audience] : registry.patterns) {
+      if (glob_match(pattern, channel)) {
+        sends.emplace_back(encode({"pmessage", pattern, channel, message}),
+                           audience);
+      }
+    }
+  }
+
+  size_t receivers = 0;
+  for (auto &[encoded, audience] : sends) {
+    receivers += audience->count;
+    for (size_t i = 0; i < audience->groups.size(); i++) {
+      audience->groups[i].mailbox->push(
+          new Delivery{.message = encoded, .audience = audience, .group = i});
+    }
+  }
+  sends.clear();
+  return receivers;
+}
+
+// backtracks to the last star on a mismatch, letting it absorb one more
+// character, which is all the backtracking a glob needs
+bool glob_match(std::string_view pattern, std::string_view string) {
+  size_t p = 0;
+  size_t s = 0;
+  size_t star = std::string_view::npos;
+  size_t absorbed = 0;
+
+  while (s < string.length()) {
+    if (p < pattern.length() and pattern[p] == '*') {
+      star = ++p;
+      absorbed = s;
+      continue;
+    }
+    size_t next = p;
+    if (p < pattern.length() and match_one(pattern, next, string[s])) {
+      p = next;
+      s++;
+    } else if (star != std::string_view::npos) {
+      p = star;
+      s = ++absorbed;
+    } else {
+      return false;
+    }
+  }
+  while (p < pattern.length() and pattern[p] == '*') {
+    p++;
+  }
+  return p == pattern.length();
+}
@@ -0,0 +1,462 @@
+#include "replication.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+
+#include "log.h"
+#include "protocol.h"
+#include "snapshot.h"
+
+// how often the feeder moves the stream along, which bounds replica lag
+const auto FEED_INTERVAL = std::chrono::milliseconds(10);
+const auto RECONNECT_INTERVAL = std::chrono::seconds(1);
+// a replica this far behind is dropped and has to sync again, like redis's
+// client-output-buffer-limit for replicas
+const size_t MAX_REPLICA_PENDING = 256 * 1024 * 1024;
+const size_t REPLID_LEN = 40;
+
+static std::string make_replid() {
+  std::random_device random;
+  std::string replid;
+
+  while (replid.length() < REPLID_LEN) {
+    replid += "0123456789abcdef"[random() % 16];
+  }
+  return replid;
+}
+
+Primary::Link::~Link() {
+  if (snapshot) {
+    munmap(snapshot, snapshot_len);
+  }
+  close(sock);
+}
+
+Primary::Primary(Storage &storage, size_t backlog_size)
+    : storage(storage), replid(make_replid()), backlog(backlog_size, '\0') {}
+
+Primary::~Primary() {
+  {
+    std::lock_guard guard(lock);
+    running = false;
+  }
+  wake.notify_all();
+  if (feeder.joinable()) {
+    feeder.join();
+  }
+  if (syncer.joinable()) {
+    syncer.join();
+  }
+  for (int sock : waiting) {
+    close(sock);
+  }
+}
+
+void Primary::start() {
+  running = true;
+  feeder = std::thread(&Primary::feed_loop, this);
+  syncer = std::thread(&Primary::sync_loop, this);
+}
+
+void Primary::propagate() {
+  drained.clear();
+  storage.drain_replication(drained);
+  if (drained.empty()) {
+    return;
+  }
+
+  for (auto &link : links) {
+    link->out.append(drained);
+  }
+
+  // keep the tail of the stream for partial resyncs
+  std::string_view data(drained);
+  if (data.length() > backlog.size()) {
+    offset += data.length() - backlog.size();
+    data.remove_prefix(data.length() - backlog.size());
+  }
+  while (!data.empty()) {
+    size_t at = offset % backlog.size();
+    size_t len = std::min(data.length(), backlog.size() - at);
+    memcpy(backlog.data() + at, data.data(), len);
+    offset += len;
+    data.remove_prefix(len);
+  }
+}
+
+void Primary::attach(int sock, std::string_view from_replid,
+                     int64_t from_offset) {
+  std::unique_lock guard(lock);
+  uint64_t held = std::min<uint64_t>(offset, backlog.size());
+
+  if (from_replid != replid or from_offset < 0 or
+      uint64_t(from_offset) > offset or
+      uint64_t(from_offset) < offset - held) {
+    waiting.push_back(sock);
+    guard.unlock();
+    wake.notify_all();
+    return;
+  }
+
+  auto link = std::make_unique<Link>(sock);
+  link->preamble = "+CONTINUE\r\n";
+  for (uint64_t at = from_offset; at < offset;) {
+    size_t index = at % backlog.size();
+    size_t len = std::min<uint64_t>(offset - at, backlog.size() - index);
+    link->out.append(backlog, index, len);
+    at += len;
+  }
+  link->ready = true;
+  links.push_back(std::move(link));
+}
+
+void Primary::feed_loop() {
+  std::unique_lock guard(lock);
+
+  while (running) {
+    wake.wait_for(guard, FEED_INTERVAL, [&] { return !running; });
+    propagate();
+
+    // links still waiting for their snapshot belong to the syncer
+    std::erase_if(links, [&](auto &link) {
+      if (!link->ready) {
+        return false;
+      }
+      if (link->out.size() - link->out_sent > MAX_REPLICA_PENDING) {
+        write_log(LogLevel::WARNING,
+                  "replica fell too far behind, dropping it");
+        return true;
+      }
+      return !serve(*link);
+    });
+  }
+}
+
+bool Primary::serve(Link &link) {
+  // replicas send nothing we act on, but reading is how a hang up shows
+  char discard[512];
+  ssize_t len;
+  while (0 < (len = recv(link.sock, discard, sizeof(discard), MSG_DONTWAIT))) {
+  }
+  if (0 == len or (errno != EAGAIN and errno != EWOULDBLOCK)) {
+    return false;
+  }
+
+  auto send_all = [&](std::string_view data, size_t &sent) {
+    while (sent < data.length()) {
+      ssize_t written = send(link.sock, data.data() + sent,
+                             data.length() - sent, MSG_NOSIGNAL);
+      if (0 > written) {
+        return errno == EAGAIN or errno == EWOULDBLOCK ? 0 : -1;
+      }
+      sent += written;
+    }
+    return 1;
+  };
+
+  size_t preamble_sent = 0;
+  int done = send_all(link.preamble, preamble_sent);
+  link.preamble.erase(0, preamble_sent);
+  if (1 != done) {
+    return 0 == done;
+  }
+
+  if (link.snapshot) {
+    if (1 != (done = send_all(std::string_view(link.snapshot,
+                                               link.snapshot_len),
+                              link.snapshot_sent))) {
+      return 0 == done;
+    }
+    munmap(link.snapshot, link.snapshot_len);
+    link.snapshot = nullptr;
+  }
+
+  done = send_all(link.out, link.out_sent);
+  if (link.out_sent == link.out.size()) {
+    link.out.clear();
+    link.out_sent = 0;
+  } else if (link.out_sent >= link.out.size() / 2) {
+    link.out.erase(0, link.out_sent);
+    link.out_sent = 0;
+  }
+  return 0 <= done;
+}
+
+void Primary::sync_loop() {
+  std::unique_lock guard(lock);
+
+  while (true) {
+    wake.wait(guard, [&] { return !waiting.empty() or !running; });
+    if (!running) {
+      return;
+    }
+    int sock = waiting.front();
+    waiting.pop_front();
+
+    guard.unlock();
+    full_sync(sock);
+    guard.lock();
+  }
+}
+
+void Primary::full_sync(int sock) {
+  int fd = memfd_create("sider-sync", MFD_CLOEXEC);
+  if (0 > fd) {
+    write_log(LogLevel::WARNING, "failed to create a snapshot for a replica");
+    close(sock);
+    return;
+  }
+
+  Link *link = nullptr;
+  uint64_t start = 0;
+  bool written = false;
+  try {
+    write_snapshot(storage, fd, [&] {
+      // every shard is locked, so whatever the stream holds so far comes
+      // before the snapshot and everything after it comes after
+      std::lock_guard guard(lock);
+      storage.start_replication();
+      propagate();
+      start = offset;
+
+      links.push_back(std::make_unique<Link>(sock));
+      link = links.back().get();
+    });
+    written = true;
+  } catch (std::runtime_error const &e) {
+    write_log(LogLevel::WARNING, "failed to snapshot for a replica: ",
+              e.what());
+  }
+
+  size_t len = lseek(fd, 0, SEEK_END);
+  auto snapshot = written ? (char *)mmap(nullptr, len, PROT_READ, MAP_SHARED,
+                                         fd, 0)
+                          : (char *)MAP_FAILED;
+  close(fd);
+
+  std::lock_guard guard(lock);
+  if (!link) {
+    close(sock);
+    return;
+  }
+  if (snapshot == MAP_FAILED) {
+    std::erase_if(links, [&](auto &other) { return other.get() == link; });
+    return;
+  }
+
+  link->preamble = "+FULLRESYNC " + replid + " " + std::to_string(start) +
+                   "\r\n$" + std::to_string(len) + "\r\n";
+  link->snapshot = snapshot;
+  link->snapshot_len = len;
+  link->ready = true;
+}
+
+Primary::Stats Primary::stats() {
+  std::lock_guard guard(lock);
+  return {.replid = replid,
+          .offset = offset,
+          .replicas = links.size(),
+          .backlog_size = backlog.size()};
+}
+
+Replica::Replica(Storage &storage, std::string host, uint16_t port)
+    : storage(storage), host(std::move(host)), port(port) {}
+
+Replica::~Replica() {
+  if (thread.joinable()) {
+    running = false;
+    // wakes the thread out of a blocking read
+    int linked_sock = sock;
+    if (0 <= linked_sock) {
+      shutdown(linked_sock, SHUT_RDWR);
+    }
+    thread.join();
+  }
+}
+
+void Replica::start() {
+  running = true;
+  thread = std::thread(&Replica::run, this);
+}
+
+void Replica::run() {
+  while (running) {
+    try {
+      sync();
+    } catch (std::runtime_error const &e) {
+      if (running) {
+        write_log(LogLevel::WARNING, "replication error: ", e.what());
+      }
+    }
+    linked = false;
+    if (0 <= sock) {
+      close(sock.exchange(-1));
+    }
+
+    auto until = std::chrono::steady_clock::now() + RECONNECT_INTERVAL;
+    while (running and std::chrono::steady_clock::now() < until) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+  }
+}
+
+int connect_to(std::string const &host, uint16_t port) {
+  addrinfo hints{.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  addrinfo *addrs;
+  if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints,
+                  &addrs)) {
+    throw std::runtime_error("failed to resolve " + host);
+  }
+
+  int linked_sock = -1;
+  for (auto addr = addrs; addr; addr = addr->ai_next) {
+    if (0 > (linked_sock = socket(addr->ai_family,
+                                  addr->ai_socktype | SOCK_CLOEXEC, 0))) {
+      continue;
+    }
+    if (!connect(linked_sock, addr->ai_addr, addr->ai_addrlen)) {
+      break;
+    }
+    close(linked_sock);
+    linked_sock = -1;
+  }
+  freeaddrinfo(addrs);
+
+  if (0 > linked_sock) {
+    throw std::runtime_error("failed to connect to " + host + ":" +
+                             std::to_string(port));
+  }
+  int opt = 1;
+  setsockopt(linked_sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  return linked_sock;
+}
+
+void Replica::sync() {
+  sock = connect_to(host, port);
+
+  std::string psync = "*3\r\n$5\r\nPSYNC\r\n";
+  auto arg = [&](std::string_view value) {
+    psync += "$" + std::to_string(value.length()) + "\r\n";
+    psync += value;
+    psync += "\r\n";
+  };
+  arg(replid);
+  arg(std::to_string(offset.load()));
+  if (0 > send(sock, psync.data(), psync.length(), MSG_NOSIGNAL)) {
+    throw std::runtime_error("lost the primary");
+  }
+
+  InputBuffer in;
+  auto read_more = [&](size_t min_free = READ_CHUNK) {
+    auto [tail, free] = in.prepare(min_free);
+    ssize_t len = recv(sock, tail, free, 0);
+    if (0 >= len) {
+      throw std::runtime_error("lost the primary");
+    }
+    in.commit(len);
+  };
+  auto read_line = [&] {
+    size_t end;
+    while ((end = in.view().find("\r\n")) == std::string_view::npos) {
+      read_more();
+    }
+    std::string line(in.view().substr(0, end));
+    in.consume(end + 2);
+    return line;
+  };
+
+  auto line = read_line();
+  if (line.starts_with("+FULLRESYNC ")) {
+    auto space = line.find(' ', 12);
+    if (space == std::string::npos) {
+      throw std::runtime_error("bad reply to PSYNC: " + line);
+    }
+    auto new_replid = line.substr(12, space - 12);
+    int64_t new_offset = strtoll(line.c_str() + space + 1, nullptr, 10);
+
+    auto header = read_line();
+    if (!header.starts_with("$")) {
+      throw std::runtime_error("bad snapshot from the primary");
+    }
+    size_t len = strtoull(header.c_str() + 1, nullptr, 10);
+    while (in.view().length() < len) {
+      read_more(std::max(READ_CHUNK, len - in.view().length()));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    storage.clear();
+    auto keys = load_snapshot(storage, in.view().substr(0, len));
+    in.consume(len);
+    // whatever the append-only file held before is stale now
+    storage.request_rewrite();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    write_log(LogLevel::NOTICE, "synced ", keys, " keys from the primary in ",
+              elapsed.count(), "ms");
+
+    {
+      std::lock_guard guard(replid_lock);
+      replid = new_replid;
+    }
+    offset = new_offset;
+  } else if (line != "+CONTINUE") {
+    throw std::runtime_error("primary refused to sync: " + line);
+  }
+  linked = true;
+
+  OutputBuffer replies;
+  while (true) {
+    if (!in.empty()) {
+      auto consumed = server_transact(storage, in.view(), replies);
+      replies.clear();
+      if (!consumed) {
+        throw std::runtime_error("bad stream from the primary");
+      }
+      in.consume(*consumed);
+      offset += *consumed;
+    }
+    read_more();
+  }
+}
+
+Replica::Stats Replica::stats() {
+  std::lock_guard guard(replid_lock);
+  return {.host = host,
+          .port = port,
+          .linked = linked,
+          .replid = replid,
+          .offset = offset};
+}
+
+static thread_local std::optional<PsyncRequest> psync_request;
+
+void request_psync(std::string_view replid, int64_t offset) {
+  psync_request = PsyncRequest{std::string(replid), offset};
+}
+
+std::optional<PsyncRequest> take_psync_request() {
+  return std::exchange(psync_request, std::nullopt);
+}
+
+static Primary *primary_role = nullptr;
+static Replica *replica_role = nullptr;
+
+void set_replication_role(Primary *primary, Replica *replica) {
+  primary_role = primary;
+  replica_role = replica;
+}
+
+Primary *replication_primary() { return primary_role; }
+
+Replica *replication_replica() { return replica_role; }
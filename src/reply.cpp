@@ -0,0 +1,115 @@
+#include "reply.h"
+
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+
+#include "metrics.h"
+
+// a drained buffer keeps its capacity for the next batch unless it grew past
+// this, so one huge pipeline doesn't pin memory for the connection lifetime
+const size_t MAX_RETAINED = 64 * 1024;
+
+ssize_t OutputBuffer::write_to(int sock) {
+  std::array<iovec, IOV_MAX> iov;
+  msghdr msg{.msg_iov = iov.data(), .msg_iovlen = gather(iov)};
+
+  ssize_t written = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  if (0 <= written) {
+    consume(written);
+  }
+  return written;
+}
+
+size_t OutputBuffer::gather(std::span<iovec> iov) const {
+  size_t iov_len = 0;
+
+  for (size_t i = head; i < chunks.size() and iov_len < iov.size(); i++) {
+    auto view = chunks[i].view();
+    size_t skip = i == head ? offset : 0;
+
+    if (view.length() > skip) {
+      iov[iov_len++] = {.iov_base = (void *)(view.data() + skip),
+                        .iov_len = view.length() - skip};
+    }
+  }
+  return iov_len;
+}
+
+void OutputBuffer::consume(size_t written) {
+  pending -= written;
+  size_t left = written;
+  while (head < chunks.size()) {
+    auto &chunk = chunks[head];
+    size_t remaining = chunk.view().length() - offset;
+
+    if (left < remaining) {
+      offset += left;
+      break;
+    }
+    left -= remaining;
+    offset = 0;
+    chunk.value.reset();
+    chunk.bytes.clear();
+    head++;
+  }
+
+  if (pending == 0) {
+    chunks.resize(1);
+    if (chunks[0].bytes.capacity() > MAX_RETAINED) {
+      std::string().swap(chunks[0].bytes);
+    }
+    head = 0;
+    offset = 0;
+  }
+}
+
+void Reply::number_line(char prefix, int64_t number) {
+  std::array<char, 24> line;
+  line[0] = prefix;
+
+  auto res = std::to_chars(line.begin() + 1, line.end() - 2, number);
+  *res.ptr++ = '\r';
+  *res.ptr++ = '\n';
+
+  out.append(std::string_view(line.begin(), res.ptr));
+}
+
+void Reply::simple_string(std::string_view string) {
+  out.append('+');
+  out.append(string);
+  out.append("\r\n");
+}
+
+void Reply::error(std::string_view message) {
+  thread_stats().error_replies.add();
+  out.append('-');
+  out.append(message);
+  out.append("\r\n");
+}
+
+void Reply::integer(int64_t integer) { number_line(':', integer); }
+
+void Reply::bulk_string(std::string_view string) {
+  number_line('$', string.length());
+  out.append(string);
+  out.append("\r\n");
+}
+
+void Reply::bulk_string(SharedValue const &value) {
+  number_line('$', value->length());
+  out.append(value);
+  out.append("\r\n");
+}
+
+void Reply::null_bulk_string() { out.append("$-1\r\n"); }
+
+void Reply::array(size_t len) { number_line('*', len); }
+
+void Reply::null_array() { out.append("*-1\r\n"); }
+
+void Reply::map(size_t len) { number_line('%', len); }
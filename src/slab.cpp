@@ -0,0 +1,243 @@
+#include "slab.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <bit>
+#include <mutex>
+#include <new>
+#include <vector>
+
+struct Slab::Page {
+  Slab *owner;
+  // neighbours on the class's partial list
+  Page *prev;
+  Page *next;
+  // objects freed back to this page
+  void *free;
+  // objects never handed out yet start here
+  char *bump;
+  uint32_t live;
+  uint32_t capacity;
+  uint32_t size;
+  uint16_t size_class;
+  bool partial;
+};
+
+// pages come from big aligned mappings shared by every slab. malloc's
+// aligned_alloc would leave a page-sized hole next to each page, so the
+// pool carves them out of 4MB chunks itself and gives freed pages' memory
+// back to the kernel, keeping the address range for the next page. taking
+// a page is rare enough that one lock for all shards costs nothing
+class PagePool {
+  static constexpr size_t CHUNK = 4 * 1024 * 1024;
+
+  std::mutex lock;
+  std::vector<void *> free_pages;
+
+ public:
+  void *take() {
+    std::lock_guard guard(lock);
+
+    if (free_pages.empty()) {
+      // over-map by a page so the chunk can be trimmed to page alignment
+      auto mapped = (char *)mmap(nullptr, CHUNK + Slab::PAGE,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mapped == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      auto chunk =
+          (char *)(((uintptr_t)mapped + Slab::PAGE - 1) & ~(Slab::PAGE - 1));
+      if (chunk != mapped) {
+        munmap(mapped, chunk - mapped);
+      }
+      munmap(chunk + CHUNK, mapped + Slab::PAGE - chunk);
+
+      // handed out from the front of the chunk first
+      for (size_t offset = CHUNK; offset > 0; offset -= Slab::PAGE) {
+        free_pages.push_back(chunk + offset - Slab::PAGE);
+      }
+    }
+
+    auto page = free_pages.back();
+    free_pages.pop_back();
+    return page;
+  }
+
+  void give_back(void *page) {
+    madvise(page, Slab::PAGE, MADV_DONTNEED);
+    std::lock_guard guard(lock);
+    free_pages.push_back(page);
+  }
+};
+
+static PagePool page_pool;
+
+// large blocks carry their owner in front so release can find it
+struct alignas(16) LargeHeader {
+  Slab *owner;
+};
+
+// 16 byte steps up to 128, then four steps per power of two
+static size_t class_of(size_t size) {
+  if (size <= 128) {
+    return size ? (size - 1) / 16 : 0;
+  }
+  size_t bits = std::bit_width(size - 1);
+  size_t step = 1ul << (bits - 3);
+  return 8 + (bits - 8) * 4 + (size - 1) / step - 4;
+}
+
+static size_t class_size(size_t size_class) {
+  if (size_class < 8) {
+    return (size_class + 1) * 16;
+  }
+  size_t bits = 8 + (size_class - 8) / 4;
+  return (1ul << (bits - 1)) + ((size_class - 8) % 4 + 1) * (1ul << (bits - 3));
+}
+
+Slab::Page *Slab::new_page(size_t size_class) {
+  void *memory = spare;
+  if (memory) {
+    spare = nullptr;
+  } else {
+    memory = page_pool.take();
+    stats.reserved += PAGE;
+    stats.pages++;
+  }
+
+  auto page = new (memory) Page;
+  size_t size = class_size(size_class);
+  size_t header = (sizeof(Page) + 15) & ~15ul;
+
+  page->owner = this;
+  page->prev = nullptr;
+  page->next = classes[size_class].partial;
+  page->free = nullptr;
+  page->bump = (char *)memory + header;
+  page->live = 0;
+  page->capacity = (PAGE - header) / size;
+  page->size = size;
+  page->size_class = size_class;
+  page->partial = true;
+
+  if (page->next) {
+    page->next->prev = page;
+  }
+  classes[size_class].partial = page;
+  return page;
+}
+
+void Slab::unlink(Page *page) {
+  if (page->prev) {
+    page->prev->next = page->next;
+  } else {
+    classes[page->size_class].partial = page->next;
+  }
+  if (page->next) {
+    page->next->prev = page->prev;
+  }
+  page->prev = page->next = nullptr;
+  page->partial = false;
+}
+
+void *Slab::allocate(size_t size) {
+  if (size > MAX_CLASS) {
+    auto header = (LargeHeader *)malloc(sizeof(LargeHeader) + size);
+    if (!header) {
+      throw std::bad_alloc();
+    }
+    header->owner = this;
+    stats.used += size;
+    stats.allocated += size;
+    stats.reserved += sizeof(LargeHeader) + size;
+    return header + 1;
+  }
+
+  size_t size_class = class_of(size);
+  auto page = classes[size_class].partial;
+  if (!page) {
+    page = new_page(size_class);
+  }
+
+  void *ptr;
+  if (page->free) {
+    ptr = page->free;
+    page->free = *(void **)ptr;
+  } else {
+    ptr = page->bump;
+    page->bump += page->size;
+  }
+
+  if (++page->live == page->capacity) {
+    unlink(page);
+  }
+  stats.used += size;
+  stats.allocated += page->size;
+  return ptr;
+}
+
+void Slab::release_small(Page *page, void *ptr, size_t size) {
+  *(void **)ptr = page->free;
+  page->free = ptr;
+  page->live--;
+  stats.used -= size;
+  stats.allocated -= page->size;
+
+  if (page->live == 0) {
+    // one empty page is kept for whichever class needs a page next, so a
+    // key count hovering on a page boundary doesn't allocate and free it
+    // over and over
+    if (page->partial) {
+      unlink(page);
+    }
+    page->~Page();
+    if (spare) {
+      page_pool.give_back(page);
+      stats.reserved -= PAGE;
+      stats.pages--;
+    } else {
+      spare = page;
+    }
+  } else if (!page->partial) {
+    auto &size_class = classes[page->size_class];
+
+    page->partial = true;
+    page->next = size_class.partial;
+    if (page->next) {
+      page->next->prev = page;
+    }
+    size_class.partial = page;
+  }
+}
+
+void Slab::release(void *ptr, size_t size) {
+  if (size > MAX_CLASS) {
+    auto header = (LargeHeader *)ptr - 1;
+    auto &stats = header->owner->stats;
+    stats.used -= size;
+    stats.allocated -= size;
+    stats.reserved -= sizeof(LargeHeader) + size;
+    free(header);
+    return;
+  }
+
+  auto page = (Page *)((uintptr_t)ptr & ~(PAGE - 1));
+  page->owner->release_small(page, ptr, size);
+}
+
+Slab::~Slab() {
+  // whatever is still allocated belongs to cells destroyed before us, so
+  // only the spare pages remain
+  for (auto &size_class : classes) {
+    while (auto page = size_class.partial) {
+      unlink(page);
+      page->~Page();
+      page_pool.give_back(page);
+    }
+  }
+  if (spare) {
+    page_pool.give_back(spare);
+  }
+}
@@ -0,0 +1,103 @@
+#include "slowlog.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+
+const size_t MAX_ARGS = 32;
+const size_t MAX_ARG_LEN = 128;
+
+namespace {
+
+struct Slowlog {
+  // in nanoseconds, negative when off
+  std::atomic<int64_t> threshold = 10 * 1000 * 1000;
+  std::atomic<size_t> max_len = 128;
+
+  std::mutex lock;
+  // newest first
+  std::deque<SlowlogEntry> entries;
+  uint64_t next_id = 0;
+};
+
+// never destroyed, since workers may still run commands while the process
+// exits
+Slowlog &slowlog() {
+  static auto &slowlog = *new Slowlog();
+  return slowlog;
+}
+
+}  // namespace
+
+void set_slowlog_config(int64_t slower_than, size_t max_len) {
+  auto &slowlog = ::slowlog();
+  slowlog.threshold = slower_than < 0 ? -1 : slower_than * 1000;
+  slowlog.max_len = max_len;
+
+  std::lock_guard guard(slowlog.lock);
+  if (slowlog.entries.size() > max_len) {
+    slowlog.entries.resize(max_len);
+  }
+}
+
+bool slowlog_wants(uint64_t nanos) {
+  auto threshold = slowlog().threshold.load(std::memory_order_relaxed);
+  return 0 <= threshold and nanos >= uint64_t(threshold);
+}
+
+void slowlog_push(uint64_t nanos, std::span<std::string_view const> args,
+                  std::string_view client) {
+  auto &slowlog = ::slowlog();
+  SlowlogEntry entry{
+      .time = std::chrono::duration_cast<std::chrono::seconds>(
+                  std::chrono::system_clock::now().time_since_epoch())
+                  .count(),
+      .micros = nanos / 1000,
+      .client = std::string(client),
+  };
+
+  // the last kept argument says how many more there were
+  size_t kept = args.size() > MAX_ARGS ? MAX_ARGS - 1 : args.size();
+  for (size_t i = 0; i < kept; i++) {
+    if (args[i].length() > MAX_ARG_LEN) {
+      entry.args.push_back(std::string(args[i].substr(0, MAX_ARG_LEN)) +
+                           "... (" +
+                           std::to_string(args[i].length() - MAX_ARG_LEN) +
+                           " more bytes)");
+    } else {
+      entry.args.emplace_back(args[i]);
+    }
+  }
+  if (kept < args.size()) {
+    entry.args.push_back("... (" + std::to_string(args.size() - kept) +
+                         " more arguments)");
+  }
+
+  std::lock_guard guard(slowlog.lock);
+  entry.id = slowlog.next_id++;
+  slowlog.entries.push_front(std::move(entry));
+  if (slowlog.entries.size() > slowlog.max_len) {
+    slowlog.entries.pop_back();
+  }
+}
+
+std::vector<SlowlogEntry> slowlog_get(size_t count) {
+  auto &slowlog = ::slowlog();
+  std::lock_guard guard(slowlog.lock);
+  count = std::min(count, slowlog.entries.size());
+  return {slowlog.entries.begin(), slowlog.entries.begin() + count};
+}
+
+size_t slowlog_len() {
+  auto &slowlog = ::slowlog();
+  std::lock_guard guard(slowlog.lock);
+  return slowlog.entries.size();
+}
+
+void slowlog_reset() {
+  auto &slowlog = ::slowlog();
+  std::lock_guard guard(slowlog.lock);
+  slowlog.entries.clear();
+}
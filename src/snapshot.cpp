@@ -0,0 +1,410 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "cell.h"
+#include "checksum.h"
+#include "collection.h"
+#include "log.h"
+#include "storage.h"
+
+const char MAGIC[8] = {'S', 'I', 'D', 'E', 'R', 'S', 'N', 'P'};
+// version 1 had strings only, and reads the same
+const uint32_t VERSION = 2;
+const char TRAILER_MAGIC[4] = {'S', 'E', 'N', 'D'};
+// magic, version, padding, creation time
+const size_t HEADER_LEN = 24;
+// key count, its crc32c, magic
+const size_t TRAILER_LEN = 16;
+// block length and crc32c
+const size_t BLOCK_HEADER_LEN = 8;
+// records are cut into blocks of about this much, each checksummed alone
+const size_t BLOCK_LEN = 64 * 1024;
+
+template <typename T>
+static void put(std::string &out, T value) {
+  char bytes[sizeof(T)];
+  memcpy(bytes, &value, sizeof(T));
+  out.append(bytes, sizeof(T));
+}
+
+template <typename T>
+static T get(char const *bytes) {
+  T value;
+  memcpy(&value, bytes, sizeof(T));
+  return value;
+}
+
+static void put_varint(std::string &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(char(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(char(value));
+}
+
+static void append_value(std::string &out, DataCell const &value) {
+  if (value.get_type() == Type::STRING) {
+    IntBuffer scratch;
+    auto string = value.view(scratch);
+    put_varint(out, string.length());
+    out.append(string);
+  } else {
+    put_varint(out, element_count(value));
+    for_each_element(value, [&](std::string_view element) {
+      put_varint(out, element.length());
+      out.append(element);
+    });
+  }
+}
+
+namespace snapshot {
+
+void append_record(std::string &out, std::string_view key,
+                   DataCell const &value) {
+  auto expiry = value.expiry();
+  out.push_back(uint8_t(value.get_type()) << TYPE_SHIFT |
+                (expiry != NO_EXPIRY ? HAS_EXPIRY : 0));
+  if (expiry != NO_EXPIRY) {
+    put<int64_t>(out, expiry);
+  }
+  put_varint(out, key.length());
+  out.append(key);
+  append_value(out, value);
+}
+
+void append_payload(std::string &out, DataCell const &value) {
+  size_t start = out.length();
+  out.push_back(uint8_t(value.get_type()));
+  append_value(out, value);
+  put<uint32_t>(out, crc32c(out.data() + start, out.length() - start));
+}
+
+}  // namespace snapshot
+
+static void write_all(int fd, std::string_view data) {
+  while (!data.empty()) {
+    ssize_t written = write(fd, data.data(), data.length());
+    if (0 > written) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("failed to write snapshot");
+    }
+    data.remove_prefix(written);
+  }
+}
+
+// ends the snapshot in every shard even if writing it fails halfway, so
+// writers stop preserving entries for it
+struct SnapshotGuard {
+  Storage &storage;
+
+  ~SnapshotGuard() { storage.end_snapshot(); }
+};
+
+size_t write_snapshot(Storage &storage, int fd,
+                      std::function<void()> const &at_start) {
+  std::string out;
+
+  out.append(MAGIC, sizeof(MAGIC));
+  put<uint32_t>(out, VERSION);
+  put<uint32_t>(out, 0);
+  put<int64_t>(out, now_ms());
+  write_all(fd, out);
+  out.clear();
+
+  // room for the block header, filled in once the block's length is known
+  auto flush_block = [&] {
+    if (out.length() > BLOCK_HEADER_LEN) {
+      uint32_t len = out.length() - BLOCK_HEADER_LEN;
+      uint32_t crc = crc32c(out.data() + BLOCK_HEADER_LEN, len);
+      memcpy(out.data(), &len, sizeof(len));
+      memcpy(out.data() + sizeof(len), &crc, sizeof(crc));
+      write_all(fd, out);
+    }
+    out.assign(BLOCK_HEADER_LEN, '\0');
+  };
+
+  size_t keys = 0;
+  {
+    storage.begin_snapshot(at_start);
+    SnapshotGuard guard{storage};
+
+    out.assign(BLOCK_HEADER_LEN, '\0');
+    for (size_t i = 0; i < storage.shard_count(); i++) {
+      while (storage.snapshot_chunk(i, out, keys)) {
+        if (out.length() >= BLOCK_LEN) {
+          flush_block();
+        }
+      }
+    }
+    flush_block();
+  }
+
+  out.clear();
+  put<uint64_t>(out, keys);
+  put<uint32_t>(out, crc32c(out.data(), sizeof(uint64_t)));
+  out.append(TRAILER_MAGIC, sizeof(TRAILER_MAGIC));
+  write_all(fd, out);
+  return keys;
+}
+
+static std::string save_path = "dump.sdb";
+static std::atomic<bool> saving = false;
+
+void set_snapshot_path(std::string path) { save_path = std::move(path); }
+
+std::string const &snapshot_path() { return save_path; }
+
+static size_t save_to_path(Storage &storage) {
+  auto temp = save_path + ".tmp";
+  int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (0 > fd) {
+    throw std::runtime_error("failed to open snapshot file");
+  }
+
+  size_t keys;
+  try {
+    keys = write_snapshot(storage, fd);
+    if (fsync(fd)) {
+      throw std::runtime_error("failed to fsync snapshot");
+    }
+  } catch (std::runtime_error const &) {
+    close(fd);
+    unlink(temp.c_str());
+    throw;
+  }
+  close(fd);
+
+  if (rename(temp.c_str(), save_path.c_str())) {
+    unlink(temp.c_str());
+    throw std::runtime_error("failed to replace snapshot file");
+  }
+  return keys;
+}
+
+size_t save_snapshot(Storage &storage) {
+  if (saving.exchange(true)) {
+    throw std::runtime_error("a save is already in progress");
+  }
+  try {
+    size_t keys = save_to_path(storage);
+    saving = false;
+    return keys;
+  } catch (std::runtime_error const &) {
+    saving = false;
+    throw;
+  }
+}
+
+bool background_save(Storage &storage) {
+  if (saving.exchange(true)) {
+    return false;
+  }
+
+  std::thread([&storage] {
+    try {
+      save_to_path(storage);
+    } catch (std::runtime_error const &e) {
+      write_log(LogLevel::WARNING, "background save error: ", e.what());
+    }
+    saving = false;
+  }).detach();
+  return true;
+}
+
+bool save_in_progress() { return saving; }
+
+static std::runtime_error corrupt(std::string const &what) {
+  return std::runtime_error("snapshot is corrupt: " + what);
+}
+
+// reads a varint at pos, moving pos past it
+static uint64_t get_varint(std::string_view data, size_t &pos) {
+  uint64_t value = 0;
+
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos >= data.length()) {
+      throw corrupt("truncated record");
+    }
+    uint8_t byte = data[pos++];
+    value |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  throw corrupt("bad length");
+}
+
+static std::string_view get_bytes(std::string_view data, size_t &pos) {
+  uint64_t len = get_varint(data, pos);
+  if (len > data.length() - pos) {
+    throw corrupt("truncated record");
+  }
+  auto bytes = data.substr(pos, len);
+  pos += len;
+  return bytes;
+}
+
+namespace snapshot {
+
+std::optional<Type> parse_payload(std::string_view payload,
+                                  std::vector<std::string_view> &elements) {
+  if (payload.length() < 1 + sizeof(uint32_t)) {
+    return std::nullopt;
+  }
+  auto body = payload.substr(0, payload.length() - sizeof(uint32_t));
+  if (get<uint32_t>(payload.data() + body.length()) !=
+          crc32c(body.data(), body.length()) or
+      Type(body[0]) > Type::ZSET) {
+    return std::nullopt;
+  }
+
+  auto type = Type(body[0]);
+  size_t at = 1;
+  elements.clear();
+  try {
+    uint64_t count = type == Type::STRING ? 1 : get_varint(body, at);
+    for (; count > 0; count--) {
+      elements.push_back(get_bytes(body, at));
+    }
+  } catch (std::runtime_error const &) {
+    return std::nullopt;
+  }
+  if (at != body.length()) {
+    return std::nullopt;
+  }
+  return type;
+}
+
+}  // namespace snapshot
+
+size_t load_snapshot(Storage &storage, std::string_view data) {
+  if (data.length() < HEADER_LEN + TRAILER_LEN or
+      memcmp(data.data(), MAGIC, sizeof(MAGIC))) {
+    throw corrupt("bad header");
+  }
+  auto version = get<uint32_t>(data.data() + sizeof(MAGIC));
+  if (version != 1 and version != VERSION) {
+    throw std::runtime_error("unsupported snapshot version");
+  }
+
+  auto trailer = data.data() + data.length() - TRAILER_LEN;
+  uint64_t keys = get<uint64_t>(trailer);
+  if (get<uint32_t>(trailer + sizeof(keys)) != crc32c(trailer, sizeof(keys)) or
+      memcmp(trailer + sizeof(keys) + sizeof(uint32_t), TRAILER_MAGIC,
+             sizeof(TRAILER_MAGIC))) {
+    throw corrupt("bad trailer");
+  }
+
+  storage.reserve(keys);
+  auto now = now_ms();
+  size_t pos = HEADER_LEN, end = data.length() - TRAILER_LEN, loaded = 0;
+  // reused by every collection
+  std::vector<std::string_view> elements;
+
+  while (pos < end) {
+    if (end - pos < BLOCK_HEADER_LEN) {
+      throw corrupt("truncated block");
+    }
+    uint32_t len = get<uint32_t>(data.data() + pos);
+    uint32_t crc = get<uint32_t>(data.data() + pos + sizeof(len));
+    pos += BLOCK_HEADER_LEN;
+    if (len > end - pos) {
+      throw corrupt("truncated block");
+    }
+
+    auto block = data.substr(pos, len);
+    if (crc32c(block.data(), block.length()) != crc) {
+      throw corrupt("checksum mismatch at byte " + std::to_string(pos));
+    }
+    pos += len;
+
+    for (size_t at = 0; at < block.length(); loaded++) {
+      uint8_t flags = block[at++];
+      int64_t expiry = NO_EXPIRY;
+      if (flags & snapshot::HAS_EXPIRY) {
+        if (block.length() - at < sizeof(expiry)) {
+          throw corrupt("truncated record");
+        }
+        expiry = get<int64_t>(block.data() + at);
+        at += sizeof(expiry);
+      }
+      auto key = get_bytes(block, at);
+      auto type = Type(flags >> snapshot::TYPE_SHIFT);
+      if (type > Type::ZSET) {
+        throw corrupt("unknown type");
+      }
+
+      // keys that expired while the server was down stay gone
+      bool live = expiry == NO_EXPIRY or expiry > now;
+      if (type == Type::STRING) {
+        auto value = get_bytes(block, at);
+        if (live) {
+          storage.load(key, value, expiry);
+        }
+        continue;
+      }
+
+      elements.clear();
+      for (uint64_t n = get_varint(block, at); n > 0; n--) {
+        elements.push_back(get_bytes(block, at));
+      }
+      if (live and !storage.load(key, type, elements, expiry)) {
+        throw corrupt("bad collection");
+      }
+    }
+  }
+
+  if (loaded != keys) {
+    throw corrupt("expected " + std::to_string(keys) + " keys, found " +
+                  std::to_string(loaded));
+  }
+  return loaded;
+}
+
+size_t load_snapshot(Storage &storage, std::string const &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (0 > fd) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    throw std::runtime_error("failed to open snapshot");
+  }
+
+  struct stat info;
+  if (fstat(fd, &info)) {
+    close(fd);
+    throw std::runtime_error("failed to stat snapshot");
+  }
+  size_t length = info.st_size;
+
+  auto data = (char *)mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("failed to map snapshot");
+  }
+  madvise(data, length, MADV_SEQUENTIAL);
+
+  try {
+    size_t keys = load_snapshot(storage, std::string_view(data, length));
+    munmap(data, length);
+    return keys;
+  } catch (std::runtime_error const &) {
+    munmap(data, length);
+    throw;
+  }
+}
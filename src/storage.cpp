@@ -1,43 +1,1230 @@
 #include "storage.h"
 
+#include <algorithm>
+#include <bit>
 #include <charconv>
 #include <chrono>
+#include <functional>
 #include <mutex>
+#include <numeric>
 
-bool Storage::set(BulkString&& key, BulkString&& value,
-                  std::optional<BulkString> const& px) {
-  std::unique_lock guard(data_lock);
-  decltype(DataCell::expiry) expiry;
+#include "lazy_free.h"
+#include "snapshot.h"
+#include "tracking.h"
 
-  if (px) {
-    size_t ms;
-    auto res = std::from_chars(px->view().begin(), px->view().end(), ms);
-    if (res.ec == std::errc::invalid_argument) {
-      return false;
+// expired keys one shard gives up per lock hold, so the expiry cycle never
+// keeps writers waiting long
+const size_t EXPIRE_BATCH = 32;
+// index groups moved per shard per cycle, so resizes finish under read-only
+// traffic too
+const size_t REHASH_GROUPS = 64;
+// keys one SET may evict, so a write landing on a shard far over its limit
+// doesn't stall; the writes after it keep going
+const size_t EVICT_BATCH = 16;
+// entries a snapshot records per shard lock hold
+const size_t SNAPSHOT_CHUNK = 1024;
+// map groups a SCAN visits per shard lock hold
+const size_t SCAN_GROUPS = 64;
+// groups a SCAN visits per key it was asked for, like redis, so a call over
+// a sparse map still returns in bounded time
+const size_t SCAN_GROUPS_PER_KEY = 10;
+
+static const std::pair<EvictionPolicy, std::string_view> POLICY_NAMES[] = {
+    {EvictionPolicy::NOEVICTION, "noeviction"},
+    {EvictionPolicy::ALLKEYS_LRU, "allkeys-lru"},
+    {EvictionPolicy::ALLKEYS_LFU, "allkeys-lfu"},
+    {EvictionPolicy::VOLATILE_TTL, "volatile-ttl"},
+};
+
+std::optional<EvictionPolicy> parse_eviction_policy(std::string_view name) {
+  for (auto [policy, policy_name] : POLICY_NAMES) {
+    if (name == policy_name) {
+      return policy;
+    }
+  }
+  return std::nullopt;
+}
+
+std::string_view eviction_policy_name(EvictionPolicy policy) {
+  for (auto [candidate, name] : POLICY_NAMES) {
+    if (candidate == policy) {
+      return name;
+    }
+  }
+  return {};
+}
+
+Storage::Storage(size_t shard_count, MaxMemory max_memory, bool slotted)
+    : shard_bits(std::countr_zero(std::bit_ceil(std::max(shard_count, 1ul)))),
+      slotted(slotted),
+      max_memory(max_memory) {
+  // a slot never spans shards
+  if (slotted) {
+    shard_bits = std::min<size_t>(shard_bits, CLUSTER_SLOT_BITS);
+    slot_keys = std::make_unique<uint32_t[]>(CLUSTER_SLOTS);
+    slot_cursors = std::make_unique<std::atomic<uint32_t>[]>(CLUSTER_SLOTS);
+  }
+  shard_limit =
+      max_memory.bytes ? std::max(max_memory.bytes >> shard_bits, 1ul) : 0;
+  shards = std::make_unique<Shard[]>(1ul << shard_bits);
+}
+
+void Storage::track_expiry(Shard& shard, uint64_t hash, int64_t expiry) {
+  if (expiry != NO_EXPIRY) {
+    shard.expiries.emplace_back(expiry, hash);
+    std::push_heap(shard.expiries.begin(), shard.expiries.end(),
+                   std::greater<>());
+  }
+}
+
+size_t Storage::footprint(Map::Entry const& entry) {
+  return sizeof(entry) + entry.key.allocated() + entry.value.allocated();
+}
+
+void Storage::mark_changed(Shard& shard, Map::Entry& entry) {
+  entry.value.set_version(++shard.writes);
+  invalidate_key(entry.key.view());
+}
+
+void Storage::save_for_snapshot(Shard& shard, Map::Entry& entry) {
+  if (!shard.snapshotting or
+      entry.value.snapshot_epoch() == shard.snapshot_epoch) {
+    return;
+  }
+  if (!entry.value.expired()) {
+    snapshot::append_record(shard.snapshot_saved, entry.key.view(),
+                            entry.value);
+    shard.snapshot_saved_keys++;
+  }
+  entry.value.set_snapshot_epoch(shard.snapshot_epoch);
+}
+
+void Storage::remove(Shard& shard, Map::Entry& entry, bool lazy) {
+  preserve(shard, entry);
+  discard(shard, entry, lazy);
+}
+
+void Storage::discard(Shard& shard, Map::Entry& entry, bool lazy) {
+  shard.stored -= footprint(entry);
+  if (slotted) {
+    slot_keys[entry.hash >> SLOT_SHIFT]--;
+  }
+  if (lazy) {
+    entry.value.free_lazily();
+  }
+  shard.data.erase(entry);
+}
+
+// the key the policy would rather lose, out of a random sample for lru and
+// lfu, or the one expiring soonest for volatile-ttl
+Storage::Map::Entry* Storage::eviction_candidate(Shard& shard) {
+  auto& data = shard.data;
+
+  if (max_memory.policy == EvictionPolicy::VOLATILE_TTL) {
+    auto& heap = shard.expiries;
+
+    while (!heap.empty()) {
+      auto [expiry, hash] = heap.front();
+      auto entry = data.find_if(hash, [&](auto& candidate) {
+        return candidate.value.expiry() == expiry;
+      });
+      if (entry) {
+        return entry;
+      }
+      std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+      heap.pop_back();
+    }
+    return nullptr;
+  }
+
+  if (max_memory.policy == EvictionPolicy::NOEVICTION or !data.size()) {
+    return nullptr;
+  }
+
+  Map::Entry* best = nullptr;
+  uint32_t best_score = 0;
+
+  for (size_t i = 0; i < max_memory.samples; i++) {
+    shard.random ^= shard.random << 13;
+    shard.random ^= shard.random >> 7;
+    shard.random ^= shard.random << 17;
+
+    auto& candidate = data.at(shard.random % data.size());
+    // higher is a better victim
+    uint32_t score = max_memory.policy == EvictionPolicy::ALLKEYS_LRU
+                         ? candidate.value.idle()
+                         : 255 - candidate.value.frequency();
+    if (!best or score > best_score) {
+      best = &candidate;
+      best_score = score;
+    }
+  }
+  return best;
+}
+
+bool Storage::make_room(Shard& shard) {
+  size_t evicted = 0;
+
+  while (shard.stored > shard_limit and evicted < EVICT_BATCH) {
+    auto victim = eviction_candidate(shard);
+    if (!victim) {
+      break;
     }
-    expiry = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    // replicas don't evict on their own
+    if (propagating()) {
+      log(shard, {"DEL", victim->key.view()});
+    }
+    remove(shard, *victim);
+    evicted++;
+  }
+
+  shard.evicted += evicted;
+  return shard.stored <= shard_limit or evicted;
+}
+
+// counts this thread's log appends for logged_by_thread
+static thread_local size_t logged = 0;
+
+size_t Storage::logged_by_thread() { return logged; }
+
+static void append_line(std::string& out, char prefix, size_t n) {
+  char digits[24];
+  digits[0] = prefix;
+  auto end = std::to_chars(digits + 1, digits + sizeof(digits) - 2, n).ptr;
+  *end++ = '\r';
+  *end++ = '\n';
+  out.append(digits, end);
+}
+
+static void append_arg(std::string& out, std::string_view arg) {
+  append_line(out, '$', arg.length());
+  out.append(arg);
+  out.append("\r\n");
+}
+
+// appends args as a RESP array, the form log entries are replayed from
+static void append_command(std::string& out,
+                           std::span<std::string_view const> args) {
+  append_line(out, '*', args.size());
+  for (auto arg : args) {
+    append_arg(out, arg);
   }
+}
+
+static void append_command(std::string& out,
+                           std::initializer_list<std::string_view> args) {
+  append_command(out, std::span(args.begin(), args.end()));
+}
+
+// elements per command when a collection is recreated, so a big one doesn't
+// turn into a single huge entry. even, so pairs stay together
+const size_t RESTORE_BATCH = 64;
+
+static std::string_view add_command(Type type) {
+  switch (type) {
+    case Type::HASH:
+      return "HSET";
+    case Type::LIST:
+      return "RPUSH";
+    case Type::SET:
+      return "SADD";
+    case Type::ZSET:
+      return "ZADD";
+    case Type::STRING:
+      break;
+  }
+  return "SET";
+}
+
+void Storage::append_restore(std::string& out, Map::Entry const& entry) {
+  auto& value = entry.value;
+  auto key = entry.key.view();
+  char digits[20];
+  auto expiry = std::string_view(
+      digits,
+      std::to_chars(digits, digits + sizeof(digits), value.expiry()).ptr);
+
+  if (value.get_type() == Type::STRING) {
+    IntBuffer scratch;
+    if (value.expiry() == NO_EXPIRY) {
+      append_command(out, {"SET", key, value.view(scratch)});
+    } else {
+      append_command(out, {"SET", key, value.view(scratch), "PXAT", expiry});
+    }
+    return;
+  }
+
+  // streamed, since a sorted set's scores are only rendered one at a time
+  size_t count = element_count(value), i = 0;
+  for_each_element(value, [&](std::string_view element) {
+    if (i % RESTORE_BATCH == 0) {
+      append_line(out, '*', 2 + std::min(RESTORE_BATCH, count - i));
+      append_arg(out, add_command(value.get_type()));
+      append_arg(out, key);
+    }
+    append_arg(out, element);
+    i++;
+  });
+  if (value.expiry() != NO_EXPIRY) {
+    append_command(out, {"PEXPIREAT", key, expiry});
+  }
+}
+
+std::vector<std::unique_lock<std::mutex>> Storage::lock_logs() {
+  std::vector<std::unique_lock<std::mutex>> guards;
+  for (size_t i = 0; i < shard_count(); i++) {
+    guards.emplace_back(shards[i].log_lock);
+  }
+  return guards;
+}
+
+void Storage::log(Shard& shard, std::initializer_list<std::string_view> args) {
+  log(shard, std::span(args.begin(), args.end()));
+}
+
+void Storage::log(Shard& shard, std::span<std::string_view const> args) {
+  std::lock_guard guard(shard.log_lock);
+  if (logging) {
+    append_command(shard.log, args);
+    logged++;
+  }
+  if (replicating) {
+    append_command(shard.repl, args);
+  }
+}
+
+void Storage::log_restore(Shard& shard, Map::Entry const& entry) {
+  std::lock_guard guard(shard.log_lock);
+  if (logging) {
+    append_restore(shard.log, entry);
+    logged++;
+  }
+  if (replicating) {
+    append_restore(shard.repl, entry);
+  }
+}
 
-  data[std::move(key)] = DataCell{.value = std::move(value), .expiry = expiry};
+void Storage::set_locked(Shard& shard, uint64_t hash, std::string_view key,
+                         std::string_view value, int64_t expiry) {
+  if (auto entry = shard.data.find(key, hash)) {
+    auto& data_cell = entry->value;
+    preserve(shard, *entry);
+    size_t before = footprint(*entry);
 
+    // overwrite in place, reusing the old value's buffer when it fits
+    data_cell.assign(value, *shard.arena);
+    if (expiry == KEEP_TTL) {
+      if (data_cell.expired()) {
+        data_cell.set_expiry(NO_EXPIRY, *shard.arena);
+      }
+    } else if (expiry != data_cell.expiry()) {
+      data_cell.set_expiry(expiry, *shard.arena);
+      track_expiry(shard, hash, expiry);
+    }
+    data_cell.touch();
+    shard.stored += footprint(*entry) - before;
+    if (propagating()) {
+      log_restore(shard, *entry);
+    }
+  } else {
+    expiry = expiry == KEEP_TTL ? NO_EXPIRY : expiry;
+    auto& added = shard.data.insert(hash, Key(key, *shard.arena),
+                                    DataCell(value, expiry, *shard.arena));
+    added.value.set_snapshot_epoch(shard.snapshot_epoch);
+    added.value.set_version(++shard.writes);
+    shard.stored += footprint(added);
+    count_in_slot(hash);
+    invalidate_key(key);
+    track_expiry(shard, hash, expiry);
+    if (propagating()) {
+      log_restore(shard, added);
+    }
+  }
+}
+
+bool Storage::set(std::string_view key, std::string_view value,
+                  int64_t expiry) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::unique_lock guard(shard.data_lock);
+
+  if (shard_limit and !make_room(shard)) {
+    return false;
+  }
+  set_locked(shard, hash, key, value, expiry);
   return true;
 }
 
-std::optional<BulkString> Storage::get(BulkString const& key) {
-  std::shared_lock guard(data_lock);
+void Storage::get(std::string_view key, Reply& reply) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+
+  {
+    std::shared_lock guard(shard.data_lock);
+
+    auto entry = shard.data.find(key, hash);
+    if (!entry) {
+      reply.null_bulk_string();
+      return;
+    }
+    if (!entry->value.expired()) {
+      if (entry->value.get_type() != Type::STRING) {
+        reply.error(WRONGTYPE_ERROR);
+        return;
+      }
+      entry->value.touch();
+      entry->value.reply(reply);
+      return;
+    }
+  }
+
+  // the key looked expired, but readers can't erase, so retake the lock
+  // exclusively and check again in case a writer refreshed it meanwhile
+  std::unique_lock guard(shard.data_lock);
+
+  if (auto entry = shard.data.find(key, hash)) {
+    if (!entry->value.expired()) {
+      if (entry->value.get_type() != Type::STRING) {
+        reply.error(WRONGTYPE_ERROR);
+        return;
+      }
+      entry->value.touch();
+      entry->value.reply(reply);
+      return;
+    }
+    remove(shard, *entry);
+  }
+  reply.null_bulk_string();
+}
+
+template <typename Fn>
+void Storage::lock_batch(std::span<std::string_view const> keys,
+                         size_t stride, bool exclusive, Fn&& fn) {
+  // one of each per worker thread, reused by every batch
+  thread_local std::vector<uint64_t> hashes;
+  thread_local std::vector<size_t> locked;
+
+  hashes.clear();
+  locked.clear();
+  for (size_t i = 0; i < keys.size(); i += stride) {
+    hashes.push_back(hash_of(keys[i]));
+    locked.push_back(shard_index(hashes.back()));
+  }
+  std::sort(locked.begin(), locked.end());
+  locked.erase(std::unique(locked.begin(), locked.end()), locked.end());
+
+  struct Unlock {
+    Storage& storage;
+    bool exclusive;
+    size_t count = 0;
+
+    ~Unlock() {
+      for (size_t i = count; i-- > 0;) {
+        auto& lock = storage.shards[locked[i]].data_lock;
+        exclusive ? lock.unlock() : lock.unlock_shared();
+      }
+    }
+  } unlock{*this, exclusive};
+
+  for (auto i : locked) {
+    exclusive ? shards[i].data_lock.lock() : shards[i].data_lock.lock_shared();
+    unlock.count++;
+  }
+  for (auto hash : hashes) {
+    shard_for(hash).data.prefetch(hash);
+  }
+  fn(hashes);
+}
+
+void Storage::mget(std::span<std::string_view const> keys, Reply& reply) {
+  lock_batch(keys, 1, false, [&](auto& hashes) {
+    reply.array(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      auto entry = shard_for(hashes[i]).data.find(keys[i], hashes[i]);
+      // expired keys are left for a writer or the cron to delete
+      if (entry and !entry->value.expired() and
+          entry->value.get_type() == Type::STRING) {
+        entry->value.touch();
+        entry->value.reply(reply);
+      } else {
+        reply.null_bulk_string();
+      }
+    }
+  });
+}
+
+std::optional<bool> Storage::mset(std::span<std::string_view const> pairs,
+                                  bool only_new) {
+  std::optional<bool> result = true;
+
+  lock_batch(pairs, 2, true, [&](auto& hashes) {
+    // MSETNX gives up before evicting anything for keys it won't set
+    for (size_t i = 0; only_new and i < hashes.size(); i++) {
+      auto entry = shard_for(hashes[i]).data.find(pairs[2 * i], hashes[i]);
+      if (entry and !entry->value.expired()) {
+        result = false;
+        return;
+      }
+    }
+    for (size_t i = 0; shard_limit and i < hashes.size(); i++) {
+      if (!make_room(shard_for(hashes[i]))) {
+        result = std::nullopt;
+        return;
+      }
+    }
+
+    for (size_t i = 0; i < hashes.size(); i++) {
+      set_locked(shard_for(hashes[i]), hashes[i], pairs[2 * i],
+                 pairs[2 * i + 1], NO_EXPIRY);
+    }
+  });
+  return result;
+}
+
+size_t Storage::del(std::span<std::string_view const> keys) {
+  size_t deleted = 0;
+
+  lock_batch(keys, 1, true, [&](auto& hashes) {
+    for (size_t i = 0; i < keys.size(); i++) {
+      auto& shard = shard_for(hashes[i]);
+      auto entry = shard.data.find(keys[i], hashes[i]);
+      if (!entry) {
+        continue;
+      }
+
+      bool live = !entry->value.expired();
+      remove(shard, *entry, true);
+      if (live) {
+        deleted++;
+        if (propagating()) {
+          log(shard, {"DEL", keys[i]});
+        }
+      }
+    }
+  });
+  return deleted;
+}
+
+size_t Storage::exists(std::span<std::string_view const> keys) {
+  size_t found = 0;
+
+  lock_batch(keys, 1, false, [&](auto& hashes) {
+    for (size_t i = 0; i < keys.size(); i++) {
+      auto entry = shard_for(hashes[i]).data.find(keys[i], hashes[i]);
+      found += entry and !entry->value.expired();
+    }
+  });
+  return found;
+}
+
+template <typename Fn>
+Storage::Access Storage::write_string(std::string_view key,
+                                      std::string_view initial,
+                                      std::span<std::string_view const> command,
+                                      Fn&& fn) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::unique_lock guard(shard.data_lock);
+
+  if (shard_limit and !make_room(shard)) {
+    return Access::OOM;
+  }
+
+  auto entry = shard.data.find(key, hash);
+  if (entry and entry->value.expired()) {
+    remove(shard, *entry);
+    entry = nullptr;
+  }
+  if (entry and entry->value.get_type() != Type::STRING) {
+    return Access::WRONGTYPE;
+  }
+  bool created = !entry;
+  if (created) {
+    entry = &shard.data.insert(hash, Key(key, *shard.arena),
+                               DataCell(initial, NO_EXPIRY, *shard.arena));
+    entry->value.set_snapshot_epoch(shard.snapshot_epoch);
+    shard.stored += footprint(*entry);
+    count_in_slot(hash);
+  }
+
+  save_for_snapshot(shard, *entry);
+  size_t before = footprint(*entry);
+  bool changed = fn(entry->value, *shard.arena);
+  entry->value.touch();
+  shard.stored += footprint(*entry) - before;
+
+  if (changed and propagating()) {
+    log(shard, command);
+  }
+  if (changed) {
+    mark_changed(shard, *entry);
+  } else if (created) {
+    discard(shard, *entry);
+  }
+  return Access::OK;
+}
+
+Storage::Access Storage::incr(std::string_view key, int64_t delta,
+                              std::span<std::string_view const> command,
+                              int64_t& value) {
+  auto sum = DataCell::Sum::OK;
+  auto access = write_string(key, "0", command, [&](auto& cell, auto& arena) {
+    if ((sum = cell.add(delta, arena)) == DataCell::Sum::OK) {
+      value = *cell.integer();
+    }
+    return sum == DataCell::Sum::OK;
+  });
+  if (access != Access::OK or sum == DataCell::Sum::OK) {
+    return access;
+  }
+  return sum == DataCell::Sum::OVERFLOW ? Access::OVERFLOW
+                                        : Access::NOT_INTEGER;
+}
+
+Storage::Access Storage::append(std::string_view key, std::string_view suffix,
+                                std::span<std::string_view const> command,
+                                size_t& length) {
+  return write_string(key, "", command, [&](auto& cell, auto& arena) {
+    length = cell.append(suffix, arena);
+    return true;
+  });
+}
+
+Storage::Access Storage::set_range(std::string_view key, size_t offset,
+                                   std::string_view bytes,
+                                   std::span<std::string_view const> command,
+                                   size_t& length) {
+  return write_string(key, "", command, [&](auto& cell, auto& arena) {
+    if (bytes.empty()) {
+      IntBuffer scratch;
+      length = cell.view(scratch).length();
+      return false;
+    }
+    length = cell.set_range(offset, bytes, arena);
+    return true;
+  });
+}
+
+Storage::Access Storage::getset(std::string_view key, std::string_view value,
+                                Reply& reply) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::unique_lock guard(shard.data_lock);
+
+  if (shard_limit and !make_room(shard)) {
+    return Access::OOM;
+  }
+
+  auto entry = shard.data.find(key, hash);
+  if (entry and entry->value.expired()) {
+    remove(shard, *entry);
+    entry = nullptr;
+  }
+  if (entry and entry->value.get_type() != Type::STRING) {
+    return Access::WRONGTYPE;
+  }
+  if (entry) {
+    // a shared value's reply keeps its own reference, so the old value
+    // can be overwritten right after
+    entry->value.reply(reply);
+  } else {
+    reply.null_bulk_string();
+  }
+  set_locked(shard, hash, key, value, NO_EXPIRY);
+  return Access::OK;
+}
+
+Storage::Watch Storage::watch(std::string_view key) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::shared_lock guard(shard.data_lock);
+
+  auto entry = shard.data.find(key, hash);
+  bool exists = entry and !entry->value.expired();
+  return {shard.writes, exists ? entry->value.get_version() : uint16_t(0),
+          exists};
+}
+
+bool Storage::changed(std::string_view key, Watch const& watch) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::shared_lock guard(shard.data_lock);
+
+  // expiring changes a key without a write
+  auto entry = shard.data.find(key, hash);
+  bool exists = entry and !entry->value.expired();
+  if (exists != watch.exists) {
+    return true;
+  }
+  if (!exists or shard.writes == watch.writes) {
+    return false;
+  }
+
+  // the version is the write count's low bits at the key's last change.
+  // past 64k writes they'll have wrapped, so give up and call it changed
+  if (shard.writes - watch.writes > UINT16_MAX) {
+    return true;
+  }
+  return entry->value.get_version() != watch.version;
+}
+
+void Storage::atomically(std::span<std::string_view const> keys, bool all,
+                         std::function<void()> const& fn) {
+  std::vector<size_t> locked;
+  if (all) {
+    locked.resize(shard_count());
+    std::iota(locked.begin(), locked.end(), 0);
+  } else {
+    for (auto key : keys) {
+      locked.push_back(shard_index(hash_of(key)));
+    }
+    std::sort(locked.begin(), locked.end());
+    locked.erase(std::unique(locked.begin(), locked.end()), locked.end());
+  }
+
+  // in shard order, like lock_batch
+  struct Release {
+    Storage& storage;
+    std::vector<size_t>& locked;
+    size_t count = 0;
+
+    ~Release() {
+      for (size_t i = count; i-- > 0;) {
+        storage.shards[locked[i]].data_lock.release();
+      }
+    }
+  } release{*this, locked};
+
+  // only the shards this call took are released, moved to the front
+  for (auto i : locked) {
+    if (shards[i].data_lock.hold()) {
+      locked[release.count++] = i;
+    }
+  }
+  fn();
+}
+
+uint64_t Storage::scan(uint64_t cursor, size_t count,
+                       std::function<void(std::string_view, Type)> const& fn) {
+  size_t i = cursor & (shard_count() - 1);
+  size_t map_cursor = cursor >> shard_bits;
+  size_t seen = 0;
+  size_t groups = std::max(count, 1ul) * SCAN_GROUPS_PER_KEY;
+
+  while (seen < count and groups) {
+    auto& shard = shards[i];
+    {
+      std::shared_lock guard(shard.data_lock);
+      auto now = now_ms();
 
-  if (data.contains(key)) {
-    const auto& data_cell = data[key];
+      for (size_t n = 0; n < SCAN_GROUPS and seen < count and groups;
+           n++, groups--) {
+        map_cursor = shard.data.scan(map_cursor, [&](auto& entry) {
+          seen++;
+          auto expiry = entry.value.expiry();
+          if (expiry == NO_EXPIRY or expiry > now) {
+            fn(entry.key.view(), entry.value.get_type());
+          }
+        });
+        if (!map_cursor) {
+          break;
+        }
+      }
+    }
 
-    if (!data_cell.expiry) {
-      return std::move(BulkString(std::string(data_cell.value.view())));
+    if (!map_cursor and ++i == shard_count()) {
+      return 0;
     }
+  }
+  return (map_cursor << shard_bits) | i;
+}
+
+size_t Storage::size() {
+  size_t keys = 0;
+  for (size_t i = 0; i < shard_count(); i++) {
+    std::shared_lock guard(shards[i].data_lock);
+    keys += shards[i].data.size();
+  }
+  return keys;
+}
+
+void Storage::flush(bool async, std::span<std::string_view const> command) {
+  // every shard at once, so the flush is a single instant
+  std::vector<std::unique_lock<ShardLock>> guards;
+  for (size_t i = 0; i < shard_count(); i++) {
+    guards.emplace_back(shards[i].data_lock);
+  }
 
-    if (std::chrono::steady_clock::now() < *data_cell.expiry) {
-      return std::move(BulkString(std::string(data_cell.value.view())));
+  for (size_t i = 0; i < shard_count(); i++) {
+    auto& shard = shards[i];
+
+    if (shard.snapshotting) {
+      for (size_t j = 0; j < shard.data.size(); j++) {
+        preserve(shard, shard.data.at(j));
+      }
+    }
+    if (async and shard.data.size()) {
+      auto data = std::make_shared<Map>();
+      data->swap(shard.data);
+      std::shared_ptr<Slab> arena = std::move(shard.arena);
+      shard.arena = std::make_unique<Slab>();
+      // the cells go before the slab they were carved from
+      lazy_free([data, arena]() mutable {
+        data.reset();
+        arena.reset();
+      });
     } else {
-      data.erase(key);
+      shard.data.clear();
     }
+    shard.expiries = {};
+    shard.stored = 0;
+    clear_slots(i);
   }
-  return std::nullopt;
-}
\ No newline at end of file
+  invalidate_all();
+
+  if (propagating()) {
+    // what's pending was all flushed anyway, and a drain takes every log at
+    // once, so the flush only has to go first in one of them
+    auto logs = lock_logs();
+    for (size_t i = 0; i < shard_count(); i++) {
+      auto& shard = shards[i];
+      rewrite_flushed |= shard.rewriting;
+      shard.log.clear();
+      shard.rewrite_from = 0;
+      shard.repl.clear();
+    }
+    if (logging) {
+      append_command(shards[0].log, command);
+      logged++;
+    }
+    if (replicating) {
+      append_command(shards[0].repl, command);
+    }
+  }
+}
+
+int64_t Storage::ttl(std::string_view key) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::shared_lock guard(shard.data_lock);
+
+  auto entry = shard.data.find(key, hash);
+
+  if (!entry or entry->value.expired()) {
+    return -2;
+  }
+  if (entry->value.expiry() == NO_EXPIRY) {
+    return -1;
+  }
+  return std::max(entry->value.expiry() - now_ms(), 0l);
+}
+
+bool Storage::expire(std::string_view key, int64_t expiry) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::unique_lock guard(shard.data_lock);
+
+  auto entry = shard.data.find(key, hash);
+
+  if (!entry or entry->value.expired()) {
+    return false;
+  }
+
+  if (expiry == entry->value.expiry()) {
+    return true;
+  }
+
+  if (expiry <= now_ms()) {
+    remove(shard, *entry);
+  } else {
+    preserve(shard, *entry);
+    size_t before = footprint(*entry);
+    entry->value.set_expiry(expiry, *shard.arena);
+    shard.stored += footprint(*entry) - before;
+    track_expiry(shard, hash, expiry);
+  }
+
+  if (propagating()) {
+    char digits[20];
+    auto end = std::to_chars(digits, digits + sizeof(digits), expiry).ptr;
+    log(shard, {"PEXPIREAT", key, std::string_view(digits, end - digits)});
+  }
+  return true;
+}
+
+bool Storage::persist(std::string_view key) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::unique_lock guard(shard.data_lock);
+
+  auto entry = shard.data.find(key, hash);
+
+  if (!entry or entry->value.expiry() == NO_EXPIRY or
+      entry->value.expired()) {
+    return false;
+  }
+  preserve(shard, *entry);
+  size_t before = footprint(*entry);
+  entry->value.set_expiry(NO_EXPIRY, *shard.arena);
+  shard.stored += footprint(*entry) - before;
+  if (propagating()) {
+    log(shard, {"PERSIST", key});
+  }
+  return true;
+}
+
+std::optional<std::pair<Type, std::string_view>> Storage::describe(
+    std::string_view key) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::shared_lock guard(shard.data_lock);
+
+  auto entry = shard.data.find(key, hash);
+  if (!entry or entry->value.expired()) {
+    return std::nullopt;
+  }
+  return std::pair(entry->value.get_type(), encoding_name(entry->value));
+}
+
+// pops up to EXPIRE_BATCH due heap entries, returning true if more are due
+bool Storage::expire_shard(Shard& shard, int64_t now) {
+  auto& heap = shard.expiries;
+
+  for (size_t popped = 0; popped < EXPIRE_BATCH; popped++) {
+    if (heap.empty() or heap.front().first > now) {
+      break;
+    }
+
+    auto [expiry, hash] = heap.front();
+    std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+    heap.pop_back();
+
+    // stale if the key was deleted, persisted or given another expiry since
+    auto entry = shard.data.find_if(hash, [&](auto& candidate) {
+      return candidate.value.expiry() == expiry;
+    });
+    if (entry) {
+      remove(shard, *entry);
+    }
+  }
+
+  // keys whose TTL keeps getting refreshed leave stale entries behind, so
+  // rebuild the heap from the live expiries once they dominate it
+  if (heap.size() > 2 * shard.data.size() + 1024) {
+    heap.clear();
+    shard.data.for_each([&](auto& entry) {
+      if (entry.value.expiry() != NO_EXPIRY) {
+        heap.emplace_back(entry.value.expiry(), entry.hash);
+      }
+    });
+    std::make_heap(heap.begin(), heap.end(), std::greater<>());
+  }
+
+  return !heap.empty() and heap.front().first <= now;
+}
+
+bool Storage::expire_cycle(std::chrono::microseconds budget) {
+  auto deadline = std::chrono::steady_clock::now() + budget;
+  size_t shard_count = 1ul << shard_bits;
+  bool more = false;
+
+  for (size_t visited = 0; visited < shard_count; visited++) {
+    auto& shard = shards[next_expiry_shard];
+    next_expiry_shard = (next_expiry_shard + 1) & (shard_count - 1);
+
+    {
+      std::unique_lock guard(shard.data_lock);
+
+      more |= expire_shard(shard, now_ms());
+      shard.data.rehash_step(REHASH_GROUPS);
+    }
+
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return true;
+    }
+  }
+
+  return more;
+}
+
+Storage::MemoryStats Storage::memory_stats() {
+  MemoryStats stats;
+
+  for (size_t i = 0; i < 1ul << shard_bits; i++) {
+    std::shared_lock guard(shards[i].data_lock);
+
+    stats.keys += shards[i].data.size();
+    stats.slab += shards[i].arena->get_stats();
+    stats.tables += shards[i].data.allocated();
+    stats.stored += shards[i].stored;
+    stats.evicted += shards[i].evicted;
+  }
+  stats.shared = shared_value_bytes();
+  stats.max_memory = max_memory;
+  return stats;
+}
+
+void Storage::drain_log(std::string& main, std::string& tail) {
+  auto logs = lock_logs();
+  for (size_t i = 0; i < shard_count(); i++) {
+    auto& shard = shards[i];
+
+    main.append(shard.log);
+    if (shard.rewriting) {
+      tail.append(shard.log, shard.rewrite_from);
+    }
+    shard.log.clear();
+    shard.rewrite_from = 0;
+  }
+}
+
+void Storage::drain_replication(std::string& out) {
+  auto logs = lock_logs();
+  for (size_t i = 0; i < shard_count(); i++) {
+    auto& shard = shards[i];
+
+    out.append(shard.repl);
+    shard.repl.clear();
+  }
+}
+
+void Storage::dump_shard(size_t i, std::string& out) {
+  auto& shard = shards[i];
+  // no writes land in the shard while it's dumped, so the dump and the
+  // entries that follow it in the tail line up exactly
+  std::shared_lock guard(shard.data_lock);
+  auto now = now_ms();
+
+  shard.data.for_each([&](auto& entry) {
+    if (entry.value.expiry() == NO_EXPIRY or entry.value.expiry() > now) {
+      append_restore(out, entry);
+    }
+  });
+
+  std::lock_guard log_guard(shard.log_lock);
+  shard.rewriting = true;
+  shard.rewrite_from = shard.log.size();
+}
+
+bool Storage::end_rewrite() {
+  auto logs = lock_logs();
+  for (size_t i = 0; i < shard_count(); i++) {
+    shards[i].rewriting = false;
+    shards[i].rewrite_from = 0;
+  }
+  if (std::exchange(rewrite_flushed, false)) {
+    rewrite_requested = true;
+    return false;
+  }
+  return true;
+}
+
+bool Storage::request_rewrite() {
+  if (!logging) {
+    return false;
+  }
+  rewrite_requested = true;
+  return true;
+}
+
+void Storage::begin_snapshot(std::function<void()> const& at_start) {
+  snapshot_lock.lock();
+
+  // every shard at once, so the snapshot is of a single instant
+  std::vector<std::unique_lock<ShardLock>> guards;
+  for (size_t i = 0; i < shard_count(); i++) {
+    guards.emplace_back(shards[i].data_lock);
+  }
+
+  for (size_t i = 0; i < shard_count(); i++) {
+    auto& shard = shards[i];
+    shard.snapshot_epoch = !shard.snapshot_epoch;
+    shard.snapshotting = true;
+    shard.snapshot_cursor = shard.data.size();
+    shard.snapshot_saved.clear();
+    shard.snapshot_saved_keys = 0;
+  }
+
+  if (at_start) {
+    at_start();
+  }
+}
+
+bool Storage::snapshot_chunk(size_t i, std::string& out, size_t& keys) {
+  auto& shard = shards[i];
+  std::unique_lock guard(shard.data_lock);
+
+  if (!shard.snapshotting) {
+    return false;
+  }
+
+  auto& cursor = shard.snapshot_cursor;
+  cursor = std::min(cursor, shard.data.size());
+
+  for (size_t n = 0; n < SNAPSHOT_CHUNK and cursor > 0; n++) {
+    auto& entry = shard.data.at(--cursor);
+
+    if (entry.value.snapshot_epoch() != shard.snapshot_epoch) {
+      if (!entry.value.expired()) {
+        snapshot::append_record(out, entry.key.view(), entry.value);
+        keys++;
+      }
+      entry.value.set_snapshot_epoch(shard.snapshot_epoch);
+    }
+  }
+
+  if (cursor) {
+    return true;
+  }
+
+  out.append(shard.snapshot_saved);
+  keys += shard.snapshot_saved_keys;
+  shard.snapshot_saved = std::string();
+  shard.snapshot_saved_keys = 0;
+  shard.snapshotting = false;
+  return false;
+}
+
+void Storage::end_snapshot() {
+  for (size_t i = 0; i < shard_count(); i++) {
+    auto& shard = shards[i];
+    std::unique_lock guard(shard.data_lock);
+
+    if (shard.snapshotting) {
+      // the next snapshot flips the epoch again, so every cell has to end
+      // up marked for it to start from a clean slate
+      auto& cursor = shard.snapshot_cursor;
+      for (cursor = std::min(cursor, shard.data.size()); cursor > 0;) {
+        shard.data.at(--cursor).value.set_snapshot_epoch(shard.snapshot_epoch);
+      }
+      shard.snapshot_saved = std::string();
+      shard.snapshot_saved_keys = 0;
+      shard.snapshotting = false;
+    }
+  }
+
+  snapshot_lock.unlock();
+}
+
+void Storage::reserve(size_t keys) {
+  // shards get slightly uneven shares of the keys
+  size_t per_shard = (keys >> shard_bits) + (keys >> shard_bits) / 8 + 64;
+
+  for (size_t i = 0; i < shard_count(); i++) {
+    std::unique_lock guard(shards[i].data_lock);
+    shards[i].data.reserve(per_shard);
+  }
+}
+
+void Storage::load(std::string_view key, std::string_view value,
+                   int64_t expiry) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::unique_lock guard(shard.data_lock);
+
+  auto& added = shard.data.insert(hash, Key(key, *shard.arena),
+                                  DataCell(value, expiry, *shard.arena));
+  added.value.set_snapshot_epoch(shard.snapshot_epoch);
+  shard.stored += footprint(added);
+  count_in_slot(hash);
+  invalidate_key(key);
+  track_expiry(shard, hash, expiry);
+  if (propagating()) {
+    log_restore(shard, added);
+  }
+}
+
+bool Storage::load(std::string_view key, Type type,
+                   std::span<std::string_view const> elements,
+                   int64_t expiry) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::unique_lock guard(shard.data_lock);
+
+  DataCell value(type, *shard.arena);
+  if (!restore(value, elements, *shard.arena)) {
+    return false;
+  }
+  value.set_expiry(expiry, *shard.arena);
+
+  auto& added =
+      shard.data.insert(hash, Key(key, *shard.arena), std::move(value));
+  added.value.set_snapshot_epoch(shard.snapshot_epoch);
+  shard.stored += footprint(added);
+  count_in_slot(hash);
+  invalidate_key(key);
+  track_expiry(shard, hash, expiry);
+  if (propagating()) {
+    log_restore(shard, added);
+  }
+  return true;
+}
+
+void Storage::clear() {
+  for (size_t i = 0; i < shard_count(); i++) {
+    auto& shard = shards[i];
+    std::unique_lock guard(shard.data_lock);
+
+    if (shard.snapshotting) {
+      for (size_t j = 0; j < shard.data.size(); j++) {
+        preserve(shard, shard.data.at(j));
+      }
+    }
+    shard.data.clear();
+    shard.expiries.clear();
+    shard.expiries.shrink_to_fit();
+    shard.stored = 0;
+    clear_slots(i);
+  }
+  invalidate_all();
+}
+
+void Storage::clear_slots(size_t i) {
+  if (slotted) {
+    size_t per_shard = CLUSTER_SLOTS >> shard_bits;
+    std::fill_n(slot_keys.get() + i * per_shard, per_shard, 0);
+  }
+}
+
+size_t Storage::count_keys_in_slot(uint16_t slot) {
+  auto& shard = shard_for(uint64_t(slot) << SLOT_SHIFT);
+  std::shared_lock guard(shard.data_lock);
+  return slot_keys[slot];
+}
+
+void Storage::keys_in_slot(uint16_t slot, size_t count,
+                           std::vector<std::string>& keys) {
+  auto& shard = shard_for(uint64_t(slot) << SLOT_SHIFT);
+  std::shared_lock guard(shard.data_lock);
+
+  // keys moved off leave holes the last entries are moved into, maybe
+  // behind the cursor, so going round once finds those too
+  size_t size = shard.data.size();
+  size_t start = slot_cursors[slot].load(std::memory_order_relaxed);
+  if (start >= size) {
+    start = 0;
+  }
+  size_t end = start;
+  for (size_t walked = 0; walked < size and keys.size() < count; walked++) {
+    size_t i = (start + walked) % size;
+    auto& entry = shard.data.at(i);
+    if (entry.hash >> SLOT_SHIFT == slot and !entry.value.expired()) {
+      keys.emplace_back(entry.key.view());
+      end = i + 1;
+    }
+  }
+  slot_cursors[slot].store(end, std::memory_order_relaxed);
+}
+
+bool Storage::dump(std::string_view key, std::string& out) {
+  auto hash = hash_of(key);
+  auto& shard = shard_for(hash);
+  std::shared_lock guard(shard.data_lock);
+
+  auto entry = shard.data.find(key, hash);
+  if (!entry or entry->value.expired()) {
+    return false;
+  }
+  snapshot::append_payload(out, entry->value);
+  return true;
+}
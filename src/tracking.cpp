@@ -0,0 +1,486 @@
+#include "tracking.h"
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+
+const size_t TABLE_SHARDS = 64;
+
+namespace {
+
+// lets the maps be probed with a string_view
+struct StringHash {
+  using is_transparent = void;
+
+  size_t operator()(std::string_view string) const {
+    return std::hash<std::string_view>{}(string);
+  }
+};
+
+// client ids kept sorted in one allocation, so membership is a binary
+// search and a set costs a pointer and two sizes
+class IdSet {
+  std::vector<uint64_t> ids;
+
+ public:
+  // false if it was there already
+  bool insert(uint64_t id) {
+    auto at = std::lower_bound(ids.begin(), ids.end(), id);
+    if (at != ids.end() and *at == id) {
+      return false;
+    }
+    ids.insert(at, id);
+    return true;
+  }
+  void erase(uint64_t id) {
+    auto at = std::lower_bound(ids.begin(), ids.end(), id);
+    if (at != ids.end() and *at == id) {
+      ids.erase(at);
+    }
+  }
+  size_t size() const { return ids.size(); }
+  bool empty() const { return ids.empty(); }
+  auto begin() const { return ids.begin(); }
+  auto end() const { return ids.end(); }
+};
+
+// a broadcast mode prefix and the clients registered for it
+struct Prefix {
+  std::string prefix;
+  IdSet clients;
+};
+
+struct Client {
+  Subscriber subscriber;
+  int protocol = 2;
+  bool invalidation_subscriber = false;
+  std::optional<TrackingOptions> tracking;
+};
+
+struct Directory {
+  std::shared_mutex lock;
+  std::unordered_map<uint64_t, Client> clients;
+  // broadcast mode's prefixes, sorted so the ones a key starts with are
+  // found by a few binary searches instead of trying each
+  std::vector<Prefix> prefixes;
+  // how many there are, so writes can skip queueing a key nobody read
+  // without the lock
+  std::atomic<size_t> prefix_count = 0;
+
+  std::vector<Prefix>::iterator find_prefix(std::string_view prefix) {
+    return std::lower_bound(
+        prefixes.begin(), prefixes.end(), prefix,
+        [](Prefix const &entry, std::string_view prefix) {
+          return entry.prefix < prefix;
+        });
+  }
+};
+
+struct TableShard {
+  std::mutex lock;
+  // the clients that read each key since it last changed
+  std::unordered_map<std::string, IdSet, StringHash, std::equal_to<>>
+      readers;
+};
+
+struct Table {
+  std::array<TableShard, TABLE_SHARDS> shards;
+  std::atomic<size_t> keys = 0;
+  std::atomic<size_t> items = 0;
+  // like redis's tracking-table-max-keys, 0 for no limit
+  std::atomic<size_t> max_keys = 1000000;
+
+  TableShard &shard_for(std::string_view key) {
+    return shards[StringHash{}(key) % TABLE_SHARDS];
+  }
+};
+
+// never destroyed, since workers may still change keys while the process
+// exits
+Directory &directory() {
+  static auto &directory = *new Directory();
+  return directory;
+}
+
+Table &table() {
+  static auto &table = *new Table();
+  return table;
+}
+
+thread_local uint64_t caller = 0;
+
+// the keys the calling thread changed, with the clients that had read them,
+// waiting for flush_invalidations
+thread_local std::vector<std::pair<std::string, std::vector<uint64_t>>>
+    pending;
+
+// calls fn with each registered prefix key starts with. the greatest prefix
+// not after what's left of the key either starts it, or shares with it a
+// shorter start that any others must fit in, so each search shortens it
+template <typename Fn>
+void for_each_prefix_of(std::vector<Prefix> const &prefixes,
+                        std::string_view key, Fn &&fn) {
+  auto end = prefixes.end();
+  std::string_view left = key;
+  while (end != prefixes.begin()) {
+    end = std::upper_bound(prefixes.begin(), end, left,
+                           [](std::string_view left, Prefix const &entry) {
+                             return left < entry.prefix;
+                           });
+    if (end == prefixes.begin()) {
+      return;
+    }
+    auto &candidate = *(end - 1);
+    if (left.starts_with(candidate.prefix)) {
+      fn(candidate);
+      if (candidate.prefix.empty()) {
+        return;
+      }
+      left = left.substr(0, candidate.prefix.length() - 1);
+      end--;
+    } else {
+      size_t common = std::mismatch(left.begin(), left.end(),
+                                    candidate.prefix.begin(),
+                                    candidate.prefix.end())
+                          .first -
+                      left.begin();
+      left = left.substr(0, common);
+    }
+  }
+}
+
+// the invalidation for key, or for every key when there's none, as a push
+// for RESP3 and as a pubsub message for RESP2
+SharedValue encode(std::optional<std::string_view> key, bool push) {
+  auto encoded = std::make_shared<std::string>(
+      push ? ">2\r\n$10\r\ninvalidate\r\n"
+           : "*3\r\n$7\r\nmessage\r\n$20\r\n__redis__:invalidate\r\n");
+  if (key) {
+    *encoded += "*1\r\n$" + std::to_string(key->length()) + "\r\n";
+    *encoded += *key;
+    *encoded += "\r\n";
+  } else {
+    *encoded += push ? "_\r\n" : "$-1\r\n";
+  }
+  return encoded;
+}
+
+void add_target(Audience &audience, Subscriber const &target) {
+  auto group = std::find_if(
+      audience.groups.begin(), audience.groups.end(),
+      [&](auto &group) { return group.mailbox == target.mailbox; });
+  if (group == audience.groups.end()) {
+    group = audience.groups.insert(group, {target.mailbox, {}});
+  } else if (std::any_of(group->targets.begin(), group->targets.end(),
+                         [&](auto &other) { return other.id == target.id; })) {
+    // redirected to by more than one of them
+    return;
+  }
+  group->targets.push_back({target.sock, target.id});
+  audience.count++;
+}
+
+void deliver(std::optional<std::string_view> key, Audience &&audience,
+             bool push) {
+  if (!audience.count) {
+    return;
+  }
+  auto message = encode(key, push);
+  auto shared = std::make_shared<Audience const>(std::move(audience));
+  for (size_t i = 0; i < shared->groups.size(); i++) {
+    shared->groups[i].mailbox->push(new Delivery{message, shared, i});
+  }
+}
+
+// tells the clients in ids that key changed, or that everything did. the
+// directory's lock must be held
+void notify(Directory &directory, std::span<uint64_t const> ids,
+            std::optional<std::string_view> key, uint64_t changed_by) {
+  Audience pushes, messages;
+  for (auto id : ids) {
+    auto client = directory.clients.find(id);
+    if (client == directory.clients.end() or !client->second.tracking or
+        (client->second.tracking->noloop and id == changed_by)) {
+      continue;
+    }
+    auto redirect = client->second.tracking->redirect;
+    auto target = redirect ? directory.clients.find(redirect) : client;
+    if (target == directory.clients.end()) {
+      continue;
+    }
+    if (target->second.protocol == 3) {
+      add_target(pushes, target->second.subscriber);
+    } else if (redirect and target->second.invalidation_subscriber) {
+      // a RESP2 client can't take pushes, so it only hears through a
+      // redirect to a connection listening for them
+      add_target(messages, target->second.subscriber);
+    }
+  }
+  deliver(key, std::move(pushes), true);
+  deliver(key, std::move(messages), false);
+}
+
+// stops tracking for client, whose entry's lock is held exclusively
+void untrack(Directory &directory, uint64_t id, Client &client) {
+  if (!client.tracking) {
+    return;
+  }
+  for (auto &prefix : client.tracking->prefixes) {
+    auto registered = directory.find_prefix(prefix);
+    registered->clients.erase(id);
+    if (registered->clients.empty()) {
+      directory.prefixes.erase(registered);
+    }
+  }
+  directory.prefix_count.store(directory.prefixes.size(),
+                               std::memory_order_relaxed);
+  client.tracking.reset();
+  tracking_clients.fetch_sub(1, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+void add_client(Subscriber const &client) {
+  auto &directory = ::directory();
+  std::unique_lock guard(directory.lock);
+  directory.clients.emplace(client.id, Client{client});
+}
+
+void remove_client(uint64_t id) {
+  auto &directory = ::directory();
+  std::unique_lock guard(directory.lock);
+  auto client = directory.clients.find(id);
+  if (client != directory.clients.end()) {
+    untrack(directory, id, client->second);
+    directory.clients.erase(client);
+  }
+}
+
+void set_client_protocol(uint64_t id, int protocol) {
+  auto &directory = ::directory();
+  std::unique_lock guard(directory.lock);
+  auto client = directory.clients.find(id);
+  if (client != directory.clients.end()) {
+    client->second.protocol = protocol;
+  }
+}
+
+void set_client_invalidation_subscriber(uint64_t id, bool subscribed) {
+  auto &directory = ::directory();
+  std::unique_lock guard(directory.lock);
+  auto client = directory.clients.find(id);
+  if (client != directory.clients.end()) {
+    client->second.invalidation_subscriber = subscribed;
+  }
+}
+
+void enable_tracking(uint64_t id, TrackingOptions options) {
+  auto &directory = ::directory();
+  std::unique_lock guard(directory.lock);
+  auto &client = directory.clients.at(id);
+
+  if (options.redirect and options.redirect != id and
+      !directory.clients.contains(options.redirect)) {
+    throw std::runtime_error(
+        "ERR The client ID you want redirect to does not exist");
+  }
+  if (!options.bcast and !options.prefixes.empty()) {
+    throw std::runtime_error(
+        "ERR PREFIX option requires BCAST mode to be enabled");
+  }
+  if (client.tracking and client.tracking->bcast != options.bcast) {
+    throw std::runtime_error(
+        "ERR You can't switch BCAST mode on/off before disabling tracking "
+        "for this client, and then re-enabling it with a different mode.");
+  }
+  if (options.bcast and options.prefixes.empty()) {
+    options.prefixes.emplace_back();
+  }
+
+  // turning it on again adds prefixes to the ones there are
+  auto prefixes = client.tracking ? client.tracking->prefixes
+                                  : std::vector<std::string>();
+  size_t registered = prefixes.size();
+  for (auto &prefix : options.prefixes) {
+    if (std::find(prefixes.begin(), prefixes.end(), prefix) !=
+        prefixes.end()) {
+      continue;
+    }
+    for (auto &other : prefixes) {
+      if (prefix.starts_with(other) or other.starts_with(prefix)) {
+        throw std::runtime_error("ERR Prefix '" + prefix +
+                                 "' overlaps with an existing prefix '" +
+                                 other +
+                                 "'. Prefixes for a single client must not "
+                                 "overlap.");
+      }
+    }
+    prefixes.push_back(prefix);
+  }
+
+  for (size_t i = registered; i < prefixes.size(); i++) {
+    auto at = directory.find_prefix(prefixes[i]);
+    if (at == directory.prefixes.end() or at->prefix != prefixes[i]) {
+      at = directory.prefixes.insert(at, {prefixes[i], {}});
+    }
+    at->clients.insert(id);
+  }
+  directory.prefix_count.store(directory.prefixes.size(),
+                               std::memory_order_relaxed);
+  if (!client.tracking) {
+    tracking_clients.fetch_add(1, std::memory_order_relaxed);
+  }
+  options.prefixes = std::move(prefixes);
+  client.tracking = std::move(options);
+}
+
+void disable_tracking(uint64_t id) {
+  auto &directory = ::directory();
+  std::unique_lock guard(directory.lock);
+  auto client = directory.clients.find(id);
+  if (client != directory.clients.end()) {
+    untrack(directory, id, client->second);
+  }
+}
+
+std::optional<TrackingOptions> tracking_options(uint64_t id) {
+  auto &directory = ::directory();
+  std::shared_lock guard(directory.lock);
+  auto client = directory.clients.find(id);
+  return client == directory.clients.end() ? std::nullopt
+                                           : client->second.tracking;
+}
+
+void track_reads(uint64_t id, std::span<std::string_view const> keys) {
+  auto &table = ::table();
+  // keys forgotten to stay under the limit, reused by every call on this
+  // thread
+  thread_local std::vector<std::pair<std::string, IdSet>> forgotten;
+
+  for (auto key : keys) {
+    auto &shard = table.shard_for(key);
+    std::unique_lock guard(shard.lock);
+
+    auto entry = shard.readers.find(key);
+    if (entry == shard.readers.end()) {
+      entry = shard.readers.emplace(key, IdSet()).first;
+      table.keys.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (entry->second.insert(id)) {
+      table.items.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // over the limit, the shard taking the key gives up others, which the
+    // hash spreads evenly enough
+    size_t max_keys = table.max_keys.load(std::memory_order_relaxed);
+    while (max_keys and
+           table.keys.load(std::memory_order_relaxed) > max_keys and
+           !shard.readers.empty()) {
+      auto node = shard.readers.extract(shard.readers.begin());
+      table.keys.fetch_sub(1, std::memory_order_relaxed);
+      table.items.fetch_sub(node.mapped().size(), std::memory_order_relaxed);
+      forgotten.emplace_back(std::move(node.key()), std::move(node.mapped()));
+    }
+  }
+
+  if (!forgotten.empty()) {
+    auto &directory = ::directory();
+    std::shared_lock guard(directory.lock);
+    std::vector<uint64_t> ids;
+    for (auto &[key, readers] : forgotten) {
+      ids.assign(readers.begin(), readers.end());
+      notify(directory, ids, key, 0);
+    }
+    forgotten.clear();
+  }
+}
+
+void set_tracking_caller(uint64_t id) {
+  // what's queued was the last caller's doing
+  flush_invalidations();
+  caller = id;
+}
+
+void invalidate_tracked(std::string_view key) {
+  auto &table = ::table();
+  std::vector<uint64_t> ids;
+
+  auto &shard = table.shard_for(key);
+  {
+    std::unique_lock guard(shard.lock);
+    auto entry = shard.readers.find(key);
+    if (entry != shard.readers.end()) {
+      ids.assign(entry->second.begin(), entry->second.end());
+      shard.readers.erase(entry);
+      table.keys.fetch_sub(1, std::memory_order_relaxed);
+      table.items.fetch_sub(ids.size(), std::memory_order_relaxed);
+    }
+  }
+
+  if (!ids.empty() or
+      directory().prefix_count.load(std::memory_order_relaxed)) {
+    pending.emplace_back(key, std::move(ids));
+  }
+}
+
+void flush_invalidations() {
+  if (pending.empty()) {
+    return;
+  }
+  auto &directory = ::directory();
+  std::shared_lock guard(directory.lock);
+  for (auto &[key, ids] : pending) {
+    for_each_prefix_of(directory.prefixes, key, [&](Prefix const &prefix) {
+      ids.insert(ids.end(), prefix.clients.begin(), prefix.clients.end());
+    });
+    if (!ids.empty()) {
+      notify(directory, ids, key, caller);
+    }
+  }
+  pending.clear();
+}
+
+void invalidate_all() {
+  if (!tracking_clients.load(std::memory_order_relaxed)) {
+    return;
+  }
+  auto &table = ::table();
+  for (auto &shard : table.shards) {
+    std::unique_lock guard(shard.lock);
+    table.keys.fetch_sub(shard.readers.size(), std::memory_order_relaxed);
+    for (auto &[_, ids] : shard.readers) {
+      table.items.fetch_sub(ids.size(), std::memory_order_relaxed);
+    }
+    shard.readers.clear();
+  }
+
+  auto &directory = ::directory();
+  std::shared_lock guard(directory.lock);
+  std::vector<uint64_t> ids;
+  for (auto &[id, client] : directory.clients) {
+    if (client.tracking) {
+      ids.push_back(id);
+    }
+  }
+  // even to NOLOOP clients, like redis
+  notify(directory, ids, std::nullopt, 0);
+}
+
+void set_tracking_table_max_keys(size_t keys) {
+  table().max_keys.store(keys, std::memory_order_relaxed);
+}
+
+TrackingStats tracking_stats() {
+  auto &table = ::table();
+  TrackingStats stats;
+  stats.keys = table.keys.load(std::memory_order_relaxed);
+  stats.items = table.items.load(std::memory_order_relaxed);
+  stats.prefixes = directory().prefix_count.load(std::memory_order_relaxed);
+  return stats;
+}
@@ -0,0 +1,178 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+
+static int io_uring_setup(unsigned entries, io_uring_params &params) {
+  return syscall(__NR_io_uring_setup, entries, &params);
+}
+
+static int io_uring_enter(int fd, unsigned submit, unsigned wait,
+                          unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned count) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// the ring's entries, which the tail overlays the first of. indexed by hand,
+// since c++ lays the header's flexible array out past an empty member
+static io_uring_buf &entry(io_uring_buf_ring *ring, unsigned i) {
+  return ((io_uring_buf *)ring)[i];
+}
+
+static void *map(size_t length, int fd, off_t offset) {
+  void *ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+  return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+Ring::Ring(unsigned entries, unsigned buffer_count, unsigned buffer_size)
+    : buffer_count(buffer_count), buffer_size(buffer_size) {
+  // only this thread submits, and completions are only wanted when it
+  // waits, which spares the kernel interrupting it to run them
+  io_uring_params params{};
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+                 IORING_SETUP_SUBMIT_ALL;
+  if (0 > (fd = io_uring_setup(entries, params))) {
+    params = {};
+    if (0 > (fd = io_uring_setup(entries, params))) {
+      throw std::runtime_error(std::string("failed to set up io_uring: ") +
+                               strerror(errno));
+    }
+  }
+
+  try {
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+      throw std::runtime_error("io_uring is too old");
+    }
+    sq_ring_len = std::max(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    if (!(sq_ring = map(sq_ring_len, fd, IORING_OFF_SQ_RING))) {
+      throw std::runtime_error("failed to map io_uring");
+    }
+    sqes_len = params.sq_entries * sizeof(io_uring_sqe);
+    if (!(sqes = (io_uring_sqe *)map(sqes_len, fd, IORING_OFF_SQES))) {
+      throw std::runtime_error("failed to map io_uring submissions");
+    }
+
+    auto base = (char *)sq_ring;
+    sq_head = (unsigned *)(base + params.sq_off.head);
+    sq_tail = (unsigned *)(base + params.sq_off.tail);
+    sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    // submission slots are used in order, so the indirection is fixed
+    auto array = (unsigned *)(base + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; i++) {
+      array[i] = i;
+    }
+    cq_head = (unsigned *)(base + params.cq_off.head);
+    cq_tail = (unsigned *)(base + params.cq_off.tail);
+    cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(base + params.cq_off.cqes);
+
+    buffers_len = buffer_count * sizeof(io_uring_buf);
+    buffers = (io_uring_buf_ring *)mmap(nullptr, buffers_len,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+      buffers = nullptr;
+      throw std::runtime_error("failed to map io_uring buffer ring");
+    }
+    io_uring_buf_reg reg{.ring_addr = (uint64_t)buffers,
+                         .ring_entries = buffer_count,
+                         .bgid = BUFFER_GROUP};
+    if (io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+      throw std::runtime_error(
+          std::string("failed to register io_uring buffers: ") +
+          strerror(errno));
+    }
+
+    buffer_data = new char[(size_t)buffer_count * buffer_size];
+    for (unsigned i = 0; i < buffer_count; i++) {
+      provide(i);
+    }
+  } catch (...) {
+    release();
+    throw;
+  }
+}
+
+Ring::~Ring() { release(); }
+
+void Ring::release() {
+  delete[] buffer_data;
+  if (buffers) {
+    munmap(buffers, buffers_len);
+  }
+  if (sqes) {
+    munmap(sqes, sqes_len);
+  }
+  if (sq_ring) {
+    munmap(sq_ring, sq_ring_len);
+  }
+  close(fd);
+}
+
+void Ring::enter(unsigned wait) {
+  unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  int submitted;
+  while (0 > (submitted = io_uring_enter(fd, unsubmitted, wait, flags))) {
+    // the completions waiting have to be handled before more can be
+    // submitted, and the rest goes with the next enter
+    if (errno == EBUSY and wait) {
+      return;
+    }
+    if (errno != EINTR) {
+      throw std::runtime_error(std::string("failed to enter io_uring: ") +
+                               strerror(errno));
+    }
+  }
+  unsubmitted -= submitted;
+}
+
+io_uring_sqe &Ring::prepare() {
+  unsigned tail = *sq_tail;
+  if (tail - std::atomic_ref(*sq_head).load(std::memory_order_acquire) ==
+      sq_entries) {
+    enter(0);
+  }
+
+  auto &sqe = sqes[tail & sq_mask];
+  memset(&sqe, 0, sizeof(sqe));
+  std::atomic_ref(*sq_tail).store(tail + 1, std::memory_order_release);
+  unsubmitted++;
+  return sqe;
+}
+
+void Ring::submit_and_wait() { enter(1); }
+
+std::string_view Ring::buffer(io_uring_cqe const &cqe) const {
+  size_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+  return {buffer_data + bid * buffer_size, (size_t)cqe.res};
+}
+
+void Ring::recycle(io_uring_cqe const &cqe) {
+  provide(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+}
+
+// fields one at a time, as assigning the whole entry would clear the tail
+void Ring::provide(uint16_t bid) {
+  auto &buf = entry(buffers, buffer_tail & (buffer_count - 1));
+  buf.addr = (uint64_t)(buffer_data + (size_t)bid * buffer_size);
+  buf.len = buffer_size;
+  buf.bid = bid;
+  std::atomic_ref(buffers->tail)
+      .store(++buffer_tail, std::memory_order_release);
+}
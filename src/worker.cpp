@@ -0,0 +1,784 @@
+#include "worker.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <stdexcept>
+
+#include "log.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "tracking.h"
+
+const int LISTEN_BACKLOG = 511;
+const int MAX_EVENTS = 256;
+const size_t MAX_PENDING_OUT = 1024 * 1024;
+
+// submission slots, and the provided buffers every receive on a worker's
+// ring shares, which is all the read buffer an idle connection holds
+const unsigned URING_ENTRIES = 4096;
+const unsigned URING_BUFFERS = 256;
+// buffers one send hands the kernel, the rest waits for the next
+const size_t SEND_IOVECS = 64;
+
+// what a completion is for, in the low byte of its user data above the
+// socket it's about
+enum Op : uint8_t { ACCEPT, MAILBOX, SYNCED, RECV, SEND, CANCEL };
+
+static uint64_t user_data(int fd, Op op) { return (uint64_t)fd << 8 | op; }
+
+std::optional<IoBackend> parse_io_backend(std::string_view name) {
+  if (name == "epoll") {
+    return IoBackend::EPOLL;
+  }
+  if (name == "io_uring" or name == "uring") {
+    return IoBackend::URING;
+  }
+  return std::nullopt;
+}
+
+// like redis's client-output-buffer-limit pubsub 32mb 8mb 60: a subscriber
+// whose pending output passes the hard limit, or stays over the soft one
+// that long, is disconnected
+const size_t PUBSUB_HARD_LIMIT = 32 * 1024 * 1024;
+const size_t PUBSUB_SOFT_LIMIT = 8 * 1024 * 1024;
+const auto PUBSUB_SOFT_PERIOD = std::chrono::seconds(60);
+
+// connection ids, across every worker. 0 is left to mean none
+static std::atomic<uint64_t> next_client_id = 1;
+
+static void set_nonblocking(int sock) {
+  int flags = fcntl(sock, F_GETFL, 0);
+  if (0 > flags or 0 > fcntl(sock, F_SETFL, flags | O_NONBLOCK)) {
+    throw std::runtime_error("failed to make socket non-blocking");
+  }
+}
+
+Worker::Worker(int id, uint16_t port, Storage &storage, Aof *aof,
+               Primary *primary, IoBackend backend)
+    : id(id),
+      backend(backend),
+      storage(storage),
+      aof(aof),
+      primary(primary) {
+  sockaddr_in addr{
+      .sin_family = AF_INET,
+      .sin_port = htons(port),
+      .sin_addr = {.s_addr = INADDR_ANY},
+  };
+
+  if (0 > (sock = socket(AF_INET, SOCK_STREAM, 0))) {
+    throw std::runtime_error("failed to create socket");
+  }
+  int opt = 1;
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) or
+      setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+    close(sock);
+    throw std::runtime_error("failed to set socket options");
+  }
+  if (bind(sock, (sockaddr *)&addr, sizeof(addr))) {
+    close(sock);
+    throw std::runtime_error("failed to bind socket");
+  }
+  if (listen(sock, LISTEN_BACKLOG)) {
+    close(sock);
+    throw std::runtime_error("failed to prepare socket");
+  }
+  set_nonblocking(sock);
+
+  if (0 > (epoll = epoll_create1(EPOLL_CLOEXEC))) {
+    close(sock);
+    throw std::runtime_error("failed to create epoll instance");
+  }
+  epoll_event event{.events = EPOLLIN, .data = {.fd = sock}};
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, sock, &event)) {
+    close(epoll);
+    close(sock);
+    throw std::runtime_error("failed to register listening socket");
+  }
+
+  event = {.events = EPOLLIN, .data = {.fd = mailbox.fd()}};
+  if (epoll_ctl(epoll, EPOLL_CTL_ADD, mailbox.fd(), &event)) {
+    close(epoll);
+    close(sock);
+    throw std::runtime_error("failed to register mailbox");
+  }
+
+  if (aof and aof->get_policy() == AppendFsync::ALWAYS) {
+    if (0 > (synced_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+      close(epoll);
+      close(sock);
+      throw std::runtime_error("failed to create eventfd");
+    }
+    event = {.events = EPOLLIN, .data = {.fd = synced_event}};
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, synced_event, &event)) {
+      close(synced_event);
+      close(epoll);
+      close(sock);
+      throw std::runtime_error("failed to register eventfd");
+    }
+    aof->add_listener(synced_event);
+  }
+}
+
+Worker::~Worker() {
+  for (auto &[client_sock, _] : conns) {
+    close(client_sock);
+  }
+  if (0 <= synced_event) {
+    close(synced_event);
+  }
+  close(epoll);
+  close(sock);
+}
+
+void Worker::start() {
+  thread = std::thread([this] {
+    try {
+      event_loop();
+    } catch (std::runtime_error const &e) {
+      write_log(LogLevel::WARNING, "worker ", id, " error: ", e.what());
+    }
+  });
+}
+
+void Worker::join() {
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+void Worker::event_loop() {
+  if (backend == IoBackend::URING) {
+    try {
+      ring = std::make_unique<Ring>(URING_ENTRIES, URING_BUFFERS, READ_CHUNK);
+    } catch (std::runtime_error const &e) {
+      write_log(LogLevel::WARNING, "worker ", id, ": ", e.what(),
+                ", using epoll");
+    }
+  }
+  ring ? uring_loop() : epoll_loop();
+}
+
+void Worker::epoll_loop() {
+  std::array<epoll_event, MAX_EVENTS> events;
+
+  while (true) {
+    int ready = epoll_wait(epoll, events.data(), events.size(), -1);
+    if (0 > ready) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error("failed to wait for events");
+    }
+
+    for (int i = 0; i < ready; i++) {
+      int fd = events[i].data.fd;
+
+      if (fd == sock) {
+        accept_all();
+        continue;
+      }
+      if (fd == synced_event) {
+        handle_synced();
+        continue;
+      }
+      if (fd == mailbox.fd()) {
+        handle_deliveries();
+        continue;
+      }
+
+      auto iter = conns.find(fd);
+      if (iter == conns.end()) {
+        continue;
+      }
+      auto &conn = iter->second;
+
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        close_conn(conn);
+      } else if (events[i].events & EPOLLOUT) {
+        if (!flush(conn)) {
+          continue;
+        }
+        if (conn.handing_over) {
+          finish_hand_over(conn);
+        } else if (conn.closing and !conn.want_write) {
+          close_conn(conn);
+        }
+      } else if (events[i].events & EPOLLIN) {
+        handle_readable(conn);
+      }
+    }
+  }
+}
+
+void Worker::uring_loop() {
+  // multishot: each of these keeps completing until it fails
+  auto &accept = ring->prepare();
+  accept.opcode = IORING_OP_ACCEPT;
+  accept.fd = sock;
+  accept.ioprio = IORING_ACCEPT_MULTISHOT;
+  accept.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  accept.user_data = user_data(sock, ACCEPT);
+  arm_poll(mailbox.fd(), MAILBOX);
+  if (0 <= synced_event) {
+    arm_poll(synced_event, SYNCED);
+  }
+
+  while (true) {
+    ring->submit_and_wait();
+    ring->completions([&](io_uring_cqe const &cqe) { complete(cqe); });
+
+    for (int client_sock : retired) {
+      auto iter = conns.find(client_sock);
+      if (iter == conns.end() or !iter->second.detached or
+          iter->second.inflight) {
+        continue;
+      }
+      if (auto &psync = iter->second.handing_over) {
+        auto handed = std::move(*psync);
+        conns.erase(iter);
+        thread_stats().connected_clients.sub();
+        primary->attach(client_sock, handed.replid, handed.offset);
+      } else {
+        close(client_sock);
+        conns.erase(iter);
+        thread_stats().connected_clients.sub();
+      }
+    }
+    retired.clear();
+  }
+}
+
+void Worker::complete(io_uring_cqe const &cqe) {
+  int fd = cqe.user_data >> 8;
+  auto op = Op(cqe.user_data & 0xff);
+  bool more = cqe.flags & IORING_CQE_F_MORE;
+
+  if (op == ACCEPT) {
+    // running out of descriptors shouldn't take the whole worker down
+    if (0 <= cqe.res) {
+      arm_recv(add_conn(cqe.res));
+    }
+    if (!more) {
+      auto &accept = ring->prepare();
+      accept.opcode = IORING_OP_ACCEPT;
+      accept.fd = sock;
+      accept.ioprio = IORING_ACCEPT_MULTISHOT;
+      accept.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+      accept.user_data = user_data(sock, ACCEPT);
+    }
+    return;
+  }
+  if (op == MAILBOX or op == SYNCED) {
+    if (op == MAILBOX) {
+      handle_deliveries();
+    } else {
+      handle_synced();
+    }
+    if (!more) {
+      arm_poll(fd, op);
+    }
+    return;
+  }
+
+  auto iter = conns.find(fd);
+  if (iter == conns.end()) {
+    return;
+  }
+  auto &conn = iter->second;
+  if (!more) {
+    conn.inflight--;
+  }
+
+  if (op == RECV) {
+    conn.receiving = more;
+    if (0 < cqe.res) {
+      if (!conn.detached) {
+        received(conn, ring->buffer(cqe));
+      }
+      ring->recycle(cqe);
+    } else if (!conn.detached and cqe.res != -ENOBUFS and
+               cqe.res != -ECANCELED) {
+      // hung up
+      close_conn(conn);
+    }
+    // a receive stops when the buffers run out, and on some kernels after
+    // a burst of data too
+    if (!conn.receiving and !conn.detached and !conn.paused and
+        (0 < cqe.res or cqe.res == -ENOBUFS)) {
+      arm_recv(conn);
+    }
+  } else if (op == SEND) {
+    sent(conn, cqe.res);
+  }
+  retire(conn);
+}
+
+void Worker::received(Connection &conn, std::string_view data) {
+  // a connection hanging up after a protocol error reads no further
+  if (conn.closing) {
+    return;
+  }
+  size_t logged = Storage::logged_by_thread();
+  thread_stats().net_input_bytes.add(data.length());
+
+  // whole commands run straight from the ring's buffer, and only a partial
+  // one is copied out to wait for the rest
+  std::string_view input = data;
+  if (!conn.in.empty()) {
+    auto [tail, free] = conn.in.prepare(data.length());
+    memcpy(tail, data.data(), data.length());
+    conn.in.commit(data.length());
+    input = conn.in.view();
+  }
+  size_t length = input.length();
+
+  if (!conn.paused and !serve(conn, input)) {
+    return;
+  }
+  if (conn.in.empty()) {
+    auto [tail, free] = conn.in.prepare(input.length());
+    memcpy(tail, input.data(), input.length());
+    conn.in.commit(input.length());
+  } else {
+    conn.in.consume(length - input.length());
+  }
+  conn.in.release();
+
+  // a client pipelining faster than it reads stops being read until its
+  // replies drain
+  if (conn.pending_out() >= MAX_PENDING_OUT and !conn.paused) {
+    conn.paused = true;
+    if (conn.receiving) {
+      cancel(conn, user_data(conn.sock, RECV), 0);
+    }
+  }
+
+  hold_for_sync(conn, logged);
+  flush(conn);
+}
+
+void Worker::sent(Connection &conn, int result) {
+  if (0 > result) {
+    if (!conn.detached) {
+      close_conn(conn);
+    }
+    return;
+  }
+  conn.sending.consume(result);
+  thread_stats().net_output_bytes.add(result);
+  if (conn.detached and !conn.handing_over) {
+    return;
+  }
+  if (!conn.sending.empty()) {
+    submit_send(conn);
+    return;
+  }
+  flush(conn);
+  if (conn.detached) {
+    return;
+  }
+
+  if (conn.paused and conn.pending_out() < MAX_PENDING_OUT) {
+    size_t logged = Storage::logged_by_thread();
+    auto input = conn.in.view();
+    size_t length = input.length();
+
+    conn.paused = false;
+    if (!serve(conn, input)) {
+      return;
+    }
+    conn.in.consume(length - input.length());
+    conn.in.release();
+    hold_for_sync(conn, logged);
+    flush(conn);
+    if (!conn.receiving and !conn.closing) {
+      arm_recv(conn);
+    }
+  }
+  if (conn.closing and !conn.pending_out()) {
+    close_conn(conn);
+  }
+}
+
+void Worker::arm_poll(int fd, uint8_t op) {
+  auto &poll = ring->prepare();
+  poll.opcode = IORING_OP_POLL_ADD;
+  poll.fd = fd;
+  poll.poll32_events = POLLIN;
+  poll.len = IORING_POLL_ADD_MULTI;
+  poll.user_data = user_data(fd, Op(op));
+}
+
+void Worker::arm_recv(Connection &conn) {
+  auto &recv = ring->prepare();
+  recv.opcode = IORING_OP_RECV;
+  recv.fd = conn.sock;
+  recv.ioprio = IORING_RECV_MULTISHOT;
+  recv.flags = IOSQE_BUFFER_SELECT;
+  recv.buf_group = Ring::BUFFER_GROUP;
+  recv.user_data = user_data(conn.sock, RECV);
+  conn.inflight++;
+  conn.receiving = true;
+}
+
+void Worker::submit_send(Connection &conn) {
+  conn.iov.resize(SEND_IOVECS);
+  conn.msg = {.msg_iov = conn.iov.data(),
+              .msg_iovlen = conn.sending.gather(conn.iov)};
+
+  auto &send = ring->prepare();
+  send.opcode = IORING_OP_SENDMSG;
+  send.fd = conn.sock;
+  send.addr = (uint64_t)&conn.msg;
+  send.msg_flags = MSG_NOSIGNAL;
+  send.user_data = user_data(conn.sock, SEND);
+  conn.inflight++;
+}
+
+void Worker::cancel(Connection &conn, uint64_t target, uint32_t flags) {
+  auto &cancel = ring->prepare();
+  cancel.opcode = IORING_OP_ASYNC_CANCEL;
+  cancel.fd = conn.sock;
+  cancel.addr = target;
+  cancel.cancel_flags = flags;
+  cancel.user_data = user_data(conn.sock, CANCEL);
+  conn.inflight++;
+}
+
+void Worker::retire(Connection &conn) {
+  if (conn.detached and !conn.inflight) {
+    retired.push_back(conn.sock);
+  }
+}
+
+void Worker::accept_all() {
+  int client_sock;
+
+  while (0 <= (client_sock = accept4(sock, nullptr, nullptr,
+                                     SOCK_NONBLOCK | SOCK_CLOEXEC))) {
+    epoll_event event{.events = EPOLLIN, .data = {.fd = client_sock}};
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, client_sock, &event)) {
+      close(client_sock);
+      continue;
+    }
+    add_conn(client_sock);
+  }
+
+  // EAGAIN means another worker got there first or the queue is drained, and
+  // running out of descriptors shouldn't take the whole worker down
+  if (errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR and
+      errno != ECONNABORTED and errno != EMFILE and errno != ENFILE) {
+    throw std::runtime_error("failed to accept connection");
+  }
+}
+
+// "ip:port" of the other end, or empty if it can't be told
+static std::string peer_name(int sock) {
+  sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  char host[INET6_ADDRSTRLEN];
+  uint16_t port;
+
+  if (getpeername(sock, (sockaddr *)&addr, &len)) {
+    return "";
+  }
+  if (addr.ss_family == AF_INET) {
+    auto in = (sockaddr_in *)&addr;
+    inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+    port = ntohs(in->sin_port);
+  } else if (addr.ss_family == AF_INET6) {
+    auto in6 = (sockaddr_in6 *)&addr;
+    inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+    port = ntohs(in6->sin6_port);
+  } else {
+    return "";
+  }
+  return std::string(host) + ":" + std::to_string(port);
+}
+
+Connection &Worker::add_conn(int client_sock) {
+  int opt = 1;
+  setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+  auto &conn =
+      conns.emplace(client_sock, Connection(client_sock, next_client_id++))
+          .first->second;
+  conn.session.subscriber = {&mailbox, client_sock, conn.id};
+  add_client(conn.session.subscriber);
+  conn.session.client = peer_name(client_sock);
+
+  auto &stats = thread_stats();
+  stats.connections_received.add();
+  stats.connected_clients.add();
+  return conn;
+}
+
+void Worker::handle_readable(Connection &conn) {
+  size_t logged = Storage::logged_by_thread();
+  ssize_t len;
+
+  while (true) {
+    auto [tail, free] = conn.in.prepare();
+    if (0 >= (len = read(conn.sock, tail, free))) {
+      break;
+    }
+    conn.in.commit(len);
+    thread_stats().net_input_bytes.add(len);
+
+    auto input = conn.in.view();
+    size_t length = input.length();
+    if (!serve(conn, input)) {
+      return;
+    }
+    conn.in.consume(length - input.length());
+
+    // a client pipelining faster than it reads gets throttled here
+    if (conn.closing or conn.out.size() >= MAX_PENDING_OUT) {
+      break;
+    }
+  }
+
+  bool hung_up = 0 == len or
+                 (0 > len and errno != EAGAIN and errno != EWOULDBLOCK);
+
+  hold_for_sync(conn, logged);
+
+  // every reply produced by this batch of reads goes out in one write
+  if (flush(conn) and (hung_up or (conn.closing and !conn.want_write))) {
+    close_conn(conn);
+  }
+}
+
+bool Worker::serve(Connection &conn, std::string_view &input) {
+  write_log(LogLevel::DEBUG, "read:\n", input);
+  auto consumed =
+      server_transact(storage, input, conn.out, !primary, &conn.session);
+  write_log(LogLevel::DEBUG, "writing: ", conn.out.size(), " bytes");
+
+  if (!consumed) {
+    // reply with the protocol error, then hang up once it's flushed
+    conn.closing = true;
+    return true;
+  }
+  input.remove_prefix(*consumed);
+
+  if (auto psync = take_psync_request()) {
+    if (primary) {
+      hand_over(conn, *psync);
+      return false;
+    }
+    Reply(conn.out).error("ERR a replica can't be synced from");
+  }
+  return true;
+}
+
+void Worker::hold_for_sync(Connection &conn, size_t logged) {
+  // flush holds the replies back until the sync that covers them
+  if (0 <= synced_event and Storage::logged_by_thread() != logged) {
+    if (!conn.durable_at) {
+      unsynced.push_back(conn.sock);
+    }
+    conn.durable_at = aof->ticket();
+    aof->request_sync();
+  }
+}
+
+void Worker::handle_synced() {
+  uint64_t count;
+  read(synced_event, &count, sizeof(count));
+  auto synced = aof->synced_ticket();
+
+  std::erase_if(unsynced, [&](int client_sock) {
+    auto iter = conns.find(client_sock);
+    if (iter == conns.end()) {
+      return true;
+    }
+    auto &conn = iter->second;
+    if (conn.detached) {
+      return true;
+    }
+    if (conn.durable_at > synced) {
+      return false;
+    }
+
+    conn.durable_at = 0;
+    if (!flush(conn)) {
+      return true;
+    }
+    if (conn.handing_over) {
+      finish_hand_over(conn);
+    } else if (conn.closing and !conn.want_write) {
+      close_conn(conn);
+    }
+    return true;
+  });
+}
+
+void Worker::handle_deliveries() {
+  // reused by every drain
+  thread_local std::vector<int> touched;
+  auto now = std::chrono::steady_clock::now();
+
+  mailbox.drain([&](Delivery &delivery) {
+    for (auto target : delivery.audience->groups[delivery.group].targets) {
+      auto iter = conns.find(target.sock);
+      if (iter == conns.end() or iter->second.id != target.id or
+          iter->second.detached or iter->second.handing_over) {
+        continue;
+      }
+      // the message's one encoding, queued by reference
+      iter->second.out.append(delivery.message);
+      touched.push_back(target.sock);
+    }
+  });
+
+  std::sort(touched.begin(), touched.end());
+  touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+  for (int client_sock : touched) {
+    auto &conn = conns.at(client_sock);
+    size_t pending = conn.pending_out();
+
+    if (pending <= PUBSUB_SOFT_LIMIT) {
+      conn.over_soft_limit.reset();
+    } else if (!conn.over_soft_limit) {
+      conn.over_soft_limit = now;
+    }
+    if (pending > PUBSUB_HARD_LIMIT or
+        (conn.over_soft_limit and
+         now - *conn.over_soft_limit > PUBSUB_SOFT_PERIOD)) {
+      close_conn(conn);
+    } else if (flush(conn) and conn.closing and !conn.want_write) {
+      close_conn(conn);
+    }
+  }
+  touched.clear();
+}
+
+// returns false if the connection was closed
+bool Worker::flush(Connection &conn) {
+  if (conn.durable_at) {
+    return true;
+  }
+  if (ring) {
+    // one send in flight at a time, carrying whatever's queued when it
+    // starts
+    if (conn.sending.empty() and !conn.out.empty()) {
+      std::swap(conn.sending, conn.out);
+      submit_send(conn);
+    }
+    return true;
+  }
+  ssize_t written;
+  while (!conn.out.empty()) {
+    if (0 > (written = conn.out.write_to(conn.sock))) {
+      if (errno == EAGAIN or errno == EWOULDBLOCK) {
+        if (!conn.want_write) {
+          epoll_event event{.events = EPOLLOUT, .data = {.fd = conn.sock}};
+          epoll_ctl(epoll, EPOLL_CTL_MOD, conn.sock, &event);
+          conn.want_write = true;
+        }
+        return true;
+      }
+      close_conn(conn);
+      return false;
+    }
+    thread_stats().net_output_bytes.add(written);
+  }
+
+  if (conn.want_write) {
+    // a connection being handed over reads nothing more
+    epoll_event event{.events = conn.handing_over ? 0u : EPOLLIN,
+                      .data = {.fd = conn.sock}};
+    epoll_ctl(epoll, EPOLL_CTL_MOD, conn.sock, &event);
+    conn.want_write = false;
+  }
+  return true;
+}
+
+void Worker::hand_over(Connection &conn, PsyncRequest const &psync) {
+  int client_sock = conn.sock;
+
+  if (ring) {
+    // handed over once the replies before PSYNC are out and the receive
+    // has stopped
+    flush(conn);
+    if (conn.session.subscribed()) {
+      conn.session.unsubscribe_all();
+    }
+    remove_client(conn.id);
+    std::erase(unsynced, client_sock);
+    conn.detached = true;
+    conn.handing_over = psync;
+    if (conn.receiving) {
+      cancel(conn, user_data(client_sock, RECV), 0);
+    }
+    retire(conn);
+    return;
+  }
+
+  // whatever came before PSYNC is answered first, once the aof has synced
+  // it under fsync always, and nothing more is read meanwhile. the socket
+  // stays open
+  if (conn.session.subscribed()) {
+    conn.session.unsubscribe_all();
+  }
+  remove_client(conn.id);
+  conn.handing_over = psync;
+  epoll_event event{.events = conn.want_write ? EPOLLOUT : 0u,
+                    .data = {.fd = client_sock}};
+  epoll_ctl(epoll, EPOLL_CTL_MOD, client_sock, &event);
+  if (flush(conn)) {
+    finish_hand_over(conn);
+  }
+}
+
+void Worker::finish_hand_over(Connection &conn) {
+  if (!conn.out.empty() or conn.durable_at) {
+    return;
+  }
+  // off the unsynced list already, since durable_at is clear
+  int client_sock = conn.sock;
+  auto psync = std::move(*conn.handing_over);
+  epoll_ctl(epoll, EPOLL_CTL_DEL, client_sock, nullptr);
+  conns.erase(client_sock);
+  thread_stats().connected_clients.sub();
+  primary->attach(client_sock, psync.replid, psync.offset);
+}
+
+void Worker::close_conn(Connection &conn) {
+  int client_sock = conn.sock;
+
+  if (conn.session.subscribed()) {
+    conn.session.unsubscribe_all();
+  }
+  remove_client(conn.id);
+  if (ring) {
+    // the socket stays open until the kernel lets go of the buffers its
+    // operations point at. shutting it down ends them right away
+    conn.detached = true;
+    if (conn.inflight) {
+      shutdown(client_sock, SHUT_RDWR);
+      cancel(conn, 0, IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL);
+    }
+    retire(conn);
+    return;
+  }
+  epoll_ctl(epoll, EPOLL_CTL_DEL, client_sock, nullptr);
+  close(client_sock);
+  conns.erase(client_sock);
+  thread_stats().connected_clients.sub();
+}